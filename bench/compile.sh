@@ -0,0 +1 @@
+g++ -O2 -D__multi_thread -o queuebench queuebench.cc -lpthread
@@ -0,0 +1,85 @@
+#include "../include/common/qqueue.h"
+#include "../include/common/qlockfreequeue.h"
+
+Q_USING_NAMESPACE
+
+// 比较QQueue与QLockFreeQueue在不同生产者/消费者数下的吞吐
+// 用法: ./queuebench [items] [queue-size]
+
+template <typename QUEUE_TYPE>
+struct benchInfo {
+	QUEUE_TYPE* queue;
+	int32_t     items;
+	volatile int32_t ready;
+	volatile int32_t go;
+};
+
+template <typename QUEUE_TYPE>
+static void* producer(void* arg)
+{
+	benchInfo<QUEUE_TYPE>* info=(benchInfo<QUEUE_TYPE>*)arg;
+	__sync_add_and_fetch(&info->ready, 1);
+	while(!info->go);
+	for(int32_t i=0; i<info->items; ++i)
+		info->queue->push(i+1);
+	return NULL;
+}
+
+template <typename QUEUE_TYPE>
+static void* consumer(void* arg)
+{
+	benchInfo<QUEUE_TYPE>* info=(benchInfo<QUEUE_TYPE>*)arg;
+	__sync_add_and_fetch(&info->ready, 1);
+	while(!info->go);
+	for(int32_t i=0; i<info->items; ++i)
+		info->queue->pop();
+	return NULL;
+}
+
+template <typename QUEUE_TYPE>
+static double run(int32_t threads, int32_t items, int32_t queue_size)
+{
+	QUEUE_TYPE queue;
+	if(queue.init(queue_size)<0)
+		return -1;
+
+	benchInfo<QUEUE_TYPE> info;
+	info.queue=&queue;
+	info.items=items/threads;
+	info.ready=0;
+	info.go=0;
+
+	pthread_t* tids=q_new_array<pthread_t>(threads*2);
+	for(int32_t i=0; i<threads; ++i) {
+		q_create_thread(&tids[i*2], producer<QUEUE_TYPE>, &info);
+		q_create_thread(&tids[i*2+1], consumer<QUEUE_TYPE>, &info);
+	}
+	while(info.ready<threads*2)
+		q_sleep(1);
+
+	QStopwatch sw;
+	sw.start();
+	info.go=1;
+	for(int32_t i=0; i<threads*2; ++i)
+		pthread_join(tids[i], NULL);
+	sw.stop();
+
+	q_delete_array<pthread_t>(tids);
+	return (double)info.items*threads/(sw.elapsed_us()+1)*1000000;
+}
+
+int main(int argc, char** argv)
+{
+	int32_t items=argc>1?atoi(argv[1]):200000;
+	int32_t queue_size=argc>2?atoi(argv[2]):1024;
+
+	printf("items = (%d), queue size = (%d)\n", items, queue_size);
+	printf("%-10s %16s %16s\n", "P=C", "QQueue ops/s", "LockFree ops/s");
+	for(int32_t threads=1; threads<=64; threads<<=1) {
+		double locked=run< QQueue<int32_t> >(threads, items, queue_size);
+		double lockfree=run< QLockFreeQueue<int32_t> >(threads, items, queue_size);
+		printf("%-10d %16.0f %16.0f\n", threads, locked, lockfree);
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2016 Terry Niu (Beijing, China)
+** Filename:	qaccesstracker.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2016/05/12
+**
+*********************************************************************************************/
+
+#ifndef __QACCESSTRACKER_H_
+#define __QACCESSTRACKER_H_
+
+#include "qglobal.h"
+
+#define ACCESS_TRACKER_MAGIC        ("QACCESS")
+#define ACCESS_TRACKER_VERSION      (1)
+#define ACCESS_TRACKER_MIN_SLOTS    (1<<10)
+#define ACCESS_TRACKER_MAX_COUNT    (0xffff)
+#define ACCESS_TRACKER_DAY_SECONDS  (86400)
+
+Q_BEGIN_NAMESPACE
+
+#pragma pack(1)
+
+/* table file: header, slots */
+struct accessHeader {
+	char            magic[8];
+	uint32_t        version;
+	uint32_t        decay_day;
+	uint64_t        slot_num;
+	char            reserved[40];
+};
+
+/* 4 bytes per slot, day is counted from the epoch */
+struct accessSlot {
+	uint16_t        day;
+	uint16_t        count;
+};
+
+#pragma pack()
+
+// 图片访问记录类, 按图片编号的哈希定位槽位, 每个槽位记录最近访问日与访问计数, 计数每天减半;
+// 槽位不存图片编号, 冲突的图片共用一个槽位, 只会让冷图片显得更热而晚些迁移, 不会误判热图片;
+// 记录表以共享方式映射到文件, 重启后保留
+class QAccessTracker: public noncopyable {
+	public:
+		inline QAccessTracker() :
+			fd_(-1),
+			addr_(NULL),
+			map_size_(0),
+			header_(NULL),
+			slots_(NULL),
+			slot_mask_(0)
+		{}
+
+		virtual ~QAccessTracker()
+		{
+			if(addr_!=NULL) {
+				msync(addr_, map_size_, MS_SYNC);
+				munmap(addr_, map_size_);
+			}
+			if(fd_>=0)
+				::close(fd_);
+		}
+
+		// @函数名: 初始化函数, 文件不存在或槽位数变化时重建, 全部槽位记为当天访问,
+		//         已有图片从此时起计算空闲天数
+		// @参数01: 记录表文件路径
+		// @参数02: 记录表字节数, 槽位数向下取整为2的幂
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		inline int32_t init(const char* path, uint64_t bytes)
+		{
+			struct stat st;
+			uint64_t slot_num=ACCESS_TRACKER_MIN_SLOTS;
+
+			if(path==NULL)
+				return -1;
+
+			while((slot_num<<1)*sizeof(accessSlot)<=bytes)
+				slot_num<<=1;
+			map_size_=sizeof(accessHeader)+slot_num*sizeof(accessSlot);
+
+			fd_=::open(path, O_RDWR|O_CREAT, 0644);
+			if(fd_<0)
+				return -2;
+
+			if(fstat(fd_, &st)<0)
+				return -3;
+
+			bool reset=(uint64_t)st.st_size!=map_size_;
+			if(reset && ftruncate(fd_, map_size_)<0)
+				return -4;
+
+			addr_=mmap(NULL, map_size_, PROT_READ|PROT_WRITE, MAP_SHARED, fd_, 0);
+			if(addr_==MAP_FAILED) {
+				addr_=NULL;
+				return -5;
+			}
+
+			header_=reinterpret_cast<accessHeader*>(addr_);
+			slots_=reinterpret_cast<accessSlot*>((char*)addr_+sizeof(accessHeader));
+			slot_mask_=slot_num-1;
+
+			if(!reset && (memcmp(header_->magic, ACCESS_TRACKER_MAGIC, sizeof(ACCESS_TRACKER_MAGIC))!=0 \
+						||header_->version!=ACCESS_TRACKER_VERSION||header_->slot_num!=slot_num))
+				reset=true;
+
+			if(reset) {
+				uint16_t day=today();
+				for(uint64_t i=0; i<slot_num; ++i)
+				{
+					slots_[i].day=day;
+					slots_[i].count=0;
+				}
+				memset(header_, 0, sizeof(accessHeader));
+				memcpy(header_->magic, ACCESS_TRACKER_MAGIC, sizeof(ACCESS_TRACKER_MAGIC));
+				header_->version=ACCESS_TRACKER_VERSION;
+				header_->decay_day=day;
+				header_->slot_num=slot_num;
+			}
+
+			return 0;
+		}
+
+		// @函数名: 记录一次访问, 并发更新不加锁, 偶尔丢失的计数不影响冷热判断
+		inline void touch(uint64_t key)
+		{
+			accessSlot& slot=slots_[q_hash64(key)&slot_mask_];
+			uint16_t day=today();
+
+			if(slot.day!=day)
+				slot.day=day;
+			if(slot.count<ACCESS_TRACKER_MAX_COUNT)
+				slot.count++;
+		}
+
+		// @函数名: 是否为冷图片
+		// @参数01: 图片编号
+		// @参数02: 超过此天数未访问即为冷图片
+		// @参数03: 空闲至少一天且衰减后的访问计数低于此值也为冷图片, 为0时不按计数判断
+		inline bool cold(uint64_t key, uint32_t cold_days, uint32_t cold_count) const
+		{
+			const accessSlot& slot=slots_[q_hash64(key)&slot_mask_];
+			uint16_t day=today();
+			uint32_t idle=day>slot.day?day-slot.day:0;
+
+			if(idle>=cold_days)
+				return true;
+			return cold_count>0 && idle>=1 && slot.count<cold_count;
+		}
+
+		// @函数名: 按上次衰减以来经过的天数将全部计数减半, 每天至多一次
+		inline void decay()
+		{
+			uint16_t day=today();
+			uint32_t shift=0;
+
+			if(header_->decay_day>=day)
+				return;
+
+			shift=q_min((uint32_t)(day-header_->decay_day), (uint32_t)16);
+			for(uint64_t i=0; i<=slot_mask_; ++i)
+				slots_[i].count>>=shift;
+			header_->decay_day=day;
+			msync(addr_, map_size_, MS_ASYNC);
+		}
+
+		// @函数名: 槽位数
+		inline uint64_t slot_num() const
+		{return slot_mask_+1;}
+
+	private:
+		static inline uint16_t today()
+		{return (uint16_t)(time(NULL)/ACCESS_TRACKER_DAY_SECONDS);}
+
+	private:
+		int32_t         fd_;
+		void*           addr_;
+		uint64_t        map_size_;
+		accessHeader*   header_;
+		accessSlot*     slots_;
+		uint64_t        slot_mask_;
+};
+
+Q_END_NAMESPACE
+
+#endif // __QACCESSTRACKER_H_
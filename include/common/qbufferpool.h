@@ -0,0 +1,269 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2014 Terry Niu (Beijing, China)
+** Filename:	qbufferpool.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2014/05/10
+**
+*********************************************************************************************/
+
+#ifndef __QBUFFERPOOL_H_
+#define __QBUFFERPOOL_H_
+
+#include "qglobal.h"
+
+Q_BEGIN_NAMESPACE
+
+// 最小级别4KB, 共11个级别, 最大级别4MB
+#define BUFFER_POOL_MIN_SHIFT  (12)
+#define BUFFER_POOL_CLASS_NUM  (11)
+#define BUFFER_POOL_MIN_SIZE   (1<<BUFFER_POOL_MIN_SHIFT)
+#define BUFFER_POOL_MAX_SIZE   (1<<(BUFFER_POOL_MIN_SHIFT+BUFFER_POOL_CLASS_NUM-1))
+
+// 分级缓冲池类, 按2的幂分级按需分配, 归还的缓冲区留在本级空闲链表中复用;
+// 总内存(使用中与空闲之和)受预算限制, 超出时先释放其它级别的空闲缓冲区, 仍不足则分配失败
+class QBufferPool: public noncopyable {
+	public:
+		/* per class stats */
+		struct classStat {
+			int32_t         buffer_size;
+			uint32_t        used_num;
+			uint32_t        free_num;
+			uint32_t        peak_num;
+			uint64_t        acquire_num;
+			uint64_t        fail_num;
+		};
+
+		inline QBufferPool() :
+			budget_(0),
+			total_bytes_(0)
+		{
+			for(int32_t i=0; i<BUFFER_POOL_CLASS_NUM; ++i)
+			{
+				classes_[i].free_list=NULL;
+				classes_[i].free_num=0;
+				classes_[i].used_num=0;
+				classes_[i].peak_num=0;
+				classes_[i].acquire_num=0;
+				classes_[i].fail_num=0;
+			}
+		}
+
+		virtual ~QBufferPool()
+		{trim(-1);}
+
+		// @函数名: 初始化函数
+		// @参数01: 内存预算(字节), 0表示不限制
+		inline int32_t init(uint64_t budget)
+		{
+			budget_=budget;
+			return 0;
+		}
+
+		// @函数名: 获取缓冲区所属级别, 超过最大级别返回-1
+		static inline int32_t class_of(int32_t size)
+		{
+			if(size<=0||size>BUFFER_POOL_MAX_SIZE)
+				return -1;
+			int32_t class_id=0;
+			while((1<<(BUFFER_POOL_MIN_SHIFT+class_id))<size)
+				++class_id;
+			return class_id;
+		}
+
+		// @函数名: 获取级别对应的缓冲区大小
+		static inline int32_t class_size(int32_t class_id)
+		{return 1<<(BUFFER_POOL_MIN_SHIFT+class_id);}
+
+		// @函数名: 申请至少size字节的缓冲区, 实际容量写入capacity, 失败返回NULL
+		char* acquire(int32_t size, int32_t& capacity)
+		{
+			int32_t class_id=class_of(size);
+			if(class_id<0)
+				return NULL;
+
+			sizeClass& sc=classes_[class_id];
+			char* buf=NULL;
+
+			sc.mutex.lock();
+			++sc.acquire_num;
+			if(sc.free_list) {
+				buf=reinterpret_cast<char*>(sc.free_list);
+				sc.free_list=sc.free_list->next;
+				--sc.free_num;
+				if(++sc.used_num>sc.peak_num)
+					sc.peak_num=sc.used_num;
+			}
+			sc.mutex.unlock();
+
+			if(buf==NULL) {
+				buf=allocate(class_id);
+				if(buf==NULL) {
+					sc.mutex.lock();
+					++sc.fail_num;
+					sc.mutex.unlock();
+					return NULL;
+				}
+
+				sc.mutex.lock();
+				if(++sc.used_num>sc.peak_num)
+					sc.peak_num=sc.used_num;
+				sc.mutex.unlock();
+			}
+
+			capacity=class_size(class_id);
+			return buf;
+		}
+
+		// @函数名: 归还缓冲区, capacity须为申请时得到的容量
+		void release(char*& buf, int32_t capacity)
+		{
+			if(buf==NULL)
+				return;
+
+			int32_t class_id=class_of(capacity);
+			Q_ASSERT(class_id>=0&&class_size(class_id)==capacity, "QBufferPool: bad capacity (%d)", capacity);
+
+			sizeClass& sc=classes_[class_id];
+			freeNode* node=reinterpret_cast<freeNode*>(buf);
+
+			sc.mutex.lock();
+			node->next=sc.free_list;
+			sc.free_list=node;
+			++sc.free_num;
+			--sc.used_num;
+			sc.mutex.unlock();
+
+			buf=NULL;
+		}
+
+		// @函数名: 释放空闲缓冲区, 返回释放的字节数
+		// @参数01: 需要释放的字节数, -1表示释放全部空闲缓冲区
+		int64_t trim(int64_t bytes)
+		{
+			int64_t freed=0;
+			// 优先释放大级别, 以较少的释放次数腾出预算
+			for(int32_t i=BUFFER_POOL_CLASS_NUM-1; i>=0 && (bytes<0||freed<bytes); --i)
+			{
+				sizeClass& sc=classes_[i];
+				sc.mutex.lock();
+				while(sc.free_list && (bytes<0||freed<bytes))
+				{
+					char* buf=reinterpret_cast<char*>(sc.free_list);
+					sc.free_list=sc.free_list->next;
+					--sc.free_num;
+					q_delete_array<char>(buf);
+					__sync_sub_and_fetch(&total_bytes_, (uint64_t)class_size(i));
+					freed+=class_size(i);
+				}
+				sc.mutex.unlock();
+			}
+			return freed;
+		}
+
+		// @函数名: 获取内存预算
+		inline uint64_t budget() const
+		{return budget_;}
+
+		// @函数名: 获取已分配的内存总量(使用中与空闲之和)
+		inline uint64_t total_bytes() const
+		{return total_bytes_;}
+
+		// @函数名: 获取级别统计信息
+		int32_t get_stat(int32_t class_id, classStat& stat)
+		{
+			if(class_id<0||class_id>=BUFFER_POOL_CLASS_NUM)
+				return -1;
+
+			sizeClass& sc=classes_[class_id];
+			sc.mutex.lock();
+			stat.buffer_size=class_size(class_id);
+			stat.used_num=sc.used_num;
+			stat.free_num=sc.free_num;
+			stat.peak_num=sc.peak_num;
+			stat.acquire_num=sc.acquire_num;
+			stat.fail_num=sc.fail_num;
+			sc.mutex.unlock();
+			return 0;
+		}
+
+		// @函数名: 输出各级别内存使用情况, 返回写入长度
+		int32_t report(char* buf, int32_t size)
+		{
+			classStat stat;
+			int32_t len=0;
+			int32_t ret=0;
+
+			ret=snprintf(buf, size, "buffer_pool_budget:%lu\r\nbuffer_pool_bytes:%lu\r\n", \
+					(unsigned long)budget_, (unsigned long)total_bytes_);
+			if(ret<0||ret>=size)
+				return -1;
+			len+=ret;
+
+			for(int32_t i=0; i<BUFFER_POOL_CLASS_NUM; ++i)
+			{
+				get_stat(i, stat);
+				if(stat.used_num==0 && stat.free_num==0 && stat.acquire_num==0)
+					continue;
+
+				ret=snprintf(buf+len, size-len, "buffer_pool_%dk:used=%u,free=%u,used_bytes=%lu,peak=%u,acquire=%lu,fail=%lu\r\n", \
+						stat.buffer_size>>10, \
+						stat.used_num, \
+						stat.free_num, \
+						(unsigned long)stat.used_num*stat.buffer_size, \
+						stat.peak_num, \
+						(unsigned long)stat.acquire_num, \
+						(unsigned long)stat.fail_num);
+				if(ret<0||ret>=size-len)
+					return -1;
+				len+=ret;
+			}
+			return len;
+		}
+
+	private:
+		// 在预算内新分配一个缓冲区
+		char* allocate(int32_t class_id)
+		{
+			uint64_t bytes=class_size(class_id);
+
+			if(__sync_add_and_fetch(&total_bytes_, bytes)>budget_ && budget_>0) {
+				__sync_sub_and_fetch(&total_bytes_, bytes);
+				// 空闲缓冲区也计入预算, 先腾出别的级别的空闲内存再重试
+				trim(bytes);
+				if(__sync_add_and_fetch(&total_bytes_, bytes)>budget_) {
+					__sync_sub_and_fetch(&total_bytes_, bytes);
+					return NULL;
+				}
+			}
+
+			char* buf=q_new_array<char>(bytes);
+			if(buf==NULL)
+				__sync_sub_and_fetch(&total_bytes_, bytes);
+			return buf;
+		}
+
+		struct freeNode {
+			freeNode*       next;
+		};
+
+		struct sizeClass {
+			QMutexLock      mutex;
+			freeNode*       free_list;
+			uint32_t        free_num;
+			uint32_t        used_num;
+			uint32_t        peak_num;
+			uint64_t        acquire_num;
+			uint64_t        fail_num;
+		};
+
+		sizeClass       classes_[BUFFER_POOL_CLASS_NUM];
+		uint64_t        budget_;
+		volatile uint64_t total_bytes_;
+};
+
+Q_END_NAMESPACE
+
+#endif // __QBUFFERPOOL_H_
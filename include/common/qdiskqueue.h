@@ -0,0 +1,320 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2016 Terry Niu (Beijing, China)
+** Filename:	qdiskqueue.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2016/04/12
+**
+*********************************************************************************************/
+
+#ifndef __QDISKQUEUE_H_
+#define __QDISKQUEUE_H_
+
+#include <sys/statvfs.h>
+
+#include "qglobal.h"
+
+/* write latency histogram, bucket i counts writes taking [2^i, 2^(i+1)) microseconds */
+#define DISK_LATENCY_BUCKETS (24)
+/* the histogram is halved once it holds this many writes, so it follows the recent ones */
+#define DISK_LATENCY_WINDOW  (1024)
+
+Q_BEGIN_NAMESPACE
+
+/* write job run by the disk thread, lives on the submitter's stack */
+struct diskJob {
+	int32_t         (*fun)(void* arg);
+	void*           arg;
+	int32_t         ret;
+	bool            done;
+
+	diskJob(int32_t (*in_fun)(void* arg), void* in_arg) :
+		fun(in_fun),
+		arg(in_arg),
+		ret(0),
+		done(false)
+	{}
+};
+
+// 磁盘写入队列类, 每块磁盘一个写入线程按提交顺序执行写入任务, 提交者等待任务完成;
+// 队列达到上限时提交立即失败, 调用者可改写其他磁盘, 慢盘只拖住写入它的请求;
+// 同时统计最近写入的耗时分布与磁盘剩余空间, 供调用者挑选磁盘或将磁盘置为只读
+class QDiskQueue: public noncopyable {
+	public:
+		inline QDiskQueue() :
+			max_depth_(1),
+			depth_(0),
+			stop_(false),
+			started_(false),
+			jobs_(0),
+			rejected_(0),
+			latency_count_(0),
+			latency_sum_(0),
+			free_bytes_(0),
+			total_bytes_(0),
+			fsid_(0),
+			readonly_(false)
+		{
+			memset(latency_hist_, 0, sizeof(latency_hist_));
+			pthread_mutex_init(&mutex_, NULL);
+			pthread_cond_init(&pending_cond_, NULL);
+			pthread_cond_init(&done_cond_, NULL);
+		}
+
+		virtual ~QDiskQueue()
+		{
+			stop();
+			pthread_cond_destroy(&done_cond_);
+			pthread_cond_destroy(&pending_cond_);
+			pthread_mutex_destroy(&mutex_);
+		}
+
+		// @函数名: 初始化函数, 启动写入线程
+		// @参数01: 磁盘上的目录, 用于统计剩余空间
+		// @参数02: 排队与执行中的任务数上限
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		inline int32_t init(const char* path, int32_t max_depth)
+		{
+			if(path==NULL||max_depth<=0)
+				return -1;
+
+			path_=path;
+			max_depth_=max_depth;
+
+			if(refresh()<0)
+				return -2;
+
+			if(q_create_thread(&tid_, QDiskQueue::disk_thread, this)<0)
+				return -3;
+			started_=true;
+
+			return 0;
+		}
+
+		// @函数名: 停止写入线程, 已提交的任务执行完后返回
+		inline void stop()
+		{
+			if(!started_)
+				return;
+
+			pthread_mutex_lock(&mutex_);
+			stop_=true;
+			pthread_cond_signal(&pending_cond_);
+			pthread_mutex_unlock(&mutex_);
+
+			q_thread_join(tid_);
+			started_=false;
+		}
+
+		// @函数名: 提交任务并等待执行完毕
+		// @参数01: 任务, 结果写入job.ret
+		// @返回值: 已执行返回0, 队列已满或已停止返回-1
+		inline int32_t submit(diskJob& job)
+		{
+			pthread_mutex_lock(&mutex_);
+			if(stop_||depth_>=max_depth_) {
+				rejected_++;
+				pthread_mutex_unlock(&mutex_);
+				return -1;
+			}
+
+			pending_.push_back(&job);
+			depth_++;
+			pthread_cond_signal(&pending_cond_);
+
+			while(!job.done)
+				pthread_cond_wait(&done_cond_, &mutex_);
+			pthread_mutex_unlock(&mutex_);
+
+			return 0;
+		}
+
+		// @函数名: 重新读取磁盘剩余与总字节数, 写入时只使用读取的结果, 不逐次statvfs
+		// @返回值: 成功返回0, 失败返回-1
+		inline int32_t refresh()
+		{
+			struct statvfs st;
+			if(statvfs(path_.c_str(), &st)<0)
+				return -1;
+			free_bytes_=(uint64_t)st.f_bavail*st.f_frsize;
+			total_bytes_=(uint64_t)st.f_blocks*st.f_frsize;
+			fsid_=st.f_fsid;
+			return 0;
+		}
+
+		// @函数名: 上次refresh时的剩余字节数
+		inline uint64_t free_bytes() const
+		{return free_bytes_;}
+
+		// @函数名: 上次refresh时的总字节数
+		inline uint64_t total_bytes() const
+		{return total_bytes_;}
+
+		// @函数名: 文件系统标识, 多个目录在同一文件系统时相同
+		inline uint64_t fsid() const
+		{return fsid_;}
+
+		// @函数名: 最近写入耗时的百分位数
+		// @参数01: 百分位, 1-100
+		// @返回值: 所在区间的上限(微秒), 尚无写入时返回0
+		inline uint64_t latency(uint32_t percent)
+		{
+			uint64_t target=0;
+			uint64_t count=0;
+
+			pthread_mutex_lock(&mutex_);
+			if(latency_count_==0) {
+				pthread_mutex_unlock(&mutex_);
+				return 0;
+			}
+
+			target=((uint64_t)latency_count_*percent+99)/100;
+			for(int32_t i=0; i<DISK_LATENCY_BUCKETS; ++i)
+			{
+				count+=latency_hist_[i];
+				if(count>=target) {
+					pthread_mutex_unlock(&mutex_);
+					return (uint64_t)2<<i;
+				}
+			}
+			pthread_mutex_unlock(&mutex_);
+
+			return (uint64_t)2<<(DISK_LATENCY_BUCKETS-1);
+		}
+
+		// @函数名: 耗时统计中的写入数, 衰减后只计最近的写入
+		inline uint32_t latency_samples() const
+		{return latency_count_;}
+
+		// @函数名: 最近写入的平均耗时(微秒), 尚无写入时返回0
+		inline uint64_t mean_latency()
+		{
+			uint64_t mean=0;
+
+			pthread_mutex_lock(&mutex_);
+			mean=latency_count_>0?latency_sum_/latency_count_:0;
+			pthread_mutex_unlock(&mutex_);
+
+			return mean;
+		}
+
+		// @函数名: 清空耗时统计, 只读磁盘恢复写入前调用, 以免旧的慢写入立即再次触发只读
+		inline void reset_latency()
+		{
+			pthread_mutex_lock(&mutex_);
+			memset(latency_hist_, 0, sizeof(latency_hist_));
+			latency_count_=0;
+			latency_sum_=0;
+			pthread_mutex_unlock(&mutex_);
+		}
+
+		// @函数名: 只读磁盘不再接受新图片, 已有图片照常读取与删除
+		inline void set_readonly(bool readonly)
+		{readonly_=readonly;}
+
+		inline bool readonly() const
+		{return readonly_;}
+
+		inline const std::string& path() const
+		{return path_;}
+
+		// @函数名: 排队与执行中的任务数
+		inline int32_t depth() const
+		{return depth_;}
+
+		// @函数名: 已执行任务数
+		inline uint64_t jobs() const
+		{return jobs_;}
+
+		// @函数名: 因队列已满被拒绝的任务数
+		inline uint64_t rejected() const
+		{return rejected_;}
+
+	private:
+		// @函数名: 记入一次写入耗时, 须持有mutex_
+		inline void record_latency(uint64_t us)
+		{
+			int32_t bucket=0;
+
+			if(latency_count_>=DISK_LATENCY_WINDOW) {
+				latency_count_=0;
+				for(int32_t i=0; i<DISK_LATENCY_BUCKETS; ++i)
+				{
+					latency_hist_[i]>>=1;
+					latency_count_+=latency_hist_[i];
+				}
+				latency_sum_>>=1;
+			}
+
+			while(bucket<DISK_LATENCY_BUCKETS-1 && us>>(bucket+1)>0)
+				++bucket;
+
+			latency_hist_[bucket]++;
+			latency_count_++;
+			latency_sum_+=us;
+		}
+
+		// @函数名: 写入线程, 逐个执行任务
+		static void* disk_thread(void* argv)
+		{
+			QDiskQueue* ptr_this=reinterpret_cast<QDiskQueue*>(argv);
+			diskJob* job=NULL;
+			QStopwatch sw;
+
+			pthread_mutex_lock(&ptr_this->mutex_);
+			for(;;)
+			{
+				while(ptr_this->pending_.empty() && !ptr_this->stop_)
+					pthread_cond_wait(&ptr_this->pending_cond_, &ptr_this->mutex_);
+
+				if(ptr_this->pending_.empty() && ptr_this->stop_)
+					break;
+
+				job=ptr_this->pending_.front();
+				ptr_this->pending_.pop_front();
+				pthread_mutex_unlock(&ptr_this->mutex_);
+
+				sw.start();
+				job->ret=job->fun(job->arg);
+				sw.stop();
+
+				pthread_mutex_lock(&ptr_this->mutex_);
+				ptr_this->record_latency(sw.elapsed_us()>0?sw.elapsed_us():0);
+				job->done=true;
+				ptr_this->depth_--;
+				ptr_this->jobs_++;
+				pthread_cond_broadcast(&ptr_this->done_cond_);
+			}
+			pthread_mutex_unlock(&ptr_this->mutex_);
+
+			return NULL;
+		}
+
+	private:
+		std::string                     path_;
+		int32_t                         max_depth_;
+		volatile int32_t                depth_;
+		bool                            stop_;
+		bool                            started_;
+		pthread_t                       tid_;
+		pthread_mutex_t                 mutex_;
+		pthread_cond_t                  pending_cond_;
+		pthread_cond_t                  done_cond_;
+		std::deque<diskJob*>            pending_;
+		uint64_t                        jobs_;
+		uint64_t                        rejected_;
+		/* decayed latency histogram and the sum of the latencies it holds */
+		uint32_t                        latency_hist_[DISK_LATENCY_BUCKETS];
+		uint32_t                        latency_count_;
+		uint64_t                        latency_sum_;
+		volatile uint64_t               free_bytes_;
+		volatile uint64_t               total_bytes_;
+		volatile uint64_t               fsid_;
+		volatile bool                   readonly_;
+};
+
+Q_END_NAMESPACE
+
+#endif // __QDISKQUEUE_H_
@@ -126,6 +126,7 @@
 #else
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/param.h>
@@ -134,6 +135,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -484,6 +486,17 @@ enum SortOrder {NoSort=0x00, AscendingOrder, DescendingOrder};
 
 enum State {Stopped=0x00, Paused, Running};
 
+// 64位整数哈希(murmur3的fmix64), 图片编号等键的每一位都影响结果的全部位
+__inline uint64_t q_hash64(uint64_t key)
+{
+	key^=key>>33;
+	key*=0xff51afd7ed558ccdULL;
+	key^=key>>33;
+	key*=0xc4ceb9fe1a85ec53ULL;
+	key^=key>>33;
+	return key;
+}
+
 // 原子操作
 __inline uint32_t q_add_and_fetch(uint32_t* val)
 {
@@ -1060,6 +1073,141 @@ static inline int32_t q_get_cpu_processors()
 #endif
 }
 
+#ifndef WIN32
+// 节点编号不超过64, 与mbind使用的单字节点掩码一致
+#define Q_NUMA_MAX_NODES (64)
+
+// 解析CPU列表, 如"0-3,8,10-11", 超出本机CPU数的编号忽略, 格式错误或结果为空返回-1
+static inline int32_t q_parse_cpu_set(const char* spec, cpu_set_t* cpu_set)
+{
+	int32_t cpu_num=q_get_cpu_processors();
+	const char* ptr=spec;
+	char* end=NULL;
+	long first=0;
+	long last=0;
+
+	CPU_ZERO(cpu_set);
+	while(*ptr)
+	{
+		first=strtol(ptr, &end, 10);
+		if(end==ptr||first<0)
+			return -1;
+		last=first;
+		ptr=end;
+
+		if(*ptr=='-') {
+			last=strtol(++ptr, &end, 10);
+			if(end==ptr||last<first)
+				return -1;
+			ptr=end;
+		}
+
+		for(long i=first; i<=last && i<cpu_num && i<CPU_SETSIZE; ++i)
+			CPU_SET(i, cpu_set);
+
+		if(*ptr==',')
+			++ptr;
+		else if(*ptr)
+			return -1;
+	}
+
+	return CPU_COUNT(cpu_set)>0?0:-1;
+}
+
+// 将CPU集合格式化为"0-3,8"形式
+static inline int32_t q_format_cpu_set(const cpu_set_t* cpu_set, char* buf, int32_t size)
+{
+	int32_t len=0;
+	int32_t ret=0;
+
+	buf[0]=0;
+	for(int32_t i=0; i<CPU_SETSIZE; ++i)
+	{
+		if(!CPU_ISSET(i, cpu_set))
+			continue;
+
+		int32_t j=i;
+		while(j+1<CPU_SETSIZE && CPU_ISSET(j+1, cpu_set))
+			++j;
+
+		if(j>i)
+			ret=snprintf(buf+len, size-len, "%s%d-%d", len?",":"", i, j);
+		else
+			ret=snprintf(buf+len, size-len, "%s%d", len?",":"", i);
+		if(ret<0||ret>=size-len)
+			return -1;
+		len+=ret;
+		i=j;
+	}
+
+	return len;
+}
+
+// 将调用线程绑定到CPU集合上
+static inline int32_t q_set_thread_cpu_set(const cpu_set_t* cpu_set)
+{
+	if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpu_set))
+		return -1;
+	return 0;
+}
+
+// 获取CPU所在的NUMA节点, 无法获知时返回-1
+static inline int32_t q_get_cpu_node(int32_t cpu)
+{
+	char path[64]={0};
+	for(int32_t node=0; node<Q_NUMA_MAX_NODES; ++node)
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if(access(path, F_OK)==0)
+			return node;
+	}
+	return -1;
+}
+
+// 获取CPU集合所在的NUMA节点, 集合跨节点或无法获知时返回-1
+static inline int32_t q_get_cpu_set_node(const cpu_set_t* cpu_set)
+{
+	int32_t node=-1;
+	int32_t cpu_node=-1;
+
+	for(int32_t i=0; i<CPU_SETSIZE; ++i)
+	{
+		if(!CPU_ISSET(i, cpu_set))
+			continue;
+		cpu_node=q_get_cpu_node(i);
+		if(cpu_node<0||(node>=0 && cpu_node!=node))
+			return -1;
+		node=cpu_node;
+	}
+
+	return node;
+}
+
+// 将内存区间内的完整页面优先放在NUMA节点node上, 已分配的页面一并迁移; 内核不支持时返回-1
+static inline int32_t q_bind_memory_node(void* ptr, size_t size, int32_t node)
+{
+#ifdef __NR_mbind
+	uintptr_t page=(uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t begin=((uintptr_t)ptr+page-1)&~(page-1);
+	uintptr_t end=((uintptr_t)ptr+size)&~(page-1);
+	unsigned long node_mask=0;
+
+	if(node<0||node>=(int32_t)(sizeof(node_mask)*8))
+		return -1;
+	if(end<=begin)
+		return 0;
+
+	// MPOL_PREFERRED(1), MPOL_MF_MOVE(2)
+	node_mask=1UL<<node;
+	if(syscall(__NR_mbind, begin, end-begin, 1, &node_mask, sizeof(node_mask)*8, 2)<0)
+		return -1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+#endif
+
 static inline int32_t q_get_load_avg()
 {
 #ifdef WIN32
@@ -1701,7 +1849,7 @@ static int32_t q_set_nodelay(Q_SOCKET_T in_socket)
 #endif
 }
 
-static int32_t q_TCP_server(Q_SOCKET_T& in_listen, uint16_t in_port, int32_t backlog=511)
+static int32_t q_TCP_server(Q_SOCKET_T& in_listen, uint16_t in_port, int32_t backlog=511, bool reuse_port=false)
 {
 	struct sockaddr_in my_server_addr;
 	my_server_addr.sin_family=AF_INET;
@@ -1719,6 +1867,14 @@ static int32_t q_TCP_server(Q_SOCKET_T& in_listen, uint16_t in_port, int32_t bac
 #else
 	int32_t reuse=1;
 	setsockopt(in_listen, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+	// 多个监听套接字绑定同一端口, 由内核在其间分配连接
+	if(reuse_port && setsockopt(in_listen, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))<0) {
+		q_close_socket(in_listen);
+		Q_DEBUG("q_listen_socket: set SO_REUSEPORT failure!");
+		return -1;
+	}
+#endif
 #endif
 	if(bind(in_listen, (struct sockaddr*)&my_server_addr, sizeof(my_server_addr))<0) {
 		q_close_socket(in_listen);
@@ -0,0 +1,270 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2016 Terry Niu (Beijing, China)
+** Filename:	qgroupcommit.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2016/03/22
+**
+*********************************************************************************************/
+
+#ifndef __QGROUPCOMMIT_H_
+#define __QGROUPCOMMIT_H_
+
+#include "qglobal.h"
+
+/* sync modes */
+#define GROUP_COMMIT_NONE   (0)
+#define GROUP_COMMIT_BATCH  (1)
+#define GROUP_COMMIT_WRITE  (2)
+
+Q_BEGIN_NAMESPACE
+
+/* one caller waiting for its write to reach the disk, lives on the caller's stack */
+struct syncWaiter {
+	int32_t         fd;
+	int32_t         ret;
+	bool            done;
+
+	syncWaiter(int32_t in_fd) :
+		fd(in_fd),
+		ret(0),
+		done(false)
+	{}
+};
+
+// 组提交类, 多个线程写入后调用sync加入同一批次, 由同步线程对批次内的文件只做一次fdatasync,
+// 全部落盘后一起返回; 批次达到batch_size个或首个请求等待超过max_delay毫秒时提交,
+// 提交期间到达的请求自然组成下一批次
+class QGroupCommit: public noncopyable {
+	public:
+		inline QGroupCommit() :
+			mode_(GROUP_COMMIT_NONE),
+			batch_size_(1),
+			max_delay_(0),
+			sync_fs_(false),
+			stop_(false),
+			started_(false),
+			batches_(0),
+			writes_(0)
+		{
+			pthread_mutex_init(&mutex_, NULL);
+			pthread_cond_init(&pending_cond_, NULL);
+			pthread_cond_init(&done_cond_, NULL);
+		}
+
+		virtual ~QGroupCommit()
+		{
+			stop();
+			pthread_cond_destroy(&done_cond_);
+			pthread_cond_destroy(&pending_cond_);
+			pthread_mutex_destroy(&mutex_);
+		}
+
+		// @函数名: 初始化函数, 批量模式下启动同步线程
+		// @参数01: 同步模式, GROUP_COMMIT_NONE不同步, GROUP_COMMIT_BATCH批量同步, GROUP_COMMIT_WRITE每次写入同步
+		// @参数02: 批次最大请求数
+		// @参数03: 批次最长等待时间(毫秒), 0表示不等待
+		// @参数04: 为true时以syncfs同步整个文件系统, 适用于每次写入不同文件的场景
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		inline int32_t init(int32_t mode, int32_t batch_size, int32_t max_delay, bool sync_fs=false)
+		{
+			if(batch_size<=0||max_delay<0)
+				return -1;
+
+			mode_=mode;
+			batch_size_=batch_size;
+			max_delay_=max_delay;
+			sync_fs_=sync_fs;
+
+			if(mode_==GROUP_COMMIT_BATCH) {
+				if(q_create_thread(&tid_, QGroupCommit::sync_thread, this)<0)
+					return -2;
+				started_=true;
+			}
+
+			return 0;
+		}
+
+		// @函数名: 停止同步线程, 已加入批次的请求同步后返回
+		inline void stop()
+		{
+			if(!started_)
+				return;
+
+			pthread_mutex_lock(&mutex_);
+			stop_=true;
+			pthread_cond_signal(&pending_cond_);
+			pthread_mutex_unlock(&mutex_);
+
+			q_thread_join(tid_);
+			started_=false;
+		}
+
+		// @函数名: 等待文件此前的写入落盘
+		// @参数01: 文件描述符, 返回前调用者不得关闭
+		// @返回值: 成功返回0, 同步失败返回小于0的错误码
+		inline int32_t sync(int32_t fd)
+		{
+			if(mode_==GROUP_COMMIT_NONE)
+				return 0;
+
+			if(mode_==GROUP_COMMIT_WRITE) {
+				q_add_and_fetch(&batches_);
+				q_add_and_fetch(&writes_);
+				return flush_fd(fd);
+			}
+
+			syncWaiter waiter(fd);
+
+			pthread_mutex_lock(&mutex_);
+			if(stop_) {
+				pthread_mutex_unlock(&mutex_);
+				return flush_fd(fd);
+			}
+
+			pending_.push_back(&waiter);
+			if(pending_.size()==1||(int32_t)pending_.size()>=batch_size_)
+				pthread_cond_signal(&pending_cond_);
+
+			while(!waiter.done)
+				pthread_cond_wait(&done_cond_, &mutex_);
+			pthread_mutex_unlock(&mutex_);
+
+			return waiter.ret;
+		}
+
+		// @函数名: 同步模式
+		inline int32_t mode() const
+		{return mode_;}
+
+		// @函数名: 已提交批次数
+		inline uint32_t batches() const
+		{return batches_;}
+
+		// @函数名: 已同步写入数
+		inline uint32_t writes() const
+		{return writes_;}
+
+	private:
+		inline int32_t flush_fd(int32_t fd)
+		{
+			int32_t ret=sync_fs_?syncfs(fd):fdatasync(fd);
+			return ret<0?-1:0;
+		}
+
+		// @函数名: 同步一个批次, 同一文件只同步一次, syncfs模式下同一文件系统只同步一次
+		inline void flush(std::vector<syncWaiter*>& batch)
+		{
+			std::vector<uint64_t> keys;
+			std::vector<int32_t> rets;
+			struct stat st;
+			uint64_t key=0;
+			size_t i=0;
+			size_t j=0;
+
+			for(i=0; i<batch.size(); ++i)
+			{
+				// 图片分布在多块磁盘时按设备号区分文件系统, 取不到设备号时单独同步
+				if(sync_fs_) {
+					if(fstat(batch[i]->fd, &st)<0) {
+						batch[i]->ret=flush_fd(batch[i]->fd);
+						continue;
+					}
+					key=st.st_dev;
+				} else {
+					key=batch[i]->fd;
+				}
+
+				for(j=0; j<keys.size(); ++j)
+				{
+					if(keys[j]==key)
+						break;
+				}
+				if(j==keys.size()) {
+					keys.push_back(key);
+					rets.push_back(flush_fd(batch[i]->fd));
+				}
+				batch[i]->ret=rets[j];
+			}
+
+			batches_++;
+			writes_+=batch.size();
+		}
+
+		// @函数名: 同步线程
+		static void* sync_thread(void* argv)
+		{
+			QGroupCommit* ptr_this=reinterpret_cast<QGroupCommit*>(argv);
+			std::vector<syncWaiter*> batch;
+			struct timespec deadline;
+
+			pthread_mutex_lock(&ptr_this->mutex_);
+			for(;;)
+			{
+				while(ptr_this->pending_.empty() && !ptr_this->stop_)
+					pthread_cond_wait(&ptr_this->pending_cond_, &ptr_this->mutex_);
+
+				if(ptr_this->pending_.empty() && ptr_this->stop_)
+					break;
+
+				// 批次未满时等待更多请求加入, 最多等待max_delay毫秒
+				if(ptr_this->max_delay_>0 && (int32_t)ptr_this->pending_.size()<ptr_this->batch_size_ && !ptr_this->stop_) {
+					clock_gettime(CLOCK_REALTIME, &deadline);
+					deadline.tv_sec+=ptr_this->max_delay_/1000;
+					deadline.tv_nsec+=(ptr_this->max_delay_%1000)*1000000L;
+					if(deadline.tv_nsec>=1000000000L) {
+						deadline.tv_sec+=1;
+						deadline.tv_nsec-=1000000000L;
+					}
+
+					while((int32_t)ptr_this->pending_.size()<ptr_this->batch_size_ && !ptr_this->stop_)
+					{
+						if(pthread_cond_timedwait(&ptr_this->pending_cond_, &ptr_this->mutex_, &deadline)==ETIMEDOUT)
+							break;
+					}
+				}
+
+				// 超出批次上限的请求留给下一批次
+				if((int32_t)ptr_this->pending_.size()>ptr_this->batch_size_) {
+					batch.assign(ptr_this->pending_.begin(), ptr_this->pending_.begin()+ptr_this->batch_size_);
+					ptr_this->pending_.erase(ptr_this->pending_.begin(), ptr_this->pending_.begin()+ptr_this->batch_size_);
+				} else {
+					batch.swap(ptr_this->pending_);
+				}
+				pthread_mutex_unlock(&ptr_this->mutex_);
+
+				ptr_this->flush(batch);
+
+				pthread_mutex_lock(&ptr_this->mutex_);
+				for(size_t i=0; i<batch.size(); ++i)
+					batch[i]->done=true;
+				batch.clear();
+				pthread_cond_broadcast(&ptr_this->done_cond_);
+			}
+			pthread_mutex_unlock(&ptr_this->mutex_);
+
+			return NULL;
+		}
+
+	private:
+		int32_t                         mode_;
+		int32_t                         batch_size_;
+		int32_t                         max_delay_;
+		bool                            sync_fs_;
+		bool                            stop_;
+		bool                            started_;
+		pthread_t                       tid_;
+		pthread_mutex_t                 mutex_;
+		/* signalled when the first waiter joins or the batch is full */
+		pthread_cond_t                  pending_cond_;
+		pthread_cond_t                  done_cond_;
+		std::vector<syncWaiter*>        pending_;
+		uint32_t                        batches_;
+		uint32_t                        writes_;
+};
+
+Q_END_NAMESPACE
+
+#endif // __QGROUPCOMMIT_H_
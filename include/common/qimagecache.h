@@ -0,0 +1,418 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2016 Terry Niu (Beijing, China)
+** Filename:	qimagecache.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2016/04/06
+**
+*********************************************************************************************/
+
+#ifndef __QIMAGECACHE_H_
+#define __QIMAGECACHE_H_
+
+#include "qglobal.h"
+
+#define IMAGE_CACHE_MAX_SHARDS      (1<<10)
+/* count-min sketch rows, 4-bit counters kept in bytes */
+#define IMAGE_CACHE_SKETCH_DEPTH    (4)
+#define IMAGE_CACHE_SKETCH_MAX      (15)
+#define IMAGE_CACHE_SKETCH_MIN      (1<<10)
+#define IMAGE_CACHE_SKETCH_LIMIT    (1<<20)
+
+Q_BEGIN_NAMESPACE
+
+/* cached image, pinned by references while its bytes are being sent */
+struct cacheItem {
+	uint64_t        key;
+	char*           data;
+	int32_t         len;
+	/* where the image is stored, returned along with the bytes */
+	std::string     location;
+	int32_t         refs;
+	/* evicted or erased while pinned, freed by the last release */
+	bool            unlinked;
+	cacheItem*      prev;
+	cacheItem*      next;
+
+	cacheItem() :
+		key(0),
+		data(NULL),
+		len(0),
+		refs(0),
+		unlinked(false),
+		prev(NULL),
+		next(NULL)
+	{}
+};
+
+struct cacheStat {
+	uint64_t        hits;
+	uint64_t        misses;
+	uint64_t        evictions;
+	/* candidates the admission policy turned away */
+	uint64_t        rejections;
+	uint64_t        bytes;
+	uint64_t        items;
+
+	cacheStat() :
+		hits(0),
+		misses(0),
+		evictions(0),
+		rejections(0),
+		bytes(0),
+		items(0)
+	{}
+};
+
+/* one lock, LRU list and frequency sketch per shard */
+struct cacheShard {
+	QMutexLock                      mutex;
+	std::map<uint64_t, cacheItem*>  items;
+	/* most recently used first */
+	cacheItem*                      head;
+	cacheItem*                      tail;
+	uint64_t                        bytes;
+	uint8_t*                        sketch;
+	uint32_t                        sketch_width;
+	uint32_t                        additions;
+	/* bumped by every erase, put refuses images read before the erase */
+	uint64_t                        erase_epoch;
+	cacheStat                       stat;
+
+	cacheShard() :
+		head(NULL),
+		tail(NULL),
+		bytes(0),
+		sketch(NULL),
+		sketch_width(0),
+		additions(0),
+		erase_epoch(0)
+	{}
+};
+
+// 热点图片缓存类, 按图片编号分片, 各分片独立加锁并按字节数限定容量;
+// 采用TinyLFU准入策略: 每次访问计入分片的频率草图(count-min sketch, 计数定期减半以淡忘旧的访问),
+// 缓存已满时新图片的访问频率须高于全部待淘汰的LRU图片才能进入, 批量重新抓取的一次性访问无法冲掉热点图片
+class QImageCache: public noncopyable {
+	public:
+		inline QImageCache() :
+			shards_(NULL),
+			shard_num_(0),
+			shard_capacity_(0),
+			max_item_size_(0)
+		{}
+
+		virtual ~QImageCache()
+		{
+			for(uint32_t i=0; i<shard_num_; ++i)
+			{
+				cacheItem* item=shards_[i].head;
+				while(item!=NULL) {
+					cacheItem* next=item->next;
+					free_item(item);
+					item=next;
+				}
+				q_delete_array<uint8_t>(shards_[i].sketch);
+			}
+			q_delete_array<cacheShard>(shards_);
+		}
+
+		// @函数名: 初始化函数
+		// @参数01: 缓存总字节数, 平均分给各分片
+		// @参数02: 分片数, 向上取整为2的幂
+		// @参数03: 可缓存的单张图片最大字节数
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		inline int32_t init(uint64_t capacity, uint32_t shard_num, int32_t max_item_size)
+		{
+			if(capacity==0||shard_num==0||shard_num>IMAGE_CACHE_MAX_SHARDS||max_item_size<=0)
+				return -1;
+
+			shard_num_=1;
+			while(shard_num_<shard_num)
+				shard_num_<<=1;
+			shard_capacity_=capacity/shard_num_;
+			max_item_size_=max_item_size;
+
+			shards_=q_new_array<cacheShard>(shard_num_);
+			if(shards_==NULL)
+				return -2;
+
+			// 草图宽度按分片能容纳的4KB图片数估算
+			uint32_t width=IMAGE_CACHE_SKETCH_MIN;
+			while(width<IMAGE_CACHE_SKETCH_LIMIT && width<(shard_capacity_>>12))
+				width<<=1;
+
+			for(uint32_t i=0; i<shard_num_; ++i)
+			{
+				shards_[i].sketch=q_new_array<uint8_t>(width*IMAGE_CACHE_SKETCH_DEPTH);
+				if(shards_[i].sketch==NULL)
+					return -2;
+				memset(shards_[i].sketch, 0, width*IMAGE_CACHE_SKETCH_DEPTH);
+				shards_[i].sketch_width=width;
+			}
+
+			return 0;
+		}
+
+		// @函数名: 查找图片并计入访问频率, 命中时增加引用
+		// @参数01: 图片编号
+		// @参数02: 返回分片的删除计数, 未命中时读出图片后随put传回
+		// @返回值: 命中返回图片, 用完须调用release; 未命中返回NULL
+		inline cacheItem* get(uint64_t key, uint64_t& epoch)
+		{
+			uint64_t h=q_hash64(key);
+			cacheShard& shard=shards_[shard_of(h)];
+			QScopeMutex guard(shard.mutex);
+
+			record(shard, h);
+			epoch=shard.erase_epoch;
+
+			std::map<uint64_t, cacheItem*>::iterator it=shard.items.find(key);
+			if(it==shard.items.end()) {
+				shard.stat.misses++;
+				return NULL;
+			}
+
+			cacheItem* item=it->second;
+			unlink(shard, item);
+			push_front(shard, item);
+			item->refs++;
+			shard.stat.hits++;
+			return item;
+		}
+
+		// @函数名: 预判图片能否进入缓存, 未命中时据此决定是否读出图片数据
+		inline bool admit(uint64_t key, int32_t len)
+		{
+			if(len<=0||len>max_item_size_||(uint64_t)len>shard_capacity_)
+				return false;
+
+			uint64_t h=q_hash64(key);
+			cacheShard& shard=shards_[shard_of(h)];
+			QScopeMutex guard(shard.mutex);
+
+			if(victims(shard, h, len)<0) {
+				shard.stat.rejections++;
+				return false;
+			}
+			return true;
+		}
+
+		// @函数名: 放入图片, 无论成功与否都接管data(q_new_array分配)
+		// @参数01: 图片编号
+		// @参数02: 图片数据
+		// @参数03: 数据长度
+		// @参数04: 图片位置
+		// @参数05: 读取前get返回的删除计数, 此后分片中有图片被删除时不放入, 删除前读出的图片不会回到缓存
+		// @返回值: 成功返回增加引用后的图片, 用完须调用release; 准入策略拒绝或期间有删除返回NULL
+		inline cacheItem* put(uint64_t key, char* data, int32_t len, const std::string& location, uint64_t epoch)
+		{
+			if(data==NULL||len<=0||len>max_item_size_||(uint64_t)len>shard_capacity_) {
+				q_delete_array<char>(data);
+				return NULL;
+			}
+
+			uint64_t h=q_hash64(key);
+			cacheShard& shard=shards_[shard_of(h)];
+			QScopeMutex guard(shard.mutex);
+
+			if(shard.erase_epoch!=epoch) {
+				q_delete_array<char>(data);
+				return NULL;
+			}
+
+			// 并发的读取已先放入
+			std::map<uint64_t, cacheItem*>::iterator it=shard.items.find(key);
+			if(it!=shard.items.end()) {
+				q_delete_array<char>(data);
+				it->second->refs++;
+				return it->second;
+			}
+
+			int32_t evict_num=victims(shard, h, len);
+			if(evict_num<0) {
+				shard.stat.rejections++;
+				q_delete_array<char>(data);
+				return NULL;
+			}
+
+			for(int32_t i=0; i<evict_num; ++i)
+			{
+				cacheItem* victim=shard.tail;
+				remove(shard, victim);
+				shard.stat.evictions++;
+			}
+
+			cacheItem* item=q_new<cacheItem>();
+			if(item==NULL) {
+				q_delete_array<char>(data);
+				return NULL;
+			}
+			item->key=key;
+			item->data=data;
+			item->len=len;
+			item->location=location;
+			item->refs=1;
+
+			shard.items.insert(std::make_pair(key, item));
+			push_front(shard, item);
+			shard.bytes+=len;
+			return item;
+		}
+
+		// @函数名: 释放get或put增加的引用
+		inline void release(cacheItem* item)
+		{
+			cacheShard& shard=shards_[shard_of(q_hash64(item->key))];
+			bool dead=false;
+
+			shard.mutex.lock();
+			dead=(--item->refs==0 && item->unlinked);
+			shard.mutex.unlock();
+
+			if(dead)
+				free_item(item);
+		}
+
+		// @函数名: 删除图片, 正在发送的图片在最后一个引用释放后回收
+		inline void erase(uint64_t key)
+		{
+			cacheShard& shard=shards_[shard_of(q_hash64(key))];
+			QScopeMutex guard(shard.mutex);
+
+			shard.erase_epoch++;
+			std::map<uint64_t, cacheItem*>::iterator it=shard.items.find(key);
+			if(it!=shard.items.end())
+				remove(shard, it->second);
+		}
+
+		// @函数名: 汇总各分片统计
+		inline void stats(cacheStat& stat)
+		{
+			stat=cacheStat();
+			for(uint32_t i=0; i<shard_num_; ++i)
+			{
+				QScopeMutex guard(shards_[i].mutex);
+				stat.hits+=shards_[i].stat.hits;
+				stat.misses+=shards_[i].stat.misses;
+				stat.evictions+=shards_[i].stat.evictions;
+				stat.rejections+=shards_[i].stat.rejections;
+				stat.bytes+=shards_[i].bytes;
+				stat.items+=shards_[i].items.size();
+			}
+		}
+
+	private:
+		// 高位选分片, 低位留给草图
+		inline uint32_t shard_of(uint64_t h) const
+		{return (uint32_t)(h>>48)&(shard_num_-1);}
+
+		// 第row行的计数位置, 两个32位哈希组合出各行相互独立的位置
+		static inline uint32_t slot(const cacheShard& shard, uint64_t h, int32_t row)
+		{
+			uint32_t h1=(uint32_t)h;
+			uint32_t h2=(uint32_t)(h>>32)|1;
+			return row*shard.sketch_width+((h1+row*h2)&(shard.sketch_width-1));
+		}
+
+		inline void record(cacheShard& shard, uint64_t h)
+		{
+			for(int32_t i=0; i<IMAGE_CACHE_SKETCH_DEPTH; ++i)
+			{
+				uint8_t& counter=shard.sketch[slot(shard, h, i)];
+				if(counter<IMAGE_CACHE_SKETCH_MAX)
+					counter++;
+			}
+
+			// 访问数达到草图宽度的10倍时全部计数减半, 过去的热点逐渐让位
+			if(++shard.additions>=shard.sketch_width*10) {
+				for(uint32_t i=0; i<shard.sketch_width*IMAGE_CACHE_SKETCH_DEPTH; ++i)
+					shard.sketch[i]>>=1;
+				shard.additions=0;
+			}
+		}
+
+		inline uint32_t frequency(const cacheShard& shard, uint64_t h) const
+		{
+			uint32_t freq=IMAGE_CACHE_SKETCH_MAX;
+			for(int32_t i=0; i<IMAGE_CACHE_SKETCH_DEPTH; ++i)
+			{
+				uint8_t counter=shard.sketch[slot(shard, h, i)];
+				if(counter<freq)
+					freq=counter;
+			}
+			return freq;
+		}
+
+		// 腾出len字节需淘汰的LRU图片数, 任一待淘汰图片的频率不低于新图片时返回-1
+		inline int32_t victims(const cacheShard& shard, uint64_t h, int32_t len) const
+		{
+			uint64_t bytes=shard.bytes;
+			uint32_t freq=frequency(shard, h);
+			int32_t num=0;
+
+			for(cacheItem* item=shard.tail; item!=NULL && bytes+len>shard_capacity_; item=item->prev)
+			{
+				if(frequency(shard, q_hash64(item->key))>=freq)
+					return -1;
+				bytes-=item->len;
+				++num;
+			}
+
+			return bytes+len>shard_capacity_?-1:num;
+		}
+
+		inline void push_front(cacheShard& shard, cacheItem* item)
+		{
+			item->prev=NULL;
+			item->next=shard.head;
+			if(shard.head!=NULL)
+				shard.head->prev=item;
+			shard.head=item;
+			if(shard.tail==NULL)
+				shard.tail=item;
+		}
+
+		inline void unlink(cacheShard& shard, cacheItem* item)
+		{
+			if(item->prev!=NULL)
+				item->prev->next=item->next;
+			else
+				shard.head=item->next;
+			if(item->next!=NULL)
+				item->next->prev=item->prev;
+			else
+				shard.tail=item->prev;
+			item->prev=NULL;
+			item->next=NULL;
+		}
+
+		// 移出分片, 无引用时直接回收
+		inline void remove(cacheShard& shard, cacheItem* item)
+		{
+			unlink(shard, item);
+			shard.items.erase(item->key);
+			shard.bytes-=item->len;
+			item->unlinked=true;
+			if(item->refs==0)
+				free_item(item);
+		}
+
+		static inline void free_item(cacheItem* item)
+		{
+			q_delete_array<char>(item->data);
+			q_delete<cacheItem>(item);
+		}
+
+	private:
+		cacheShard*     shards_;
+		uint32_t        shard_num_;
+		uint64_t        shard_capacity_;
+		int32_t         max_item_size_;
+};
+
+Q_END_NAMESPACE
+
+#endif // __QIMAGECACHE_H_
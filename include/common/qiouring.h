@@ -0,0 +1,365 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2014 Terry Niu (Beijing, China)
+** Filename:	qiouring.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2014/05/12
+**
+*********************************************************************************************/
+
+#ifndef __QIOURING_H_
+#define __QIOURING_H_
+
+#include "qglobal.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define Q_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef Q_HAVE_IO_URING
+#define Q_IORING_OP(op) (IORING_OP_##op)
+#define Q_IOSQE_IO_LINK (IOSQE_IO_LINK)
+#else
+#define Q_IORING_OP(op) (0)
+#define Q_IOSQE_IO_LINK (0)
+#endif
+
+Q_BEGIN_NAMESPACE
+
+// io_uring封装类, 直接使用系统调用, 不依赖liburing;
+// 准备的提交项先留在提交队列中, 调用submit时一次io_uring_enter批量提交并可等待完成;
+// 编译环境或内核不支持时init返回<0, 由调用方退回epoll或同步读写
+class QIoUring: public noncopyable {
+	public:
+		inline QIoUring() :
+			ring_fd_(-1),
+			sq_ptr_(NULL),
+			sq_size_(0),
+			cq_ptr_(NULL),
+			cq_size_(0),
+			sqes_(NULL),
+			sqes_size_(0),
+			sq_head_(NULL),
+			sq_tail_(NULL),
+			sq_mask_(0),
+			sq_entries_(0),
+			sq_array_(NULL),
+			cq_head_(NULL),
+			cq_tail_(NULL),
+			cq_mask_(0),
+			cqes_(NULL),
+			sqe_tail_(0),
+			pending_(0)
+		{}
+
+		virtual ~QIoUring()
+		{
+#ifdef Q_HAVE_IO_URING
+			if(sqes_)
+				::munmap(sqes_, sqes_size_);
+			if(cq_ptr_ && cq_ptr_!=sq_ptr_)
+				::munmap(cq_ptr_, cq_size_);
+			if(sq_ptr_)
+				::munmap(sq_ptr_, sq_size_);
+			if(ring_fd_>=0)
+				::close(ring_fd_);
+#endif
+		}
+
+		// @函数名: 初始化函数, 提交队列长度向上取整为2的幂, 不支持io_uring时返回<0
+		int32_t init(uint32_t entries)
+		{
+#ifdef Q_HAVE_IO_URING
+			struct io_uring_params params;
+			memset(&params, 0, sizeof(params));
+
+			ring_fd_=(int32_t)::syscall(__NR_io_uring_setup, entries, &params);
+			if(ring_fd_<0)
+				return -1;
+
+			sq_size_=params.sq_off.array+params.sq_entries*sizeof(uint32_t);
+			cq_size_=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+			// 新内核提交与完成队列共用一次映射
+			if(params.features&IORING_FEAT_SINGLE_MMAP)
+				sq_size_=cq_size_=q_max(sq_size_, cq_size_);
+
+			sq_ptr_=::mmap(NULL, sq_size_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+			if(sq_ptr_==MAP_FAILED) {
+				sq_ptr_=NULL;
+				return -2;
+			}
+
+			if(params.features&IORING_FEAT_SINGLE_MMAP) {
+				cq_ptr_=sq_ptr_;
+			} else {
+				cq_ptr_=::mmap(NULL, cq_size_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+				if(cq_ptr_==MAP_FAILED) {
+					cq_ptr_=NULL;
+					return -3;
+				}
+			}
+
+			sqes_size_=params.sq_entries*sizeof(struct io_uring_sqe);
+			sqes_=reinterpret_cast<struct io_uring_sqe*>(::mmap(NULL, sqes_size_, PROT_READ|PROT_WRITE, \
+						MAP_SHARED|MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+			if(sqes_==MAP_FAILED) {
+				sqes_=NULL;
+				return -4;
+			}
+
+			char* sq=reinterpret_cast<char*>(sq_ptr_);
+			sq_head_=reinterpret_cast<volatile uint32_t*>(sq+params.sq_off.head);
+			sq_tail_=reinterpret_cast<volatile uint32_t*>(sq+params.sq_off.tail);
+			sq_mask_=*reinterpret_cast<uint32_t*>(sq+params.sq_off.ring_mask);
+			sq_entries_=*reinterpret_cast<uint32_t*>(sq+params.sq_off.ring_entries);
+			sq_array_=reinterpret_cast<uint32_t*>(sq+params.sq_off.array);
+
+			char* cq=reinterpret_cast<char*>(cq_ptr_);
+			cq_head_=reinterpret_cast<volatile uint32_t*>(cq+params.cq_off.head);
+			cq_tail_=reinterpret_cast<volatile uint32_t*>(cq+params.cq_off.tail);
+			cq_mask_=*reinterpret_cast<uint32_t*>(cq+params.cq_off.ring_mask);
+			cqes_=reinterpret_cast<struct io_uring_cqe*>(cq+params.cq_off.cqes);
+
+			sqe_tail_=*sq_tail_;
+			return 0;
+#else
+			Q_NOTUSED(entries);
+			return -1;
+#endif
+		}
+
+		// @函数名: 探测内核是否支持io_uring
+		static bool supported()
+		{
+			QIoUring ring;
+			return ring.init(2)==0;
+		}
+
+		// @函数名: 注册固定缓冲区, 之后可用read_fixed按下标读入, 免去每次提交时的页面锁定
+		int32_t register_buffers(const struct iovec* iovs, uint32_t iov_num)
+		{
+#ifdef Q_HAVE_IO_URING
+			if(::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iovs, iov_num)<0)
+				return -1;
+			return 0;
+#else
+			Q_NOTUSED(iovs);
+			Q_NOTUSED(iov_num);
+			return -1;
+#endif
+		}
+
+		// 以下准备函数只填写提交项, 队列满时先提交已准备的部分, 返回<0表示失败
+		// user_data原样出现在对应的完成事件中
+
+		// @函数名: 接收
+		inline int32_t recv(int32_t fd, void* buf, uint32_t len, uint64_t user_data)
+		{return prepare(Q_IORING_OP(RECV), fd, buf, len, 0, user_data, 0);}
+
+		// @函数名: 读入注册过的固定缓冲区, buf须位于下标为buf_index的缓冲区内
+		inline int32_t read_fixed(int32_t fd, void* buf, uint32_t len, uint16_t buf_index, uint64_t user_data)
+		{
+			int32_t ret=prepare(Q_IORING_OP(READ_FIXED), fd, buf, len, 0, user_data, 0);
+#ifdef Q_HAVE_IO_URING
+			if(ret==0)
+				last_sqe()->buf_index=buf_index;
+#else
+			Q_NOTUSED(buf_index);
+#endif
+			return ret;
+		}
+
+		// @函数名: 读取, 套接字或eventfd的offset填0
+		inline int32_t read(int32_t fd, void* buf, uint32_t len, uint64_t offset, uint64_t user_data)
+		{return prepare(Q_IORING_OP(READ), fd, buf, len, offset, user_data, 0);}
+
+		// @函数名: 写入, link为true时下一个提交项在本项成功后才执行
+		inline int32_t write(int32_t fd, const void* buf, uint32_t len, uint64_t offset, uint64_t user_data, bool link=false)
+		{return prepare(Q_IORING_OP(WRITE), fd, const_cast<void*>(buf), len, offset, user_data, link?Q_IOSQE_IO_LINK:0);}
+
+		// @函数名: 接收新连接, addr与addr_len须保持有效直至完成
+		inline int32_t accept(int32_t fd, struct sockaddr* addr, socklen_t* addr_len, uint64_t user_data)
+		{
+			int32_t ret=prepare(Q_IORING_OP(ACCEPT), fd, addr, 0, (uint64_t)(uintptr_t)addr_len, user_data, 0);
+			return ret;
+		}
+
+		// @函数名: 关闭文件
+		inline int32_t close(int32_t fd, uint64_t user_data)
+		{return prepare(Q_IORING_OP(CLOSE), fd, NULL, 0, 0, user_data, 0);}
+
+		// @函数名: 定时器, 到期后以-ETIME完成; 同一时刻只支持一个未完成的定时器
+		inline int32_t timeout(int32_t timeout_ms, uint64_t user_data)
+		{
+#ifdef Q_HAVE_IO_URING
+			timeout_.tv_sec=timeout_ms/1000;
+			timeout_.tv_nsec=(timeout_ms%1000)*1000000LL;
+			return prepare(Q_IORING_OP(TIMEOUT), -1, &timeout_, 1, 0, user_data, 0);
+#else
+			Q_NOTUSED(timeout_ms);
+			Q_NOTUSED(user_data);
+			return -1;
+#endif
+		}
+
+		// @函数名: 提交已准备的提交项并等待至少wait_num个完成事件, 返回提交数, 失败返回<0
+		int32_t submit(uint32_t wait_num=0)
+		{
+#ifdef Q_HAVE_IO_URING
+			uint32_t flags=wait_num>0?IORING_ENTER_GETEVENTS:0;
+			uint32_t to_submit=pending_;
+			int32_t ret=0;
+
+			// 提交项写入后再发布队尾, 内核看到队尾时提交项已完整
+			__sync_synchronize();
+			*sq_tail_=sqe_tail_;
+			__sync_synchronize();
+
+			do {
+				ret=(int32_t)::syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_num, flags, NULL, 0);
+			} while(ret<0 && errno==EINTR && wait_num==0);
+
+			if(ret<0)
+				return -1;
+			pending_-=(q_min((uint32_t)ret, pending_));
+			return ret;
+#else
+			Q_NOTUSED(wait_num);
+			return -1;
+#endif
+		}
+
+		// @函数名: 取出一个完成事件, 没有时返回false
+		inline bool next_completion(uint64_t& user_data, int32_t& res)
+		{
+#ifdef Q_HAVE_IO_URING
+			uint32_t head=*cq_head_;
+			__sync_synchronize();
+			if(head==*cq_tail_)
+				return false;
+
+			struct io_uring_cqe* cqe=cqes_+(head&cq_mask_);
+			user_data=cqe->user_data;
+			res=cqe->res;
+
+			// 读完完成项后才推进队头, 内核方可复用该位置
+			__sync_synchronize();
+			*cq_head_=head+1;
+			return true;
+#else
+			Q_NOTUSED(user_data);
+			Q_NOTUSED(res);
+			return false;
+#endif
+		}
+
+		// @函数名: 撤回尚未被内核取走的提交项, 提交失败后调用, 其中的缓冲区与文件描述符不再被内核使用;
+		//         未使用SQPOLL, 内核只在io_uring_enter中取走提交项
+		// @返回值: 撤回的提交项数
+		inline uint32_t withdraw()
+		{
+#ifdef Q_HAVE_IO_URING
+			__sync_synchronize();
+			uint32_t head=*sq_head_;
+			uint32_t num=sqe_tail_-head;
+
+			sqe_tail_=head;
+			*sq_tail_=head;
+			__sync_synchronize();
+			pending_=0;
+			return num;
+#else
+			return 0;
+#endif
+		}
+
+		// @函数名: 未提交的提交项数
+		inline uint32_t pending() const
+		{return pending_;}
+
+	private:
+#ifdef Q_HAVE_IO_URING
+		inline struct io_uring_sqe* last_sqe()
+		{return sqes_+((sqe_tail_-1)&sq_mask_);}
+#endif
+
+		int32_t prepare(uint8_t opcode, int32_t fd, void* addr, uint32_t len, uint64_t offset, uint64_t user_data, uint8_t flags)
+		{
+#ifdef Q_HAVE_IO_URING
+			if(ring_fd_<0)
+				return -1;
+
+			// 提交队列已满, 先把已准备的交给内核腾出位置
+			if(sqe_tail_-*sq_head_>=sq_entries_ && (submit()<0 || sqe_tail_-*sq_head_>=sq_entries_))
+				return -2;
+
+			uint32_t index=sqe_tail_&sq_mask_;
+			struct io_uring_sqe* sqe=sqes_+index;
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode=opcode;
+			sqe->flags=flags;
+			sqe->fd=fd;
+			sqe->off=offset;
+			sqe->addr=(uint64_t)(uintptr_t)addr;
+			sqe->len=len;
+			sqe->user_data=user_data;
+
+			sq_array_[index]=index;
+			++sqe_tail_;
+			++pending_;
+			return 0;
+#else
+			Q_NOTUSED(opcode);
+			Q_NOTUSED(fd);
+			Q_NOTUSED(addr);
+			Q_NOTUSED(len);
+			Q_NOTUSED(offset);
+			Q_NOTUSED(user_data);
+			Q_NOTUSED(flags);
+			return -1;
+#endif
+		}
+
+		int32_t                 ring_fd_;
+		void*                   sq_ptr_;
+		size_t                  sq_size_;
+		void*                   cq_ptr_;
+		size_t                  cq_size_;
+#ifdef Q_HAVE_IO_URING
+		struct io_uring_sqe*    sqes_;
+#else
+		void*                   sqes_;
+#endif
+		size_t                  sqes_size_;
+		volatile uint32_t*      sq_head_;
+		volatile uint32_t*      sq_tail_;
+		uint32_t                sq_mask_;
+		uint32_t                sq_entries_;
+		uint32_t*               sq_array_;
+		volatile uint32_t*      cq_head_;
+		volatile uint32_t*      cq_tail_;
+		uint32_t                cq_mask_;
+#ifdef Q_HAVE_IO_URING
+		struct io_uring_cqe*    cqes_;
+		struct __kernel_timespec timeout_;
+#else
+		void*                   cqes_;
+#endif
+		/* local submission tail, published to the kernel on submit */
+		uint32_t                sqe_tail_;
+		uint32_t                pending_;
+};
+
+Q_END_NAMESPACE
+
+#endif // __QIOURING_H_
@@ -0,0 +1,250 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2014 Terry Niu (Beijing, China)
+** Filename:	qlockfreequeue.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2014/05/07
+**
+*********************************************************************************************/
+
+#ifndef __QLOCKFREEQUEUE_H_
+#define __QLOCKFREEQUEUE_H_
+
+#include "qglobal.h"
+
+#ifndef WIN32
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+Q_BEGIN_NAMESPACE
+
+// 阻塞等待前的自旋次数
+#define Q_LOCKFREE_SPIN_COUNT (128)
+
+// 无锁有界多生产者多消费者循环队列类, 接口与QQueue一致
+// 每个槽位带序号, 生产者与消费者各自用CAS推进位置, 互不加锁;
+// 队列满或空时阻塞版本在futex上等待, 对端操作后按需唤醒, 不再轮询休眠
+template <typename T_TYPE>
+class QLockFreeQueue {
+	public:
+		inline QLockFreeQueue() :
+			cells_(NULL),
+			mask_(0),
+			max_size_(0),
+			enqueue_pos_(0),
+			dequeue_pos_(0),
+			push_seq_(0),
+			pop_waiters_(0),
+			pop_seq_(0),
+			push_waiters_(0)
+		{}
+
+		inline ~QLockFreeQueue()
+		{q_delete_array<Cell>(cells_);}
+
+		// 容量向上取整为2的幂, 至少可存储size-1个元素, 与QQueue保持兼容
+		inline int32_t init(int32_t size)
+		{
+			if(size<=0)
+				return -1;
+			uint32_t capacity=2;
+			while(capacity<(uint32_t)size)
+				capacity<<=1;
+			cells_=q_new_array<Cell>(capacity);
+			if(cells_==NULL)
+				return -2;
+			for(uint32_t i=0; i<capacity; ++i)
+				cells_[i].sequence=i;
+			mask_=capacity-1;
+			max_size_=capacity;
+			enqueue_pos_=dequeue_pos_=0;
+			return 0;
+		}
+
+		// 非线程安全, 仅在没有并发读写时调用
+		inline void clear()
+		{
+			T_TYPE item;
+			while(pop_non_blocking(item)==0);
+		}
+
+		int32_t max_size() const
+		{return max_size_;}
+
+		int32_t size() const
+		{return (int32_t)(enqueue_pos_-dequeue_pos_);}
+
+		inline bool full()
+		{return size()>=max_size_;}
+
+		inline bool empty()
+		{return enqueue_pos_==dequeue_pos_;}
+
+		void push(const T_TYPE& item)
+		{
+			int32_t spins=0;
+			Q_FOREVER {
+				if(push_non_blocking(item)==0)
+					return;
+#ifdef WIN32
+				q_sleep(1);
+#else
+				if(spin_wait(spins))
+					continue;
+				// 先登记等待再读取序号并重试, 避免错过登记前完成的出队
+				__sync_add_and_fetch(&push_waiters_, 1);
+				uint32_t seq=pop_seq_;
+				if(push_non_blocking(item)==0) {
+					__sync_sub_and_fetch(&push_waiters_, 1);
+					return;
+				}
+				futex_wait(&pop_seq_, seq);
+				__sync_sub_and_fetch(&push_waiters_, 1);
+#endif
+			}
+		}
+
+		T_TYPE pop()
+		{
+			T_TYPE item;
+			int32_t spins=0;
+			Q_FOREVER {
+				if(pop_non_blocking(item)==0)
+					return item;
+#ifdef WIN32
+				q_sleep(1);
+#else
+				if(spin_wait(spins))
+					continue;
+				__sync_add_and_fetch(&pop_waiters_, 1);
+				uint32_t seq=push_seq_;
+				if(pop_non_blocking(item)==0) {
+					__sync_sub_and_fetch(&pop_waiters_, 1);
+					return item;
+				}
+				futex_wait(&push_seq_, seq);
+				__sync_sub_and_fetch(&pop_waiters_, 1);
+#endif
+			}
+		}
+
+		int32_t push_non_blocking(const T_TYPE& item)
+		{
+			Cell* cell=NULL;
+			uint64_t pos=enqueue_pos_;
+			Q_FOREVER {
+				cell=cells_+(pos&mask_);
+				uint64_t seq=cell->sequence;
+				__sync_synchronize();
+				int64_t dif=(int64_t)seq-(int64_t)pos;
+				if(dif==0) {
+					if(__sync_bool_compare_and_swap(&enqueue_pos_, pos, pos+1))
+						break;
+					pos=enqueue_pos_;
+				} else if(dif<0) {
+					return -1;
+				} else {
+					pos=enqueue_pos_;
+				}
+			}
+			cell->data=item;
+			__sync_synchronize();
+			cell->sequence=pos+1;
+
+			// 仅在有消费者休眠时推进序号并唤醒, 无竞争时不触碰共享计数
+			__sync_synchronize();
+			if(pop_waiters_) {
+				__sync_add_and_fetch(&push_seq_, 1);
+				futex_wake(&push_seq_);
+			}
+			return 0;
+		}
+
+		int32_t pop_non_blocking(T_TYPE& item)
+		{
+			Cell* cell=NULL;
+			uint64_t pos=dequeue_pos_;
+			Q_FOREVER {
+				cell=cells_+(pos&mask_);
+				uint64_t seq=cell->sequence;
+				__sync_synchronize();
+				int64_t dif=(int64_t)seq-(int64_t)(pos+1);
+				if(dif==0) {
+					if(__sync_bool_compare_and_swap(&dequeue_pos_, pos, pos+1))
+						break;
+					pos=dequeue_pos_;
+				} else if(dif<0) {
+					return -1;
+				} else {
+					pos=dequeue_pos_;
+				}
+			}
+			item=cell->data;
+			__sync_synchronize();
+			cell->sequence=pos+mask_+1;
+
+			__sync_synchronize();
+			if(push_waiters_) {
+				__sync_add_and_fetch(&pop_seq_, 1);
+				futex_wake(&pop_seq_);
+			}
+			return 0;
+		}
+
+	private:
+		struct Cell {
+			volatile uint64_t sequence;
+			T_TYPE data;
+		};
+
+		// 休眠前短暂自旋, 队列很快可用时省去两次系统调用; 返回true表示应重试
+		static inline bool spin_wait(int32_t& spins)
+		{
+			if(++spins<Q_LOCKFREE_SPIN_COUNT) {
+#if defined(__i386__) || defined(__x86_64__)
+				__asm__ __volatile__("pause");
+#endif
+				return true;
+			}
+			spins=0;
+			return false;
+		}
+
+		static inline void futex_wait(volatile uint32_t* addr, uint32_t val)
+		{
+#ifndef WIN32
+			::syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#endif
+		}
+
+		static inline void futex_wake(volatile uint32_t* addr)
+		{
+#ifndef WIN32
+			::syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+		}
+
+		Cell* cells_;
+		uint64_t mask_;
+		int32_t max_size_;
+		/* producer and consumer positions live on separate cache lines */
+		char pad0_[64];
+		volatile uint64_t enqueue_pos_;
+		char pad1_[64];
+		volatile uint64_t dequeue_pos_;
+		char pad2_[64];
+		/* futex words bumped only while someone sleeps on them, and the number of sleepers */
+		volatile uint32_t push_seq_;
+		volatile uint32_t pop_waiters_;
+		char pad3_[64];
+		volatile uint32_t pop_seq_;
+		volatile uint32_t push_waiters_;
+		char pad4_[64];
+};
+
+Q_END_NAMESPACE
+
+#endif // __QLOCKFREEQUEUE_H_
@@ -84,6 +84,9 @@ class QMD5
 		unsigned char buffer[64];  /* input buffer */
 	} MD5_CTX;	
 
+	// context for the incremental MD5Begin/MD5Append/MD5End interface
+	MD5_CTX stream_context;
+
 	/* MD5 initialization. Begins an MD5 operation, writing a new context.
 	*/
 	void MD5Init (MD5_CTX *context)
@@ -344,6 +347,25 @@ public:
 		memset(output, 0, 16);
 		MD5Final(output, &context);
 	}
+
+	/* Incremental digest for data arriving in blocks: MD5Begin once, MD5Append for
+	every block, MD5End for the same 16 bytes MD5Bits128 gives on the whole input.
+	*/
+	void MD5Begin()
+	{
+		MD5Init(&stream_context);
+	}
+
+	void MD5Append(const unsigned char * input, unsigned int inputLen)
+	{
+		MD5Update(&stream_context, (unsigned char *)input, inputLen);
+	}
+
+	void MD5End(unsigned char output[])
+	{
+		memset(output, 0, 16);
+		MD5Final(output, &stream_context);
+	}
 };
 
 Q_END_NAMESPACE
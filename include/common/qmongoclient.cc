@@ -90,6 +90,34 @@ int32_t QMongoClient::insert(const char* id, const char* idValue, const char* co
 	return MONGO_OK;
 }
 
+int32_t QMongoClient::insert(const char* id, const char* idValue, const char* columnName1, const char* columnValue1, const char* columnName2, const char* columnValue2, \
+		const char* columnName3, const char* columnValue3)
+{
+	if(id == NULL || idValue == NULL || columnName1 == NULL || columnValue1 == NULL || columnName2 == NULL || columnValue2 == NULL \
+			|| columnName3 == NULL || columnValue3 == NULL)
+		return MONGO_ERR;
+
+	try {
+		mongo::BSONObj p = BSON(GENOID \
+				<< id \
+				<< idValue \
+				<< columnName1 \
+				<< columnValue1 \
+				<< columnName2 \
+				<< columnValue2 \
+				<< columnName3 \
+				<< columnValue3 \
+				<< "createdAt" \
+				<< mongo::Date_t(dt(QDateTime::now().to_string().c_str())));
+
+		conn_->insert(collection_, p);
+	} catch(const mongo::DBException& e) {
+		Q_INFO("QMongoClient: database faild for (%s)...", e.toString().c_str());
+		return MONGO_ERR;
+	}
+	return MONGO_OK;
+}
+
 bool QMongoClient::select(const char* id, const char* idValue, const char* columnName, std::string& columnValue)
 {
 	if(id == NULL || idValue == NULL || columnName == NULL)
@@ -153,6 +181,26 @@ int32_t QMongoClient::update(const char* id, const char* idValue, const char* co
 	return MONGO_OK;
 }
 
+int32_t QMongoClient::increment(const char* id, const char* idValue, const char* columnName, int32_t delta, int32_t& columnValue)
+{
+	if(id == NULL || idValue == NULL || columnName == NULL)
+		return MONGO_ERR;
+
+	try {
+		// $inc只改动该列, 文档其余列保持不变
+		conn_->update(collection_, BSON(id << idValue), BSON("$inc" << BSON(columnName << delta)));
+
+		mongo::BSONObj res = conn_->findOne(collection_, BSON(id << idValue));
+		if(res.isEmpty())
+			return MONGO_ERR;
+		columnValue = res.hasField(columnName) ? res.getIntField(columnName) : 0;
+	} catch(const mongo::DBException& e) {
+		Q_INFO("QMongoClient: database faild for (%s)...", e.toString().c_str());
+		return MONGO_ERR;
+	}
+	return MONGO_OK;
+}
+
 int32_t QMongoClient::remove(const char* id, const char* idValue)
 {
 	try {
@@ -55,6 +55,10 @@ class QMongoClient {
 		// @函数名: 插入文档
 		int32_t insert(const char* id, const char* idValue, const char* columnName1, const char* columnValue1, const char* columnName2, const char* columnValue2);
 
+		// @函数名: 插入文档
+		int32_t insert(const char* id, const char* idValue, const char* columnName1, const char* columnValue1, const char* columnName2, const char* columnValue2, \
+				const char* columnName3, const char* columnValue3);
+
 		// @函数名: 查询id并获取指定列内容
 		bool select(const char* id, const char* idValue, const char* columnName, std::string& columnValue);
 
@@ -64,6 +68,15 @@ class QMongoClient {
 		// @函数名: 更新函数
 		int32_t update(const char* id, const char* idValue, const char* columnName, const char* columnValue);
 
+		// @函数名: 整数列原子增减, 列不存在时按0计
+		// @参数01: 键名
+		// @参数02: 键值
+		// @参数03: 列名
+		// @参数04: 增量, 可为负数
+		// @参数05: 返回增减后的列值
+		// @返回值: 成功返回MONGO_OK, 文档不存在或失败返回MONGO_ERR
+		int32_t increment(const char* id, const char* idValue, const char* columnName, int32_t delta, int32_t& columnValue);
+
 		// @函数名: 删除图片函数
 		int32_t remove(const char* id, const char* idValue);
 
@@ -0,0 +1,578 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2016 Terry Niu (Beijing, China)
+** Filename:	qneedleindex.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2016/03/15
+**
+*********************************************************************************************/
+
+#ifndef __QNEEDLEINDEX_H_
+#define __QNEEDLEINDEX_H_
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "qglobal.h"
+#include "qvolume.h"
+
+#define NEEDLE_INDEX_MAGIC      ("QNEEDLE")
+#define NEEDLE_INDEX_VERSION    (1)
+/* control bytes probed at once */
+#define NEEDLE_INDEX_GROUP      (16)
+#define NEEDLE_INDEX_MIN_SLOTS  (1<<10)
+/* control bytes filtered and written per batch when saving */
+#define NEEDLE_INDEX_SAVE_BATCH (1<<12)
+
+/* control byte, used slots keep 7 bits of the hash */
+#define NEEDLE_CTRL_EMPTY       ((int8_t)0x80)
+#define NEEDLE_CTRL_DELETED     ((int8_t)0xfe)
+
+/* packed location: vid(10) | offset/NEEDLE_ALIGN(30) | size(24) */
+#define NEEDLE_LOC_VID_BITS     (10)
+#define NEEDLE_LOC_OFFSET_BITS  (30)
+#define NEEDLE_LOC_SIZE_BITS    (24)
+#define NEEDLE_LOC_MAX_VID      ((1U<<NEEDLE_LOC_VID_BITS)-1)
+#define NEEDLE_LOC_MAX_OFFSET   (((uint64_t)1<<NEEDLE_LOC_OFFSET_BITS)*NEEDLE_ALIGN)
+#define NEEDLE_LOC_MAX_SIZE     ((1U<<NEEDLE_LOC_SIZE_BITS)-1)
+
+Q_BEGIN_NAMESPACE
+
+#pragma pack(1)
+
+/* 16 bytes per slot */
+struct needleEntry {
+	uint64_t        key;
+	uint64_t        loc;
+};
+
+/* checkpoint file: header, marks, control bytes, slots */
+struct needleIndexHeader {
+	char            magic[8];
+	uint32_t        version;
+	uint32_t        mark_num;
+	uint64_t        slot_num;
+	uint64_t        size;
+	char            reserved[32];
+};
+
+#pragma pack()
+
+/* needle copied by compaction */
+struct needleMove {
+	uint64_t        key;
+	volumeLocation  from;
+	volumeLocation  to;
+};
+
+/* live needles of one volume according to the index */
+struct volumeLive {
+	uint64_t        needle_num;
+	/* needle bytes without direct io padding */
+	uint64_t        bytes;
+
+	volumeLive() :
+		needle_num(0),
+		bytes(0)
+	{}
+};
+
+// 图片编号到卷位置的内存索引, 开放寻址, 每个槽位16字节;
+// 另有每槽1字节控制字保存哈希高7位, 按16个一组用SSE2一次比较, 未命中的槽位不访问;
+// 检查点按内存布局整体写出, 重启时mmap后直接拷回, 无需重新扫描卷文件
+class QNeedleIndex: public noncopyable {
+	public:
+		inline QNeedleIndex() :
+			slot_num_(0),
+			size_(0),
+			used_(0),
+			ctrl_(NULL),
+			slots_(NULL)
+		{}
+
+		virtual ~QNeedleIndex()
+		{
+			q_delete_array<int8_t>(ctrl_);
+			q_delete_array<needleEntry>(slots_);
+		}
+
+		// @函数名: 初始化函数
+		// @参数01: 初始槽位数, 向上取整为2的幂, 装载超过7/8时翻倍
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		inline int32_t init(uint64_t slot_num=NEEDLE_INDEX_MIN_SLOTS)
+		{
+			QScopeWrite guard(rwlock_);
+			return resize(round_slots(slot_num));
+		}
+
+		// @函数名: 位置能否放入16字节槽位
+		static inline bool packable(const volumeLocation& location)
+		{
+			return location.vid<=NEEDLE_LOC_MAX_VID && location.offset<NEEDLE_LOC_MAX_OFFSET \
+				&& (location.offset&(NEEDLE_ALIGN-1))==0 && location.size<=NEEDLE_LOC_MAX_SIZE;
+		}
+
+		// @函数名: 查找图片位置
+		// @参数01: 图片编号
+		// @参数02: 返回图片位置
+		// @返回值: 找到返回true
+		inline bool find(uint64_t key, volumeLocation& location)
+		{
+			QScopeRead guard(rwlock_);
+			int64_t index=lookup(key, q_hash64(key));
+			if(index<0)
+				return false;
+			unpack(slots_[index].loc, location);
+			return true;
+		}
+
+		// @函数名: 插入或更新图片位置
+		// @参数01: 图片编号
+		// @参数02: 图片位置
+		// @返回值: 成功返回0, 位置超出槽位表示范围返回-1, 扩容失败返回-2
+		inline int32_t insert(uint64_t key, const volumeLocation& location)
+		{
+			if(!packable(location))
+				return -1;
+
+			QScopeWrite guard(rwlock_);
+			uint64_t h=q_hash64(key);
+			int64_t index=lookup(key, h);
+			if(index>=0) {
+				slots_[index].loc=pack(location);
+				return 0;
+			}
+
+			// 已用槽位(含删除标记)超过7/8时扩容, 删除标记较多时按原大小重建
+			if((used_+1)*8>slot_num_*7) {
+				if(resize((size_+1)*16>slot_num_*7?slot_num_<<1:slot_num_)<0)
+					return -2;
+			}
+
+			place(key, h, pack(location));
+			++size_;
+			return 0;
+		}
+
+		// @函数名: 删除图片位置
+		// @返回值: 存在并删除返回true
+		inline bool remove(uint64_t key)
+		{
+			QScopeWrite guard(rwlock_);
+			int64_t index=lookup(key, q_hash64(key));
+			if(index<0)
+				return false;
+
+			// 所在组内仍有空槽时查找必然在此组终止, 可直接置空
+			if(group_has_empty(index&~(uint64_t)(NEEDLE_INDEX_GROUP-1))) {
+				ctrl_[index]=NEEDLE_CTRL_EMPTY;
+				--used_;
+			} else {
+				ctrl_[index]=NEEDLE_CTRL_DELETED;
+			}
+			--size_;
+			return true;
+		}
+
+		// @函数名: 批量改写压缩后的needle位置, 全部在一次写锁内完成, 读者只会看到全部旧位置或全部新位置;
+		//         期间位置已变化(删除或重新写入)的图片不再改写
+		// @参数01: 待改写的needle
+		// @返回值: 改写的条目数, 新位置超出槽位表示范围返回-1
+		inline int64_t relocate(const std::vector<needleMove>& moves)
+		{
+			uint64_t loc=0;
+			int64_t index=0;
+			int64_t num=0;
+
+			for(size_t i=0; i<moves.size(); ++i)
+			{
+				if(!packable(moves[i].to))
+					return -1;
+			}
+
+			QScopeWrite guard(rwlock_);
+			for(size_t i=0; i<moves.size(); ++i)
+			{
+				index=lookup(moves[i].key, q_hash64(moves[i].key));
+				loc=pack(moves[i].from);
+				if(index<0||slots_[index].loc!=loc)
+					continue;
+				slots_[index].loc=pack(moves[i].to);
+				++num;
+			}
+
+			return num;
+		}
+
+		// @函数名: 按卷统计索引中的存活needle, 卷中其余needle即为死needle
+		// @参数01: 返回各卷统计, 下标为卷编号
+		inline void live(std::vector<volumeLive>& out)
+		{
+			volumeLive* item=NULL;
+			volumeLocation location;
+
+			out.clear();
+
+			QScopeRead guard(rwlock_);
+			for(uint64_t i=0; i<slot_num_; ++i)
+			{
+				if(ctrl_[i]==NEEDLE_CTRL_EMPTY||ctrl_[i]==NEEDLE_CTRL_DELETED)
+					continue;
+
+				unpack(slots_[i].loc, location);
+				if(location.vid>=out.size())
+					out.resize(location.vid+1);
+				item=&out[location.vid];
+				item->needle_num++;
+				item->bytes+=QVolume::needle_size(location.size);
+			}
+		}
+
+		// @函数名: 索引条目数
+		inline uint64_t size()
+		{
+			QScopeRead guard(rwlock_);
+			return size_;
+		}
+
+		// @函数名: 索引占用内存(字节)
+		inline uint64_t memory()
+		{
+			QScopeRead guard(rwlock_);
+			return slot_num_*(sizeof(needleEntry)+sizeof(int8_t));
+		}
+
+		// @函数名: 写检查点, 先写临时文件再改名, 中途失败不影响已有检查点
+		// @参数01: 检查点文件路径
+		// @参数02: 各卷写入位置, 须在索引快照之前获取, 其后追加的needle重启时由卷扫描补入;
+		//          快照中指向写入位置之后的条目不写入, 重启时以卷扫描校验后的结果为准
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		inline int32_t save(const char* path, const std::vector<volumeMark>& marks)
+		{
+			needleIndexHeader header;
+			std::string temp_path=q_format("%s.tmp", path);
+			std::vector<uint64_t> ends;
+			volumeLocation location;
+			int8_t ctrl[NEEDLE_INDEX_SAVE_BATCH];
+			uint64_t batch=0;
+			int32_t fd=-1;
+			int32_t ret=0;
+
+			for(size_t i=0; i<marks.size(); ++i)
+			{
+				if(marks[i].vid>=ends.size())
+					ends.resize(marks[i].vid+1, (uint64_t)-1);
+				ends[marks[i].vid]=marks[i].offset;
+			}
+
+			fd=::open(temp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+			if(fd<0)
+				return -1;
+
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, NEEDLE_INDEX_MAGIC, strlen(NEEDLE_INDEX_MAGIC));
+			header.version=NEEDLE_INDEX_VERSION;
+			header.mark_num=marks.size();
+
+			// 持读锁写入页缓存, 查找不受影响, 落盘在释放锁之后进行
+			rwlock_.rdlock();
+			header.slot_num=slot_num_;
+			header.size=size_;
+			if(write_all(fd, (const char*)&header, sizeof(header))<0 \
+					||(!marks.empty()&&write_all(fd, (const char*)&marks[0], marks.size()*sizeof(volumeMark))<0))
+				ret=-2;
+
+			for(uint64_t i=0; ret==0 && i<slot_num_; i+=batch)
+			{
+				batch=slot_num_-i<NEEDLE_INDEX_SAVE_BATCH?slot_num_-i:NEEDLE_INDEX_SAVE_BATCH;
+				memcpy(ctrl, ctrl_+i, batch*sizeof(int8_t));
+				for(uint64_t j=0; j<batch; ++j)
+				{
+					if(ctrl[j]==NEEDLE_CTRL_EMPTY||ctrl[j]==NEEDLE_CTRL_DELETED)
+						continue;
+					unpack(slots_[i+j].loc, location);
+					if(location.vid<ends.size() && location.offset>=ends[location.vid]) {
+						ctrl[j]=NEEDLE_CTRL_DELETED;
+						header.size--;
+					}
+				}
+				if(write_all(fd, (const char*)ctrl, batch*sizeof(int8_t))<0)
+					ret=-2;
+			}
+
+			if(ret==0 && write_all(fd, (const char*)slots_, slot_num_*sizeof(needleEntry))<0)
+				ret=-2;
+			rwlock_.unlock();
+
+			// 条目数在过滤之后才确定, 改写头部
+			if(ret==0 && pwrite(fd, &header, sizeof(header), 0)!=(ssize_t)sizeof(header))
+				ret=-2;
+
+			if(ret==0&&fdatasync(fd)<0)
+				ret=-3;
+			::close(fd);
+
+			if(ret==0&&::rename(temp_path.c_str(), path)<0)
+				ret=-4;
+
+			if(ret<0)
+				::unlink(temp_path.c_str());
+			return ret;
+		}
+
+		// @函数名: 加载检查点
+		// @参数01: 检查点文件路径
+		// @参数02: 返回检查点中各卷写入位置
+		// @返回值: 成功返回0, 检查点不存在返回1, 失败返回小于0的错误码
+		inline int32_t load(const char* path, std::vector<volumeMark>& marks)
+		{
+			struct stat st;
+			needleIndexHeader* header=NULL;
+			const char* ptr=NULL;
+			uint64_t expect=0;
+			int32_t fd=-1;
+			int32_t ret=0;
+
+			marks.clear();
+
+			fd=::open(path, O_RDONLY);
+			if(fd<0)
+				return errno==ENOENT?1:-1;
+
+			if(fstat(fd, &st)<0||(uint64_t)st.st_size<sizeof(needleIndexHeader)) {
+				::close(fd);
+				return -2;
+			}
+
+			void* addr=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+			::close(fd);
+			if(addr==MAP_FAILED)
+				return -3;
+
+			ptr=(const char*)addr;
+			header=(needleIndexHeader*)ptr;
+			expect=sizeof(needleIndexHeader)+(uint64_t)header->mark_num*sizeof(volumeMark) \
+			       +header->slot_num*(sizeof(int8_t)+sizeof(needleEntry));
+
+			if(memcmp(header->magic, NEEDLE_INDEX_MAGIC, strlen(NEEDLE_INDEX_MAGIC))!=0||header->version!=NEEDLE_INDEX_VERSION \
+					||header->slot_num<NEEDLE_INDEX_MIN_SLOTS||(header->slot_num&(header->slot_num-1))!=0 \
+					||expect!=(uint64_t)st.st_size) {
+				munmap(addr, st.st_size);
+				return -4;
+			}
+
+			ptr+=sizeof(needleIndexHeader);
+			marks.assign((const volumeMark*)ptr, (const volumeMark*)ptr+header->mark_num);
+			ptr+=header->mark_num*sizeof(volumeMark);
+
+			rwlock_.wrlock();
+			if(alloc(header->slot_num)<0) {
+				ret=-5;
+			} else {
+				memcpy(ctrl_, ptr, slot_num_*sizeof(int8_t));
+				ptr+=slot_num_*sizeof(int8_t);
+				memcpy(slots_, ptr, slot_num_*sizeof(needleEntry));
+
+				size_=header->size;
+				used_=0;
+				for(uint64_t i=0; i<slot_num_; ++i)
+				{
+					if(ctrl_[i]!=NEEDLE_CTRL_EMPTY)
+						++used_;
+				}
+			}
+			rwlock_.unlock();
+
+			munmap(addr, st.st_size);
+			if(ret<0)
+				marks.clear();
+			return ret;
+		}
+
+	private:
+		// 哈希低位选组, 高7位作控制字
+		static inline int8_t tag(uint64_t h)
+		{return (int8_t)(h>>57);}
+
+		static inline uint64_t pack(const volumeLocation& location)
+		{
+			return ((uint64_t)location.vid<<(NEEDLE_LOC_OFFSET_BITS+NEEDLE_LOC_SIZE_BITS)) \
+				|((location.offset/NEEDLE_ALIGN)<<NEEDLE_LOC_SIZE_BITS)|location.size;
+		}
+
+		static inline void unpack(uint64_t loc, volumeLocation& location)
+		{
+			location.vid=(uint32_t)(loc>>(NEEDLE_LOC_OFFSET_BITS+NEEDLE_LOC_SIZE_BITS));
+			location.offset=((loc>>NEEDLE_LOC_SIZE_BITS)&(((uint64_t)1<<NEEDLE_LOC_OFFSET_BITS)-1))*NEEDLE_ALIGN;
+			location.size=(uint32_t)(loc&NEEDLE_LOC_MAX_SIZE);
+		}
+
+		static inline uint64_t round_slots(uint64_t slot_num)
+		{
+			uint64_t n=NEEDLE_INDEX_MIN_SLOTS;
+			while(n<slot_num)
+				n<<=1;
+			return n;
+		}
+
+		// @函数名: 组内与给定控制字相等的槽位掩码, 第i位对应组内第i个槽位
+		inline uint32_t group_match(uint64_t group, int8_t value) const
+		{
+#ifdef __SSE2__
+			__m128i ctrl=_mm_loadu_si128((const __m128i*)(ctrl_+group));
+			return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+			uint32_t mask=0;
+			for(int32_t i=0; i<NEEDLE_INDEX_GROUP; ++i)
+			{
+				if(ctrl_[group+i]==value)
+					mask|=1U<<i;
+			}
+			return mask;
+#endif
+		}
+
+		inline bool group_has_empty(uint64_t group) const
+		{return group_match(group, NEEDLE_CTRL_EMPTY)!=0;}
+
+		// @函数名: 查找槽位, 按组做三角数探测, 遇到含空槽的组即终止
+		// @返回值: 找到返回槽位下标, 否则返回-1
+		inline int64_t lookup(uint64_t key, uint64_t h) const
+		{
+			uint64_t mask=slot_num_-1;
+			uint64_t group=h&mask&~(uint64_t)(NEEDLE_INDEX_GROUP-1);
+			uint32_t match=0;
+			int8_t t=tag(h);
+
+			for(uint64_t step=NEEDLE_INDEX_GROUP; step<=slot_num_; step+=NEEDLE_INDEX_GROUP)
+			{
+				match=group_match(group, t);
+				while(match)
+				{
+					uint64_t index=group+__builtin_ctz(match);
+					if(slots_[index].key==key)
+						return (int64_t)index;
+					match&=match-1;
+				}
+
+				if(group_has_empty(group))
+					return -1;
+
+				group=(group+step)&mask;
+			}
+
+			return -1;
+		}
+
+		// @函数名: 在探测序列上第一个空槽或删除标记处放入, 调用前须确认键不存在且有空位
+		inline void place(uint64_t key, uint64_t h, uint64_t loc)
+		{
+			uint64_t mask=slot_num_-1;
+			uint64_t group=h&mask&~(uint64_t)(NEEDLE_INDEX_GROUP-1);
+			uint32_t free_mask=0;
+
+			for(uint64_t step=NEEDLE_INDEX_GROUP; ; step+=NEEDLE_INDEX_GROUP)
+			{
+				free_mask=group_match(group, NEEDLE_CTRL_EMPTY)|group_match(group, NEEDLE_CTRL_DELETED);
+				if(free_mask)
+					break;
+				group=(group+step)&mask;
+			}
+
+			uint64_t index=group+__builtin_ctz(free_mask);
+			if(ctrl_[index]==NEEDLE_CTRL_EMPTY)
+				++used_;
+			ctrl_[index]=tag(h);
+			slots_[index].key=key;
+			slots_[index].loc=loc;
+		}
+
+		// @函数名: 分配空表
+		inline int32_t alloc(uint64_t slot_num)
+		{
+			int8_t* ctrl=q_new_array<int8_t>(slot_num);
+			needleEntry* slots=q_new_array<needleEntry>(slot_num);
+			if(ctrl==NULL||slots==NULL) {
+				q_delete_array<int8_t>(ctrl);
+				q_delete_array<needleEntry>(slots);
+				return -1;
+			}
+
+			q_delete_array<int8_t>(ctrl_);
+			q_delete_array<needleEntry>(slots_);
+
+			memset(ctrl, NEEDLE_CTRL_EMPTY, slot_num*sizeof(int8_t));
+			ctrl_=ctrl;
+			slots_=slots;
+			slot_num_=slot_num;
+			size_=0;
+			used_=0;
+			return 0;
+		}
+
+		// @函数名: 按新槽位数重建, 同时清除删除标记
+		inline int32_t resize(uint64_t slot_num)
+		{
+			int8_t* old_ctrl=ctrl_;
+			needleEntry* old_slots=slots_;
+			uint64_t old_num=slot_num_;
+
+			int8_t* ctrl=q_new_array<int8_t>(slot_num);
+			needleEntry* slots=q_new_array<needleEntry>(slot_num);
+			if(ctrl==NULL||slots==NULL) {
+				q_delete_array<int8_t>(ctrl);
+				q_delete_array<needleEntry>(slots);
+				return -1;
+			}
+
+			memset(ctrl, NEEDLE_CTRL_EMPTY, slot_num*sizeof(int8_t));
+			ctrl_=ctrl;
+			slots_=slots;
+			slot_num_=slot_num;
+			used_=0;
+
+			for(uint64_t i=0; i<old_num; ++i)
+			{
+				if(old_ctrl[i]>=0)
+					place(old_slots[i].key, q_hash64(old_slots[i].key), old_slots[i].loc);
+			}
+
+			q_delete_array<int8_t>(old_ctrl);
+			q_delete_array<needleEntry>(old_slots);
+			return 0;
+		}
+
+		static inline int32_t write_all(int32_t fd, const char* buf, uint64_t len)
+		{
+			uint64_t done=0;
+			ssize_t ret=0;
+
+			while(done<len)
+			{
+				ret=::write(fd, buf+done, len-done);
+				if(ret<0 && errno==EINTR)
+					continue;
+				if(ret<=0)
+					return -1;
+				done+=ret;
+			}
+
+			return 0;
+		}
+
+	private:
+		uint64_t        slot_num_;
+		uint64_t        size_;
+		/* slots not empty, including deleted */
+		uint64_t        used_;
+		int8_t*         ctrl_;
+		needleEntry*    slots_;
+		QRWLock         rwlock_;
+};
+
+Q_END_NAMESPACE
+
+#endif // __QNEEDLEINDEX_H_
@@ -44,6 +44,23 @@ static int getImageSize(const char* fileName, int* width, int* height)
 	return 0;
 }
 
+// 图像尺寸(内存中的编码数据)
+static int getImageSize(const char* data, int len, int* width, int* height)
+{
+	cv::Mat buf(1, len, CV_8UC1, (void*)data);
+	cv::Mat img = cv::imdecode(buf, CV_LOAD_IMAGE_UNCHANGED);
+	if(img.empty()) {
+		printf("getImageSize error, unable to decode (%d) bytes!", len);
+		return -1;
+	}
+
+	cv::Size size = img.size();
+	*width = size.width;
+	*height = size.height;
+
+	return 0;
+}
+
 // 图像截取
 static int getSubImage(const char* fileName, const char* newFileName, int x, int y, int width, int height)
 {
@@ -5,6 +5,9 @@ Q_BEGIN_NAMESPACE
 QRemoteMonitor::QRemoteMonitor() :
 	listen_sock_(-1),
 	timeout_(8000),
+	fun_state_(NULL),
+	fun_stats_(NULL),
+	fun_disk_(NULL),
 	fun_argv_(NULL),
 	success_flag_(0),
 	display_log_(1)
@@ -51,6 +54,16 @@ int32_t QRemoteMonitor::init(uint16_t monitor_port, int32_t timeout, int32_t (*f
 	return MONITOR_OK;
 }
 
+void QRemoteMonitor::setStatsCallback(int32_t (*fun_stats)(void* argv, char* buf, int32_t size))
+{
+	this->fun_stats_ = fun_stats;
+}
+
+void QRemoteMonitor::setDiskCallback(int32_t (*fun_disk)(void* argv, uint64_t* used_bytes, uint64_t* total_bytes))
+{
+	this->fun_disk_ = fun_disk;
+}
+
 Q_THREAD_T QRemoteMonitor::thread_monitor(void* ptr_info)
 {
 	QRemoteMonitor* ptr_this=reinterpret_cast<QRemoteMonitor*>(ptr_info);
@@ -61,7 +74,11 @@ Q_THREAD_T QRemoteMonitor::thread_monitor(void* ptr_info)
 	int32_t client_port;
 
 	uint32_t cmd = 0;
+	int32_t readonly_disks = 0;
 	serverInfo server_info;
+	statsInfo stats_info;
+	char* stats_buf = q_new_array<char>(MONITOR_STATS_SIZE);
+	Q_CHECK_PTR(stats_buf);
 
 	ptr_this->success_flag_ = 1;
 
@@ -80,11 +97,28 @@ Q_THREAD_T QRemoteMonitor::thread_monitor(void* ptr_info)
 			}
 
 			// 接收请求报文信息
-			if(q_recvbuf(client, (char*)&cmd, sizeof(uint32_t)) || cmd!=*(uint32_t *)"PING") {
+			if(q_recvbuf(client, (char*)&cmd, sizeof(uint32_t)) || (cmd!=*(uint32_t *)"PING" && cmd!=*(uint32_t *)"STAT")) {
 				Q_INFO("QRemoteMonitor: recv data error, magic mark = (%.*s)!", sizeof(uint32_t), (char*)&cmd);
 				throw -2;
 			}
 
+			// 统计信息请求, 由服务端输出文本形式的统计项
+			if(cmd==*(uint32_t *)"STAT") {
+				stats_info.magic_mark = *(uint32_t*)"STAT";
+				stats_info.length = ptr_this->fun_stats_?ptr_this->fun_stats_(ptr_this->fun_argv_, stats_buf, MONITOR_STATS_SIZE):0;
+				if(stats_info.length<0)
+					stats_info.length = 0;
+
+				if(q_sendbuf(client, (char*)&stats_info, sizeof(statsInfo)) \
+						|| (stats_info.length>0 && q_sendbuf(client, stats_buf, stats_info.length))) {
+					Q_INFO("QRemoteMonitor: send stats error!");
+					throw -6;
+				}
+
+				q_close_socket(client);
+				continue;
+			}
+
 			/******************************************************************************************/
 			server_info.magic_mark = *(uint32_t*)"PONG";
 			server_info.length = sizeof(serverInfo)-sizeof(int32_t);
@@ -100,11 +134,19 @@ Q_THREAD_T QRemoteMonitor::thread_monitor(void* ptr_info)
 			server_info.load_average = q_get_load_avg();
 			server_info.processor_num = q_get_cpu_processors();
 
-			if(q_get_disk_usage("./", &server_info.used_disk_bytes, &server_info.total_disk_bytes)) {
+			// 服务端提供数据盘用量时以其为准, 有磁盘只读时服务仍正常但需告警
+			readonly_disks = ptr_this->fun_disk_?ptr_this->fun_disk_(ptr_this->fun_argv_, &server_info.used_disk_bytes, \
+					&server_info.total_disk_bytes):-1;
+			if(readonly_disks<0 && q_get_disk_usage("./", &server_info.used_disk_bytes, &server_info.total_disk_bytes)) {
 				Q_INFO("QRemoteMonitor: q_get_disk_usage error!");
 				throw -3;
 			}
 
+			if(readonly_disks>0 && server_info.error_type==TYPE_OK) {
+				server_info.error_type = TYPE_DISK;
+				server_info.error_level = LEVEL_B;
+			}
+
 			if(q_get_mem_usage(&server_info.used_mem_bytes, &server_info.total_mem_bytes)) {
 				Q_INFO("QRemoteMonitor: q_get_disk_usage error!");
 				throw -4;
@@ -141,6 +183,7 @@ Q_THREAD_T QRemoteMonitor::thread_monitor(void* ptr_info)
 		}
 	}
 
+	q_delete_array<char>(stats_buf);
 	ptr_this->success_flag_ = -1;
 	return NULL;
 }
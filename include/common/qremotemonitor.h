@@ -17,6 +17,8 @@
 #define MONITOR_OK     (0)
 #define MONITOR_ERR    (-1)
 
+#define MONITOR_STATS_SIZE (1<<16)
+
 Q_BEGIN_NAMESPACE
 
 // 错误类型
@@ -25,7 +27,8 @@ enum errorType {
 	TYPE_MONITOR,				// monitor错误
 	TYPE_NETWORK,				// 网络错误
 	TYPE_SERVICE,				// 服务错误
-	TYPE_OTHER				// 其它错误
+	TYPE_OTHER,				// 其它错误
+	TYPE_DISK				// 有磁盘已置为只读
 };
 
 // 错误级别
@@ -52,6 +55,12 @@ class QRemoteMonitor : public noncopyable {
 			uint64_t     used_mem_bytes;		// 已使用内存信息
 			uint64_t     total_mem_bytes;		// 总计内存信息
 		};
+
+		/* reply to STAT, followed by length bytes of "name:value\r\n" lines */
+		struct statsInfo {
+			uint32_t     magic_mark;		// 魔数
+			int32_t	     length;			// 后续数据总长度
+		};
 #pragma pack()
 
 		// @函数名: 构造函数
@@ -63,6 +72,12 @@ class QRemoteMonitor : public noncopyable {
 		// @函数名: 初始化函数
 		int32_t init(uint16_t monitor_port, int32_t timeout, int32_t (*fun_state)(void* argv), void* fun_argv, int32_t display_log = 1);
 
+		// @函数名: 设置统计信息输出函数, 收到STAT命令时调用, 参数与fun_state相同
+		void setStatsCallback(int32_t (*fun_stats)(void* argv, char* buf, int32_t size));
+
+		// @函数名: 设置磁盘用量函数, 收到PING命令时调用, 返回只读磁盘数, 失败返回<0时改为统计当前目录
+		void setDiskCallback(int32_t (*fun_disk)(void* argv, uint64_t* used_bytes, uint64_t* total_bytes));
+
 	private:
 		// @函数名: 监控线程
 		static Q_THREAD_T thread_monitor(void* ptr_info);
@@ -72,6 +87,8 @@ class QRemoteMonitor : public noncopyable {
 		uint16_t	monitor_port_;
 		int32_t		timeout_;
 		int32_t		(*fun_state_)(void* argv);
+		int32_t		(*fun_stats_)(void* argv, char* buf, int32_t size);
+		int32_t		(*fun_disk_)(void* argv, uint64_t* used_bytes, uint64_t* total_bytes);
 		void*		fun_argv_;
 		int32_t		success_flag_;
 		int32_t		display_log_;
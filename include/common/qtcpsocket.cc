@@ -1,27 +1,69 @@
 #include "qtcpsocket.h"
+#include "qcrc.h"
+
+// 头文件不支持零拷贝发送时MSG_ZEROCOPY标志为空, 分段响应全部拷贝发送
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY (0)
+#endif
 
 Q_BEGIN_NAMESPACE
 
+// 距截止时间的剩余毫秒数, 已过期返回0
+static inline int32_t time_left(int64_t deadline)
+{
+	int64_t left=deadline-QStopwatch::elapsed()/1000;
+	if(left<=0)
+		return 0;
+	return left>0x7fffffff?0x7fffffff:(int32_t)left;
+}
+
+// 在截止时间前等待套接字就绪, 就绪或被信号打断返回true, 超时或出错返回false
+static inline bool poll_deadline(Q_SOCKET_T sock, int16_t events, int64_t deadline)
+{
+	struct pollfd pfd;
+	int32_t ret=0;
+
+	pfd.fd=sock;
+	pfd.events=events;
+	pfd.revents=0;
+
+	ret=::poll(&pfd, 1, time_left(deadline));
+	return ret>0||(ret<0 && errno==EINTR);
+}
+
+// 解析线程组的CPU集合配置, "all"表示不绑定, 得到空集合
+static inline int32_t parse_cpu_list(const char* cpu_list, cpu_set_t& cpu_set)
+{
+	CPU_ZERO(&cpu_set);
+	if(q_strcasecmp(cpu_list, "all")==0)
+		return 0;
+	return q_parse_cpu_set(cpu_list, &cpu_set);
+}
+
 // TCP通讯客户端
 QTcpClient::QTcpClient()
 {
 	this->server_port_=TCP_DEFAULT_SERVER_PORT;
 	this->server_timeout_=TCP_DEFAULT_SERVER_TIMEOUT;
 	this->sock_=TCP_DEFAULT_INVALID_SOCKET;
+	this->keep_alive_=true;
+	this->pending_=0;
 	this->version_=TCP_HEADER_VERSION;
 	this->protocol_type_=TCP_DEFAULT_PROTOCOL_TYPE;
 	this->source_type_=TCP_DEFAULT_SOURCE_TYPE;
 	this->command_type_=TCP_DEFAULT_COMMAND_TYPE;
 	this->operate_type_=TCP_DEFAULT_OPERATE_TYPE;
+	this->request_id_=0;
 	this->request_buffer_=NULL;
 	this->request_buffer_size_=TCP_DEFAULT_REQUEST_SIZE;
 	this->reply_buffer_=NULL;
 	this->reply_buffer_size_=TCP_DEFAULT_REPLY_SIZE;
+	this->max_reply_size_=TCP_DEFAULT_MAX_REPLY_SIZE;
 }
 
 QTcpClient::~QTcpClient()
 {
-	q_close_socket(sock_);
+	close();
 	q_delete_array<char>(this->request_buffer_);
 	q_delete_array<char>(this->reply_buffer_);
 }
@@ -72,6 +114,21 @@ void QTcpClient::setOperateType(uint16_t operate_type)
 	this->operate_type_=operate_type;
 }
 
+void QTcpClient::setRequestId(uint64_t request_id)
+{
+	this->request_id_=request_id;
+}
+
+void QTcpClient::setKeepAlive(bool keep_alive)
+{
+	this->keep_alive_=keep_alive;
+}
+
+void QTcpClient::setMaxReplySize(int32_t max_reply_size)
+{
+	this->max_reply_size_=max_reply_size;
+}
+
 int32_t QTcpClient::sendRequest(const char* ptr_data, int32_t data_len, const void* ptr_extend, int32_t extend_len)
 {
 	if(ptr_data==NULL||data_len<0)
@@ -87,10 +144,13 @@ int32_t QTcpClient::sendRequest(const char* ptr_data, int32_t data_len, const vo
 		packet_len+=sizeof(int32_t)+data_len;
 	}
 
-	request_buffer_size_=packet_len;
-	request_buffer_=q_new_array<char>(request_buffer_size_);
-	if(request_buffer_==NULL)
-		return TCP_ERR_HEAP_ALLOC;
+	if(request_buffer_==NULL||packet_len>request_buffer_size_) {
+		q_delete_array<char>(request_buffer_);
+		request_buffer_size_=packet_len;
+		request_buffer_=q_new_array<char>(request_buffer_size_);
+		if(request_buffer_==NULL)
+			return TCP_ERR_HEAP_ALLOC;
+	}
 
 	requestHeader* request_header=reinterpret_cast<requestHeader*>(request_buffer_);
 	request_header->version=TCP_HEADER_VERSION;
@@ -98,6 +158,8 @@ int32_t QTcpClient::sendRequest(const char* ptr_data, int32_t data_len, const vo
 
 	request_header->protocol_type=protocol_type_;
 	request_header->source_type=source_type_;
+	request_header->request_id=request_id_;
+	memset(request_header->reserved, 0, sizeof(request_header->reserved));
 	request_header->command_type=command_type_;
 
 	ptr_temp=request_buffer_+sizeof(requestHeader);
@@ -117,17 +179,32 @@ int32_t QTcpClient::sendRequest(const char* ptr_data, int32_t data_len, const vo
 		memcpy(ptr_temp+sizeof(uint16_t)+sizeof(int32_t), ptr_data, data_len);
 	}
 
-	if(q_init_socket()<0)
-		return TCP_ERR_SOCKET_INIT;
+	// 服务端可能已关闭空闲连接, 复用前先检查(流水线发送时连接上可能已有响应到达, 不做检查)
+	if(sock_!=TCP_DEFAULT_INVALID_SOCKET && pending_==0 && !connection_alive())
+		close();
 
-	if(q_connect_socket(sock_, server_ip_, server_port_)<0)
-		return TCP_ERR_SOCKET_CONNECTION;
+	if(sock_==TCP_DEFAULT_INVALID_SOCKET)
+	{
+		if(q_init_socket()<0)
+			return TCP_ERR_SOCKET_INIT;
+
+		if(q_connect_socket(sock_, server_ip_, server_port_)<0) {
+			sock_=TCP_DEFAULT_INVALID_SOCKET;
+			return TCP_ERR_SOCKET_CONNECTION;
+		}
 
-	if(q_set_overtime(sock_, server_timeout_)<0)
-		return TCP_ERR_SOCKET_TIMEOUT;
+		if(q_set_overtime(sock_, server_timeout_)<0) {
+			close();
+			return TCP_ERR_SOCKET_TIMEOUT;
+		}
+	}
 
-	if(q_sendbuf(sock_, request_buffer_, packet_len)<0)
+	if(q_sendbuf(sock_, request_buffer_, packet_len)<0) {
+		close();
 		return TCP_ERR_SOCKET_SEND;
+	}
+
+	++pending_;
 
 	return TCP_OK;
 }
@@ -135,25 +212,45 @@ int32_t QTcpClient::sendRequest(const char* ptr_data, int32_t data_len, const vo
 int32_t QTcpClient::getReply(networkReply* reply)
 {
 	baseHeader base_header;
-	if(q_recvbuf(sock_, (char*)&base_header, sizeof(baseHeader))<0)
+	if(q_recvbuf(sock_, (char*)&base_header, sizeof(baseHeader))<0) {
+		close();
 		return TCP_ERR_SOCKET_RECV;
+	}
 
-	if(base_header.version!=TCP_HEADER_VERSION)
+	if(base_header.version!=TCP_HEADER_VERSION) {
+		close();
 		return TCP_ERR_SOCKET_VERSION;
+	}
 
-	if(base_header.length<=0||base_header.length+sizeof(baseHeader)>1<<20)
+	if(base_header.length<=0||base_header.length>max_reply_size_) {
+		close();
 		return TCP_ERR_PACKET_LENGTH;
+	}
 
-	reply_buffer_size_=base_header.length;
-	reply_buffer_=q_new_array<char>(reply_buffer_size_);
-	if(reply_buffer_==NULL)
-		return TCP_ERR_HEAP_ALLOC;
+	if(reply_buffer_==NULL||base_header.length>reply_buffer_size_) {
+		q_delete_array<char>(reply_buffer_);
+		reply_buffer_size_=base_header.length;
+		reply_buffer_=q_new_array<char>(reply_buffer_size_);
+		if(reply_buffer_==NULL) {
+			close();
+			return TCP_ERR_HEAP_ALLOC;
+		}
+	}
 
-	if(q_recvbuf(sock_, reply_buffer_, base_header.length))
+	if(q_recvbuf(sock_, reply_buffer_, base_header.length)) {
+		close();
 		return TCP_ERR_SOCKET_RECV;
+	}
+
+	if(pending_>0)
+		--pending_;
+
+	if(!keep_alive_ && pending_==0)
+		close();
 
 	replyParam* reply_param=reinterpret_cast<replyParam*>(reply_buffer_);
 
+	reply->request_id=reply_param->request_id;
 	reply->status=reply_param->status;
 	if(!reply->status && base_header.length!=sizeof(replyParam)) {
 		reply->length=*(uint32_t*)(reply_buffer_+sizeof(replyParam));
@@ -163,6 +260,32 @@ int32_t QTcpClient::getReply(networkReply* reply)
 	return TCP_OK;
 }
 
+void QTcpClient::close()
+{
+	if(sock_!=TCP_DEFAULT_INVALID_SOCKET) {
+		q_close_socket(sock_);
+		sock_=TCP_DEFAULT_INVALID_SOCKET;
+	}
+	pending_=0;
+}
+
+bool QTcpClient::connection_alive()
+{
+	struct pollfd pfd;
+	pfd.fd=sock_;
+	pfd.events=POLLIN;
+	pfd.revents=0;
+
+	if(::poll(&pfd, 1, 0)<0)
+		return false;
+
+	if(pfd.revents==0)
+		return true;
+
+	// 空闲连接上可读只可能是对端关闭或异常数据, 均不能再复用
+	return false;
+}
+
 QTcpServer::QTcpServer()
 {
 	this->pid_=getpid();
@@ -176,6 +299,12 @@ QTcpServer::QTcpServer()
 	this->server_name_=NULL;
 	this->server_port_=TCP_DEFAULT_SERVER_PORT;
 	this->server_timeout_=TCP_DEFAULT_SERVER_TIMEOUT;
+	this->keepalive_timeout_=TCP_DEFAULT_KEEPALIVE_TIMEOUT;
+	this->max_clients_=TCP_DEFAULT_MAX_CLIENTS;
+	this->max_inflight_=TCP_DEFAULT_MAX_INFLIGHT;
+	this->max_queue_wait_=TCP_DEFAULT_MAX_QUEUE_WAIT;
+	this->stream_threshold_=TCP_DEFAULT_STREAM_THRESHOLD;
+	this->zerocopy_threshold_=TCP_DEFAULT_ZEROCOPY_THRESHOLD;
 	this->thread_info_=NULL;
 	this->thread_max_=0;
 	this->comm_thread_max_=TCP_DEFAULT_THREAD_NUM;
@@ -187,19 +316,27 @@ QTcpServer::QTcpServer()
 	this->send_thread_max_=TCP_DEFAULT_THREAD_NUM;
 	this->send_buffer_size_=TCP_DEFAULT_BUFFER_SIZE;
 	this->send_thread_timeout_=TCP_DEFAULT_THREAD_TIMEOUT;
-	this->listen_sock_=TCP_DEFAULT_INVALID_SOCKET;
+	this->io_model_=TCP_DEFAULT_IO_MODEL;
+	this->reactor_info_=NULL;
+	this->shard_info_=NULL;
+	this->shard_num_=TCP_DEFAULT_SHARD_NUM;
+	this->shard_affinity_=0;
+	CPU_ZERO(&this->comm_cpu_set_);
+	CPU_ZERO(&this->work_cpu_set_);
+	CPU_ZERO(&this->send_cpu_set_);
+	this->numa_local_=0;
 	this->queue_size_=TCP_DEFAULT_QUEUE_SIZE;
 	this->client_request_size_=TCP_DEFAULT_REQUEST_SIZE;
 	this->client_reply_size_=TCP_DEFAULT_REPLY_SIZE;
 	this->header_size_=TCP_DEFAULT_HEADER_SIZE;
-	this->chunk_queue_=NULL;
-	this->client_queue_=NULL;
-	this->client_trigger_=NULL;
+	this->buffer_pool_budget_=TCP_DEFAULT_BUFFER_POOL_BUDGET;
 	this->send_ip_=NULL;
 	this->send_port_=0;
 	this->data_path_=NULL;
 	this->read_path_=NULL;
 	this->write_path_=NULL;
+	this->write_fp_=NULL;
+	this->spool_ckp_offset_=0;
 	this->monitor_=NULL;
 	this->monitor_port_=TCP_DEFAULT_MONITOR_PORT;
 	this->logger_=NULL;
@@ -213,6 +350,10 @@ QTcpServer::QTcpServer()
 	this->stat_succconnections_=0;
 	this->stat_failedconnections_=0;
 	this->stat_rejectedconnections_=0;
+	this->stat_currconnections_=0;
+	this->stat_inflightrequests_=0;
+	this->stat_expiredconnections_=0;
+	this->stat_expiredrequests_=0;
 }
 
 QTcpServer::~QTcpServer()
@@ -221,28 +362,55 @@ QTcpServer::~QTcpServer()
 
 	q_free(pidfile_);
 
-	q_close_socket(listen_sock_);
-
-	clientInfo* client_info=NULL;
-	while(chunk_queue_->pop_non_blocking(client_info)==0)
-	{
-		q_delete_array<char>(client_info->request_buffer);
-		q_delete_array<char>(client_info->reply_buffer);
+	if(shard_info_) {
+		for(int32_t i=0; i<shard_num_; ++i)
+			q_close_socket(shard_info_[i].listen_sock);
 	}
-	q_delete< QQueue<clientInfo*> >(chunk_queue_);
-
-	q_delete< QQueue<clientInfo*> >(client_queue_);
-	q_delete< QTrigger >(client_trigger_);
 
 	free_server_info();
 
+	if(shard_info_) {
+		for(int32_t i=0; i<shard_num_; ++i)
+		{
+			clientInfo* client_info=NULL;
+			while(shard_info_[i].chunk_queue && shard_info_[i].chunk_queue->pop_non_blocking(client_info)==0)
+			{
+				release_buffers(client_info);
+				q_delete<QMutexLock>(client_info->send_mutex);
+			}
+			q_delete<clientQueue>(shard_info_[i].chunk_queue);
+			q_delete_array<clientInfo*>(shard_info_[i].slots);
+
+			q_delete<clientQueue>(shard_info_[i].client_queue);
+			q_delete< QTrigger >(shard_info_[i].client_trigger);
+		}
+		q_delete_array<shardInfo>(shard_info_);
+	}
+
+	if(reactor_info_) {
+		for(int32_t i=0; i<comm_thread_max_; ++i)
+		{
+			if(reactor_info_[i].epoll_fd>=0)
+				::close(reactor_info_[i].epoll_fd);
+			if(reactor_info_[i].event_fd>=0)
+				::close(reactor_info_[i].event_fd);
+			q_delete_array<struct epoll_event>(reactor_info_[i].events);
+			q_delete<clientQueue>(reactor_info_[i].resume_queue);
+			q_delete<QIoUring>(reactor_info_[i].ring);
+			q_delete<QTimerWheel>(reactor_info_[i].wheel);
+		}
+		q_delete_array<reactorInfo>(reactor_info_);
+	}
+
 	q_free(send_ip_);
 	q_free(data_path_);
 	q_free(read_path_);
 	q_free(write_path_);
 
-	fclose(write_fp_);
-	write_fp_=NULL;
+	if(write_fp_) {
+		fclose(write_fp_);
+		write_fp_=NULL;
+	}
 
 	q_free(log_path_);
 	q_free(log_prefix_);
@@ -282,73 +450,119 @@ int32_t QTcpServer::init(const char* cfg_file)
 		return TCP_ERR;
 	}
 
-	/* queue */
-	chunk_queue_=q_new< QQueue<clientInfo*> >();
-	if(chunk_queue_==NULL) {
+	/* buffer pool */
+	ret=buffer_pool_.init((uint64_t)buffer_pool_budget_<<20);
+	if(ret<0) {
 		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-				"chunk_queue_ alloc error, null value!");
+				"buffer_pool_ init error, ret = (%d)!", \
+				ret);
 		return TCP_ERR;
 	}
-	
-	ret=chunk_queue_->init(queue_size_+1);
-	if(ret<0) {
+
+	/* shards */
+	cpu_set_t init_cpu_set;
+	cpu_set_t shard_cpu_set;
+	if(pthread_getaffinity_np(pthread_self(), sizeof(init_cpu_set), &init_cpu_set))
+		numa_local_=0;
+
+	shard_info_=q_new_array<shardInfo>(shard_num_);
+	if(shard_info_==NULL) {
 		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-				"init chunk_queue_ error, ret = (%d)", \
-				ret);
+				"shard_info_ alloc error, null value!");
 		return TCP_ERR;
 	}
 
-	for(int32_t i=0; i<queue_size_; ++i)
+	for(int32_t s=0; s!=shard_num_; ++s)
 	{
-		clientInfo* client_info=q_new<clientInfo>();
-		if(client_info==NULL) {
+		shardInfo* shard=shard_info_+s;
+		// 客户端结构平均分给各分片, 余数归前几个分片
+		int32_t slot_num=queue_size_/shard_num_+(s<queue_size_%shard_num_?1:0);
+
+		/* queue */
+		shard->chunk_queue=q_new<clientQueue>();
+		if(shard->chunk_queue==NULL) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-					"client_info is null!");
+					"shard (%d) chunk_queue alloc error, null value!", \
+					s+1);
 			return TCP_ERR;
 		}
 
-		client_info->request_buffer_size=client_request_size_;
-		client_info->request_buffer=q_new_array<char>(client_info->request_buffer_size);
-		if(client_info->request_buffer==NULL) {
+		ret=shard->chunk_queue->init(slot_num+1);
+		if(ret<0) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-					"client_info->request_buffer is null!");
+					"init shard (%d) chunk_queue error, ret = (%d)", \
+					s+1, \
+					ret);
 			return TCP_ERR;
 		}
 
-		client_info->reply_buffer_size=client_reply_size_;
-		client_info->reply_buffer=q_new_array<char>(client_info->reply_buffer_size);
-		if(client_info->reply_buffer==NULL) {
+		shard->slots=q_new_array<clientInfo*>(slot_num);
+		if(shard->slots==NULL) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-					"client_info->reply_buffer is null!");
+					"shard (%d) slots alloc error, null value!", \
+					s+1);
 			return TCP_ERR;
 		}
+		shard->slot_num=slot_num;
 
-		chunk_queue_->push(client_info);
-	}
+		// 客户端结构主要由工作线程访问, 主线程临时迁到该分片工作线程的CPU上分配, 首次写入即落在其NUMA节点
+		if(numa_local_ && thread_cpu_set(work_cpu_set_, s, shard_cpu_set)>0)
+			q_set_thread_cpu_set(&shard_cpu_set);
 
-	/* client queue */
-	client_queue_=q_new< QQueue<clientInfo*> >();
-	if(client_queue_==NULL) {
-		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-				"client_queue_ is null!");
-		return TCP_ERR;
-	}
+		for(int32_t i=0; i<slot_num; ++i)
+		{
+			clientInfo* client_info=q_new<clientInfo>();
+			if(client_info==NULL) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"client_info is null!");
+				return TCP_ERR;
+			}
 
-	ret=client_queue_->init(queue_size_+1);
-	if(ret<0) {
-		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-				"init client_queue_ error, ret = (%d)", \
-				ret);
-		return TCP_ERR;
-	}
+			client_info->shard_id=s;
+			client_info->slot_id=i;
+			shard->slots[i]=client_info;
 
-	client_trigger_=q_new<QTrigger>();
-	if(client_trigger_==NULL) {
-		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-				"client_trigger_ is null!");
-		return TCP_ERR;
+			client_info->send_mutex=q_new<QMutexLock>();
+			if(client_info->send_mutex==NULL) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"client_info->send_mutex is null!");
+				return TCP_ERR;
+			}
+
+			shard->chunk_queue->push(client_info);
+		}
+
+		/* client queue */
+		shard->client_queue=q_new<clientQueue>();
+		if(shard->client_queue==NULL) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"shard (%d) client_queue is null!", \
+					s+1);
+			return TCP_ERR;
+		}
+
+		ret=shard->client_queue->init(slot_num+1);
+		if(ret<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"init shard (%d) client_queue error, ret = (%d)", \
+					s+1, \
+					ret);
+			return TCP_ERR;
+		}
+
+		shard->client_trigger=q_new<QTrigger>();
+		if(shard->client_trigger==NULL) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"shard (%d) client_trigger is null!", \
+					s+1);
+			return TCP_ERR;
+		}
 	}
 
+	// 恢复主线程原有的CPU绑定
+	if(numa_local_)
+		q_set_thread_cpu_set(&init_cpu_set);
+
 	/* directory */
 	if(!QDir::mkdir(data_path_)) {
 		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
@@ -359,15 +573,23 @@ int32_t QTcpServer::init(const char* cfg_file)
 
 	if(access(write_path_, 00)==0)
 	{
-		ret=q_repair_file(write_path_, (const char*)&TCP_TAILER_FILE_MARK, sizeof(TCP_TAILER_FILE_MARK));
-		if(ret<0) {
+		// 只校验检查点之后的记录, 启动耗时与文件大小无关
+		int64_t dropped=recover_data_file(write_path_);
+		if(dropped<0) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-					"q_repair_file (%s) error, ret = (%d)!", \
+					"recover_data_file (%s) error, ret = (%ld)!", \
 					write_path_, \
-					ret);
+					dropped);
 			return TCP_ERR;
 		}
 
+		if(dropped>0) {
+			logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"data file (%s) has a torn or corrupt tail, (%ld) bytes dropped!", \
+					write_path_, \
+					dropped);
+		}
+
 		write_fp_=::fopen(write_path_, "rb+");
 		if(write_fp_==NULL) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
@@ -382,6 +604,14 @@ int32_t QTcpServer::init(const char* cfg_file)
 					write_path_);
 			return TCP_ERR;
 		}
+
+		// 恢复后的内容已逐条校验, 落盘后作为新的检查点
+		if(save_data_checkpoint(write_path_, write_fp_, ::ftell(write_fp_))<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"save_data_checkpoint (%s) error!", \
+					write_path_);
+			return TCP_ERR;
+		}
 	}
 
 	/* initialization */
@@ -402,13 +632,153 @@ int32_t QTcpServer::init(const char* cfg_file)
 		return TCP_ERR;
 	}
 
-	ret=q_TCP_server(listen_sock_, server_port_);
-	if(ret<0) {
-		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-				"TCP server error, listen_port = (%d), ret = (%d)!", \
-				server_port_, \
-				ret);
-		return TCP_ERR;
+	// 多分片时每个分片独立监听同一端口
+	for(int32_t s=0; s!=shard_num_; ++s)
+	{
+		ret=q_TCP_server(shard_info_[s].listen_sock, server_port_, 511, shard_num_>1);
+		if(ret<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"TCP server error, shard = (%d), listen_port = (%d), ret = (%d)!", \
+					s+1, \
+					server_port_, \
+					ret);
+			return TCP_ERR;
+		}
+	}
+
+	/* reactors */
+	if(io_model_==TCP_IO_URING && !QIoUring::supported()) {
+		// 内核或编译环境不支持io_uring时退回epoll
+		logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"io_uring is not supported, io-model falls back to epoll!");
+		io_model_=TCP_IO_EPOLL;
+	}
+
+	if(io_model_!=TCP_IO_BLOCKING)
+	{
+		for(int32_t s=0; s!=shard_num_; ++s)
+		{
+			ret=q_set_nonblocking(shard_info_[s].listen_sock);
+			if(ret<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"set listen socket nonblocking error, ret = (%d)!", \
+						ret);
+				return TCP_ERR;
+			}
+		}
+
+		reactor_info_=q_new_array<reactorInfo>(comm_thread_max_);
+		if(reactor_info_==NULL) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"reactor_info_ alloc error, null value!");
+			return TCP_ERR;
+		}
+
+		for(int32_t i=0; i!=comm_thread_max_; ++i)
+		{
+			reactorInfo* reactor=reactor_info_+i;
+			reactor->shard_id=i/(comm_thread_max_/shard_num_);
+
+			reactor->resume_queue=q_new<clientQueue>();
+			if(reactor->resume_queue==NULL||reactor->resume_queue->init(queue_size_+1)<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"reactor resume queue (%d) init error!", \
+						i+1);
+				return TCP_ERR;
+			}
+
+			reactor->wheel=q_new<QTimerWheel>();
+			if(reactor->wheel==NULL||reactor->wheel->init(QStopwatch::elapsed()/1000, TCP_DEFAULT_TIMER_TICK)<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"reactor timer wheel (%d) init error!", \
+						i+1);
+				return TCP_ERR;
+			}
+
+			reactor->event_fd=::eventfd(0, EFD_NONBLOCK);
+			if(reactor->event_fd<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"eventfd (%d) create error!", \
+						i+1);
+				return TCP_ERR;
+			}
+
+			if(io_model_==TCP_IO_URING) {
+				shardInfo* shard=shard_info_+reactor->shard_id;
+
+				// 每个连接至多一个接收在途, 另有accept、eventfd读取与定时器各一个
+				reactor->ring=q_new<QIoUring>();
+				if(reactor->ring==NULL||reactor->ring->init(q_min(shard->slot_num+3, TCP_DEFAULT_URING_ENTRIES))<0) {
+					logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+							"io_uring (%d) init error!", \
+							i+1);
+					return TCP_ERR;
+				}
+
+				// 消息头缓冲区常驻于客户端结构中, 注册为固定缓冲区; 注册失败(如锁定内存受限)时改用普通接收
+				struct iovec* iovs=q_new_array<struct iovec>(shard->slot_num);
+				if(iovs) {
+					for(int32_t j=0; j<shard->slot_num; ++j)
+					{
+						iovs[j].iov_base=shard->slots[j]->header_buffer;
+						iovs[j].iov_len=sizeof(shard->slots[j]->header_buffer);
+					}
+					reactor->fixed_buffers=(reactor->ring->register_buffers(iovs, shard->slot_num)==0);
+					q_delete_array<struct iovec>(iovs);
+				}
+
+				if(!reactor->fixed_buffers) {
+					logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+							"io_uring (%d) register header buffers error, using plain recv!", \
+							i+1);
+				}
+				continue;
+			}
+
+			reactor->epoll_fd=::epoll_create1(0);
+			if(reactor->epoll_fd<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"epoll create (%d) error!", \
+						i+1);
+				return TCP_ERR;
+			}
+
+			reactor->event_size=TCP_DEFAULT_EVENT_SIZE;
+			reactor->events=q_new_array<struct epoll_event>(reactor->event_size);
+			if(reactor->events==NULL) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"epoll events (%d) alloc error!", \
+						i+1);
+				return TCP_ERR;
+			}
+
+			// 分片的监听套接字加入该分片每个reactor, 由内核唤醒其中之一完成accept
+			struct epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events=EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+			event.events|=EPOLLEXCLUSIVE;
+#endif
+			event.data.ptr=NULL;
+
+			if(::epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, shard_info_[reactor->shard_id].listen_sock, &event)<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"epoll add listen socket (%d) error!", \
+						i+1);
+				return TCP_ERR;
+			}
+
+			// 以reactor自身地址标识eventfd事件
+			event.events=EPOLLIN;
+			event.data.ptr=reactor;
+
+			if(::epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &event)<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"epoll add eventfd (%d) error!", \
+						i+1);
+				return TCP_ERR;
+			}
+		}
 	}
 
 	/* threads */
@@ -430,6 +800,8 @@ int32_t QTcpServer::init(const char* cfg_file)
 		ptr_trd[i].status=0;
 		ptr_trd[i].flag=0;
 		ptr_trd[i].timeout=comm_thread_timeout_;
+		ptr_trd[i].shard_id=i/(comm_thread_max_/shard_num_);
+		place_thread(ptr_trd+i, comm_cpu_set_, ptr_trd[i].shard_id);
 		ptr_trd[i].buf_size=comm_buffer_size_;
 		ptr_trd[i].ptr_buf=q_new_array<char>(ptr_trd[i].buf_size);
 		if(ptr_trd[i].ptr_buf==NULL) {
@@ -439,7 +811,16 @@ int32_t QTcpServer::init(const char* cfg_file)
 			return TCP_ERR;
 		}
 
-		ret=q_create_thread(QTcpServer::comm_thread, ptr_trd+i);
+		if(numa_local_ && ptr_trd[i].numa_node>=0)
+			q_bind_memory_node(ptr_trd[i].ptr_buf, ptr_trd[i].buf_size, ptr_trd[i].numa_node);
+
+		if(io_model_==TCP_IO_EPOLL) {
+			ret=q_create_thread(QTcpServer::event_thread, ptr_trd+i);
+		} else if(io_model_==TCP_IO_URING) {
+			ret=q_create_thread(QTcpServer::uring_thread, ptr_trd+i);
+		} else {
+			ret=q_create_thread(QTcpServer::comm_thread, ptr_trd+i);
+		}
 		if(ret<0) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
 					"create comm_thread (%d) error", \
@@ -466,6 +847,8 @@ int32_t QTcpServer::init(const char* cfg_file)
 		ptr_trd[i].status=0;
 		ptr_trd[i].flag=0;
 		ptr_trd[i].timeout=work_thread_timeout_;
+		ptr_trd[i].shard_id=i/(work_thread_max_/shard_num_);
+		place_thread(ptr_trd+i, work_cpu_set_, ptr_trd[i].shard_id);
 		ptr_trd[i].buf_size=work_buffer_size_;
 		ptr_trd[i].ptr_buf=q_new_array<char>(ptr_trd[i].buf_size);
 		if(ptr_trd[i].ptr_buf==NULL) {
@@ -475,6 +858,9 @@ int32_t QTcpServer::init(const char* cfg_file)
 			return TCP_ERR;
 		}
 
+		if(numa_local_ && ptr_trd[i].numa_node>=0)
+			q_bind_memory_node(ptr_trd[i].ptr_buf, ptr_trd[i].buf_size, ptr_trd[i].numa_node);
+
 		ret=server_init(ptr_trd[i].for_worker);
 		if(ret<0) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
@@ -510,6 +896,7 @@ int32_t QTcpServer::init(const char* cfg_file)
 		ptr_trd[i].status=0;
 		ptr_trd[i].flag=0;
 		ptr_trd[i].timeout=send_thread_timeout_;
+		place_thread(ptr_trd+i, send_cpu_set_, -1);
 		ptr_trd[i].buf_size=send_buffer_size_;
 		ptr_trd[i].ptr_buf=q_new_array<char>(ptr_trd[i].buf_size);
 		if(ptr_trd[i].ptr_buf==NULL) {
@@ -519,6 +906,9 @@ int32_t QTcpServer::init(const char* cfg_file)
 			return TCP_ERR;
 		}
 
+		if(numa_local_ && ptr_trd[i].numa_node>=0)
+			q_bind_memory_node(ptr_trd[i].ptr_buf, ptr_trd[i].buf_size, ptr_trd[i].numa_node);
+
 		ret=q_create_thread(QTcpServer::send_thread, ptr_trd+i);
 		if(ret<0) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
@@ -538,6 +928,27 @@ int32_t QTcpServer::init(const char* cfg_file)
 		}
 	}
 
+	// 各线程已自行绑定, 主线程恢复原有的CPU绑定
+	if(numa_local_)
+		q_set_thread_cpu_set(&init_cpu_set);
+
+	/* placement */
+	for(int32_t i=0; i!=thread_max_; ++i)
+	{
+		char cpu_list[BUFSIZ_1K]={0};
+		const char* group_name=i<comm_thread_max_?"comm":(i<comm_thread_max_+work_thread_max_?"work":"send");
+
+		if(thread_info_[i].cpu_count==0 || q_format_cpu_set(&thread_info_[i].cpu_set, cpu_list, sizeof(cpu_list))<0)
+			strcpy(cpu_list, "all");
+
+		Q_INFO("%s thread (%d), shard (%d), cpus (%s), numa node (%d)", \
+				group_name, \
+				thread_info_[i].id+1, \
+				thread_info_[i].shard_id+1, \
+				cpu_list, \
+				thread_info_[i].numa_node);
+	}
+
 	/* monitor */
 	monitor_=q_new<QRemoteMonitor>();
 	if(monitor_==NULL) {
@@ -546,6 +957,8 @@ int32_t QTcpServer::init(const char* cfg_file)
 		return TCP_ERR;
 	}
 
+	monitor_->setStatsCallback(get_server_stats);
+	monitor_->setDiskCallback(get_disk_usage);
 	ret=monitor_->init(monitor_port_, 10000, get_thread_state, this, 1);
 	if(ret<0) {
 		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
@@ -591,6 +1004,46 @@ int32_t QTcpServer::load_server_config(const char* cfg_file)
 	if(ret<0)
 		return TCP_ERR;
 
+	ret=config_->getFieldInt32("keepalive-timeout", keepalive_timeout_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("max-clients", max_clients_);
+	if(ret<0||max_clients_<=0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("max-inflight", max_inflight_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("max-queue-wait", max_queue_wait_);
+	if(ret<0)
+		return TCP_ERR;
+
+	char io_model[BUFSIZ_32]={0};
+	ret=config_->getFieldString("io-model", io_model, sizeof(io_model));
+	if(ret<0)
+		return TCP_ERR;
+
+	if(q_strcasecmp(io_model, "blocking")==0) {
+		io_model_=TCP_IO_BLOCKING;
+	} else if(q_strcasecmp(io_model, "epoll")==0) {
+		io_model_=TCP_IO_EPOLL;
+	} else if(q_strcasecmp(io_model, "uring")==0) {
+		io_model_=TCP_IO_URING;
+	} else {
+		Q_INFO("unknown io-model (%s)!", io_model);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldInt32("stream-threshold", stream_threshold_);
+	if(ret<0||stream_threshold_<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("zerocopy-threshold", zerocopy_threshold_);
+	if(ret<0||zerocopy_threshold_<0)
+		return TCP_ERR;
+
 	ret=config_->getFieldInt32("comm-thread-max", comm_thread_max_);
 	if(ret<0)
 		return TCP_ERR;
@@ -631,6 +1084,50 @@ int32_t QTcpServer::load_server_config(const char* cfg_file)
 	if(ret<0)
 		return TCP_ERR;
 
+	ret=config_->getFieldInt32("buffer-pool-budget", buffer_pool_budget_);
+	if(ret<0||buffer_pool_budget_<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("shard-num", shard_num_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldYesNo("shard-affinity", shard_affinity_);
+	if(ret<0)
+		return TCP_ERR;
+
+	char comm_cpu_list[BUFSIZ_1K]={0};
+	ret=config_->getFieldString("comm-cpu-set", comm_cpu_list, sizeof(comm_cpu_list));
+	if(ret<0||parse_cpu_list(comm_cpu_list, comm_cpu_set_)<0) {
+		Q_INFO("invalid comm-cpu-set (%s)!", comm_cpu_list);
+		return TCP_ERR;
+	}
+
+	char work_cpu_list[BUFSIZ_1K]={0};
+	ret=config_->getFieldString("work-cpu-set", work_cpu_list, sizeof(work_cpu_list));
+	if(ret<0||parse_cpu_list(work_cpu_list, work_cpu_set_)<0) {
+		Q_INFO("invalid work-cpu-set (%s)!", work_cpu_list);
+		return TCP_ERR;
+	}
+
+	char send_cpu_list[BUFSIZ_1K]={0};
+	ret=config_->getFieldString("send-cpu-set", send_cpu_list, sizeof(send_cpu_list));
+	if(ret<0||parse_cpu_list(send_cpu_list, send_cpu_set_)<0) {
+		Q_INFO("invalid send-cpu-set (%s)!", send_cpu_list);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldYesNo("numa-local", numa_local_);
+	if(ret<0)
+		return TCP_ERR;
+
+	// 每个分片至少拥有一个通信线程、一个工作线程和一个客户端结构
+	if(shard_num_<=0||comm_thread_max_%shard_num_||work_thread_max_%shard_num_||comm_thread_max_<shard_num_ \
+			||work_thread_max_<shard_num_||queue_size_<shard_num_) {
+		Q_INFO("shard-num (%d) must divide comm-thread-max and work-thread-max, and not exceed queue-size!", shard_num_);
+		return TCP_ERR;
+	}
+
 	ret=config_->getFieldString("send-ip", send_ip_);
 	if(ret<0)
 		return TCP_ERR;
@@ -673,6 +1170,13 @@ int32_t QTcpServer::load_server_config(const char* cfg_file)
 	Q_INFO("server-port          = (%d)", server_port_);
 	Q_INFO("monitor-port         = (%d)", monitor_port_);
 	Q_INFO("server-timeout       = (%d)", server_timeout_);
+	Q_INFO("keepalive-timeout    = (%d)", keepalive_timeout_);
+	Q_INFO("max-clients          = (%d)", max_clients_);
+	Q_INFO("max-inflight         = (%d)", max_inflight_);
+	Q_INFO("max-queue-wait       = (%d)", max_queue_wait_);
+	Q_INFO("io-model             = (%s)", io_model);
+	Q_INFO("stream-threshold     = (%d)", stream_threshold_);
+	Q_INFO("zerocopy-threshold   = (%d)", zerocopy_threshold_);
 
 	Q_INFO("comm-thread-max      = (%d)", comm_thread_max_);
 	Q_INFO("comm-buffer-size     = (%d)", comm_buffer_size_);
@@ -687,6 +1191,13 @@ int32_t QTcpServer::load_server_config(const char* cfg_file)
 	Q_INFO("send-thread-timeout  = (%d)", send_thread_timeout_);
 
 	Q_INFO("queue-size           = (%d)", queue_size_);
+	Q_INFO("buffer-pool-budget   = (%d)", buffer_pool_budget_);
+	Q_INFO("shard-num            = (%d)", shard_num_);
+	Q_INFO("shard-affinity       = (%d)", shard_affinity_);
+	Q_INFO("comm-cpu-set         = (%s)", comm_cpu_list);
+	Q_INFO("work-cpu-set         = (%s)", work_cpu_list);
+	Q_INFO("send-cpu-set         = (%s)", send_cpu_list);
+	Q_INFO("numa-local           = (%d)", numa_local_);
 
 	Q_INFO("send-ip              = (%s)", send_ip_);
 	Q_INFO("send-port            = (%d)", send_port_);
@@ -723,6 +1234,51 @@ int32_t QTcpServer::start()
 	return TCP_OK;
 }
 
+int32_t QTcpServer::server_stream_begin(const char* request_buffer, int32_t buf_len, int32_t request_len, void*& stream, \
+		const void* handle)
+{
+	// 默认不支持流式请求
+	return TCP_ERR_PACKET_LENGTH;
+}
+
+int32_t QTcpServer::server_stream_data(void* stream, const char* ptr_data, int32_t data_len)
+{
+	return TCP_ERR;
+}
+
+int32_t QTcpServer::server_stream_end(void* stream, char* reply_buffer, int32_t reply_size, const void* handle)
+{
+	return TCP_ERR;
+}
+
+int32_t QTcpServer::server_process_vector(const char* request_buffer, int32_t request_len, char* reply_buffer, int32_t reply_size, \
+		replyVector& reply, const void* handle)
+{
+	return server_process(request_buffer, request_len, reply_buffer, reply_size, handle);
+}
+
+void QTcpServer::server_reply_done(replyVector& reply, const void* handle)
+{
+	if(reply.file_fd>=0) {
+		::close(reply.file_fd);
+		reply.file_fd=-1;
+	}
+}
+
+void QTcpServer::server_stream_abort(void* stream)
+{
+}
+
+int32_t QTcpServer::server_stats(char* buf, int32_t size)
+{
+	return 0;
+}
+
+int32_t QTcpServer::server_disk_usage(uint64_t& used_bytes, uint64_t& total_bytes)
+{
+	return -1;
+}
+
 Q_THREAD_T QTcpServer::comm_thread(void* ptr_info)
 {
 	threadInfo* ptr_trd=reinterpret_cast<threadInfo*>(ptr_info);
@@ -731,7 +1287,11 @@ Q_THREAD_T QTcpServer::comm_thread(void* ptr_info)
 	QTcpServer* ptr_this=reinterpret_cast<QTcpServer*>(ptr_trd->pthis);
 	Q_CHECK_PTR(ptr_this);
 
+	shardInfo* shard=ptr_this->attach_shard(ptr_trd);
 	clientInfo* client_info=NULL;
+	Q_SOCKET_T client_sock=TCP_DEFAULT_INVALID_SOCKET;
+	char client_ip[TCP_DEFAULT_IP_SIZE]={0};
+	int32_t client_port=0;
 
 	ptr_trd->flag=1;
 
@@ -739,38 +1299,51 @@ Q_THREAD_T QTcpServer::comm_thread(void* ptr_info)
 	{
 		ptr_trd->status=0;
 
-		client_info=ptr_this->chunk_queue_->pop();
-
-		try {
-			if(q_accept_socket(ptr_this->listen_sock_, \
-						client_info->client_sock, \
-						client_info->client_ip, \
-						client_info->client_port)) {
-				ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-						"TCP socket accept error!");
-				throw TCP_ERR_SOCKET_ACCEPT;
-			}
+		if(q_accept_socket(shard->listen_sock, client_sock, client_ip, client_port)) {
+			ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
+					"TCP socket accept error!");
+			continue;
+		}
 
-			ptr_trd->status=1;
-			ptr_trd->sw.start();
+		ptr_trd->status=1;
+		ptr_trd->sw.start();
 
-			ptr_this->logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
+		// 客户端结构耗尽时不再阻塞等待, 直接回复忙
+		client_info=ptr_this->admit_client(shard, client_sock, client_ip, client_port);
+		if(client_info==NULL) {
+			ptr_trd->sw.stop();
+			continue;
+		}
+
+		try {
+			ptr_this->logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
 					"---------- Request from [%s:%d] ----------", \
 					client_info->client_ip, \
 					client_info->client_port);
 
-			if(q_set_overtime(client_info->client_sock, \
-						ptr_this->server_timeout_)) {
+			// 不再设置套接字收发超时, 整个请求的接收、处理与响应都受同一截止时间约束
+			if(q_set_nonblocking(client_info->client_sock)<0) {
 				ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-						"TCP socket set timeout (%d) error!", \
-						ptr_this->server_timeout_);
+						"TCP socket [%s:%d] set nonblocking error!", \
+						client_info->client_ip, \
+						client_info->client_port);
 				throw TCP_ERR_SOCKET_TIMEOUT;
 			}
 
-			ptr_this->client_queue_->push(client_info);
-			ptr_this->client_trigger_->signal();
+			if(!ptr_this->acquire_inflight())
+				throw TCP_ERR_SERVER_BUSY;
+
+			client_info->enqueue_time=QStopwatch::elapsed()/1000;
+			client_info->deadline=client_info->enqueue_time+ptr_this->server_timeout_;
+
+			shard->client_queue->push(client_info);
+			shard->client_trigger->signal();
 		} catch(const int32_t err) {
-			ptr_this->chunk_queue_->push(client_info);
+			if(err==TCP_ERR_SERVER_BUSY) {
+				q_add_and_fetch(&ptr_this->stat_rejectedconnections_);
+				ptr_this->reply_error(client_info, err, 0);
+			}
+			ptr_this->release_client(client_info);
 			ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
 					"Task process socket error, err = (%d)!",
 					err);
@@ -791,10 +1364,13 @@ Q_THREAD_T QTcpServer::work_thread(void* ptr_info)
 	QTcpServer* ptr_this=reinterpret_cast<QTcpServer*>(ptr_trd->pthis);
 	Q_CHECK_PTR(ptr_this);
 
+	shardInfo* shard=ptr_this->attach_shard(ptr_trd);
 	clientInfo* client_info=NULL;
 	QStopwatch sw_work;
 	int32_t recv_len=0;
 	int32_t send_len=0;
+	int32_t ret=0;
+	bool keep_alive=false;
 
 	ptr_trd->flag=1;
 
@@ -802,96 +1378,152 @@ Q_THREAD_T QTcpServer::work_thread(void* ptr_info)
 	{
 		ptr_trd->status=0;
 
-		ptr_this->client_trigger_->wait();
+		shard->client_trigger->wait();
 
-		while(ptr_this->client_queue_->pop_non_blocking(client_info)==0)
+		while(shard->client_queue->pop_non_blocking(client_info)==0)
 		{
+			// 触发器会合并连续的信号, 队列中仍有请求时唤醒下一个工作线程
+			if(!shard->client_queue->empty())
+				shard->client_trigger->signal();
+
 			ptr_trd->status=1;
 			ptr_trd->sw.start();
 
-			sw_work.start();
-
-			try {
-				if(q_recvbuf(client_info->client_sock, client_info->request_buffer, ptr_this->header_size_)) {
-					ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-							"TCP socket recv header error, size = (%d)!", \
-							ptr_this->header_size_);
-					throw TCP_ERR_SOCKET_RECV;
-				}
-
-				recv_len=ptr_this->server_header(client_info->request_buffer, ptr_this->header_size_);
-				if(recv_len<0) {
-					ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-							"TCP socket server_fun_header error, code = (%d)!", \
-							recv_len);
-					throw TCP_ERR_PACKET_HEADER;
-				}
+			do {
+				sw_work.start();
+				keep_alive=false;
+				replyVector reply;
+
+				try {
+					// 排队过久的请求客户端多半已放弃, 直接回复忙
+					if(ptr_this->queue_expired(client_info))
+						throw TCP_ERR_SERVER_BUSY;
+					client_info->enqueue_time=0;
+
+					// 已过截止时间的请求客户端不再等待, 跳过处理
+					if(ptr_this->request_expired(client_info))
+						throw TCP_ERR_REQUEST_TIMEOUT;
+
+					if(ptr_this->io_model_!=TCP_IO_BLOCKING) {
+						// 请求已由事件线程完整接收
+						recv_len=client_info->request_len;
+					} else {
+						recv_len=ptr_this->recv_blocking(client_info);
+						if(recv_len<0)
+							throw recv_len;
+					}
 
-				if(recv_len>0 && recv_len>client_info->request_buffer_size) {
-					ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-							"TCP socket recv_len (%d) > request_buffer_size (%d)!", \
-							recv_len, \
-							client_info->request_buffer_size);
-					throw TCP_ERR_PACKET_LENGTH;
-				}
+					// 响应缓冲区只在处理期间持有, 发送完即归还; 响应通常很小, 先取最小级别
+					client_info->reply_buffer=ptr_this->buffer_pool_.acquire(q_min(BUFFER_POOL_MIN_SIZE, ptr_this->client_reply_size_), \
+							client_info->reply_buffer_size);
+					if(client_info->reply_buffer==NULL)
+						throw TCP_ERR_SERVER_BUSY;
+
+					if(client_info->stream_len>0) {
+						send_len=ptr_this->process_stream(client_info, recv_len, ptr_trd->for_worker);
+					} else {
+						send_len=ptr_this->server_process_vector(client_info->request_buffer, \
+								recv_len, \
+								client_info->reply_buffer+sizeof(baseHeader), \
+								client_info->reply_buffer_size-sizeof(baseHeader), \
+								reply, \
+								ptr_trd->for_worker);
+
+						// 放不下时换用client_reply_size_大小的缓冲区重新处理一次
+						if(send_len==TCP_ERR_BUFFER_SIZE && client_info->reply_buffer_size<ptr_this->client_reply_size_) {
+							ptr_this->server_reply_done(reply, ptr_trd->for_worker);
+							reply=replyVector();
+
+							ptr_this->buffer_pool_.release(client_info->reply_buffer, client_info->reply_buffer_size);
+							client_info->reply_buffer=ptr_this->buffer_pool_.acquire(ptr_this->client_reply_size_, \
+									client_info->reply_buffer_size);
+							if(client_info->reply_buffer==NULL)
+								throw TCP_ERR_SERVER_BUSY;
+
+							send_len=ptr_this->server_process_vector(client_info->request_buffer, \
+									recv_len, \
+									client_info->reply_buffer+sizeof(baseHeader), \
+									client_info->reply_buffer_size-sizeof(baseHeader), \
+									reply, \
+									ptr_trd->for_worker);
+						}
+					}
+					if(send_len<0||reply.length>0x7fffffff-send_len) {
+						ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
+								"TCP Socket server_fun_process error, code = (%d)!", \
+								send_len);
+						throw send_len<0?send_len:TCP_ERR_DATA_LENGTH;
+					} else {
+						// 分段响应的内容不经过响应缓冲区, 长度不受client_reply_size_限制
+						baseHeader* base_header=reinterpret_cast<baseHeader*>(client_info->reply_buffer);
+						base_header->version=TCP_HEADER_VERSION;
+						base_header->length=send_len+reply.length;
+					}
 
-				if(q_recvbuf(client_info->client_sock, client_info->request_buffer, recv_len)) {
-					ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-							"TCP socket recv content error, size = (%d)!", \
-							recv_len);
-					throw TCP_ERR_SOCKET_RECV;
-				}
+					// 回填请求编号, 客户端据此匹配乱序返回的响应
+					if(send_len>=(int32_t)sizeof(replyParam)) {
+						replyParam* reply_param=reinterpret_cast<replyParam*>(client_info->reply_buffer+sizeof(baseHeader));
+						reply_param->request_id=client_info->request_id;
+					}
 
-				send_len=ptr_this->server_process(client_info->request_buffer, \
-						recv_len, \
-						client_info->reply_buffer+sizeof(baseHeader), \
-						client_info->reply_buffer_size-sizeof(baseHeader), \
-						ptr_trd->for_worker);
-				if(send_len<0) {
-					ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-							"TCP Socket server_fun_process error, code = (%d)!", \
-							send_len);
-					throw send_len;
-				} else {
-					baseHeader* base_header=reinterpret_cast<baseHeader*>(client_info->reply_buffer);
-					base_header->version=TCP_HEADER_VERSION;
-					base_header->length=send_len;
-				}
+					ret=0;
+					if(reply.length>0) {
+						ret=ptr_this->send_vector(client_info, client_info->reply_buffer, send_len+sizeof(baseHeader), reply, \
+								client_info->deadline);
+					} else if(send_len>0) {
+						ret=ptr_this->send_reply(client_info, client_info->reply_buffer, send_len+sizeof(baseHeader), \
+								client_info->deadline);
+					}
+					if(ret) {
+						ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
+								"TCP socket send error, size = (%d)", \
+								send_len+reply.length);
+						throw TCP_ERR_SOCKET_SEND;
+					}
 
-				if(send_len>0 && q_sendbuf(client_info->client_sock, client_info->reply_buffer, send_len+sizeof(baseHeader))) {
+					keep_alive=(ptr_this->keepalive_timeout_>0);
+				} catch(const int32_t errcode) {
+					// 接收中途超时的连接字节流已不完整, 不再回复直接关闭
+					if(errcode!=TCP_ERR_SOCKET_SEND && errcode!=TCP_ERR_SOCKET_TIMEOUT)
+						ptr_this->reply_error(client_info, errcode, client_info->deadline);
+
+					if(errcode==TCP_ERR_SOCKET_TIMEOUT)
+						q_add_and_fetch(&ptr_this->stat_expiredconnections_);
+
+					if(errcode==TCP_ERR_SERVER_BUSY)
+						q_add_and_fetch(&ptr_this->stat_rejectedconnections_);
+					else if(errcode==TCP_ERR_REQUEST_TIMEOUT)
+						q_add_and_fetch(&ptr_this->stat_expiredrequests_);
+					else
+						q_add_and_fetch(&ptr_this->stat_failedconnections_);
 					ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-							"TCP socket send error, size = (%d)", \
-							send_len);
-					throw TCP_ERR_SOCKET_SEND;
+							"Working thread [%s:%d] process error, code = (%d)!", \
+							client_info->client_ip, \
+							client_info->client_port, \
+							errcode); 
 				}
 
-				q_close_socket(client_info->client_sock);
-			} catch(const int32_t errcode) {
-				replyHeader reply_header;
-				reply_header.version=TCP_HEADER_VERSION;
-				reply_header.length=sizeof(replyHeader)-sizeof(uint64_t)-sizeof(int32_t);
-				reply_header.command_type=TCP_DEFAULT_COMMAND_TYPE;
-				reply_header.status=errcode;
-
-				q_sendbuf(client_info->client_sock, (char*)(&reply_header), sizeof(replyHeader));
-				q_close_socket(client_info->client_sock);
-
-				q_add_and_fetch(&ptr_this->stat_failedconnections_);
-				ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-						"Working thread [%s:%d] process error, code = (%d)!", \
-						client_info->client_ip, \
-						client_info->client_port, \
-						errcode); 
+				q_add_and_fetch(&ptr_this->stat_numconnections_);
+				ptr_this->server_reply_done(reply, ptr_trd->for_worker);
+				ptr_this->release_buffers(client_info);
+
+				sw_work.stop();
+				ptr_this->logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
+						"Task (%u) process finshed, which consumed: %dms!", \
+						ptr_this->stat_numconnections_, \
+						sw_work.elapsed_ms());
+			} while(keep_alive && ptr_this->io_model_==TCP_IO_BLOCKING && ptr_this->wait_request(client_info));
+
+			ptr_this->release_inflight();
+
+			// epoll与io_uring模式下keep-alive连接交还事件线程, 由其等待下一个请求
+			if(client_info->owner) {
+				ptr_this->release_client(client_info);
+			} else if(keep_alive && ptr_this->io_model_!=TCP_IO_BLOCKING) {
+				ptr_this->event_resume(client_info);
+			} else {
+				ptr_this->release_client(client_info);
 			}
-
-			q_add_and_fetch(&ptr_this->stat_numconnections_);
-			ptr_this->chunk_queue_->push(client_info);
-
-			sw_work.stop();
-			ptr_this->logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
-					"Task (%u) process finshed, which consumed: %dms!", \
-					ptr_this->stat_numconnections_, \
-					sw_work.elapsed_ms());
 		}
 		ptr_trd->sw.stop();
 	}
@@ -919,6 +1551,8 @@ Q_THREAD_T QTcpServer::send_thread(void* ptr_info)
 
 	int32_t ret=0;
 
+	ptr_this->bind_thread(ptr_trd);
+
 	ptr_trd->flag=1;
 
 	while(!ptr_this->exit_flag_)
@@ -974,7 +1608,7 @@ Q_THREAD_T QTcpServer::send_thread(void* ptr_info)
 				if(fread(&end_mark, sizeof(end_mark), 1, fp_r)!=1)
 					throw -5;
 
-				if(end_mark!=TCP_TAILER_FILE_MARK)
+				if(!check_record_tailer(base_header, ptr_trd->ptr_buf, end_mark))
 					throw -6;
 
 				current_size+=sizeof(baseHeader)+base_header.length+sizeof(end_mark);
@@ -1083,148 +1717,1477 @@ Q_THREAD_T QTcpServer::send_thread(void* ptr_info)
 	return NULL;
 }
 
-int32_t QTcpServer::write_data_file(const char* ptr_file, FILE*& fp_w, const char* ptr_buf, int32_t buf_len)
+clientInfo* QTcpServer::admit_client(shardInfo* shard, Q_SOCKET_T client_sock, const char* client_ip, int32_t client_port)
 {
-	int32_t ret=0;
-	int64_t offset=0;
+	clientInfo* client_info=NULL;
+	const char* reason=NULL;
 
-	baseHeader base_header;
-	base_header.version=TCP_HEADER_VERSION;
-	base_header.length=buf_len;
+	if(q_add_and_fetch(&stat_currconnections_)>(uint32_t)max_clients_) {
+		reason="too many clients";
+	} else if(shard->chunk_queue->pop_non_blocking(client_info)!=0) {
+		reason="no free client slot";
+	}
 
-	file_mutex_.lock();
+	if(reason) {
+		q_sub_and_fetch(&stat_currconnections_);
+		q_add_and_fetch(&stat_rejectedconnections_);
 
-	while(fp_w==NULL) {
-		fp_w=::fopen(ptr_file, "wb");
-		if(NULL!=fp_w)
-			break;
-		q_sleep(1000);
+		reply_busy(client_sock);
+		q_close_socket(client_sock);
+
+		logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"Connection [%s:%d] rejected, %s!", \
+				client_ip, \
+				client_port, \
+				reason);
+		return NULL;
 	}
 
-	offset=::ftell(fp_w);
+	client_info->client_sock=client_sock;
+	strcpy(client_info->client_ip, client_ip);
+	client_info->client_port=client_port;
+	client_info->request_id=0;
+	client_info->owner=NULL;
+	client_info->refs=1;
+	client_info->idle=0;
+	client_info->recv_len=0;
+	client_info->request_len=-1;
+	client_info->zerocopy=0;
+	client_info->zerocopy_sent=0;
+	client_info->zerocopy_done=0;
+
+	return client_info;
+}
 
-	try {
-		if(fwrite(&base_header, sizeof(baseHeader), 1, fp_w)!=1)
-			throw -2;
+bool QTcpServer::acquire_inflight()
+{
+	if(max_inflight_<=0)
+		return true;
 
-		if(fwrite(ptr_buf, buf_len, 1, fp_w)!=1)
-			throw -3;
+	if(q_add_and_fetch(&stat_inflightrequests_)>(uint32_t)max_inflight_) {
+		q_sub_and_fetch(&stat_inflightrequests_);
+		return false;
+	}
 
-		if(fwrite(&TCP_TAILER_FILE_MARK, sizeof(TCP_TAILER_FILE_MARK), 1, fp_w)!=1)
-			throw -4;
+	return true;
+}
 
-		while(::fflush(fp_w)!=0) {
-			Q_INFO("fflush error!");
-			q_sleep(1000);
-		}
-	} catch(const int32_t err) {
-		ret=err;
+void QTcpServer::release_inflight()
+{
+	if(max_inflight_>0)
+		q_sub_and_fetch(&stat_inflightrequests_);
+}
 
-		while(::fseek(fp_w, offset, SEEK_SET)!=0) {
-			Q_INFO("write_data_file fseek (%ld) error!", offset);
-			q_sleep(1000);
-		}
+bool QTcpServer::queue_expired(clientInfo* client_info)
+{
+	if(max_queue_wait_<=0||client_info->enqueue_time==0)
+		return false;
 
-		while(q_change_file_size(fp_w, offset)!=0) {
-			Q_INFO("write_data_file q_change_file_size (%ld) error!", offset);
-			q_sleep(1000);
-		}
+	return QStopwatch::elapsed()/1000-client_info->enqueue_time>max_queue_wait_;
+}
+
+bool QTcpServer::request_expired(clientInfo* client_info)
+{
+	// 阻塞模式下请求尚未接收, 截止时间从接收连接或上一个请求结束时算起
+	return client_info->deadline>0 && QStopwatch::elapsed()/1000>=client_info->deadline;
+}
+
+void QTcpServer::reply_busy(Q_SOCKET_T client_sock)
+{
+	replyHeader reply_header;
+	reply_header.version=TCP_HEADER_VERSION;
+	reply_header.length=sizeof(replyHeader)-sizeof(uint64_t)-sizeof(int32_t);
+	reply_header.request_id=0;
+	memset(reply_header.reserved, 0, sizeof(reply_header.reserved));
+	reply_header.command_type=TCP_DEFAULT_COMMAND_TYPE;
+	reply_header.status=TCP_ERR_SERVER_BUSY;
+
+	// 新连接的发送缓冲区为空, 不阻塞直接写出
+	::send(client_sock, (char*)(&reply_header), sizeof(replyHeader), MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+shardInfo* QTcpServer::attach_shard(threadInfo* ptr_trd)
+{
+	bind_thread(ptr_trd);
+	return shard_info_+ptr_trd->shard_id;
+}
+
+void QTcpServer::bind_thread(threadInfo* ptr_trd)
+{
+	if(ptr_trd->cpu_count>0 && q_set_thread_cpu_set(&ptr_trd->cpu_set)<0) {
+		logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"thread (%d) of shard (%d) bind %d cpus error!", \
+				ptr_trd->id+1, \
+				ptr_trd->shard_id+1, \
+				ptr_trd->cpu_count);
 	}
+}
 
-	file_mutex_.unlock();
+int32_t QTcpServer::thread_cpu_set(const cpu_set_t& group_set, int32_t shard_id, cpu_set_t& cpu_set)
+{
+	int32_t cpus[CPU_SETSIZE];
+	int32_t cpu_num=0;
+	int32_t slice=0;
 
-	return ret;
+	CPU_ZERO(&cpu_set);
+
+	// 线程组未指定CPU集合且不按分片绑定时不绑定
+	if(CPU_COUNT(&group_set)==0 && (!shard_affinity_ || shard_id<0))
+		return 0;
+
+	for(int32_t i=0; i<CPU_SETSIZE && i<q_get_cpu_processors(); ++i)
+	{
+		if(CPU_COUNT(&group_set)==0 || CPU_ISSET(i, &group_set))
+			cpus[cpu_num++]=i;
+	}
+	if(cpu_num==0)
+		return 0;
+
+	// 按分片绑定时每个分片使用线程组CPU列表中连续的一段
+	if(!shard_affinity_ || shard_id<0) {
+		slice=cpu_num;
+		shard_id=0;
+	} else {
+		slice=cpu_num/shard_num_>0?cpu_num/shard_num_:1;
+	}
+
+	for(int32_t i=0; i<slice; ++i)
+		CPU_SET(cpus[(shard_id*slice+i)%cpu_num], &cpu_set);
+
+	return CPU_COUNT(&cpu_set);
 }
 
-int32_t QTcpServer::backup_file(const char* ptr_file, char* ptr_buf, int32_t buf_size)
+void QTcpServer::place_thread(threadInfo* ptr_trd, const cpu_set_t& group_set, int32_t shard_id)
 {
-	if(ptr_file==NULL||ptr_buf==NULL||buf_size<=0)
-		return -1;
+	ptr_trd->cpu_count=thread_cpu_set(group_set, shard_id, ptr_trd->cpu_set);
+	ptr_trd->numa_node=ptr_trd->cpu_count>0?q_get_cpu_set_node(&ptr_trd->cpu_set):-1;
 
-	time_t now=time(NULL);
-	struct tm* ptm=localtime(&now);
+	// 主线程临时迁到该线程的CPU上, 随后为其分配的缓冲区与业务句柄首次写入即落在本地节点
+	if(numa_local_ && ptr_trd->cpu_count>0)
+		q_set_thread_cpu_set(&ptr_trd->cpu_set);
+}
 
-	char bak_name[1<<7]={0};
-	q_snprintf(bak_name, sizeof(bak_name)-1, "%s/%04d-%02d-%02d.snd", data_path_, ptm->tm_year+1900, ptm->tm_mon+1, ptm->tm_mday);
+int32_t QTcpServer::recv_blocking(clientInfo* client_info)
+{
+	int32_t recv_len=0;
+	int32_t ret=0;
 
-	FILE* fp_r=::fopen(ptr_file, "rb");
-	if(fp_r==NULL)
-		return -2;
+	client_info->request_id=0;
+	client_info->stream_len=0;
 
-	FILE* fp_w=::fopen(bak_name, "ab");
-	if(fp_w==NULL) {
-		fclose(fp_r);
-		fp_r=NULL;
-		return -3;
+	ret=recv_deadline(client_info, client_info->header_buffer, header_size_);
+	if(ret<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"TCP socket recv header error, size = (%d)!", \
+				header_size_);
+		return ret;
 	}
 
-	baseHeader base_header;
-	uint64_t end_mark=0;
+	recv_len=prepare_request(client_info);
+	if(recv_len<0)
+		return recv_len;
 
-	uint64_t file_size=QFile::size(ptr_file);
-	uint64_t current_size=0;
+	ret=recv_deadline(client_info, client_info->request_buffer, recv_len);
+	if(ret<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"TCP socket recv content error, size = (%d)!", \
+				recv_len);
+		return ret;
+	}
+
+	if(recv_len>=(int32_t)sizeof(requestParam))
+		client_info->request_id=reinterpret_cast<requestParam*>(client_info->request_buffer)->request_id;
+
+	return recv_len;
+}
 
+int32_t QTcpServer::recv_deadline(clientInfo* client_info, char* ptr_buf, int32_t buf_len)
+{
+	int32_t recv_len=0;
 	int32_t ret=0;
-	try {
-		while(current_size<file_size) {
-			if(::fread(&base_header, sizeof(baseHeader), 1, fp_r)!=1)
-				throw -4;
 
-			if(base_header.length>buf_size)
-				throw -5;
+	while(recv_len<buf_len)
+	{
+		ret=(int32_t)::recv(client_info->client_sock, ptr_buf+recv_len, buf_len-recv_len, 0);
+		if(ret>0) {
+			recv_len+=ret;
+		} else if(ret<0 && errno==EINTR) {
+			continue;
+		} else if(ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+			if(!poll_deadline(client_info->client_sock, POLLIN, client_info->deadline))
+				return request_expired(client_info)?TCP_ERR_SOCKET_TIMEOUT:TCP_ERR_SOCKET_RECV;
+		} else {
+			return TCP_ERR_SOCKET_RECV;
+		}
+	}
 
-			if(::fread(ptr_buf, base_header.length, 1, fp_r)!=1)
-				throw -6;
+	return 0;
+}
 
-			if(::fread(&end_mark, sizeof(end_mark), 1, fp_r)!=1)
-				throw -7;
+int32_t QTcpServer::prepare_request(clientInfo* client_info)
+{
+	int32_t recv_len=0;
 
-			if(end_mark!=TCP_TAILER_FILE_MARK)
-				throw -8;
+	recv_len=server_header(client_info->header_buffer, header_size_);
+	if(recv_len<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"TCP socket server_fun_header error, code = (%d)!", \
+				recv_len);
+		return TCP_ERR_PACKET_HEADER;
+	}
 
-			if(::fwrite(&base_header, sizeof(baseHeader), 1, fp_w)!=1)
-				throw -9;
+	client_info->stream_len=0;
+	if(stream_threshold_>0 && recv_len>stream_threshold_) {
+		// 大请求只先接收首个数据块, 其余部分由process_stream边收边处理
+		client_info->stream_len=recv_len;
+		recv_len=q_min(recv_len, TCP_DEFAULT_STREAM_CHUNK);
+	} else if(recv_len>client_request_size_) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"TCP socket recv_len (%d) > client_request_size (%d)!", \
+				recv_len, \
+				client_request_size_);
+		return TCP_ERR_PACKET_LENGTH;
+	}
 
-			if(::fwrite(ptr_buf, base_header.length, 1, fp_w)!=1)
-				throw -10;
+	// 消息头给出长度后才按大小分级申请缓冲区, 超出内存预算时回复忙
+	buffer_pool_.release(client_info->request_buffer, client_info->request_buffer_size);
+	client_info->request_buffer=buffer_pool_.acquire(q_max(recv_len, 1), client_info->request_buffer_size);
+	if(client_info->request_buffer==NULL) {
+		client_info->request_buffer_size=0;
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"buffer pool exhausted, request size = (%d), pool bytes = (%lu)!", \
+				recv_len, \
+				(unsigned long)buffer_pool_.total_bytes());
+		return TCP_ERR_SERVER_BUSY;
+	}
 
-			if(::fwrite(&end_mark, sizeof(end_mark), 1, fp_w)!=1)
-				throw -11;
+	return recv_len;
+}
 
-			current_size+=sizeof(baseHeader)+base_header.length+sizeof(end_mark);
+void QTcpServer::release_buffers(clientInfo* client_info)
+{
+	buffer_pool_.release(client_info->request_buffer, client_info->request_buffer_size);
+	client_info->request_buffer_size=0;
+	buffer_pool_.release(client_info->reply_buffer, client_info->reply_buffer_size);
+	client_info->reply_buffer_size=0;
+}
+
+int32_t QTcpServer::process_stream(clientInfo* client_info, int32_t recv_len, const void* handle)
+{
+	void* stream=NULL;
+	int32_t chunk_len=0;
+	int32_t ret=0;
+
+	ret=server_stream_begin(client_info->request_buffer, recv_len, client_info->stream_len, stream, handle);
+	if(ret<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"TCP socket server_stream_begin error, code = (%d)!", \
+				ret);
+		return ret;
+	}
+
+	// 有多少处理多少, 不等数据块填满, 网络接收与哈希、写盘交替进行
+	while(recv_len<client_info->stream_len)
+	{
+		chunk_len=q_min_3(client_info->stream_len-recv_len, TCP_DEFAULT_STREAM_CHUNK, client_info->request_buffer_size);
+
+		ret=(int32_t)::recv(client_info->client_sock, client_info->request_buffer, chunk_len, 0);
+		if(ret<0 && errno==EINTR)
+			continue;
+
+		if(ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+			if(poll_deadline(client_info->client_sock, POLLIN, client_info->deadline))
+				continue;
+			ret=-1;
+		}
+
+		if(ret<=0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"TCP socket recv stream error, received (%d) of (%d)!", \
+					recv_len, \
+					client_info->stream_len);
+			server_stream_abort(stream);
+			return request_expired(client_info)?TCP_ERR_SOCKET_TIMEOUT:TCP_ERR_SOCKET_RECV;
+		}
+
+		recv_len+=ret;
+
+		ret=server_stream_data(stream, client_info->request_buffer, ret);
+		if(ret<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"TCP socket server_stream_data error, code = (%d)!", \
+					ret);
+			server_stream_abort(stream);
+			return ret;
 		}
-	} catch(int32_t err) {
-		ret=err;
 	}
 
-	::fclose(fp_w);
-	fp_w=NULL;
+	return server_stream_end(stream, \
+			client_info->reply_buffer+sizeof(baseHeader), \
+			client_info->reply_buffer_size-sizeof(baseHeader), \
+			handle);
+}
 
-	::fclose(fp_r);
-	fp_r=NULL;
+// 接收中与空闲的连接都按各自的截止时间挂在时间轮上, 已在轮上时重新计时
+static inline void event_link(reactorInfo* reactor, clientInfo* client_info)
+{
+	reactor->wheel->add(&client_info->timer, client_info->deadline);
+}
 
-	return ret;
+static inline void event_unlink(reactorInfo* reactor, clientInfo* client_info)
+{
+	reactor->wheel->remove(&client_info->timer);
 }
 
-void QTcpServer::free_server_info()
+Q_THREAD_T QTcpServer::event_thread(void* ptr_info)
 {
-	release();
-	for(int32_t i=0; i<thread_max_; ++i)
+	threadInfo* ptr_trd=reinterpret_cast<threadInfo*>(ptr_info);
+	Q_CHECK_PTR(ptr_trd);
+
+	QTcpServer* ptr_this=reinterpret_cast<QTcpServer*>(ptr_trd->pthis);
+	Q_CHECK_PTR(ptr_this);
+
+	ptr_this->attach_shard(ptr_trd);
+	reactorInfo* reactor=ptr_this->reactor_info_+ptr_trd->id;
+	clientInfo* client_info=NULL;
+	int64_t now=0;
+	int32_t nfds=0;
+	int32_t ret=0;
+
+	ptr_trd->flag=1;
+
+	while(!ptr_this->exit_flag_)
 	{
-		client_trigger_->signal();
+		ptr_trd->status=0;
 
-		while(thread_info_[i].flag!=-1)
-			q_sleep(1);
+		nfds=::epoll_wait(reactor->epoll_fd, reactor->events, reactor->event_size, TCP_DEFAULT_EVENT_TIMEOUT);
+		if(nfds<0) {
+			if(errno!=EINTR) {
+				ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
+						"epoll_wait error, errno = (%d)!", \
+						errno);
+				q_sleep(1);
+			}
+			continue;
+		}
 
-		q_delete_array<char>(thread_info_[i].ptr_buf);
+		ptr_trd->status=1;
+		ptr_trd->sw.start();
 
-		if(thread_info_[i].for_worker!=NULL)
-			server_free(thread_info_[i].for_worker);
+		now=QStopwatch::elapsed()/1000;
+
+		for(int32_t i=0; i<nfds; ++i)
+		{
+			if(reactor->events[i].data.ptr==reactor) {
+				ptr_this->event_rearm(reactor, now);
+				continue;
+			}
+
+			client_info=reinterpret_cast<clientInfo*>(reactor->events[i].data.ptr);
+			if(client_info==NULL) {
+				ptr_this->event_accept(reactor, ptr_trd->id);
+				continue;
+			}
+
+			if(client_info->idle) {
+				// 空闲连接上到达新请求, 截止时间从此刻起算, 覆盖接收、处理与响应
+				client_info->idle=0;
+				client_info->deadline=now+ptr_this->server_timeout_;
+				event_link(reactor, client_info);
+			}
+
+			ret=ptr_this->event_recv(client_info);
+			if(ret==0)
+				continue;
+
+			if(ret==TCP_ERR_SOCKET_CLOSED) {
+				ptr_this->event_close(reactor, client_info, false);
+				continue;
+			}
+
+			if(ret<0) {
+				ptr_this->reply_error(client_info, ret, 0);
+				ptr_this->event_close(reactor, client_info, true);
+				continue;
+			}
+
+			ptr_this->event_dispatch(reactor, client_info, now);
+		}
+
+		ptr_this->event_expire(reactor, QStopwatch::elapsed()/1000);
+
+		ptr_trd->sw.stop();
 	}
 
+	ptr_trd->flag=-1;
+	return NULL;
+}
+
+void QTcpServer::event_accept(reactorInfo* reactor, int32_t reactor_id)
+{
+	Q_SOCKET_T client_sock=TCP_DEFAULT_INVALID_SOCKET;
+	char client_ip[TCP_DEFAULT_IP_SIZE]={0};
+	int32_t client_port=0;
+	shardInfo* shard=shard_info_+reactor->shard_id;
+	clientInfo* client_info=NULL;
+
+	for(;;)
+	{
+		if(q_accept_socket(shard->listen_sock, client_sock, client_ip, client_port)) {
+			if(errno==EINTR)
+				continue;
+			if(errno!=EAGAIN && errno!=EWOULDBLOCK) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"TCP socket accept error, errno = (%d)!", \
+						errno);
+			}
+			break;
+		}
+
+		client_info=admit_client(shard, client_sock, client_ip, client_port);
+		if(client_info==NULL)
+			continue;
+
+		client_info->reactor_id=reactor_id;
+		client_info->deadline=QStopwatch::elapsed()/1000+server_timeout_;
+
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events=EPOLLIN|EPOLLRDHUP;
+		event.data.ptr=client_info;
+
+		if(q_set_nonblocking(client_sock)<0 \
+				|| ::epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_sock, &event)<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"TCP socket [%s:%d] add to epoll error!", \
+					client_ip, \
+					client_port);
+			close_client(client_info);
+			continue;
+		}
+
+		event_link(reactor, client_info);
+
+		logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"---------- Request from [%s:%d] ----------", \
+				client_ip, \
+				client_port);
+	}
+}
+
+int32_t QTcpServer::event_recv(clientInfo* client_info)
+{
+	char* ptr_buf=NULL;
+	int32_t want_len=0;
+	int32_t ret=0;
+
+	for(;;)
+	{
+		ret=event_want(client_info, ptr_buf, want_len);
+		if(ret!=0)
+			return ret;
+
+		ret=(int32_t)::recv(client_info->client_sock, ptr_buf, want_len, 0);
+		if(ret>0) {
+			client_info->recv_len+=ret;
+		} else if(ret==0) {
+			// 请求之间对端关闭属于正常断开
+			if(client_info->request_len<0 && client_info->recv_len==0)
+				return TCP_ERR_SOCKET_CLOSED;
+			return TCP_ERR_SOCKET_RECV;
+		} else if(errno==EINTR) {
+			continue;
+		} else if(errno==EAGAIN || errno==EWOULDBLOCK) {
+			return 0;
+		} else {
+			return TCP_ERR_SOCKET_RECV;
+		}
+	}
+}
+
+int32_t QTcpServer::event_want(clientInfo* client_info, char*& ptr_buf, int32_t& want_len)
+{
+	int32_t ret=0;
+
+	for(;;)
+	{
+		if(client_info->request_len<0) {
+			ptr_buf=client_info->header_buffer+client_info->recv_len;
+			want_len=header_size_-client_info->recv_len;
+		} else {
+			ptr_buf=client_info->request_buffer+client_info->recv_len;
+			want_len=client_info->request_len-client_info->recv_len;
+		}
+
+		if(want_len>0)
+			return 0;
+
+		if(client_info->request_len>=0)
+			return 1;
+
+		// 大请求只在事件线程中接收首个数据块, 其余部分由工作线程边收边处理
+		ret=prepare_request(client_info);
+		if(ret<0)
+			return ret;
+
+		client_info->request_len=ret;
+		client_info->recv_len=0;
+	}
+}
+
+bool QTcpServer::event_dispatch(reactorInfo* reactor, clientInfo* client_info, int64_t now)
+{
+	shardInfo* shard=shard_info_+reactor->shard_id;
+	clientInfo* request_info=NULL;
+
+	if(client_info->request_len>=(int32_t)sizeof(requestParam))
+		client_info->request_id=reinterpret_cast<requestParam*>(client_info->request_buffer)->request_id;
+
+	if(!acquire_inflight()) {
+		// 在途请求超限, 立即回复忙, 请求已完整读出, 连接可继续使用
+		q_add_and_fetch(&stat_rejectedconnections_);
+		reply_error(client_info, TCP_ERR_SERVER_BUSY, 0);
+
+		// 流式请求的剩余部分尚未读出, 连接无法继续使用
+		if(keepalive_timeout_<=0||client_info->stream_len>0) {
+			event_close(reactor, client_info, false);
+			return false;
+		}
+
+		release_buffers(client_info);
+		client_info->recv_len=0;
+		client_info->request_len=-1;
+		client_info->request_id=0;
+		client_info->idle=1;
+		client_info->deadline=now+keepalive_timeout_;
+		event_link(reactor, client_info);
+		return true;
+	}
+
+	event_unlink(reactor, client_info);
+
+	if(client_info->request_id!=0 && keepalive_timeout_>0 && client_info->stream_len==0)
+		request_info=event_split(client_info);
+
+	if(request_info) {
+		// 流水线请求交给工作线程, 连接留在事件线程等待后续请求
+		client_info->idle=1;
+		client_info->deadline=now+keepalive_timeout_;
+		event_link(reactor, client_info);
+	} else if(reactor->epoll_fd>=0) {
+		// 完整请求交给工作线程, 事件线程不再关注该连接
+		::epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client_info->client_sock, NULL);
+	}
+
+	request_info=request_info?request_info:client_info;
+	request_info->enqueue_time=now;
+	shard->client_queue->push(request_info);
+	shard->client_trigger->signal();
+
+	return request_info!=client_info;
+}
+
+void QTcpServer::event_close(reactorInfo* reactor, clientInfo* client_info, bool failed)
+{
+	event_unlink(reactor, client_info);
+
+	// 流水线请求仍持有连接时套接字暂不关闭, 需显式移出epoll池
+	if(reactor->epoll_fd>=0)
+		::epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client_info->client_sock, NULL);
+
+	if(failed) {
+		::shutdown(client_info->client_sock, SHUT_RDWR);
+		q_add_and_fetch(&stat_failedconnections_);
+		q_add_and_fetch(&stat_numconnections_);
+	}
+
+	// io_uring模式下接收仍在途时由关闭读端使其完成, 完成事件到达后再释放连接
+	if(client_info->io_pending) {
+		::shutdown(client_info->client_sock, SHUT_RD);
+		client_info->closing=1;
+		return;
+	}
+
+	release_client(client_info);
+}
+
+clientInfo* QTcpServer::event_split(clientInfo* client_info)
+{
+	clientInfo* request_info=NULL;
+
+	if(shard_info_[client_info->shard_id].chunk_queue->pop_non_blocking(request_info)!=0)
+		return NULL;
+
+	// 请求缓冲区随请求移交, 避免拷贝, 连接接收下一个请求时重新申请
+	request_info->request_buffer=client_info->request_buffer;
+	request_info->request_buffer_size=client_info->request_buffer_size;
+	client_info->request_buffer=NULL;
+	client_info->request_buffer_size=0;
+
+	request_info->client_sock=client_info->client_sock;
+	strcpy(request_info->client_ip, client_info->client_ip);
+	request_info->client_port=client_info->client_port;
+	request_info->reactor_id=client_info->reactor_id;
+	request_info->request_len=client_info->request_len;
+	request_info->request_id=client_info->request_id;
+	request_info->deadline=client_info->deadline;
+	request_info->stream_len=0;
+	request_info->owner=client_info;
+
+	q_add_and_fetch(&client_info->refs);
+
+	client_info->recv_len=0;
+	client_info->request_len=-1;
+	client_info->request_id=0;
+
+	return request_info;
+}
+
+void QTcpServer::event_expire(reactorInfo* reactor, int64_t now)
+{
+	timerNode* node=reactor->wheel->advance(now);
+	timerNode* next=NULL;
+	clientInfo* client_info=NULL;
+
+	// 时间轮只取出到期的连接, 开销与连接总数无关
+	for(; node; node=next)
+	{
+		next=node->next;
+		client_info=reinterpret_cast<clientInfo*>(node->data);
+
+		if(!client_info->idle) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"TCP socket [%s:%d] request timeout (%d)!", \
+					client_info->client_ip, \
+					client_info->client_port, \
+					server_timeout_);
+			q_add_and_fetch(&stat_expiredconnections_);
+			event_close(reactor, client_info, true);
+			continue;
+		}
+
+		// 仍有流水线请求未响应, 顺延空闲超时
+		if(client_info->refs>1) {
+			client_info->deadline=now+keepalive_timeout_;
+			event_link(reactor, client_info);
+			continue;
+		}
+
+		logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"TCP socket [%s:%d] keep-alive timeout (%d)!", \
+				client_info->client_ip, \
+				client_info->client_port, \
+				keepalive_timeout_);
+		event_close(reactor, client_info, false);
+	}
+}
+
+void QTcpServer::event_resume(clientInfo* client_info)
+{
+	reactorInfo* reactor=reactor_info_+client_info->reactor_id;
+	uint64_t one=1;
+
+	client_info->recv_len=0;
+	client_info->request_len=-1;
+	client_info->request_id=0;
+	client_info->stream_len=0;
+
+	reactor->resume_queue->push(client_info);
+	if(::write(reactor->event_fd, &one, sizeof(one))<0 && errno!=EAGAIN) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"eventfd write error, errno = (%d)!", \
+				errno);
+	}
+}
+
+void QTcpServer::event_rearm(reactorInfo* reactor, int64_t now)
+{
+	clientInfo* client_info=NULL;
+	uint64_t count=0;
+
+	// io_uring模式下计数已由环上的读取取走
+	while(reactor->ring==NULL && ::read(reactor->event_fd, &count, sizeof(count))<0 && errno==EINTR);
+
+	while(reactor->resume_queue->pop_non_blocking(client_info)==0)
+	{
+		if(reactor->ring) {
+			client_info->idle=1;
+			client_info->deadline=now+keepalive_timeout_;
+			event_link(reactor, client_info);
+
+			if(uring_recv(reactor, client_info)<0)
+				event_close(reactor, client_info, false);
+			continue;
+		}
+
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events=EPOLLIN|EPOLLRDHUP;
+		event.data.ptr=client_info;
+
+		if(::epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_info->client_sock, &event)<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"TCP socket [%s:%d] rearm epoll error!", \
+					client_info->client_ip, \
+					client_info->client_port);
+			release_client(client_info);
+			continue;
+		}
+
+		client_info->idle=1;
+		client_info->deadline=now+keepalive_timeout_;
+		event_link(reactor, client_info);
+	}
+}
+
+Q_THREAD_T QTcpServer::uring_thread(void* ptr_info)
+{
+	threadInfo* ptr_trd=reinterpret_cast<threadInfo*>(ptr_info);
+	Q_CHECK_PTR(ptr_trd);
+
+	QTcpServer* ptr_this=reinterpret_cast<QTcpServer*>(ptr_trd->pthis);
+	Q_CHECK_PTR(ptr_this);
+
+	shardInfo* shard=ptr_this->attach_shard(ptr_trd);
+	reactorInfo* reactor=ptr_this->reactor_info_+ptr_trd->id;
+	QIoUring* ring=reactor->ring;
+	clientInfo* client_info=NULL;
+	uint64_t user_data=0;
+	int64_t now=0;
+	int32_t res=0;
+	int32_t ret=0;
+
+	// accept、eventfd读取与定时器常驻环上, 各自完成后重新提交
+	reactor->accept_len=sizeof(reactor->accept_addr);
+	if(ring->accept(shard->listen_sock, (struct sockaddr*)&reactor->accept_addr, &reactor->accept_len, TCP_URING_TAG_ACCEPT)<0 \
+			|| ring->read(reactor->event_fd, &reactor->event_count, sizeof(reactor->event_count), 0, TCP_URING_TAG_EVENT)<0 \
+			|| ring->timeout(TCP_DEFAULT_EVENT_TIMEOUT, TCP_URING_TAG_TICK)<0) {
+		ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
+				"io_uring (%d) prepare error!", \
+				ptr_trd->id+1);
+	}
+
+	ptr_trd->flag=1;
+
+	while(!ptr_this->exit_flag_)
+	{
+		ptr_trd->status=0;
+
+		// 上一轮产生的提交项在此一次系统调用全部提交, 同时等待新的完成事件
+		if(ring->submit(1)<0 && errno!=EINTR) {
+			ptr_this->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, ptr_this->log_screen_, \
+					"io_uring_enter error, errno = (%d)!", \
+					errno);
+			q_sleep(1);
+			continue;
+		}
+
+		ptr_trd->status=1;
+		ptr_trd->sw.start();
+
+		now=QStopwatch::elapsed()/1000;
+
+		while(ring->next_completion(user_data, res))
+		{
+			if(user_data==TCP_URING_TAG_ACCEPT) {
+				ptr_this->uring_accept(reactor, ptr_trd->id, res);
+				continue;
+			}
+
+			if(user_data==TCP_URING_TAG_EVENT) {
+				ptr_this->event_rearm(reactor, now);
+				ring->read(reactor->event_fd, &reactor->event_count, sizeof(reactor->event_count), 0, TCP_URING_TAG_EVENT);
+				continue;
+			}
+
+			if(user_data==TCP_URING_TAG_TICK) {
+				// 定时器只用于唤醒, 超时检查在每轮末尾进行
+				ring->timeout(TCP_DEFAULT_EVENT_TIMEOUT, TCP_URING_TAG_TICK);
+				continue;
+			}
+
+			client_info=reinterpret_cast<clientInfo*>(user_data);
+			client_info->io_pending=0;
+
+			// 连接已由超时检查关闭, 等到在途接收完成才能释放
+			if(client_info->closing) {
+				client_info->closing=0;
+				ptr_this->release_client(client_info);
+				continue;
+			}
+
+			if(res==-EINTR||res==-EAGAIN) {
+				ret=ptr_this->uring_recv(reactor, client_info);
+			} else if(res==0 && client_info->request_len<0 && client_info->recv_len==0) {
+				// 请求之间对端关闭属于正常断开
+				ret=TCP_ERR_SOCKET_CLOSED;
+			} else if(res<=0) {
+				ret=TCP_ERR_SOCKET_RECV;
+			} else {
+				if(client_info->idle) {
+					// 空闲连接上到达新请求, 截止时间从此刻起算, 覆盖接收、处理与响应
+					client_info->idle=0;
+					client_info->deadline=now+ptr_this->server_timeout_;
+					event_link(reactor, client_info);
+				}
+
+				client_info->recv_len+=res;
+				ret=ptr_this->uring_recv(reactor, client_info);
+			}
+
+			if(ret==0)
+				continue;
+
+			if(ret==TCP_ERR_SOCKET_CLOSED) {
+				ptr_this->event_close(reactor, client_info, false);
+				continue;
+			}
+
+			if(ret<0) {
+				ptr_this->reply_error(client_info, ret, 0);
+				ptr_this->event_close(reactor, client_info, true);
+				continue;
+			}
+
+			// 连接仍留在事件线程时接着接收下一个消息头
+			if(ptr_this->event_dispatch(reactor, client_info, now) && ptr_this->uring_recv(reactor, client_info)<0)
+				ptr_this->event_close(reactor, client_info, true);
+		}
+
+		ptr_this->event_expire(reactor, QStopwatch::elapsed()/1000);
+
+		ptr_trd->sw.stop();
+	}
+
+	ptr_trd->flag=-1;
+	return NULL;
+}
+
+void QTcpServer::uring_accept(reactorInfo* reactor, int32_t reactor_id, int32_t res)
+{
+	shardInfo* shard=shard_info_+reactor->shard_id;
+	clientInfo* client_info=NULL;
+	char client_ip[TCP_DEFAULT_IP_SIZE]={0};
+	int32_t client_port=0;
+
+	if(res>=0) {
+		sprintf(client_ip, "%s", inet_ntoa(reactor->accept_addr.sin_addr));
+		client_port=reactor->accept_addr.sin_port;
+		client_info=admit_client(shard, res, client_ip, client_port);
+	} else if(res!=-EAGAIN && res!=-EINTR && res!=-ECONNABORTED) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"TCP socket accept error, errno = (%d)!", \
+				-res);
+	}
+
+	if(client_info) {
+		client_info->reactor_id=reactor_id;
+		client_info->deadline=QStopwatch::elapsed()/1000+server_timeout_;
+
+		// 套接字保持非阻塞, 工作线程中的流式接收与发送与epoll模式一致
+		if(q_set_nonblocking(client_info->client_sock)<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"TCP socket [%s:%d] set nonblocking error!", \
+					client_ip, \
+					client_port);
+			close_client(client_info);
+		} else {
+			event_link(reactor, client_info);
+
+			if(uring_recv(reactor, client_info)<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"TCP socket [%s:%d] submit recv error!", \
+						client_ip, \
+						client_port);
+				event_close(reactor, client_info, false);
+			} else {
+				logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"---------- Request from [%s:%d] ----------", \
+						client_ip, \
+						client_port);
+			}
+		}
+	}
+
+	// 每个reactor始终保持一个在途的accept
+	reactor->accept_len=sizeof(reactor->accept_addr);
+	if(reactor->ring->accept(shard->listen_sock, (struct sockaddr*)&reactor->accept_addr, &reactor->accept_len, TCP_URING_TAG_ACCEPT)<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"io_uring submit accept error!");
+	}
+}
+
+int32_t QTcpServer::uring_recv(reactorInfo* reactor, clientInfo* client_info)
+{
+	char* ptr_buf=NULL;
+	int32_t want_len=0;
+	int32_t ret=0;
+
+	ret=event_want(client_info, ptr_buf, want_len);
+	if(ret!=0)
+		return ret;
+
+	// 消息头读入注册过的固定缓冲区, 请求体读入从缓冲池申请的缓冲区
+	if(client_info->request_len<0 && reactor->fixed_buffers) {
+		ret=reactor->ring->read_fixed(client_info->client_sock, ptr_buf, want_len, client_info->slot_id, (uint64_t)(uintptr_t)client_info);
+	} else {
+		ret=reactor->ring->recv(client_info->client_sock, ptr_buf, want_len, (uint64_t)(uintptr_t)client_info);
+	}
+	if(ret<0)
+		return TCP_ERR_SOCKET_RECV;
+
+	client_info->io_pending=1;
+	return 0;
+}
+
+void QTcpServer::reply_error(clientInfo* client_info, int32_t errcode, int64_t deadline)
+{
+	replyHeader reply_header;
+	reply_header.version=TCP_HEADER_VERSION;
+	reply_header.length=sizeof(replyHeader)-sizeof(uint64_t)-sizeof(int32_t);
+	reply_header.request_id=client_info->request_id;
+	memset(reply_header.reserved, 0, sizeof(reply_header.reserved));
+	reply_header.command_type=TCP_DEFAULT_COMMAND_TYPE;
+	reply_header.status=errcode;
+
+	send_reply(client_info, (char*)(&reply_header), sizeof(replyHeader), deadline);
+}
+
+int32_t QTcpServer::send_reply(clientInfo* client_info, const char* ptr_buf, int32_t buf_len, int64_t deadline)
+{
+	clientInfo* conn_info=client_info->owner?client_info->owner:client_info;
+	int32_t send_len=0;
+	int32_t ret=0;
+
+	conn_info->send_mutex->lock();
+	// 每次等待可写都只等到截止时间, 慢速读取的对端无法无限拖长发送
+	while(ret==0 && send_len<buf_len)
+	{
+		ret=(int32_t)::send(client_info->client_sock, ptr_buf+send_len, buf_len-send_len, MSG_NOSIGNAL);
+		if(ret>0) {
+			send_len+=ret;
+			ret=0;
+		} else if(ret<0 && errno==EINTR) {
+			ret=0;
+		} else if(ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+			ret=poll_deadline(client_info->client_sock, POLLOUT, deadline)?0:-1;
+		} else {
+			ret=-1;
+		}
+	}
+	// 发送不完整时字节流已无法恢复, 关闭连接让事件线程感知
+	if(ret<0)
+		::shutdown(client_info->client_sock, SHUT_RDWR);
+	conn_info->send_mutex->unlock();
+
+	return ret;
+}
+
+int32_t QTcpServer::send_vector(clientInfo* client_info, const char* ptr_buf, int32_t buf_len, const replyVector& reply, int64_t deadline)
+{
+	clientInfo* conn_info=client_info->owner?client_info->owner:client_info;
+	struct iovec iov[TCP_REPLY_MAX_SEGMENTS+1];
+	struct msghdr msg;
+	int32_t iov_num=0;
+	int32_t flags=MSG_NOSIGNAL;
+	off_t offset=reply.file_offset;
+	int32_t file_left=reply.file_len;
+	int32_t ret=0;
+
+	iov[iov_num].iov_base=const_cast<char*>(ptr_buf);
+	iov[iov_num++].iov_len=buf_len;
+	for(int32_t i=0; i<reply.segment_num; ++i)
+		iov[iov_num++]=reply.segments[i];
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov=iov;
+	msg.msg_iovlen=iov_num;
+
+	conn_info->send_mutex->lock();
+
+#ifdef SO_ZEROCOPY
+	// 内存段较大时零拷贝发送, 套接字首次使用时开启SO_ZEROCOPY, 不支持则退回普通拷贝
+	if(zerocopy_threshold_>0 && reply.length-reply.file_len>=zerocopy_threshold_ && conn_info->zerocopy>=0) {
+		int32_t one=1;
+		if(conn_info->zerocopy==0)
+			conn_info->zerocopy=(::setsockopt(client_info->client_sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))==0)?1:-1;
+		if(conn_info->zerocopy>0)
+			flags|=MSG_ZEROCOPY;
+	}
+#endif
+
+	while(ret==0 && msg.msg_iovlen>0)
+	{
+		ret=(int32_t)::sendmsg(client_info->client_sock, &msg, flags);
+		if(ret>0) {
+			if(flags&MSG_ZEROCOPY)
+				++conn_info->zerocopy_sent;
+			// 跳过已发送的段, 部分发送的段调整起点
+			while(msg.msg_iovlen>0 && (size_t)ret>=msg.msg_iov->iov_len) {
+				ret-=msg.msg_iov->iov_len;
+				++msg.msg_iov;
+				--msg.msg_iovlen;
+			}
+			if(msg.msg_iovlen>0) {
+				msg.msg_iov->iov_base=reinterpret_cast<char*>(msg.msg_iov->iov_base)+ret;
+				msg.msg_iov->iov_len-=ret;
+			}
+			ret=0;
+		} else if(ret<0 && errno==EINTR) {
+			ret=0;
+		} else if(ret<0 && errno==ENOBUFS && (flags&MSG_ZEROCOPY)) {
+			// 超出optmem限制时本次改用普通发送
+			flags&=~MSG_ZEROCOPY;
+			ret=0;
+		} else if(ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+			ret=poll_deadline(client_info->client_sock, POLLOUT, deadline)?0:-1;
+		} else {
+			ret=-1;
+		}
+	}
+
+	// 文件区间由内核直接从页缓存发送
+	while(ret==0 && file_left>0)
+	{
+		ret=(int32_t)::sendfile(client_info->client_sock, reply.file_fd, &offset, file_left);
+		if(ret>0) {
+			file_left-=ret;
+			ret=0;
+		} else if(ret<0 && errno==EINTR) {
+			ret=0;
+		} else if(ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+			ret=poll_deadline(client_info->client_sock, POLLOUT, deadline)?0:-1;
+		} else {
+			ret=-1;
+		}
+	}
+
+	// 零拷贝的页面在对端确认前仍被内核引用, 等待通知后内存段方可交还服务释放
+	if(ret==0 && (flags&MSG_ZEROCOPY))
+		ret=wait_zerocopy(conn_info, deadline);
+
+	if(ret<0)
+		::shutdown(client_info->client_sock, SHUT_RDWR);
+	conn_info->send_mutex->unlock();
+
+	return ret;
+}
+
+int32_t QTcpServer::wait_zerocopy(clientInfo* conn_info, int64_t deadline)
+{
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))*4];
+	struct msghdr msg;
+	struct cmsghdr* cmsg=NULL;
+	struct sock_extended_err* serr=NULL;
+	int32_t ret=0;
+
+	// 完成通知按发送序号区间[ee_info, ee_data]汇总在错误队列中
+	while((int32_t)(conn_info->zerocopy_sent-conn_info->zerocopy_done)>0)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control=control;
+		msg.msg_controllen=sizeof(control);
+
+		ret=(int32_t)::recvmsg(conn_info->client_sock, &msg, MSG_ERRQUEUE);
+		if(ret<0 && errno==EINTR)
+			continue;
+
+		if(ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+			// 错误队列非空时套接字报告POLLERR
+			if(poll_deadline(conn_info->client_sock, 0, deadline))
+				continue;
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"TCP socket [%s:%d] zerocopy completion timeout!", \
+					conn_info->client_ip, \
+					conn_info->client_port);
+			return -1;
+		}
+
+		if(ret<0)
+			return -1;
+
+		for(cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg))
+		{
+			serr=reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cmsg));
+			if(serr->ee_errno==0 && serr->ee_origin==SO_EE_ORIGIN_ZEROCOPY)
+				conn_info->zerocopy_done=serr->ee_data+1;
+		}
+	}
+#endif
+	return 0;
+}
+
+bool QTcpServer::wait_request(clientInfo* client_info)
+{
+	struct pollfd pfd;
+	char byte=0;
+	int32_t ret=0;
+
+	pfd.fd=client_info->client_sock;
+	pfd.events=POLLIN;
+	pfd.revents=0;
+
+	do {
+		ret=::poll(&pfd, 1, keepalive_timeout_);
+	} while(ret<0 && errno==EINTR);
+
+	if(ret<=0)
+		return false;
+
+	// 可读但读不到数据说明对端已关闭
+	do {
+		ret=(int32_t)::recv(client_info->client_sock, &byte, 1, MSG_PEEK);
+	} while(ret<0 && errno==EINTR);
+
+	// 新请求的截止时间从首个字节到达时起算
+	client_info->deadline=QStopwatch::elapsed()/1000+server_timeout_;
+
+	return ret>0;
+}
+
+void QTcpServer::close_client(clientInfo* client_info)
+{
+	q_close_socket(client_info->client_sock);
+	client_info->client_sock=TCP_DEFAULT_INVALID_SOCKET;
+	client_info->idle=0;
+	client_info->stream_len=0;
+	release_buffers(client_info);
+
+	q_sub_and_fetch(&stat_currconnections_);
+	shard_info_[client_info->shard_id].chunk_queue->push(client_info);
+}
+
+void QTcpServer::release_client(clientInfo* client_info)
+{
+	clientInfo* conn_info=client_info;
+
+	if(client_info->owner) {
+		conn_info=client_info->owner;
+
+		client_info->owner=NULL;
+		client_info->client_sock=TCP_DEFAULT_INVALID_SOCKET;
+		release_buffers(client_info);
+		shard_info_[client_info->shard_id].chunk_queue->push(client_info);
+	}
+
+	if(q_sub_and_fetch(&conn_info->refs)==0)
+		close_client(conn_info);
+}
+
+int32_t QTcpServer::write_data_file(const char* ptr_file, FILE*& fp_w, const char* ptr_buf, int32_t buf_len)
+{
+	int32_t ret=0;
+	int64_t offset=0;
+
+	baseHeader base_header;
+	base_header.version=TCP_HEADER_VERSION;
+	base_header.length=buf_len;
+
+	uint64_t end_mark=record_tailer(base_header, ptr_buf);
+
+	file_mutex_.lock();
+
+	while(fp_w==NULL) {
+		fp_w=::fopen(ptr_file, "wb");
+		if(NULL!=fp_w) {
+			spool_ckp_offset_=0;
+			break;
+		}
+		q_sleep(1000);
+	}
+
+	offset=::ftell(fp_w);
+
+	try {
+		if(fwrite(&base_header, sizeof(baseHeader), 1, fp_w)!=1)
+			throw -2;
+
+		if(fwrite(ptr_buf, buf_len, 1, fp_w)!=1)
+			throw -3;
+
+		if(fwrite(&end_mark, sizeof(end_mark), 1, fp_w)!=1)
+			throw -4;
+
+		while(::fflush(fp_w)!=0) {
+			Q_INFO("fflush error!");
+			q_sleep(1000);
+		}
+
+		// 定期落盘并推进检查点, 重启时只需校验最后不足一个间隔的记录
+		offset=::ftell(fp_w);
+		if((uint64_t)offset>=spool_ckp_offset_+TCP_SPOOL_CHECKPOINT_SIZE && save_data_checkpoint(ptr_file, fp_w, offset)<0)
+			Q_INFO("write_data_file save_data_checkpoint (%ld) error!", offset);
+	} catch(const int32_t err) {
+		ret=err;
+
+		while(::fseek(fp_w, offset, SEEK_SET)!=0) {
+			Q_INFO("write_data_file fseek (%ld) error!", offset);
+			q_sleep(1000);
+		}
+
+		while(q_change_file_size(fp_w, offset)!=0) {
+			Q_INFO("write_data_file q_change_file_size (%ld) error!", offset);
+			q_sleep(1000);
+		}
+	}
+
+	file_mutex_.unlock();
+
+	return ret;
+}
+
+int64_t QTcpServer::recover_data_file(const char* ptr_file)
+{
+	struct stat st;
+	spoolCheckpoint ckp;
+	baseHeader base_header;
+	std::string ckp_file=q_format("%s%s", ptr_file, TCP_SPOOL_CHECKPOINT_SUFFIX);
+	std::vector<char> buf;
+	uint64_t end_mark=0;
+	uint64_t offset=0;
+	uint64_t next=0;
+	int32_t fd=-1;
+
+	if(ptr_file==NULL)
+		return -1;
+
+	fd=::open(ptr_file, O_RDWR);
+	if(fd<0)
+		return -2;
+
+	if(fstat(fd, &st)<0) {
+		::close(fd);
+		return -3;
+	}
+
+	// 检查点属于同一文件且未超出文件长度时从检查点开始, 否则从头校验
+	int32_t ckp_fd=::open(ckp_file.c_str(), O_RDONLY);
+	if(ckp_fd>=0) {
+		if(pread(ckp_fd, &ckp, sizeof(ckp), 0)==(ssize_t)sizeof(ckp) \
+				&&ckp.checksum==crc32c(0, &ckp, sizeof(ckp)-sizeof(ckp.checksum)) \
+				&&ckp.inode==(uint64_t)st.st_ino&&ckp.offset<=(uint64_t)st.st_size)
+			offset=ckp.offset;
+		::close(ckp_fd);
+	}
+
+	while(offset+sizeof(baseHeader)+sizeof(end_mark)<=(uint64_t)st.st_size)
+	{
+		if(pread(fd, &base_header, sizeof(baseHeader), offset)!=(ssize_t)sizeof(baseHeader))
+			break;
+
+		if(base_header.version!=TCP_HEADER_VERSION||base_header.length<0)
+			break;
+
+		next=offset+sizeof(baseHeader)+base_header.length+sizeof(end_mark);
+		if(next>(uint64_t)st.st_size)
+			break;
+
+		buf.resize(base_header.length+1);
+		if(pread(fd, &buf[0], base_header.length, offset+sizeof(baseHeader))!=(ssize_t)base_header.length)
+			break;
+
+		if(pread(fd, &end_mark, sizeof(end_mark), next-sizeof(end_mark))!=(ssize_t)sizeof(end_mark))
+			break;
+
+		if(!check_record_tailer(base_header, &buf[0], end_mark))
+			break;
+
+		offset=next;
+	}
+
+	if(offset<(uint64_t)st.st_size && ftruncate(fd, offset)<0) {
+		::close(fd);
+		return -4;
+	}
+	::close(fd);
+
+	return (int64_t)st.st_size-(int64_t)offset;
+}
+
+int32_t QTcpServer::save_data_checkpoint(const char* ptr_file, FILE* fp_w, uint64_t offset)
+{
+	struct stat st;
+	spoolCheckpoint ckp;
+	std::string ckp_file=q_format("%s%s", ptr_file, TCP_SPOOL_CHECKPOINT_SUFFIX);
+	int32_t fd=-1;
+	int32_t ret=0;
+
+	// 检查点之前的记录须先落盘
+	if(fdatasync(fileno(fp_w))<0||fstat(fileno(fp_w), &st)<0)
+		return -1;
+
+	memset(&ckp, 0, sizeof(ckp));
+	ckp.inode=st.st_ino;
+	ckp.offset=offset;
+	ckp.checksum=crc32c(0, &ckp, sizeof(ckp)-sizeof(ckp.checksum));
+
+	fd=::open(ckp_file.c_str(), O_WRONLY|O_CREAT, 0644);
+	if(fd<0)
+		return -2;
+
+	if(pwrite(fd, &ckp, sizeof(ckp), 0)!=(ssize_t)sizeof(ckp)||fdatasync(fd)<0)
+		ret=-3;
+	::close(fd);
+
+	if(ret==0)
+		spool_ckp_offset_=offset;
+	return ret;
+}
+
+uint64_t QTcpServer::record_tailer(const baseHeader& base_header, const char* ptr_buf)
+{
+	uint32_t crc=crc32c(0, &base_header, sizeof(baseHeader));
+	crc=crc32c(crc, ptr_buf, base_header.length);
+	return ((uint64_t)crc<<32)|TCP_TAILER_CRC_MARK;
+}
+
+bool QTcpServer::check_record_tailer(const baseHeader& base_header, const char* ptr_buf, uint64_t end_mark)
+{
+	if(end_mark==TCP_TAILER_FILE_MARK)
+		return true;
+	return end_mark==record_tailer(base_header, ptr_buf);
+}
+
+int32_t QTcpServer::backup_file(const char* ptr_file, char* ptr_buf, int32_t buf_size)
+{
+	if(ptr_file==NULL||ptr_buf==NULL||buf_size<=0)
+		return -1;
+
+	time_t now=time(NULL);
+	struct tm* ptm=localtime(&now);
+
+	char bak_name[1<<7]={0};
+	q_snprintf(bak_name, sizeof(bak_name)-1, "%s/%04d-%02d-%02d.snd", data_path_, ptm->tm_year+1900, ptm->tm_mon+1, ptm->tm_mday);
+
+	FILE* fp_r=::fopen(ptr_file, "rb");
+	if(fp_r==NULL)
+		return -2;
+
+	FILE* fp_w=::fopen(bak_name, "ab");
+	if(fp_w==NULL) {
+		fclose(fp_r);
+		fp_r=NULL;
+		return -3;
+	}
+
+	baseHeader base_header;
+	uint64_t end_mark=0;
+
+	uint64_t file_size=QFile::size(ptr_file);
+	uint64_t current_size=0;
+
+	int32_t ret=0;
+	try {
+		while(current_size<file_size) {
+			if(::fread(&base_header, sizeof(baseHeader), 1, fp_r)!=1)
+				throw -4;
+
+			if(base_header.length>buf_size)
+				throw -5;
+
+			if(::fread(ptr_buf, base_header.length, 1, fp_r)!=1)
+				throw -6;
+
+			if(::fread(&end_mark, sizeof(end_mark), 1, fp_r)!=1)
+				throw -7;
+
+			if(!check_record_tailer(base_header, ptr_buf, end_mark))
+				throw -8;
+
+			if(::fwrite(&base_header, sizeof(baseHeader), 1, fp_w)!=1)
+				throw -9;
+
+			if(::fwrite(ptr_buf, base_header.length, 1, fp_w)!=1)
+				throw -10;
+
+			if(::fwrite(&end_mark, sizeof(end_mark), 1, fp_w)!=1)
+				throw -11;
+
+			current_size+=sizeof(baseHeader)+base_header.length+sizeof(end_mark);
+		}
+	} catch(int32_t err) {
+		ret=err;
+	}
+
+	::fclose(fp_w);
+	fp_w=NULL;
+
+	::fclose(fp_r);
+	fp_r=NULL;
+
+	return ret;
+}
+
+void QTcpServer::free_server_info()
+{
+	// 工作线程全部退出后才释放继承类资源, 处理中的请求仍在使用其存储对象
+	for(int32_t i=0; i<thread_max_; ++i)
+	{
+		shard_info_[thread_info_[i].shard_id].client_trigger->signal();
+
+		while(thread_info_[i].flag!=-1)
+			q_sleep(1);
+
+		q_delete_array<char>(thread_info_[i].ptr_buf);
+
+		if(thread_info_[i].for_worker!=NULL)
+			server_free(thread_info_[i].for_worker);
+	}
+	release();
+
 	q_delete<threadInfo>(thread_info_);
 }
 
+int32_t QTcpServer::get_server_stats(void* ptr_info, char* buf, int32_t size)
+{
+	QTcpServer* ptr_this=reinterpret_cast<QTcpServer*>(ptr_info);
+	Q_CHECK_PTR(ptr_this);
+
+	int32_t len=0;
+	int32_t ret=0;
+
+	ret=snprintf(buf, size, "uptime:%ld\r\n" \
+			"total_requests:%u\r\n" \
+			"failed_requests:%u\r\n" \
+			"rejected_requests:%u\r\n" \
+			"current_connections:%u\r\n" \
+			"inflight_requests:%u\r\n" \
+			"expired_connections:%u\r\n" \
+			"expired_requests:%u\r\n", \
+			(long)(time(NULL)-ptr_this->stat_starttime_), \
+			ptr_this->stat_numconnections_, \
+			ptr_this->stat_failedconnections_, \
+			ptr_this->stat_rejectedconnections_, \
+			ptr_this->stat_currconnections_, \
+			ptr_this->stat_inflightrequests_, \
+			ptr_this->stat_expiredconnections_, \
+			ptr_this->stat_expiredrequests_);
+	if(ret<0||ret>=size)
+		return -1;
+	len+=ret;
+
+	ret=ptr_this->buffer_pool_.report(buf+len, size-len);
+	if(ret<0)
+		return -2;
+	len+=ret;
+
+	ret=ptr_this->server_stats(buf+len, size-len);
+	if(ret<0)
+		return -3;
+	len+=ret;
+
+	return len;
+}
+
+int32_t QTcpServer::get_disk_usage(void* ptr_info, uint64_t* used_bytes, uint64_t* total_bytes)
+{
+	QTcpServer* ptr_this=reinterpret_cast<QTcpServer*>(ptr_info);
+	Q_CHECK_PTR(ptr_this);
+
+	return ptr_this->server_disk_usage(*used_bytes, *total_bytes);
+}
+
 int32_t QTcpServer::get_thread_state(void* ptr_info)
 {
 	QTcpServer* ptr_this=reinterpret_cast<QTcpServer*>(ptr_info);
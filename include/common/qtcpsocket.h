@@ -14,19 +14,29 @@
 
 #include "qglobal.h"
 #include "qalgorithm.h"
+#include "qbufferpool.h"
 #include "qconfigreader.h"
 #include "qdatetime.h"
 #include "qdir.h"
 #include "qfile.h"
 #include "qfunc.h"
+#include "qiouring.h"
 #include "qlogger.h"
 #include "qmd5.h"
+#include "qlockfreequeue.h"
 #include "qqueue.h"
 #include "qremotemonitor.h"
 #include "qservice.h"
+#include "qtimerwheel.h"
 #include "qvector.h"
 #include "cJSON.h"
 
+#ifndef WIN32
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#endif
+
 Q_BEGIN_NAMESPACE
 
 #define TCP_OK                    (0)
@@ -51,6 +61,9 @@ Q_BEGIN_NAMESPACE
 #define TCP_ERR_BUFFER_SIZE       (-23)
 #define TCP_ERR_OPERATE_TYPE      (-24)
 #define TCP_ERR_DATA_LENGTH       (-25)
+#define TCP_ERR_SOCKET_CLOSED     (-26)
+#define TCP_ERR_SERVER_BUSY       (-27)
+#define TCP_ERR_REQUEST_TIMEOUT   (-28)
 
 #define TCP_DEFAULT_HZ            (10)
 #define TCP_DEFAULT_MIN_HZ        (1)
@@ -63,6 +76,13 @@ Q_BEGIN_NAMESPACE
 #define TCP_DEFAULT_SERVER_PORT	  (8088)
 #define TCP_DEFAULT_MONITOR_PORT  (8078)
 #define TCP_DEFAULT_SERVER_TIMEOUT (10000)
+#define TCP_DEFAULT_KEEPALIVE_TIMEOUT (0)
+#define TCP_DEFAULT_MAX_CLIENTS   (100)
+#define TCP_DEFAULT_MAX_INFLIGHT  (0)
+#define TCP_DEFAULT_MAX_QUEUE_WAIT (0)
+#define TCP_DEFAULT_STREAM_THRESHOLD (0)
+#define TCP_DEFAULT_BUFFER_POOL_BUDGET (256)
+#define TCP_DEFAULT_ZEROCOPY_THRESHOLD (0)
 
 #define TCP_DEFAULT_PROTOCOL_TYPE (1)
 #define TCP_DEFAULT_SOURCE_TYPE   (1)
@@ -71,18 +91,37 @@ Q_BEGIN_NAMESPACE
 
 #define TCP_DEFAULT_INVALID_SOCKET (-1)
 #define TCP_DEFAULT_THREAD_NUM    (1)
+#define TCP_DEFAULT_SHARD_NUM     (1)
 #define TCP_DEFAULT_BUFFER_SIZE   (1<<20)
 #define TCP_DEFAULT_THREAD_TIMEOUT (12000)
 
 #define TCP_DEFAULT_QUEUE_SIZE    (200)
 #define TCP_DEFAULT_REQUEST_SIZE  (3<<20)
 #define TCP_DEFAULT_REPLY_SIZE    (1<<20)
+#define TCP_DEFAULT_MAX_REPLY_SIZE (64<<20)
 #define TCP_DEFAULT_HEADER_SIZE   (12)
+#define TCP_DEFAULT_STREAM_CHUNK  (1<<18)
+#define TCP_REPLY_MAX_SEGMENTS    (8)
 
 #define TCP_DEFAULT_IP_SIZE       (16)
 #define TCP_DEFAULT_NAME_SIZE     (1<<8)
 #define TCP_DEFAULT_PATH_SIZE     (1<<8)
 
+#define TCP_IO_BLOCKING           (0)
+#define TCP_IO_EPOLL              (1)
+#define TCP_IO_URING              (2)
+
+#define TCP_DEFAULT_IO_MODEL      (TCP_IO_BLOCKING)
+#define TCP_DEFAULT_EVENT_SIZE    (1<<10)
+#define TCP_DEFAULT_EVENT_TIMEOUT (100)
+#define TCP_DEFAULT_TIMER_TICK    (10)
+#define TCP_DEFAULT_URING_ENTRIES (4096)
+
+/* io_uring user data of the per-reactor operations, other values are clientInfo pointers */
+#define TCP_URING_TAG_ACCEPT      (1)
+#define TCP_URING_TAG_EVENT       (2)
+#define TCP_URING_TAG_TICK        (3)
+
 #define TCP_DEFAULT_LOG_PATH      ("../log/")
 #define TCP_DEFAULT_LOG_PREFIX	  (NULL)
 #define TCP_DEFAULT_LOG_SIZE      (1<<10)
@@ -90,6 +129,11 @@ Q_BEGIN_NAMESPACE
 
 #define TCP_HEADER_VERSION	  (*(uint64_t*)"YST1.0.0")
 #define TCP_TAILER_FILE_MARK	  (*(uint64_t*)"@#@#@#@#")
+/* spool record tailer: this mark in the low 32 bits, crc32c of header and payload in the high 32 bits */
+#define TCP_TAILER_CRC_MARK	  (*(uint32_t*)"@#C#")
+/* the spool file is synced and its checkpoint advanced every this many bytes */
+#define TCP_SPOOL_CHECKPOINT_SIZE (4<<20)
+#define TCP_SPOOL_CHECKPOINT_SUFFIX (".ckp")
 
 #pragma pack(1)
 
@@ -105,6 +149,12 @@ struct threadInfo {
 	QStopwatch	sw;
 
 	void*		for_worker;
+	int32_t		shard_id;
+
+	/* cpu set the thread is pinned to, cpu_count 0 means not pinned, numa_node -1 if unknown or mixed */
+	cpu_set_t	cpu_set;
+	int32_t		cpu_count;
+	int32_t		numa_node;
 
 	threadInfo() :
 		pthis(NULL),
@@ -114,8 +164,19 @@ struct threadInfo {
 		buf_size(0),
 		ptr_buf(NULL),
 		timeout(TCP_DEFAULT_THREAD_TIMEOUT),
-		for_worker(NULL)
-	{}
+		for_worker(NULL),
+		shard_id(0),
+		cpu_count(0),
+		numa_node(-1)
+	{CPU_ZERO(&cpu_set);}
+};
+
+/* spool checkpoint: records of the spool file below offset were verified and synced */
+struct spoolCheckpoint {
+	uint64_t	inode;
+	uint64_t	offset;
+	/* crc32c of the fields above */
+	uint32_t	checksum;
 };
 
 /* protocol */
@@ -128,13 +189,15 @@ struct baseHeader {
 struct requestParam {
 	uint16_t	protocol_type;
 	uint16_t	source_type;
-	char		reserved[14];
+	uint64_t	request_id;
+	char		reserved[6];
 	uint16_t	command_type;
 };
 
 /* reply param */
 struct replyParam {
-	char		reserved[14];
+	uint64_t	request_id;
+	char		reserved[6];
 	uint16_t	command_type;
 	int32_t		status;
 };
@@ -145,7 +208,8 @@ struct requestHeader {
 	int32_t		length;
 	uint16_t	protocol_type;
 	uint16_t	source_type;
-	char		reserved[14];
+	uint64_t	request_id;
+	char		reserved[6];
 	uint16_t	command_type;
 };
 
@@ -153,18 +217,21 @@ struct requestHeader {
 struct replyHeader {
 	uint64_t	version;
 	int32_t		length;
-	char		reserved[14];
+	uint64_t	request_id;
+	char		reserved[6];
 	uint16_t	command_type;
 	int32_t		status;
 };
 
 /* network reply */
 struct networkReply {
+	uint64_t        request_id;
 	int32_t         status;
 	char*           data;
 	int32_t         length;
 
 	networkReply() :
+		request_id(0),
 		status(0),
 		data(NULL),
 		length(0)
@@ -177,22 +244,181 @@ struct clientInfo {
 	char            client_ip[TCP_DEFAULT_IP_SIZE];
 	int32_t         client_port;
 
+	/* request and reply buffers come from the buffer pool per request, NULL when not held */
+	char            header_buffer[TCP_DEFAULT_HEADER_SIZE];
 	char*           request_buffer;
 	int32_t         request_buffer_size;
 	char*           reply_buffer;
 	int32_t         reply_buffer_size;
+	int32_t         shard_id;
+
+	/* request id, non-zero ids may be pipelined */
+	uint64_t        request_id;
+	/* connection owning this pipelined request, NULL for the connection itself */
+	clientInfo*     owner;
+	/* references held by the reactor or work thread and by pipelined requests */
+	uint32_t        refs;
+	QMutexLock*     send_mutex;
+	/* time entering the client queue in ms, 0 once picked up */
+	int64_t         enqueue_time;
+	/* total length of a streamed request, request_buffer then holds only its first chunk */
+	int32_t         stream_len;
+
+	/* epoll and io_uring modes */
+	int32_t         reactor_id;
+	int8_t          idle;
+	int32_t         recv_len;
+	int32_t         request_len;
+	/* deadline in ms, covers receiving, processing and replying to one request */
+	int64_t         deadline;
+	/* deadline timer on the reactor's timer wheel */
+	timerNode       timer;
+
+	/* io_uring mode, slot_id indexes the registered header buffers */
+	int32_t         slot_id;
+	int8_t          io_pending;
+	int8_t          closing;
+
+	/* MSG_ZEROCOPY state of the connection, 0 not enabled yet, -1 unsupported */
+	int8_t          zerocopy;
+	uint32_t        zerocopy_sent;
+	uint32_t        zerocopy_done;
 
 	clientInfo() :
 		client_sock(TCP_DEFAULT_INVALID_SOCKET),
 		request_buffer(NULL),
 		request_buffer_size(0),
 		reply_buffer(NULL),
-		reply_buffer_size(0)
+		reply_buffer_size(0),
+		shard_id(0),
+		request_id(0),
+		owner(NULL),
+		refs(0),
+		send_mutex(NULL),
+		enqueue_time(0),
+		stream_len(0),
+		reactor_id(0),
+		idle(0),
+		recv_len(0),
+		request_len(-1),
+		deadline(0),
+		slot_id(0),
+		io_pending(0),
+		closing(0),
+		zerocopy(0),
+		zerocopy_sent(0),
+		zerocopy_done(0)
+	{timer.data=this;}
+};
+
+/* queue of client slots, -D__lockfree_queue selects the lock-free ring */
+#ifdef __lockfree_queue
+typedef QLockFreeQueue<clientInfo*> clientQueue;
+#else
+typedef QQueue<clientInfo*> clientQueue;
+#endif
+
+/* shard info */
+struct shardInfo {
+	Q_SOCKET_T      listen_sock;
+	clientQueue*    chunk_queue;
+	clientQueue*    client_queue;
+	QTrigger*       client_trigger;
+	/* all client slots of the shard, by slot_id */
+	clientInfo**    slots;
+	int32_t         slot_num;
+
+	shardInfo() :
+		listen_sock(TCP_DEFAULT_INVALID_SOCKET),
+		chunk_queue(NULL),
+		client_queue(NULL),
+		client_trigger(NULL),
+		slots(NULL),
+		slot_num(0)
+	{}
+};
+
+/* reactor info */
+struct reactorInfo {
+	int32_t         shard_id;
+	int32_t         epoll_fd;
+	struct epoll_event* events;
+	int32_t         event_size;
+	/* keep-alive connections handed back by work threads */
+	int32_t         event_fd;
+	clientQueue*    resume_queue;
+	/* deadlines of receiving and idle keep-alive connections */
+	QTimerWheel*    wheel;
+	/* io_uring mode, the accept and eventfd read in flight fill accept_addr and event_count */
+	QIoUring*       ring;
+	int8_t          fixed_buffers;
+	struct sockaddr_in accept_addr;
+	socklen_t       accept_len;
+	uint64_t        event_count;
+
+	reactorInfo() :
+		shard_id(0),
+		epoll_fd(-1),
+		events(NULL),
+		event_size(0),
+		event_fd(-1),
+		resume_queue(NULL),
+		wheel(NULL),
+		ring(NULL),
+		fixed_buffers(0),
+		accept_len(0),
+		event_count(0)
 	{}
 };
 
 #pragma pack()
 
+/* scatter-gather reply, memory segments and then a file region follow the inline reply */
+struct replyVector {
+	struct iovec    segments[TCP_REPLY_MAX_SEGMENTS];
+	int32_t         segment_num;
+	int32_t         file_fd;
+	int64_t         file_offset;
+	int32_t         file_len;
+	/* bytes of segments and file region */
+	int32_t         length;
+	/* owned by the server, for releasing the segments in server_reply_done */
+	void*           context;
+
+	replyVector() :
+		segment_num(0),
+		file_fd(-1),
+		file_offset(0),
+		file_len(0),
+		length(0),
+		context(NULL)
+	{}
+
+	// 追加内存段, 段须保持有效直至server_reply_done, 段数已满或总长溢出返回-1
+	inline int32_t add(const void* ptr, int32_t len)
+	{
+		if(segment_num>=TCP_REPLY_MAX_SEGMENTS||len<0||len>0x7fffffff-length)
+			return -1;
+		segments[segment_num].iov_base=const_cast<void*>(ptr);
+		segments[segment_num].iov_len=len;
+		++segment_num;
+		length+=len;
+		return 0;
+	}
+
+	// 设置文件区间, 以sendfile发送, 总长溢出返回-1
+	inline int32_t set_file(int32_t fd, int64_t offset, int32_t len)
+	{
+		if(file_fd>=0||len<0||len>0x7fffffff-length)
+			return -1;
+		file_fd=fd;
+		file_offset=offset;
+		file_len=len;
+		length+=len;
+		return 0;
+	}
+};
+
 // TCP通讯客户端
 class QTcpClient : public noncopyable {
 	public:
@@ -226,12 +452,28 @@ class QTcpClient : public noncopyable {
 		// @函数名: 设置操作类型
 		void setOperateType(uint16_t operate_type);
 
+		// @函数名: 设置请求编号, 非0编号的请求可在同一连接上流水线发送, 响应按完成顺序返回
+		void setRequestId(uint64_t request_id);
+
+		// @函数名: 设置是否复用连接
+		void setKeepAlive(bool keep_alive=true);
+
+		// @函数名: 设置可接收的最大响应长度, 分段响应不受服务端响应缓冲区大小限制
+		void setMaxReplySize(int32_t max_reply_size=TCP_DEFAULT_MAX_REPLY_SIZE);
+
 		// @函数名: 发送请求信息
 		int32_t sendRequest(const char* ptr_data, int32_t data_len, const void* ptr_extend=NULL, int32_t extend_len=0);
 
 		// @函数名: 获取响应信息
 		int32_t getReply(networkReply* reply);
 
+		// @函数名: 关闭连接
+		void close();
+
+	private:
+		// @函数名: 检查复用的连接是否仍然可用
+		bool connection_alive();
+
 	protected:
 		/* General */
 		char            server_ip_[16];
@@ -239,16 +481,20 @@ class QTcpClient : public noncopyable {
 		int32_t         server_timeout_;
 		/* networking */
 		Q_SOCKET_T      sock_;
+		bool            keep_alive_;
+		int32_t         pending_;
 		uint64_t	version_;
 		uint16_t	protocol_type_;
 		uint16_t	source_type_;
 		uint16_t	command_type_;
+		uint64_t	request_id_;
 		/* io buffer */
 		uint16_t	operate_type_;
 		char*           request_buffer_;
 		int32_t         request_buffer_size_;
 		char*           reply_buffer_;
 		int32_t         reply_buffer_size_;
+		int32_t         max_reply_size_;
 };
 
 // TCP通讯服务端
@@ -272,13 +518,40 @@ class QTcpServer : public noncopyable {
 		// @函数名: 继承类必须实现的消息头解析函数
 		virtual int32_t server_header(const char* header_buffer, int32_t header_len, const void* handle=NULL)=0;
 
-		// @函数名: 继承类必须实现的消息体解析函数
+		// @函数名: 继承类必须实现的消息体解析函数; reply_buffer先按最小缓冲级别分配, 响应放不下时返回TCP_ERR_BUFFER_SIZE,
+		//          请求会以client_reply_size_大小的缓冲区重新处理一次, 因此须在产生副作用之前判断; 流式请求不会重新处理
 		virtual int32_t server_process(const char* request_buffer, int32_t request_len, char* reply_buffer, int32_t reply_size, \
 				const void* handle=NULL)=0;
 
 		// @函数名: 继承类必须实现的业务逻辑类释放函数
 		virtual int32_t server_free(const void* handle=NULL)=0;
 
+		// @函数名: 分段响应处理函数, 返回写入reply_buffer的长度, 大块内容可追加到reply中免于拷贝, 默认调用server_process
+		virtual int32_t server_process_vector(const char* request_buffer, int32_t request_len, char* reply_buffer, int32_t reply_size, \
+				replyVector& reply, const void* handle=NULL);
+
+		// @函数名: 分段响应发送后(无论成败)的释放函数, 默认关闭文件区间的描述符
+		virtual void server_reply_done(replyVector& reply, const void* handle=NULL);
+
+		// @函数名: 流式请求开始函数, request_buffer为请求首个数据块, 成功时设置stream并返回>=0
+		virtual int32_t server_stream_begin(const char* request_buffer, int32_t buf_len, int32_t request_len, void*& stream, \
+				const void* handle=NULL);
+
+		// @函数名: 流式请求数据块处理函数
+		virtual int32_t server_stream_data(void* stream, const char* ptr_data, int32_t data_len);
+
+		// @函数名: 流式请求结束函数, 释放stream并返回响应长度
+		virtual int32_t server_stream_end(void* stream, char* reply_buffer, int32_t reply_size, const void* handle=NULL);
+
+		// @函数名: 流式请求中止函数, 释放stream
+		virtual void server_stream_abort(void* stream);
+
+		// @函数名: 业务统计函数, 返回写入buf的长度, 附加在监控统计之后, 默认为空
+		virtual int32_t server_stats(char* buf, int32_t size);
+
+		// @函数名: 数据盘用量函数, 监控PING时调用, 返回只读磁盘数, 默认返回-1由监控统计当前目录
+		virtual int32_t server_disk_usage(uint64_t& used_bytes, uint64_t& total_bytes);
+
 		// @函数名: 继承类必须实现的初始化函数
 		virtual int32_t initialize()=0;
 
@@ -298,9 +571,136 @@ class QTcpServer : public noncopyable {
 		// @函数名: 发送线程
 		static Q_THREAD_T send_thread(void* ptr_info);
 
+		// @函数名: 线程加入所属分片, 按分配的CPU集合绑定
+		shardInfo* attach_shard(threadInfo* ptr_trd);
+
+		// @函数名: 将调用线程绑定到为其分配的CPU集合
+		void bind_thread(threadInfo* ptr_trd);
+
+		// @函数名: 计算线程组中某分片线程的CPU集合, 返回CPU数, 0表示不绑定
+		// @参数01: 线程组的CPU集合, 为空表示全部CPU
+		// @参数02: 分片编号, <0表示线程组不分片
+		int32_t thread_cpu_set(const cpu_set_t& group_set, int32_t shard_id, cpu_set_t& cpu_set);
+
+		// @函数名: 为线程分配CPU集合与NUMA节点, numa-local开启时调用线程随之迁移, 以便随后的分配落在该节点
+		void place_thread(threadInfo* ptr_trd, const cpu_set_t& group_set, int32_t shard_id);
+
+		// @函数名: 连接准入检查, 通过时返回空闲客户端结构, 否则回复忙并关闭连接
+		clientInfo* admit_client(shardInfo* shard, Q_SOCKET_T client_sock, const char* client_ip, int32_t client_port);
+
+		// @函数名: 占用一个在途请求名额, 超过max-inflight时返回false
+		bool acquire_inflight();
+
+		// @函数名: 归还在途请求名额
+		void release_inflight();
+
+		// @函数名: 检查请求在队列中的等待是否超过max-queue-wait
+		bool queue_expired(clientInfo* client_info);
+
+		// @函数名: 向尚未分配客户端结构的连接回复忙
+		void reply_busy(Q_SOCKET_T client_sock);
+
+		// @函数名: 检查请求是否已过截止时间, 过期的请求不再处理
+		bool request_expired(clientInfo* client_info);
+
+		// @函数名: 阻塞接收请求, 成功返回请求长度, 失败返回<0的错误码
+		int32_t recv_blocking(clientInfo* client_info);
+
+		// @函数名: 在截止时间内接收指定长度, 成功返回0, 超时返回TCP_ERR_SOCKET_TIMEOUT, 失败返回TCP_ERR_SOCKET_RECV
+		int32_t recv_deadline(clientInfo* client_info, char* ptr_buf, int32_t buf_len);
+
+		// @函数名: 解析已接收的消息头并从缓冲池申请请求缓冲区, 返回本次需接收的长度, 失败返回<0的错误码
+		int32_t prepare_request(clientInfo* client_info);
+
+		// @函数名: 将请求与响应缓冲区归还缓冲池
+		void release_buffers(clientInfo* client_info);
+
+		// @函数名: 监控统计信息输出函数
+		static int32_t get_server_stats(void* ptr_info, char* buf, int32_t size);
+
+		// @函数名: 监控数据盘用量函数
+		static int32_t get_disk_usage(void* ptr_info, uint64_t* used_bytes, uint64_t* total_bytes);
+
+		// @函数名: 边接收边处理超过stream-threshold的请求, 返回响应长度
+		int32_t process_stream(clientInfo* client_info, int32_t recv_len, const void* handle);
+
+		// @函数名: 事件线程(epoll模式下替代通信线程)
+		static Q_THREAD_T event_thread(void* ptr_info);
+
+		// @函数名: 接收新连接并加入epoll池
+		void event_accept(reactorInfo* reactor, int32_t reactor_id);
+
+		// @函数名: 非阻塞接收请求, 完整接收返回1, 需继续等待返回0, 失败返回<0的错误码
+		int32_t event_recv(clientInfo* client_info);
+
+		// @函数名: 计算请求下一段待接收的位置与长度, 完整接收返回1, 需继续接收返回0, 失败返回<0的错误码
+		int32_t event_want(clientInfo* client_info, char*& ptr_buf, int32_t& want_len);
+
+		// @函数名: 将完整接收的请求交给工作线程, 连接仍留在事件线程时返回true
+		bool event_dispatch(reactorInfo* reactor, clientInfo* client_info, int64_t now);
+
+		// @函数名: 事件线程(io_uring模式), 接收与accept以提交项完成, 每轮一次系统调用批量提交
+		static Q_THREAD_T uring_thread(void* ptr_info);
+
+		// @函数名: 处理accept完成事件并重新提交accept
+		void uring_accept(reactorInfo* reactor, int32_t reactor_id, int32_t res);
+
+		// @函数名: 提交连接的下一段接收, 已提交返回0, 请求已完整返回1, 失败返回<0的错误码
+		int32_t uring_recv(reactorInfo* reactor, clientInfo* client_info);
+
+		// @函数名: 将流水线请求移交独立的客户端结构, 连接继续接收后续请求
+		clientInfo* event_split(clientInfo* client_info);
+
+		// @函数名: 关闭事件线程管理的连接
+		void event_close(reactorInfo* reactor, clientInfo* client_info, bool failed);
+
+		// @函数名: 工作线程归还keep-alive连接
+		void event_resume(clientInfo* client_info);
+
+		// @函数名: 将归还的keep-alive连接重新加入epoll池
+		void event_rearm(reactorInfo* reactor, int64_t now);
+
+		// @函数名: 推进时间轮, 关闭超时连接
+		void event_expire(reactorInfo* reactor, int64_t now);
+
+		// @函数名: 发送错误响应, 截止时间为0时只尝试一次不等待
+		void reply_error(clientInfo* client_info, int32_t errcode, int64_t deadline);
+
+		// @函数名: 在截止时间内发送响应, 同一连接上的并发响应互斥发送
+		int32_t send_reply(clientInfo* client_info, const char* ptr_buf, int32_t buf_len, int64_t deadline);
+
+		// @函数名: 以writev/sendmsg发送内联响应与各内存段, 再以sendfile发送文件区间
+		int32_t send_vector(clientInfo* client_info, const char* ptr_buf, int32_t buf_len, const replyVector& reply, int64_t deadline);
+
+		// @函数名: 等待连接上此前零拷贝发送的完成通知, 之后发送的内存方可释放
+		int32_t wait_zerocopy(clientInfo* conn_info, int64_t deadline);
+
+		// @函数名: 阻塞模式下等待keep-alive连接上的下一个请求
+		bool wait_request(clientInfo* client_info);
+
+		// @函数名: 关闭连接并归还客户端结构
+		void close_client(clientInfo* client_info);
+
+		// @函数名: 释放对连接的引用, 最后一个引用释放时关闭连接
+		void release_client(clientInfo* client_info);
+
 		// @函数名: 数据存储函数
 		int32_t write_data_file(const char* ptr_file, FILE*& fp_w, const char* ptr_buf, int32_t buf_len);
 
+		// @函数名: 启动时恢复数据存储文件, 从检查点起逐条校验记录, 截掉第一条不完整或校验失败的记录及其后内容
+		// @参数01: 数据存储文件路径
+		// @返回值: 成功返回截掉的字节数, 失败返回小于0的错误码
+		int64_t recover_data_file(const char* ptr_file);
+
+		// @函数名: 同步数据存储文件并将检查点推进到指定位置
+		int32_t save_data_checkpoint(const char* ptr_file, FILE* fp_w, uint64_t offset);
+
+		// @函数名: 记录尾部, 低32位为标记, 高32位为头部与数据的crc32c
+		static uint64_t record_tailer(const baseHeader& base_header, const char* ptr_buf);
+
+		// @函数名: 校验记录尾部, 兼容不带crc的旧标记
+		static bool check_record_tailer(const baseHeader& base_header, const char* ptr_buf, uint64_t end_mark);
+
 		// @函数名: 数据备份函数
 		int32_t backup_file(const char* ptr_file, char* ptr_buf, int32_t buf_size);
 
@@ -325,6 +725,11 @@ class QTcpServer : public noncopyable {
 		char*           server_name_;
 		uint16_t        server_port_;
 		int32_t         server_timeout_;
+		int32_t         keepalive_timeout_;
+		int32_t         max_clients_;
+		int32_t         max_inflight_;
+		int32_t         max_queue_wait_;
+		int32_t         stream_threshold_;
 		/* threads */
 		threadInfo*     thread_info_;
 		int32_t         thread_max_;
@@ -338,14 +743,23 @@ class QTcpServer : public noncopyable {
 		int32_t         send_buffer_size_;
 		int32_t         send_thread_timeout_;
 		/* networking */
-		Q_SOCKET_T      listen_sock_;
+		int32_t         io_model_;
+		reactorInfo*    reactor_info_;
+		shardInfo*      shard_info_;
+		int32_t         shard_num_;
+		int32_t         shard_affinity_;
+		/* cpu sets of the thread groups, empty means not pinned */
+		cpu_set_t       comm_cpu_set_;
+		cpu_set_t       work_cpu_set_;
+		cpu_set_t       send_cpu_set_;
+		int32_t         numa_local_;
 		int32_t         queue_size_;
 		int32_t         client_request_size_;
 		int32_t         client_reply_size_;
 		int32_t         header_size_;
-		QQueue<clientInfo*>* chunk_queue_;
-		QQueue<clientInfo*>* client_queue_;
-		QTrigger*       client_trigger_;
+		QBufferPool     buffer_pool_;
+		int32_t         buffer_pool_budget_;
+		int32_t         zerocopy_threshold_;
 		/* storage */
 		char*           send_ip_;
 		int32_t         send_port_;
@@ -353,6 +767,8 @@ class QTcpServer : public noncopyable {
 		char*           read_path_;
 		char*           write_path_;
 		FILE*           write_fp_;
+		/* write file offset of the last spool checkpoint */
+		uint64_t        spool_ckp_offset_;
 		QMutexLock      file_mutex_;
 		/* sentinel */
 		QRemoteMonitor* monitor_;
@@ -370,6 +786,10 @@ class QTcpServer : public noncopyable {
 		uint32_t        stat_succconnections_;
 		uint32_t        stat_failedconnections_;
 		uint32_t        stat_rejectedconnections_;
+		uint32_t        stat_currconnections_;
+		uint32_t        stat_inflightrequests_;
+		uint32_t        stat_expiredconnections_;
+		uint32_t        stat_expiredrequests_;
 };
 
 Q_END_NAMESPACE
@@ -0,0 +1,206 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2014 Terry Niu (Beijing, China)
+** Filename:	qtimerwheel.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2014/05/14
+**
+*********************************************************************************************/
+
+#ifndef __QTIMERWHEEL_H_
+#define __QTIMERWHEEL_H_
+
+#include "qglobal.h"
+
+Q_BEGIN_NAMESPACE
+
+// 共4层, 每层64个槽, 可表示的最大间隔为64^4个时间刻度
+#define TIMER_WHEEL_BITS   (6)
+#define TIMER_WHEEL_SIZE   (1<<TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SIZE-1)
+#define TIMER_WHEEL_LEVELS (4)
+#define TIMER_WHEEL_MAX    ((int64_t)1<<(TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS))
+
+/* timer node, embedded in the object it times, prev is NULL when not on the wheel */
+struct timerNode {
+	timerNode*      prev;
+	timerNode*      next;
+	/* expire tick */
+	int64_t         expire;
+	void*           data;
+
+	timerNode() :
+		prev(NULL),
+		next(NULL),
+		expire(0),
+		data(NULL)
+	{}
+};
+
+// 分层时间轮类, 节点侵入式挂在槽位双向链表上, 添加与删除均为O(1);
+// 第0层每个槽对应一个时间刻度, 上层槽位在下层转完一圈时整体下放(cascade);
+// 非线程安全, 由所属线程独占使用
+class QTimerWheel: public noncopyable {
+	public:
+		inline QTimerWheel() :
+			tick_ms_(1),
+			current_(0),
+			count_(0)
+		{
+			for(int32_t i=0; i<TIMER_WHEEL_LEVELS; ++i)
+			{
+				for(int32_t j=0; j<TIMER_WHEEL_SIZE; ++j)
+					slots_[i][j].prev=slots_[i][j].next=&slots_[i][j];
+			}
+		}
+
+		virtual ~QTimerWheel()
+		{}
+
+		// @函数名: 初始化函数
+		// @参数01: 当前时间(毫秒)
+		// @参数02: 时间刻度(毫秒), 到期时间按刻度向上取整
+		inline int32_t init(int64_t now, int32_t tick_ms)
+		{
+			if(tick_ms<=0)
+				return -1;
+			tick_ms_=tick_ms;
+			current_=now/tick_ms_;
+			return 0;
+		}
+
+		// @函数名: 添加定时节点, 节点已在轮上时先移除
+		// @参数01: 定时节点
+		// @参数02: 到期时间(毫秒)
+		inline void add(timerNode* node, int64_t expire)
+		{
+			remove(node);
+			node->expire=(expire+tick_ms_-1)/tick_ms_;
+			place(node);
+			++count_;
+		}
+
+		// @函数名: 移除定时节点, 节点不在轮上时直接返回
+		inline void remove(timerNode* node)
+		{
+			if(node->prev==NULL)
+				return;
+			node->prev->next=node->next;
+			node->next->prev=node->prev;
+			node->prev=node->next=NULL;
+			--count_;
+		}
+
+		// @函数名: 节点是否在轮上
+		static inline bool pending(const timerNode* node)
+		{return node->prev!=NULL;}
+
+		// @函数名: 推进时间轮, 到期节点从轮上摘下并按next串成单链表返回
+		// @参数01: 当前时间(毫秒)
+		// @返回值: 到期节点链表, 处理时需先取next, 节点可在处理中重新添加
+		inline timerNode* advance(int64_t now)
+		{
+			timerNode* head=NULL;
+			timerNode* tail=NULL;
+			timerNode* slot=NULL;
+			int64_t target=now/tick_ms_;
+
+			while(current_<=target)
+			{
+				// 轮上没有节点时直接跳到目标刻度
+				if(count_==0) {
+					current_=target+1;
+					break;
+				}
+
+				if((current_&TIMER_WHEEL_MASK)==0)
+					cascade();
+
+				slot=&slots_[0][current_&TIMER_WHEEL_MASK];
+				while(slot->next!=slot)
+				{
+					timerNode* node=slot->next;
+					remove(node);
+					if(tail)
+						tail->next=node;
+					else
+						head=node;
+					tail=node;
+				}
+
+				++current_;
+			}
+
+			return head;
+		}
+
+		// @函数名: 轮上节点数
+		inline uint32_t size() const
+		{return count_;}
+
+	private:
+		// @函数名: 按到期刻度与当前刻度的间隔选择层与槽位
+		inline void place(timerNode* node)
+		{
+			int64_t expire=node->expire<current_?current_:node->expire;
+			int64_t delta=expire-current_;
+			timerNode* slot=NULL;
+			int32_t level=0;
+
+			// 超出表示范围的节点先挂在顶层最远的槽位, 下放时重新计算
+			if(delta>=TIMER_WHEEL_MAX) {
+				expire=current_+TIMER_WHEEL_MAX-1;
+				delta=TIMER_WHEEL_MAX-1;
+			}
+
+			while(delta>=((int64_t)1<<(TIMER_WHEEL_BITS*(level+1))))
+				++level;
+
+			slot=&slots_[level][(expire>>(TIMER_WHEEL_BITS*level))&TIMER_WHEEL_MASK];
+			node->prev=slot->prev;
+			node->next=slot;
+			slot->prev->next=node;
+			slot->prev=node;
+		}
+
+		// @函数名: 第0层转完一圈, 将上层当前槽位的节点重新放置, 逐层向上直到槽位下标非0
+		inline void cascade()
+		{
+			for(int32_t level=1; level<TIMER_WHEEL_LEVELS; ++level)
+			{
+				int32_t index=(int32_t)((current_>>(TIMER_WHEEL_BITS*level))&TIMER_WHEEL_MASK);
+				timerNode* slot=&slots_[level][index];
+				timerNode* node=NULL;
+
+				// 先整体摘下, 重新放置可能落回同一槽位
+				if(slot->next!=slot) {
+					node=slot->next;
+					slot->prev->next=NULL;
+					slot->prev=slot->next=slot;
+				}
+				while(node)
+				{
+					timerNode* next=node->next;
+					place(node);
+					node=next;
+				}
+
+				if(index!=0)
+					break;
+			}
+		}
+
+	private:
+		int32_t         tick_ms_;
+		/* next tick to expire */
+		int64_t         current_;
+		uint32_t        count_;
+		/* slot heads, circular lists */
+		timerNode       slots_[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+Q_END_NAMESPACE
+
+#endif // __QTIMERWHEEL_H_
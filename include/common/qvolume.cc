@@ -0,0 +1,1021 @@
+#include "qvolume.h"
+#include "qcrc.h"
+#include "qdir.h"
+
+Q_BEGIN_NAMESPACE
+
+int32_t QVolume::init(const char* path, uint32_t vid, uint64_t capacity, bool direct, const volumeMark* mark, \
+		needleVisitor visitor, void* arg)
+{
+	struct stat st;
+	struct timeval tv;
+	volumeHeader header;
+
+	if(path==NULL||capacity<=VOLUME_HEADER_SIZE)
+		return -1;
+
+	path_=path;
+	vid_=vid;
+	capacity_=capacity;
+
+	fd_=::open(path, O_RDWR|O_CREAT, 0644);
+	if(fd_<0)
+		return -2;
+
+	if(fstat(fd_, &st)<0)
+		return -3;
+
+	if(st.st_size==0) {
+		// 按容量预分配磁盘块, 卷文件一次建成, 追加时不再改变文件大小也不再分配块;
+		// 文件系统不支持时退回截断
+		if(fallocate(fd_, 0, 0, capacity_)<0 && ftruncate(fd_, capacity_)<0)
+			return -5;
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, VOLUME_MAGIC, strlen(VOLUME_MAGIC));
+		header.version=VOLUME_VERSION;
+		version_=VOLUME_VERSION;
+		header.vid=vid_;
+		header.capacity=capacity_;
+
+		// 同一编号的卷被移除后可能重建, 以微秒时间区分, 旧检查点位置不会用到新卷上
+		gettimeofday(&tv, NULL);
+		generation_=(uint32_t)((uint64_t)tv.tv_sec*1000000+tv.tv_usec);
+		if(generation_==0)
+			generation_=1;
+		header.generation=generation_;
+		header.sequence=sequence_;
+		header.flags=flags_;
+
+		if(pwrite_all((const char*)&header, sizeof(header), 0)<0)
+			return -4;
+
+		write_offset_=VOLUME_HEADER_SIZE;
+		needle_num_=0;
+	} else {
+		if(pread(fd_, &header, sizeof(header), 0)!=(ssize_t)sizeof(header))
+			return -6;
+
+		if(memcmp(header.magic, VOLUME_MAGIC, strlen(VOLUME_MAGIC))!=0||header.version<VOLUME_VERSION_CRC32 \
+				||header.version>VOLUME_VERSION||header.vid!=vid_)
+			return -7;
+
+		// 已有卷沿用创建时的容量与校验算法, 旧版本卷在压缩时改写为新版本
+		capacity_=header.capacity;
+		version_=header.version;
+		generation_=header.generation;
+		sequence_=header.sequence;
+		flags_=header.flags;
+
+		needle_num_=0;
+		if(mark!=NULL && mark->generation==generation_ && mark->offset>=VOLUME_HEADER_SIZE && mark->offset<=capacity_) {
+			needle_num_=mark->needle_num;
+			if(recover(mark->offset, visitor, arg)<0)
+				return -8;
+		} else {
+			if(recover(VOLUME_HEADER_SIZE, visitor, arg)<0)
+				return -8;
+		}
+	}
+
+	// 直写描述符只用于追加, 头部与读取仍走fd_; 打开失败(如tmpfs)时退回页缓存写入
+	if(direct) {
+		direct_fd_=::open(path, O_RDWR|O_DIRECT);
+		if(direct_fd_>=0 && posix_memalign((void**)&direct_buf_, VOLUME_DIRECT_ALIGN, VOLUME_COPY_SIZE*2)!=0) {
+			direct_buf_=NULL;
+			::close(direct_fd_);
+			direct_fd_=-1;
+		}
+	}
+
+	return 0;
+}
+
+void QVolume::close()
+{
+	if(direct_fd_>=0) {
+		::close(direct_fd_);
+		direct_fd_=-1;
+	}
+
+	if(direct_buf_!=NULL) {
+		free(direct_buf_);
+		direct_buf_=NULL;
+	}
+
+	if(fd_>=0) {
+		::close(fd_);
+		fd_=-1;
+	}
+}
+
+int32_t QVolume::append(uint64_t key, const char* data, uint32_t size, uint64_t& offset, uint16_t flags)
+{
+	needleHeader header;
+	needleFooter footer;
+	char padding[NEEDLE_ALIGN]={0};
+	struct iovec iov[4];
+	uint64_t total=needle_size(size);
+	uint64_t end=0;
+	uint64_t done=0;
+	int32_t iov_cnt=0;
+	int32_t i=0;
+	ssize_t ret=0;
+
+	if(data==NULL&&size>0)
+		return -2;
+
+	if(!fits(size))
+		return -1;
+
+	if(direct_fd_>=0 && (write_offset_&(VOLUME_DIRECT_ALIGN-1))==0)
+		return append_direct(key, data, -1, size, offset, flags);
+
+	// 直写卷中未对齐的needle(由页缓存模式写入的旧卷)同样补齐到对齐边界, 之后的needle即可直写
+	end=needle_end(size);
+
+	memset(&header, 0, sizeof(header));
+	header.magic=NEEDLE_HEADER_MAGIC;
+	header.flags=flags;
+	header.key=key;
+	header.size=size;
+	header.padding=end-write_offset_-total;
+
+	footer.magic=NEEDLE_FOOTER_MAGIC;
+	footer.checksum=data_checksum(0, data, size);
+
+	iov[0].iov_base=&header;
+	iov[0].iov_len=sizeof(header);
+	iov[1].iov_base=const_cast<char*>(data);
+	iov[1].iov_len=size;
+	iov[2].iov_base=&footer;
+	iov[2].iov_len=sizeof(footer);
+	iov[3].iov_base=padding;
+	iov[3].iov_len=total-sizeof(header)-size-sizeof(footer);
+	iov_cnt=4;
+
+	// 头部, 数据, 尾部与填充一次pwritev写入, 不完整时跳过已写部分继续
+	while(done<total)
+	{
+		ret=pwritev(fd_, iov+i, iov_cnt-i, write_offset_+done);
+		if(ret<0 && errno==EINTR)
+			continue;
+		if(ret<=0)
+			return -3;
+
+		done+=ret;
+		while(i<iov_cnt && (size_t)ret>=iov[i].iov_len) {
+			ret-=iov[i].iov_len;
+			++i;
+		}
+		if(i<iov_cnt) {
+			iov[i].iov_base=(char*)iov[i].iov_base+ret;
+			iov[i].iov_len-=ret;
+		}
+	}
+
+	offset=write_offset_;
+	write_offset_=end;
+	buffered_bytes_+=total;
+	++needle_num_;
+	return 0;
+}
+
+int32_t QVolume::append_file(uint64_t key, int32_t in_fd, uint32_t size, uint64_t& offset, uint16_t flags)
+{
+	needleHeader header;
+	needleFooter footer;
+	char tail[sizeof(needleFooter)+NEEDLE_ALIGN]={0};
+	uint64_t total=needle_size(size);
+	uint64_t end=0;
+	uint64_t pos=write_offset_+sizeof(needleHeader);
+	uint32_t left=size;
+	uint32_t checksum=0;
+	ssize_t ret=0;
+
+	if(!fits(size))
+		return -1;
+
+	if(direct_fd_>=0 && (write_offset_&(VOLUME_DIRECT_ALIGN-1))==0)
+		return append_direct(key, NULL, in_fd, size, offset, flags);
+
+	end=needle_end(size);
+
+	char* buf=q_new_array<char>(VOLUME_COPY_SIZE);
+	if(buf==NULL)
+		return -2;
+
+	// 数据分块读入并写到needle数据区, 同时累计校验码
+	while(left>0)
+	{
+		ret=::read(in_fd, buf, left<VOLUME_COPY_SIZE?left:VOLUME_COPY_SIZE);
+		if(ret<0 && errno==EINTR)
+			continue;
+		if(ret<=0||pwrite_all(buf, ret, pos)<0) {
+			q_delete_array<char>(buf);
+			return -3;
+		}
+
+		checksum=data_checksum(checksum, buf, ret);
+		pos+=ret;
+		left-=ret;
+	}
+
+	q_delete_array<char>(buf);
+
+	footer.magic=NEEDLE_FOOTER_MAGIC;
+	footer.checksum=checksum;
+	memcpy(tail, &footer, sizeof(footer));
+
+	if(pwrite_all(tail, write_offset_+total-pos, pos)<0)
+		return -3;
+
+	// 头部最后写入, 数据未写完前扫描不会把该位置当作needle
+	memset(&header, 0, sizeof(header));
+	header.magic=NEEDLE_HEADER_MAGIC;
+	header.flags=flags;
+	header.key=key;
+	header.size=size;
+	header.padding=end-write_offset_-total;
+
+	if(pwrite_all((const char*)&header, sizeof(header), write_offset_)<0)
+		return -3;
+
+	offset=write_offset_;
+	write_offset_=end;
+	buffered_bytes_+=total;
+	++needle_num_;
+	return 0;
+}
+
+int32_t QVolume::append_direct(uint64_t key, const char* data, int32_t in_fd, uint32_t size, uint64_t& offset, uint16_t flags)
+{
+	needleHeader header;
+	needleFooter footer;
+	uint64_t end=needle_end(size);
+	uint64_t total=end-write_offset_;
+	uint64_t data_end=sizeof(needleHeader)+(uint64_t)size;
+	uint64_t pos=0;
+	uint64_t from=0;
+	uint64_t to=0;
+	uint32_t copied=0;
+	uint32_t checksum=0;
+	uint32_t block_len=0;
+	uint32_t fill=0;
+	uint32_t len=0;
+	ssize_t ret=0;
+
+	char* first=direct_buf_;
+	char* block=first;
+
+	memset(&header, 0, sizeof(header));
+	header.magic=NEEDLE_HEADER_MAGIC;
+	header.flags=flags;
+	header.key=key;
+	header.size=size;
+	header.padding=total-needle_size(size);
+
+	footer.magic=NEEDLE_FOOTER_MAGIC;
+	footer.checksum=0;
+
+	// needle按块在对齐缓冲区中拼装: 头部, 数据, 尾部, 补零; 首块含头部, 最后写入,
+	// 数据未写完前扫描不会把该位置当作needle
+	while(pos<total)
+	{
+		block_len=total-pos<VOLUME_COPY_SIZE?total-pos:VOLUME_COPY_SIZE;
+		memset(block, 0, block_len);
+		fill=0;
+
+		if(pos==0) {
+			memcpy(block, &header, sizeof(header));
+			fill=sizeof(header);
+		}
+
+		while(fill<block_len && copied<size)
+		{
+			len=block_len-fill<size-copied?block_len-fill:size-copied;
+			if(data!=NULL) {
+				memcpy(block+fill, data+copied, len);
+			} else {
+				ret=::read(in_fd, block+fill, len);
+				if(ret<0 && errno==EINTR)
+					continue;
+				if(ret<=0)
+					return -3;
+				len=ret;
+			}
+
+			checksum=data_checksum(checksum, block+fill, len);
+			fill+=len;
+			copied+=len;
+		}
+
+		// 尾部可能跨越两个块
+		if(copied==size) {
+			footer.checksum=checksum;
+			from=data_end>pos?data_end:pos;
+			to=data_end+sizeof(footer)<pos+block_len?data_end+sizeof(footer):pos+block_len;
+			if(from<to)
+				memcpy(block+(from-pos), (const char*)&footer+(from-data_end), to-from);
+		}
+
+		if(block!=first||pos+block_len==total) {
+			if(pwrite_direct(block, block_len, write_offset_+pos)<0)
+				return -3;
+		}
+
+		pos+=block_len;
+		block=direct_buf_+VOLUME_COPY_SIZE;
+	}
+
+	if(total>VOLUME_COPY_SIZE && pwrite_direct(first, VOLUME_COPY_SIZE, write_offset_)<0)
+		return -3;
+
+	offset=write_offset_;
+	write_offset_=end;
+	direct_bytes_+=total;
+	++needle_num_;
+	return 0;
+}
+
+int32_t QVolume::read(uint64_t offset, uint64_t key, char* buf, uint32_t size)
+{
+	needleHeader header;
+	needleFooter footer;
+
+	if(buf==NULL||offset<VOLUME_HEADER_SIZE||offset+needle_size(size)>capacity_)
+		return -1;
+
+	if(pread(fd_, &header, sizeof(header), offset)!=(ssize_t)sizeof(header))
+		return -2;
+
+	if(header.magic!=NEEDLE_HEADER_MAGIC||header.key!=key||header.size!=size)
+		return -3;
+
+	if(pread(fd_, buf, size, offset+sizeof(header))!=(ssize_t)size)
+		return -2;
+
+	if(pread(fd_, &footer, sizeof(footer), offset+sizeof(header)+size)!=(ssize_t)sizeof(footer))
+		return -2;
+
+	if(footer.magic!=NEEDLE_FOOTER_MAGIC||footer.checksum!=data_checksum(0, buf, size))
+		return -4;
+
+	return 0;
+}
+
+int32_t QVolume::locate(uint64_t offset, uint64_t key, uint32_t size, uint64_t& data_offset)
+{
+	needleHeader header;
+
+	if(offset<VOLUME_HEADER_SIZE||offset+needle_size(size)>capacity_)
+		return -1;
+
+	if(pread(fd_, &header, sizeof(header), offset)!=(ssize_t)sizeof(header))
+		return -2;
+
+	if(header.magic!=NEEDLE_HEADER_MAGIC||header.key!=key||header.size!=size||(header.flags&NEEDLE_FLAG_DELETED))
+		return -3;
+
+	data_offset=offset+sizeof(header);
+	return 0;
+}
+
+int32_t QVolume::read_volume_header(const char* path, volumeHeader& header)
+{
+	int32_t fd=::open(path, O_RDONLY);
+	if(fd<0)
+		return -1;
+
+	ssize_t ret=pread(fd, &header, sizeof(header), 0);
+	::close(fd);
+
+	if(ret!=(ssize_t)sizeof(header)||memcmp(header.magic, VOLUME_MAGIC, strlen(VOLUME_MAGIC))!=0)
+		return -2;
+	return 0;
+}
+
+int32_t QVolume::read_header(uint64_t offset, needleHeader& header, uint64_t& next)
+{
+	if(offset>=write_offset_)
+		return 1;
+
+	if(pread(fd_, &header, sizeof(header), offset)!=(ssize_t)sizeof(header))
+		return -1;
+
+	if(header.magic!=NEEDLE_HEADER_MAGIC||header.padding>=VOLUME_DIRECT_ALIGN)
+		return -2;
+
+	next=offset+needle_size(header.size)+header.padding;
+	if(next>write_offset_)
+		return -2;
+
+	return 0;
+}
+
+int32_t QVolume::recover(uint64_t offset, needleVisitor visitor, void* arg)
+{
+	needleHeader header;
+	needleFooter footer;
+	needleTombstone tombstone;
+	uint64_t end=0;
+	uint32_t crc=0;
+	uint32_t len=0;
+	char* buf=NULL;
+	int32_t ret=0;
+
+	buf=q_new_array<char>(VOLUME_COPY_SIZE);
+	if(buf==NULL)
+		return -2;
+
+	// 卷文件按容量预先截断, 未写区域全为0, 头部魔数不符即为写入末尾;
+	// 头部完整而其余部分不完整或校验不符的needle为崩溃时未写完, 从它开始截掉
+	while(offset+sizeof(needleHeader)+sizeof(needleFooter)<=capacity_)
+	{
+		if(pread(fd_, &header, sizeof(header), offset)!=(ssize_t)sizeof(header)) {
+			ret=-1;
+			break;
+		}
+		if(header.magic!=NEEDLE_HEADER_MAGIC)
+			break;
+
+		// 直写needle之后补齐到4KB的填充计入needle
+		end=offset+needle_size(header.size)+header.padding;
+		if(header.padding>=VOLUME_DIRECT_ALIGN||end>capacity_) {
+			torn_offset_=offset;
+			break;
+		}
+
+		if(pread(fd_, &footer, sizeof(footer), offset+sizeof(header)+header.size)!=(ssize_t)sizeof(footer)) {
+			ret=-1;
+			break;
+		}
+		if(footer.magic!=NEEDLE_FOOTER_MAGIC) {
+			torn_offset_=offset;
+			break;
+		}
+
+		crc=0;
+		for(uint32_t pos=0; pos<header.size; pos+=len)
+		{
+			len=header.size-pos<VOLUME_COPY_SIZE?header.size-pos:VOLUME_COPY_SIZE;
+			if(pread(fd_, buf, len, offset+sizeof(header)+pos)!=(ssize_t)len) {
+				ret=-1;
+				break;
+			}
+			// 删除标记的数据为被删除needle的位置, 一并交给回调
+			if(pos==0 && (header.flags&NEEDLE_FLAG_DELETED) && header.size==sizeof(tombstone))
+				memcpy(&tombstone, buf, sizeof(tombstone));
+			crc=data_checksum(crc, buf, len);
+		}
+		if(ret<0)
+			break;
+
+		if(footer.checksum!=crc) {
+			torn_offset_=offset;
+			break;
+		}
+
+		if(visitor) {
+			bool named=(header.flags&NEEDLE_FLAG_DELETED) && header.size==sizeof(tombstone);
+			visitor(arg, vid_, generation_, offset, header, named?&tombstone:NULL);
+		}
+
+		++needle_num_;
+		offset=end;
+	}
+	q_delete_array<char>(buf);
+
+	if(ret<0)
+		return ret;
+
+	write_offset_=offset;
+	return 0;
+}
+
+uint32_t QVolume::data_checksum(uint32_t crc, const void* buf, size_t size) const
+{
+	if(version_==VOLUME_VERSION_CRC32)
+		return crc32(crc, buf, size);
+	return crc32c(crc, buf, size);
+}
+
+int32_t QVolume::pwrite_all(const char* buf, uint64_t len, uint64_t offset)
+{
+	return pwrite_fd(fd_, buf, len, offset);
+}
+
+int32_t QVolume::pwrite_direct(const char* buf, uint64_t len, uint64_t offset)
+{
+	return pwrite_fd(direct_fd_, buf, len, offset);
+}
+
+int32_t QVolume::pwrite_fd(int32_t fd, const char* buf, uint64_t len, uint64_t offset)
+{
+	uint64_t done=0;
+	ssize_t ret=0;
+
+	while(done<len)
+	{
+		ret=pwrite(fd, buf+done, len-done, offset+done);
+		if(ret<0 && errno==EINTR)
+			continue;
+		if(ret<=0)
+			return -1;
+		done+=ret;
+	}
+
+	return 0;
+}
+
+QVolumeStore::~QVolumeStore()
+{
+	for(size_t i=0; i<volumes_.size(); ++i)
+	{
+		if(volumes_[i]!=NULL)
+			q_delete<QVolume>(volumes_[i]);
+	}
+	volumes_.clear();
+	q_delete_array<QMutexLock>(disk_mutexes_);
+}
+
+int32_t QVolumeStore::init(const std::vector<std::string>& dirs, uint64_t volume_size, bool direct, \
+		const std::vector<volumeMark>* marks, needleVisitor visitor, void* arg)
+{
+	QVolume* vol=NULL;
+	const volumeMark* mark=NULL;
+	volumeHeader header;
+	/* (sequence, vid), disk */
+	std::vector<std::pair<std::pair<uint64_t, uint32_t>, uint32_t> > vids;
+	struct dirent* entry=NULL;
+	uint32_t vid=0;
+	uint32_t disk=0;
+	char suffix[8]={0};
+
+	if(dirs.empty()||volume_size<=VOLUME_HEADER_SIZE)
+		return -1;
+
+	dirs_=dirs;
+	volume_size_=volume_size;
+	direct_=direct;
+	actives_.assign(dirs_.size(), NULL);
+
+	disk_mutexes_=q_new_array<QMutexLock>(dirs_.size());
+	if(disk_mutexes_==NULL)
+		return -2;
+
+	// 压缩移除的卷留下编号空缺, 按各目录下实际存在的卷文件打开
+	for(disk=0; disk<dirs_.size(); ++disk)
+	{
+		if(!QDir::mkdir(dirs_[disk].c_str()))
+			return -2;
+
+		DIR* dp=::opendir(dirs_[disk].c_str());
+		if(dp==NULL)
+			return -2;
+		while((entry=::readdir(dp))!=NULL)
+		{
+			if(sscanf(entry->d_name, "%u.%7s", &vid, suffix)==2 && vid>0 \
+					&& q_format("%05u.%s", vid, VOLUME_FILE_SUFFIX)==entry->d_name) {
+				// 编号在全部目录间唯一, 重复时说明目录配置有误
+				if(QVolume::read_volume_header(q_format("%s/%s", dirs_[disk].c_str(), entry->d_name).c_str(), header)<0 \
+						||generations_.count(vid)) {
+					::closedir(dp);
+					return -3;
+				}
+				vids.push_back(std::make_pair(std::make_pair(header.sequence, vid), disk));
+				generations_[vid]=header.generation;
+				sequence_=q_max(sequence_, header.sequence);
+			}
+		}
+		::closedir(dp);
+	}
+
+	// 删除标记指明被删除needle的位置, 回放结果与顺序无关, 按创建序号打开只为保持确定;
+	// 未记录序号的旧卷序号为0, 按编号排在前面
+	std::sort(vids.begin(), vids.end());
+
+	for(size_t i=0; i<vids.size(); ++i)
+	{
+		vid=vids[i].first.second;
+		disk=vids[i].second;
+		mark=NULL;
+		for(size_t j=0; marks!=NULL && j<marks->size(); ++j)
+		{
+			if((*marks)[j].vid==vid) {
+				mark=&(*marks)[j];
+				break;
+			}
+		}
+
+		vol=open_volume(vid, disk, volume_size_, direct_, mark, visitor, arg);
+		if(vol==NULL)
+			return -3;
+		if(vid>volumes_.size())
+			volumes_.resize(vid, NULL);
+		volumes_[vid-1]=vol;
+
+		// 压缩写入的卷经页缓存写入且不做补齐, 不作为当前卷
+		if(!(vol->flags()&VOLUME_FLAG_COMPACT))
+			actives_[disk]=vol;
+	}
+
+	// 各目录创建序号最大的卷作为当前卷, 没有卷的目录新建一个
+	for(disk=0; disk<dirs_.size(); ++disk)
+	{
+		if(actives_[disk]!=NULL)
+			continue;
+		vol=add_volume(volume_size_, direct_, disk);
+		if(vol==NULL)
+			return -3;
+		actives_[disk]=vol;
+	}
+
+	return 0;
+}
+
+int32_t QVolumeStore::append(uint32_t disk, uint64_t key, const char* data, uint32_t size, volumeLocation& location, \
+		uint16_t flags, needleVisitor visitor, void* arg)
+{
+	QVolume* vol=NULL;
+	needleHeader header;
+	int32_t ret=0;
+
+	if(disk>=dirs_.size())
+		return -1;
+
+	disk_mutexes_[disk].lock();
+	vol=writable_volume(disk, size);
+	if(vol==NULL) {
+		disk_mutexes_[disk].unlock();
+		return -1;
+	}
+
+	ret=vol->append(key, data, size, location.offset, flags);
+	if(ret==0 && visitor) {
+		memset(&header, 0, sizeof(header));
+		header.magic=NEEDLE_HEADER_MAGIC;
+		header.flags=flags;
+		header.key=key;
+		header.size=size;
+		visitor(arg, vol->vid(), vol->generation(), location.offset, header, \
+				(flags&NEEDLE_FLAG_DELETED) && size==sizeof(needleTombstone)?(const needleTombstone*)data:NULL);
+	}
+	disk_mutexes_[disk].unlock();
+
+	if(ret<0)
+		return -2;
+
+	location.vid=vol->vid();
+	location.size=size;
+	return 0;
+}
+
+int32_t QVolumeStore::append_file(uint32_t disk, uint64_t key, int32_t in_fd, uint32_t size, volumeLocation& location, \
+		needleVisitor visitor, void* arg)
+{
+	QVolume* vol=NULL;
+	needleHeader header;
+	int32_t ret=0;
+
+	if(disk>=dirs_.size())
+		return -1;
+
+	disk_mutexes_[disk].lock();
+	vol=writable_volume(disk, size);
+	if(vol==NULL) {
+		disk_mutexes_[disk].unlock();
+		return -1;
+	}
+
+	ret=vol->append_file(key, in_fd, size, location.offset);
+	if(ret==0 && visitor) {
+		memset(&header, 0, sizeof(header));
+		header.magic=NEEDLE_HEADER_MAGIC;
+		header.key=key;
+		header.size=size;
+		visitor(arg, vol->vid(), vol->generation(), location.offset, header, NULL);
+	}
+	disk_mutexes_[disk].unlock();
+
+	if(ret<0)
+		return -2;
+
+	location.vid=vol->vid();
+	location.size=size;
+	return 0;
+}
+
+int32_t QVolumeStore::read(const volumeLocation& location, uint64_t key, char* buf)
+{
+	QVolume* vol=acquire(location.vid);
+	if(vol==NULL)
+		return -1;
+
+	int32_t ret=vol->read(location.offset, key, buf, location.size);
+	release(vol);
+	return ret;
+}
+
+QVolume* QVolumeStore::acquire(uint32_t vid)
+{
+	QVolume* vol=NULL;
+
+	mutex_.lock();
+	if(vid>0 && vid<=volumes_.size() && volumes_[vid-1]!=NULL) {
+		vol=volumes_[vid-1];
+		++vol->refs_;
+	}
+	mutex_.unlock();
+
+	return vol;
+}
+
+void QVolumeStore::release(QVolume* vol)
+{
+	bool last=false;
+
+	if(vol==NULL)
+		return;
+
+	mutex_.lock();
+	last=(--vol->refs_==0 && vol->removed_);
+	mutex_.unlock();
+
+	if(last)
+		q_delete<QVolume>(vol);
+}
+
+QVolume* QVolumeStore::create_volume(uint64_t capacity, uint32_t disk)
+{
+	QVolume* vol=NULL;
+
+	if(disk>=dirs_.size())
+		return NULL;
+
+	mutex_.lock();
+	vol=add_volume(capacity, false, disk, VOLUME_FLAG_COMPACT);
+	if(vol!=NULL)
+		++vol->refs_;
+	mutex_.unlock();
+
+	return vol;
+}
+
+int32_t QVolumeStore::remove(uint32_t vid)
+{
+	QVolume* vol=NULL;
+	bool last=false;
+
+	mutex_.lock();
+	if(vid==0||vid>volumes_.size()||volumes_[vid-1]==NULL \
+			||std::find(actives_.begin(), actives_.end(), volumes_[vid-1])!=actives_.end()) {
+		mutex_.unlock();
+		return -1;
+	}
+
+	vol=volumes_[vid-1];
+	volumes_[vid-1]=NULL;
+	while(!volumes_.empty() && volumes_.back()==NULL)
+		volumes_.pop_back();
+	generations_.erase(vid);
+
+	// 文件先删除, 仍在读取的描述符保持有效, 空间在关闭后回收
+	::unlink(vol->path().c_str());
+	vol->removed_=true;
+	last=(vol->refs_==0);
+	mutex_.unlock();
+
+	if(last)
+		q_delete<QVolume>(vol);
+	return 0;
+}
+
+uint32_t QVolumeStore::volume_num()
+{
+	uint32_t num=0;
+
+	mutex_.lock();
+	for(size_t i=0; i<volumes_.size(); ++i)
+	{
+		if(volumes_[i]!=NULL)
+			++num;
+	}
+	mutex_.unlock();
+
+	return num;
+}
+
+uint32_t QVolumeStore::generation(uint32_t vid)
+{
+	std::map<uint32_t, uint32_t>::iterator it;
+	uint32_t gen=0;
+
+	mutex_.lock();
+	it=generations_.find(vid);
+	if(it!=generations_.end())
+		gen=it->second;
+	mutex_.unlock();
+
+	return gen;
+}
+
+void QVolumeStore::stats(std::vector<volumeStat>& out)
+{
+	volumeStat stat;
+
+	out.clear();
+
+	mutex_.lock();
+	for(size_t i=0; i<volumes_.size(); ++i)
+	{
+		if(volumes_[i]==NULL)
+			continue;
+		stat.vid=volumes_[i]->vid();
+		stat.disk=volumes_[i]->disk();
+		stat.capacity=volumes_[i]->capacity();
+		stat.used=volumes_[i]->used();
+		stat.active=(actives_[stat.disk]==volumes_[i]);
+		out.push_back(stat);
+	}
+	mutex_.unlock();
+}
+
+bool QVolumeStore::direct()
+{
+	bool ret=false;
+
+	mutex_.lock();
+	for(size_t i=0; i<actives_.size(); ++i)
+	{
+		if(actives_[i]!=NULL && actives_[i]->direct())
+			ret=true;
+	}
+	mutex_.unlock();
+
+	return ret;
+}
+
+std::string QVolumeStore::format_location(const volumeLocation& location)
+{
+	return q_format("%u:%lu:%u", location.vid, location.offset, location.size);
+}
+
+int32_t QVolumeStore::parse_location(const char* str, volumeLocation& location)
+{
+	if(str==NULL||sscanf(str, "%u:%lu:%u", &location.vid, &location.offset, &location.size)!=3)
+		return -1;
+	return 0;
+}
+
+QVolume* QVolumeStore::writable_volume(uint32_t disk, uint32_t size)
+{
+	QVolume* vol=NULL;
+
+	if(actives_[disk]->fits(size))
+		return actives_[disk];
+
+	// 单个needle超过空卷容量时无法写入
+	if(QVolume::needle_size(size)>volume_size_-VOLUME_HEADER_SIZE)
+		return NULL;
+
+	mutex_.lock();
+	vol=add_volume(volume_size_, direct_, disk);
+	if(vol!=NULL)
+		actives_[disk]=vol;
+	mutex_.unlock();
+
+	return vol;
+}
+
+QVolume* QVolumeStore::add_volume(uint64_t capacity, bool direct, uint32_t disk, uint32_t flags)
+{
+	QVolume* vol=NULL;
+	uint32_t vid=1;
+
+	while(vid<=volumes_.size() && volumes_[vid-1]!=NULL)
+		++vid;
+
+	// 编号会被重用, 创建序号只增不减, 重启时据此确定各目录的当前卷
+	vol=open_volume(vid, disk, capacity, direct, NULL, NULL, NULL, sequence_+1, flags);
+	if(vol==NULL)
+		return NULL;
+	++sequence_;
+
+	if(vid>volumes_.size())
+		volumes_.resize(vid, NULL);
+	volumes_[vid-1]=vol;
+	generations_[vid]=vol->generation();
+	return vol;
+}
+
+void QVolumeStore::io_bytes(uint64_t& direct_bytes, uint64_t& buffered_bytes)
+{
+	direct_bytes=0;
+	buffered_bytes=0;
+
+	mutex_.lock();
+	for(size_t i=0; i<volumes_.size(); ++i)
+	{
+		if(volumes_[i]==NULL)
+			continue;
+		direct_bytes+=volumes_[i]->direct_bytes();
+		buffered_bytes+=volumes_[i]->buffered_bytes();
+	}
+	mutex_.unlock();
+}
+
+void QVolumeStore::marks(std::vector<volumeMark>& out)
+{
+	volumeMark mark;
+	uint32_t disk=0;
+
+	out.clear();
+	memset(&mark, 0, sizeof(mark));
+
+	// 持有各目录的写入锁, 追加与追加后的回调不会只完成一半
+	for(disk=0; disk<dirs_.size(); ++disk)
+		disk_mutexes_[disk].lock();
+
+	mutex_.lock();
+	for(size_t i=0; i<volumes_.size(); ++i)
+	{
+		if(volumes_[i]==NULL)
+			continue;
+		mark.vid=volumes_[i]->vid();
+		mark.generation=volumes_[i]->generation();
+		mark.offset=volumes_[i]->used();
+		mark.needle_num=volumes_[i]->needle_num();
+		out.push_back(mark);
+	}
+	mutex_.unlock();
+
+	for(disk=0; disk<dirs_.size(); ++disk)
+		disk_mutexes_[disk].unlock();
+}
+
+int32_t QVolumeStore::sync(const std::vector<volumeMark>& marks)
+{
+	QVolume* vol=NULL;
+	int32_t ret=0;
+
+	// 只同步上次之后有新写入的卷, 已写满的卷只在写满后同步一次
+	for(size_t i=0; i<marks.size(); ++i)
+	{
+		vol=acquire(marks[i].vid);
+		if(vol==NULL)
+			continue;
+
+		if(vol->generation()==marks[i].generation && marks[i].offset>vol->synced_offset_) {
+			if(fdatasync(vol->fd())<0)
+				ret=-1;
+			else
+				vol->synced_offset_=marks[i].offset;
+		}
+		release(vol);
+	}
+
+	return ret;
+}
+
+void QVolumeStore::torn(std::vector<volumeMark>& out)
+{
+	volumeMark mark;
+
+	out.clear();
+	memset(&mark, 0, sizeof(mark));
+
+	mutex_.lock();
+	for(size_t i=0; i<volumes_.size(); ++i)
+	{
+		if(volumes_[i]==NULL||volumes_[i]->torn_offset()==0)
+			continue;
+		mark.vid=volumes_[i]->vid();
+		mark.generation=volumes_[i]->generation();
+		mark.offset=volumes_[i]->torn_offset();
+		mark.needle_num=volumes_[i]->needle_num();
+		out.push_back(mark);
+	}
+	mutex_.unlock();
+}
+
+QVolume* QVolumeStore::open_volume(uint32_t vid, uint32_t disk, uint64_t capacity, bool direct, const volumeMark* mark, \
+		needleVisitor visitor, void* arg, uint64_t sequence, uint32_t flags)
+{
+	QVolume* vol=q_new<QVolume>();
+	if(vol==NULL)
+		return NULL;
+
+	vol->disk_=disk;
+	vol->sequence_=sequence;
+	vol->flags_=flags;
+	if(vol->init(q_format("%s/%05u.%s", dirs_[disk].c_str(), vid, VOLUME_FILE_SUFFIX).c_str(), vid, capacity, \
+				direct, mark, visitor, arg)<0) {
+		q_delete<QVolume>(vol);
+		return NULL;
+	}
+
+	return vol;
+}
+
+Q_END_NAMESPACE
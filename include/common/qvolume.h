@@ -0,0 +1,456 @@
+/********************************************************************************************
+**
+** Copyright (C) 2010-2016 Terry Niu (Beijing, China)
+** Filename:	qvolume.h
+** Author:	TERRY-V
+** Email:	cnbj8607@163.com
+** Support:	http://blog.sina.com.cn/terrynotes
+** Date:	2016/03/08
+**
+*********************************************************************************************/
+
+#ifndef __QVOLUME_H_
+#define __QVOLUME_H_
+
+#include <sys/uio.h>
+
+#include "qglobal.h"
+#include "qfunc.h"
+
+#define VOLUME_MAGIC         ("QVOLUME")
+/* version 2 footers carry crc32c, version 1 volumes (crc32) are still opened and verified */
+#define VOLUME_VERSION       (2)
+#define VOLUME_VERSION_CRC32 (1)
+/* volume header occupies the first page */
+#define VOLUME_HEADER_SIZE   (4096)
+#define VOLUME_FILE_SUFFIX   ("vol")
+#define VOLUME_COPY_SIZE     (1<<16)
+/* O_DIRECT needles start and end on this boundary */
+#define VOLUME_DIRECT_ALIGN  (4096)
+
+/* volume flags */
+#define VOLUME_FLAG_NONE     (0)
+/* written by compaction through the page cache, never takes new needles */
+#define VOLUME_FLAG_COMPACT  (1)
+
+#define NEEDLE_HEADER_MAGIC  (0x4c44454e)
+#define NEEDLE_FOOTER_MAGIC  (0x454c4446)
+#define NEEDLE_ALIGN         (8)
+
+/* needle flags */
+#define NEEDLE_FLAG_NONE     (0)
+/* tombstone: the image with this key was deleted, its data is the needleTombstone it kills */
+#define NEEDLE_FLAG_DELETED  (1)
+
+Q_BEGIN_NAMESPACE
+
+#pragma pack(1)
+
+/* volume file header */
+struct volumeHeader {
+	char            magic[8];
+	uint32_t        version;
+	uint32_t        vid;
+	uint64_t        capacity;
+	/* random per file, tells a recreated volume from an older one with the same vid */
+	uint32_t        generation;
+	/* creation order within the store, 0 for volumes created before it was recorded */
+	uint64_t        sequence;
+	uint32_t        flags;
+	char            reserved[24];
+};
+
+/* data of a tombstone, names the deleted needle so replay does not depend on volume order */
+struct needleTombstone {
+	uint32_t        vid;
+	uint32_t        generation;
+	uint64_t        offset;
+};
+
+/* needle = header + data + footer, padded to NEEDLE_ALIGN, followed by header.padding bytes */
+struct needleHeader {
+	uint32_t        magic;
+	uint16_t        flags;
+	uint16_t        reserved;
+	uint64_t        key;
+	uint32_t        size;
+	/* extra bytes after the aligned needle, used to keep O_DIRECT needles 4KB aligned */
+	uint32_t        padding;
+};
+
+struct needleFooter {
+	uint32_t        magic;
+	/* crc32c of the data, crc32 in version 1 volumes */
+	uint32_t        checksum;
+};
+
+/* checkpointed end of a volume, needles from offset on are not in the checkpoint */
+struct volumeMark {
+	uint32_t        vid;
+	/* the mark only applies to the volume file of this generation */
+	uint32_t        generation;
+	uint64_t        offset;
+	uint64_t        needle_num;
+};
+
+#pragma pack()
+
+/* called for every needle found while recovering a volume or appended, tombstone is NULL for images */
+typedef void (*needleVisitor)(void* arg, uint32_t vid, uint32_t generation, uint64_t offset, const needleHeader& header, \
+		const needleTombstone* tombstone);
+
+/* volume usage snapshot */
+struct volumeStat {
+	uint32_t        vid;
+	uint32_t        disk;
+	uint64_t        capacity;
+	uint64_t        used;
+	/* active volume takes the new needles */
+	bool            active;
+};
+
+/* image location inside a volume store, offset points at the needle header */
+struct volumeLocation {
+	uint32_t        vid;
+	uint64_t        offset;
+	uint32_t        size;
+
+	volumeLocation() :
+		vid(0),
+		offset(0),
+		size(0)
+	{}
+};
+
+// 卷文件类, 图片以needle形式顺序追加到预分配大小的单个大文件中;
+// 追加由调用者串行化, 读取可与追加并发进行;
+// 直写模式下needle按4KB对齐, 在对齐缓冲区中拼装后以O_DIRECT写入, 不占用页缓存
+class QVolume: public noncopyable {
+	public:
+		inline QVolume() :
+			fd_(-1),
+			direct_fd_(-1),
+			direct_buf_(NULL),
+			vid_(0),
+			disk_(0),
+			generation_(0),
+			sequence_(0),
+			flags_(VOLUME_FLAG_NONE),
+			version_(VOLUME_VERSION),
+			capacity_(0),
+			write_offset_(0),
+			synced_offset_(0),
+			torn_offset_(0),
+			needle_num_(0),
+			direct_bytes_(0),
+			buffered_bytes_(0),
+			refs_(0),
+			removed_(false)
+		{}
+
+		virtual ~QVolume()
+		{close();}
+
+		// @函数名: 打开卷文件, 不存在时创建并预分配到指定大小
+		// @参数01: 卷文件路径
+		// @参数02: 卷编号
+		// @参数03: 卷容量(字节)
+		// @参数04: 是否以O_DIRECT写入, 文件系统不支持时退回页缓存写入
+		// @参数05: 检查点位置, 非空时只扫描并校验其后的needle, 否则扫描整个卷;
+		//          校验失败的needle视为写入未完成, 写入位置退回到该needle
+		// @参数06: 扫描到的needle逐个回调
+		// @参数07: 回调参数
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		int32_t init(const char* path, uint32_t vid, uint64_t capacity, bool direct=false, const volumeMark* mark=NULL, \
+				needleVisitor visitor=NULL, void* arg=NULL);
+
+		// @函数名: 关闭卷文件
+		void close();
+
+		// @函数名: 卷剩余空间能否容纳needle
+		inline bool fits(uint32_t size) const
+		{return needle_end(size)<=capacity_;}
+
+		// @函数名: 追加needle, 失败时写入位置不变
+		// @参数01: 图片编号
+		// @参数02: 数据
+		// @参数03: 数据长度
+		// @参数04: 返回needle偏移
+		// @参数05: needle标记
+		// @返回值: 成功返回0, 空间不足返回-1, 其余失败返回小于0的错误码
+		int32_t append(uint64_t key, const char* data, uint32_t size, uint64_t& offset, uint16_t flags=NEEDLE_FLAG_NONE);
+
+		// @函数名: 追加needle, 数据从文件描述符当前位置读取
+		int32_t append_file(uint64_t key, int32_t in_fd, uint32_t size, uint64_t& offset, uint16_t flags=NEEDLE_FLAG_NONE);
+
+		// @函数名: 读取needle数据并校验
+		// @参数01: needle偏移
+		// @参数02: 图片编号
+		// @参数03: 数据缓冲区, 长度不小于size
+		// @参数04: 数据长度
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		int32_t read(uint64_t offset, uint64_t key, char* buf, uint32_t size);
+
+		// @函数名: 校验needle头部并返回数据在卷文件中的偏移, 供sendfile直接发送, 不读取数据也不校验crc
+		// @参数01: needle偏移
+		// @参数02: 图片编号
+		// @参数03: 数据长度
+		// @参数04: 返回数据偏移
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		int32_t locate(uint64_t offset, uint64_t key, uint32_t size, uint64_t& data_offset);
+
+		// @函数名: 读取卷文件头部, 不打开卷
+		static int32_t read_volume_header(const char* path, volumeHeader& header);
+
+		// @函数名: 读取needle头部, 用于顺序遍历已写入的needle
+		// @参数01: needle偏移
+		// @参数02: 返回needle头部
+		// @参数03: 返回下一个needle的偏移
+		// @返回值: 成功返回0, 已到写入末尾返回1, 失败返回小于0的错误码
+		int32_t read_header(uint64_t offset, needleHeader& header, uint64_t& next);
+
+		// @函数名: needle在卷中占用的字节数
+		static inline uint64_t needle_size(uint32_t size)
+		{
+			uint64_t len=sizeof(needleHeader)+(uint64_t)size+sizeof(needleFooter);
+			return (len+NEEDLE_ALIGN-1)&~(uint64_t)(NEEDLE_ALIGN-1);
+		}
+
+		inline int32_t fd() const
+		{return fd_;}
+
+		inline uint32_t vid() const
+		{return vid_;}
+
+		// @函数名: 卷所在目录在卷存储中的序号
+		inline uint32_t disk() const
+		{return disk_;}
+
+		inline uint32_t version() const
+		{return version_;}
+
+		// @函数名: 打开时截掉的未完成needle位置, 没有截断时为0
+		inline uint64_t torn_offset() const
+		{return torn_offset_;}
+
+		inline uint32_t generation() const
+		{return generation_;}
+
+		// @函数名: 卷的创建序号, 在卷存储内单调递增
+		inline uint64_t sequence() const
+		{return sequence_;}
+
+		// @函数名: 卷标记
+		inline uint32_t flags() const
+		{return flags_;}
+
+		inline const std::string& path() const
+		{return path_;}
+
+		inline uint64_t capacity() const
+		{return capacity_;}
+
+		inline uint64_t used() const
+		{return write_offset_;}
+
+		inline uint64_t needle_num() const
+		{return needle_num_;}
+
+		// @函数名: 是否以O_DIRECT写入
+		inline bool direct() const
+		{return direct_fd_>=0;}
+
+		// @函数名: 以O_DIRECT写入的字节数
+		inline uint64_t direct_bytes() const
+		{return direct_bytes_;}
+
+		// @函数名: 经页缓存写入的字节数
+		inline uint64_t buffered_bytes() const
+		{return buffered_bytes_;}
+
+	private:
+		// @函数名: 在当前写入位置追加needle后的结束位置, 直写模式下对齐到VOLUME_DIRECT_ALIGN
+		inline uint64_t needle_end(uint32_t size) const
+		{
+			uint64_t end=write_offset_+needle_size(size);
+			if(direct_fd_>=0)
+				end=(end+VOLUME_DIRECT_ALIGN-1)&~(uint64_t)(VOLUME_DIRECT_ALIGN-1);
+			return end;
+		}
+
+		// @函数名: 以O_DIRECT追加needle, 数据来自data或in_fd(data为NULL时)
+		int32_t append_direct(uint64_t key, const char* data, int32_t in_fd, uint32_t size, uint64_t& offset, uint16_t flags);
+
+		// @函数名: 从指定位置顺序扫描needle并校验数据, 恢复写入位置
+		int32_t recover(uint64_t offset, needleVisitor visitor, void* arg);
+
+		// @函数名: 按卷版本计算数据校验值, 版本1为crc32, 其后为crc32c
+		uint32_t data_checksum(uint32_t crc, const void* buf, size_t size) const;
+
+		// @函数名: 完整写入
+		int32_t pwrite_all(const char* buf, uint64_t len, uint64_t offset);
+
+		// @函数名: 以O_DIRECT完整写入, 缓冲区, 长度与偏移均需对齐
+		int32_t pwrite_direct(const char* buf, uint64_t len, uint64_t offset);
+
+		static int32_t pwrite_fd(int32_t fd, const char* buf, uint64_t len, uint64_t offset);
+
+	private:
+		friend class QVolumeStore;
+
+		int32_t         fd_;
+		/* O_DIRECT descriptor for appends, -1 when writing through the page cache */
+		int32_t         direct_fd_;
+		/* two VOLUME_COPY_SIZE blocks aligned to VOLUME_DIRECT_ALIGN */
+		char*           direct_buf_;
+		uint32_t        vid_;
+		uint32_t        disk_;
+		uint32_t        generation_;
+		uint64_t        sequence_;
+		uint32_t        flags_;
+		uint32_t        version_;
+		uint64_t        capacity_;
+		/* next needle offset */
+		uint64_t        write_offset_;
+		/* needles before this offset were fdatasynced by QVolumeStore::sync */
+		uint64_t        synced_offset_;
+		/* offset of the torn needle dropped by recover, 0 if none */
+		uint64_t        torn_offset_;
+		uint64_t        needle_num_;
+		uint64_t        direct_bytes_;
+		uint64_t        buffered_bytes_;
+		std::string     path_;
+		/* references held through QVolumeStore::acquire, guarded by the store mutex */
+		int32_t         refs_;
+		/* removed from the store, closed when the last reference is released */
+		bool            removed_;
+};
+
+// 卷存储类, 管理一个或多个目录(磁盘)下的卷文件, 每个目录各有一个当前卷与写入锁, 写入不同目录互不阻塞;
+// 当前卷写满后以最小的空闲编号在同一目录新建卷, 卷编号在全部目录间唯一, 图片位置无需记录目录;
+// 压缩后的卷被移除时编号留空, 正在读取的卷在最后一个引用释放后关闭
+class QVolumeStore: public noncopyable {
+	public:
+		inline QVolumeStore() :
+			volume_size_(0),
+			direct_(false),
+			sequence_(0),
+			disk_mutexes_(NULL)
+		{}
+
+		virtual ~QVolumeStore();
+
+		// @函数名: 初始化函数, 按创建序号打开各目录下全部卷文件
+		// @参数01: 卷目录列表, 每个目录一个当前卷
+		// @参数02: 单个卷容量(字节)
+		// @参数03: 是否以O_DIRECT写入
+		// @参数04: 各卷检查点位置, 为空时扫描全部卷
+		// @参数05: 扫描到的needle逐个回调
+		// @参数06: 回调参数
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		int32_t init(const std::vector<std::string>& dirs, uint64_t volume_size, bool direct=false, \
+				const std::vector<volumeMark>* marks=NULL, needleVisitor visitor=NULL, void* arg=NULL);
+
+		// @函数名: 追加图片
+		// @参数01: 目录序号
+		// @参数02: 图片编号
+		// @参数03: 图片数据
+		// @参数04: 数据长度
+		// @参数05: 返回图片位置
+		// @参数06: needle标记
+		// @参数07: 追加成功后在目录写入锁内回调, 供登记索引, 与marks取得的写入位置保持一致
+		// @参数08: 回调参数
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		int32_t append(uint32_t disk, uint64_t key, const char* data, uint32_t size, volumeLocation& location, \
+				uint16_t flags=NEEDLE_FLAG_NONE, needleVisitor visitor=NULL, void* arg=NULL);
+
+		// @函数名: 追加图片, 数据从文件描述符当前位置读取
+		int32_t append_file(uint32_t disk, uint64_t key, int32_t in_fd, uint32_t size, volumeLocation& location, \
+				needleVisitor visitor=NULL, void* arg=NULL);
+
+		// @函数名: 按位置读取图片
+		int32_t read(const volumeLocation& location, uint64_t key, char* buf);
+
+		// @函数名: 获取卷并增加引用, 不存在返回NULL, 用完须调用release
+		QVolume* acquire(uint32_t vid);
+
+		// @函数名: 释放卷引用, 已移除的卷在最后一个引用释放后关闭
+		void release(QVolume* vol);
+
+		// @函数名: 在指定目录新建只用于压缩写入的卷, 不参与新图片追加, 经页缓存写入, needle不做4KB补齐
+		// @参数01: 卷容量(字节)
+		// @参数02: 目录序号
+		// @返回值: 成功返回已加引用的卷, 失败返回NULL
+		QVolume* create_volume(uint64_t capacity, uint32_t disk);
+
+		// @函数名: 移除卷并删除卷文件, 当前卷不可移除
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		int32_t remove(uint32_t vid);
+
+		// @函数名: 卷个数
+		uint32_t volume_num();
+
+		// @函数名: 目录个数
+		inline uint32_t disk_num() const
+		{return dirs_.size();}
+
+		// @函数名: 卷的创建标识, 卷不存在返回0; 初始化扫描期间对尚未打开的卷同样有效
+		uint32_t generation(uint32_t vid);
+
+		// @函数名: 各卷使用情况
+		void stats(std::vector<volumeStat>& out);
+
+		// @函数名: 当前卷是否以O_DIRECT写入
+		bool direct();
+
+		// @函数名: 获取各卷当前写入位置, 用于检查点
+		void marks(std::vector<volumeMark>& out);
+
+		// @函数名: 将各卷写入位置之前的数据落盘, 检查点写入前调用, 重启时只需校验检查点之后的needle
+		// @参数01: marks取得的写入位置
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		int32_t sync(const std::vector<volumeMark>& marks);
+
+		// @函数名: 打开时截掉了未完成needle的卷, offset为截断位置
+		void torn(std::vector<volumeMark>& out);
+
+		// @函数名: 统计以O_DIRECT和经页缓存写入的字节数
+		void io_bytes(uint64_t& direct_bytes, uint64_t& buffered_bytes);
+
+		// @函数名: 位置转换为"vid:offset:size"字符串
+		static std::string format_location(const volumeLocation& location);
+
+		// @函数名: 解析"vid:offset:size"字符串
+		static int32_t parse_location(const char* str, volumeLocation& location);
+
+	private:
+		// @函数名: 取目录下可容纳needle的当前卷, 空间不足时新建下一个卷, 须持有该目录的写入锁
+		QVolume* writable_volume(uint32_t disk, uint32_t size);
+
+		// @函数名: 打开或创建指定编号的卷, 创建序号与卷标记只用于新建的卷, 已有卷从卷头读取
+		QVolume* open_volume(uint32_t vid, uint32_t disk, uint64_t capacity, bool direct, const volumeMark* mark=NULL, \
+				needleVisitor visitor=NULL, void* arg=NULL, uint64_t sequence=0, uint32_t flags=VOLUME_FLAG_NONE);
+
+		// @函数名: 在指定目录新建卷并登记, 编号取最小的空闲编号, 须持有mutex_
+		QVolume* add_volume(uint64_t capacity, bool direct, uint32_t disk, uint32_t flags=VOLUME_FLAG_NONE);
+
+	private:
+		std::vector<std::string>        dirs_;
+		uint64_t                        volume_size_;
+		bool                            direct_;
+		/* index is vid-1, NULL for removed volumes */
+		std::vector<QVolume*>           volumes_;
+		/* generation of every volume, filled before the volumes are opened */
+		std::map<uint32_t, uint32_t>    generations_;
+		/* creation sequence of the newest volume */
+		uint64_t                        sequence_;
+		/* active volume per directory, changed holding both its disk mutex and mutex_ */
+		std::vector<QVolume*>           actives_;
+		/* serializes the appends to the active volume of each directory */
+		QMutexLock*                     disk_mutexes_;
+		QMutexLock                      mutex_;
+};
+
+Q_END_NAMESPACE
+
+#endif // __QVOLUME_H_
@@ -1,4 +1,5 @@
 #include "idfsserver.h"
+#include "qcrc.h"
 
 int32_t IDFSServer::initialize()
 {
@@ -8,6 +9,22 @@ int32_t IDFSServer::initialize()
 	if(ret<0)
 		return TCP_ERR;
 
+	// 多块磁盘以逗号分隔, 文件模式的图片位置记录磁盘序号, 只能在末尾追加新磁盘
+	std::vector<std::string> paths=q_split(std::string(img_path_), ',');
+	img_paths_.clear();
+	for(size_t i=0; i<paths.size(); ++i)
+	{
+		if(!q_trim(paths[i]).empty())
+			img_paths_.push_back(paths[i]);
+	}
+
+	if(img_paths_.empty()) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"img-path (%s) lists no directory!", \
+				img_path_);
+		return TCP_ERR;
+	}
+
 	ret=config_->getFieldString("img-dir", img_dir_);
 	if(ret<0)
 		return TCP_ERR;
@@ -16,32 +33,409 @@ int32_t IDFSServer::initialize()
 	if(ret<0)
 		return TCP_ERR;
 
-	ret=config_->getFieldString("mongo-uri", mongo_uri_);
+	char storage_mode[1<<5]={0};
+	ret=config_->getFieldString("storage-mode", storage_mode, sizeof(storage_mode));
 	if(ret<0)
 		return TCP_ERR;
 
-	ret=config_->getFieldString("mongo-img-collection", mongo_img_collection_);
+	if(q_strcasecmp(storage_mode, "file")==0) {
+		storage_mode_=IDFS_STORAGE_FILE;
+	} else if(q_strcasecmp(storage_mode, "volume")==0) {
+		storage_mode_=IDFS_STORAGE_VOLUME;
+	} else {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"unknown storage-mode (%s)!", \
+				storage_mode);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldInt32("volume-size", volume_size_);
 	if(ret<0)
 		return TCP_ERR;
 
-	/* directory */
-	if(!QDir::mkdir(img_path_)) {
+	// 索引槽位中卷内偏移按8字节单位占30位, 单卷最大8GB
+	if(volume_size_<=0||(uint64_t)volume_size_<<20>NEEDLE_LOC_MAX_OFFSET) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"volume-size (%d) must be between 1 and %lu!", \
+				volume_size_, \
+				NEEDLE_LOC_MAX_OFFSET>>20);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldYesNo("volume-direct-io", volume_direct_io_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("index-checkpoint-interval", index_checkpoint_interval_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("compact-dead-ratio", compact_dead_ratio_);
+	if(ret<0)
+		return TCP_ERR;
+
+	if(compact_dead_ratio_<0||compact_dead_ratio_>100) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"compact-dead-ratio (%d) must be between 0 and 100!", \
+				compact_dead_ratio_);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldInt32("compact-interval", compact_interval_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("compact-rate", compact_rate_);
+	if(ret<0)
+		return TCP_ERR;
+
+	char sync_mode[1<<5]={0};
+	ret=config_->getFieldString("sync-mode", sync_mode, sizeof(sync_mode));
+	if(ret<0)
+		return TCP_ERR;
+
+	int32_t group_commit_mode=GROUP_COMMIT_NONE;
+	if(q_strcasecmp(sync_mode, "none")==0) {
+		group_commit_mode=GROUP_COMMIT_NONE;
+	} else if(q_strcasecmp(sync_mode, "batch")==0) {
+		group_commit_mode=GROUP_COMMIT_BATCH;
+	} else if(q_strcasecmp(sync_mode, "write")==0) {
+		group_commit_mode=GROUP_COMMIT_WRITE;
+	} else {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"unknown sync-mode (%s)!", \
+				sync_mode);
+		return TCP_ERR;
+	}
+
+	int32_t sync_batch_size=0;
+	ret=config_->getFieldInt32("sync-batch-size", sync_batch_size);
+	if(ret<0)
+		return TCP_ERR;
+
+	int32_t sync_max_delay=0;
+	ret=config_->getFieldInt32("sync-max-delay", sync_max_delay);
+	if(ret<0)
+		return TCP_ERR;
+
+	// 文件模式下每张图片一个文件, 以syncfs一次同步整个文件系统, 目录项随之落盘
+	ret=group_commit_.init(group_commit_mode, sync_batch_size, sync_max_delay, storage_mode_==IDFS_STORAGE_FILE);
+	if(ret<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"group commit init error, ret = (%d)!", \
+				ret);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldInt32("hot-cache-size", hot_cache_size_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("hot-cache-shards", hot_cache_shards_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("hot-cache-item-size", hot_cache_item_size_);
+	if(ret<0)
+		return TCP_ERR;
+
+	hot_cache_=NULL;
+	if(hot_cache_size_>0) {
+		hot_cache_=q_new<QImageCache>();
+		if(hot_cache_==NULL)
+			return TCP_ERR;
+
+		ret=hot_cache_->init((uint64_t)hot_cache_size_<<20, hot_cache_shards_, hot_cache_item_size_<<10);
+		if(ret<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"hot cache init error, size = (%d), shards = (%d), item size = (%d), ret = (%d)!", \
+					hot_cache_size_, \
+					hot_cache_shards_, \
+					hot_cache_item_size_, \
+					ret);
+			return TCP_ERR;
+		}
+	}
+
+	char disk_placement[1<<5]={0};
+	ret=config_->getFieldString("disk-placement", disk_placement, sizeof(disk_placement));
+	if(ret<0)
+		return TCP_ERR;
+
+	if(q_strcasecmp(disk_placement, "hash")==0) {
+		disk_placement_=IDFS_PLACEMENT_HASH;
+	} else if(q_strcasecmp(disk_placement, "space")==0) {
+		disk_placement_=IDFS_PLACEMENT_SPACE;
+	} else if(q_strcasecmp(disk_placement, "adaptive")==0) {
+		disk_placement_=IDFS_PLACEMENT_ADAPTIVE;
+	} else {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"unknown disk-placement (%s)!", \
+				disk_placement);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldInt32("disk-queue-depth", disk_queue_depth_);
+	if(ret<0)
+		return TCP_ERR;
+
+	if(disk_queue_depth_<=0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"disk-queue-depth (%d) must be larger than 0!", \
+				disk_queue_depth_);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldInt32("disk-readonly-free", disk_readonly_free_);
+	if(ret<0)
+		return TCP_ERR;
+
+	if(disk_readonly_free_<0||disk_readonly_free_>=100) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"disk-readonly-free (%d) must be between 0 and 99!", \
+				disk_readonly_free_);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldInt32("disk-readonly-latency", disk_readonly_latency_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("disk-readonly-retry", disk_readonly_retry_);
+	if(ret<0)
+		return TCP_ERR;
+
+	// 存储层与img-path逐项对应, 未列出的磁盘为热层
+	char img_tier[1<<10]={0};
+	ret=config_->getFieldString("img-tier", img_tier, sizeof(img_tier));
+	if(ret<0)
+		return TCP_ERR;
+
+	std::vector<std::string> tiers=q_split(std::string(img_tier), ',');
+	if(tiers.size()>img_paths_.size()) {
 		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
-				"mkdir img_path_ (%s) error!", \
+				"img-tier (%s) lists more tiers than img-path (%s)!", \
+				img_tier, \
 				img_path_);
 		return TCP_ERR;
 	}
 
+	disk_tiers_.assign(img_paths_.size(), IDFS_TIER_HOT);
+	for(size_t i=0; i<tiers.size(); ++i)
+	{
+		q_trim(tiers[i]);
+		if(q_strcasecmp(tiers[i].c_str(), "cold")==0) {
+			disk_tiers_[i]=IDFS_TIER_COLD;
+		} else if(q_strcasecmp(tiers[i].c_str(), "hot")!=0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"unknown img-tier (%s)!", \
+					tiers[i].c_str());
+			return TCP_ERR;
+		}
+	}
+
+	ret=config_->getFieldInt32("tier-cold-days", tier_cold_days_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("tier-cold-count", tier_cold_count_);
+	if(ret<0)
+		return TCP_ERR;
+
+	if(tier_cold_days_<0||tier_cold_count_<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"tier-cold-days (%d) and tier-cold-count (%d) must not be negative!", \
+				tier_cold_days_, \
+				tier_cold_count_);
+		return TCP_ERR;
+	}
+
+	ret=config_->getFieldInt32("tier-migrate-interval", tier_migrate_interval_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("tier-migrate-rate", tier_migrate_rate_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldInt32("tier-track-size", tier_track_size_);
+	if(ret<0)
+		return TCP_ERR;
+
+	access_tracker_=NULL;
+	tier_stop_=0;
+	tier_thread_started_=false;
+	tier_migrating_=0;
+	tier_migrated_images_=0;
+	tier_migrated_bytes_=0;
+	tier_migrate_errors_=0;
+	tier_unlinks_.clear();
+
+	ret=config_->getFieldString("mongo-uri", mongo_uri_);
+	if(ret<0)
+		return TCP_ERR;
+
+	ret=config_->getFieldString("mongo-img-collection", mongo_img_collection_);
+	if(ret<0)
+		return TCP_ERR;
+
+	/* directory */
 	char directory[1<<10]={0};
-	for(int32_t i=0; i<img_subdir_num_; i++)
+	for(size_t disk=0; disk<img_paths_.size(); ++disk)
 	{
-		if(snprintf(directory, sizeof(directory), "%s/%s/%03d", img_path_, img_dir_, i)<0)
+		if(!QDir::mkdir(img_paths_[disk].c_str())) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"mkdir img_path_ (%s) error!", \
+					img_paths_[disk].c_str());
+			return TCP_ERR;
+		}
+
+		for(int32_t i=0; storage_mode_==IDFS_STORAGE_FILE && i<img_subdir_num_; i++)
+		{
+			if(snprintf(directory, sizeof(directory), "%s/%s/%03d", img_paths_[disk].c_str(), img_dir_, i)<0)
+				return TCP_ERR;
+
+			if(!QDir::mkdir(directory))
+				return TCP_ERR;
+		}
+
+		// 流式上传的临时文件与图片同盘, 保证改名为原子操作
+		if(snprintf(directory, sizeof(directory), "%s/%s/%s", img_paths_[disk].c_str(), img_dir_, IDFS_IMG_TMP_DIR)<0)
 			return TCP_ERR;
 
 		if(!QDir::mkdir(directory))
 			return TCP_ERR;
 	}
 
+	stream_seq_=0;
+	uring_seq_=0;
+
+	// 每块磁盘一个写入线程, 慢盘的队列排满后新图片改写其他磁盘, 不阻塞其余写入
+	disk_queues_=q_new_array<QDiskQueue>(img_paths_.size());
+	if(disk_queues_==NULL)
+		return TCP_ERR;
+
+	for(size_t disk=0; disk<img_paths_.size(); ++disk)
+	{
+		ret=disk_queues_[disk].init(img_paths_[disk].c_str(), disk_queue_depth_);
+		if(ret<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"disk queue (%s) init error, ret = (%d)!", \
+					img_paths_[disk].c_str(), \
+					ret);
+			return TCP_ERR;
+		}
+	}
+
+	// 启动前先检查一次, 已满的磁盘从一开始就不接受写入
+	disk_slow_since_.assign(img_paths_.size(), 0);
+	disk_stop_=0;
+	disk_thread_started_=false;
+	check_disks();
+
+	if(q_create_thread(&disk_tid_, IDFSServer::disk_check_thread, this)<0)
+		return TCP_ERR;
+	disk_thread_started_=true;
+
+	/* volume */
+	volume_store_=NULL;
+	needle_index_=NULL;
+	index_stop_=0;
+	index_thread_started_=false;
+	compact_stop_=0;
+	compact_thread_started_=false;
+	compact_volumes_=0;
+	compact_copied_bytes_=0;
+	compact_reclaimed_bytes_=0;
+	compact_vid_=0;
+	compact_total_bytes_=0;
+	compact_done_bytes_=0;
+	torn_volumes_=0;
+	checksum_errors_=0;
+	if(storage_mode_==IDFS_STORAGE_VOLUME) {
+		std::vector<volumeMark> marks;
+		std::vector<std::string> volume_dirs;
+
+		for(size_t disk=0; disk<img_paths_.size(); ++disk)
+			volume_dirs.push_back(q_format("%s/%s/%s", img_paths_[disk].c_str(), img_dir_, IDFS_VOLUME_DIR));
+
+		// 检查点位于第一块磁盘, 记录全部磁盘上各卷的位置
+		index_path_=q_format("%s/%s", volume_dirs[0].c_str(), IDFS_INDEX_FILE);
+
+		needle_index_=q_new<QNeedleIndex>();
+		if(needle_index_==NULL)
+			return TCP_ERR;
+
+		// 有检查点时只需扫描各卷检查点之后的部分, 检查点损坏时退回全量扫描
+		ret=needle_index_->load(index_path_.c_str(), marks);
+		if(ret!=0) {
+			if(ret<0) {
+				logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"needle index (%s) load error, ret = (%d), rebuilding from volumes!", \
+						index_path_.c_str(), \
+						ret);
+			}
+			marks.clear();
+			if(needle_index_->init()<0)
+				return TCP_ERR;
+		}
+
+		volume_store_=q_new<QVolumeStore>();
+		if(volume_store_==NULL)
+			return TCP_ERR;
+
+		replay_kills_.clear();
+		ret=volume_store_->init(volume_dirs, (uint64_t)volume_size_<<20, volume_direct_io_!=0, &marks, \
+				IDFSServer::index_visitor, this);
+		replay_kills_.clear();
+		if(ret<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"volume store (%s) init error, ret = (%d)!", \
+					img_path_, \
+					ret);
+			return TCP_ERR;
+		}
+
+		logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"volume store (%s) opened, disks = (%u), volumes = (%u), needles = (%lu), index memory = (%lu)", \
+				img_path_, \
+				volume_store_->disk_num(), \
+				volume_store_->volume_num(), \
+				needle_index_->size(), \
+				needle_index_->memory());
+
+		// 检查点之后的needle逐个校验, 崩溃时未写完的needle及其后内容已截掉, 不会被读出
+		std::vector<volumeMark> torn;
+		volume_store_->torn(torn);
+		torn_volumes_=torn.size();
+		for(size_t i=0; i<torn.size(); ++i)
+		{
+			logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"volume (%u) has a torn needle at offset (%lu), truncated to (%lu) needles!", \
+					torn[i].vid, \
+					torn[i].offset, \
+					torn[i].needle_num);
+		}
+
+		if(volume_direct_io_&&!volume_store_->direct()) {
+			logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"volume direct io is not supported under (%s), writing through page cache!", \
+					img_path_);
+		}
+
+		if(index_checkpoint_interval_>0) {
+			if(q_create_thread(&index_tid_, IDFSServer::index_thread, this)<0)
+				return TCP_ERR;
+			index_thread_started_=true;
+		}
+
+		if(compact_dead_ratio_>0&&compact_interval_>0) {
+			if(q_create_thread(&compact_tid_, IDFSServer::compact_thread, this)<0)
+				return TCP_ERR;
+			compact_thread_started_=true;
+		}
+	}
+
 	/* mongo */
 	mongo_client_=new(std::nothrow) QMongoClient(mongo_uri_);
 	if(!mongo_client_) {
@@ -53,6 +447,30 @@ int32_t IDFSServer::initialize()
 
 	mongo_client_->setCollection(mongo_img_collection_);
 
+	// 同时有热层与冷层磁盘时才记录访问并启动迁移线程
+	bool has_hot=std::count(disk_tiers_.begin(), disk_tiers_.end(), IDFS_TIER_HOT)>0;
+	bool has_cold=std::count(disk_tiers_.begin(), disk_tiers_.end(), IDFS_TIER_COLD)>0;
+	if(has_hot&&has_cold&&tier_migrate_interval_>0) {
+		std::string access_path=q_format("%s/%s/%s", img_paths_[0].c_str(), img_dir_, IDFS_ACCESS_FILE);
+
+		access_tracker_=q_new<QAccessTracker>();
+		if(access_tracker_==NULL)
+			return TCP_ERR;
+
+		ret=access_tracker_->init(access_path.c_str(), (uint64_t)tier_track_size_<<20);
+		if(ret<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"access tracker (%s) init error, ret = (%d)!", \
+					access_path.c_str(), \
+					ret);
+			return TCP_ERR;
+		}
+
+		if(q_create_thread(&tier_tid_, IDFSServer::tier_thread, this)<0)
+			return TCP_ERR;
+		tier_thread_started_=true;
+	}
+
 	/* curl global */
 	ret=QNetworkAccessManager::global_init();
 	if(ret<0)
@@ -63,6 +481,15 @@ int32_t IDFSServer::initialize()
 
 int32_t IDFSServer::server_init(void*& handle)
 {
+	// io_uring模式下每个工作线程持有一个环, 供图片落盘使用
+	if(io_model_==TCP_IO_URING) {
+		QIoUring* ring=q_new<QIoUring>();
+		if(ring==NULL||ring->init(IDFS_URING_ENTRIES)<0) {
+			q_delete<QIoUring>(ring);
+			return TCP_ERR;
+		}
+		handle=ring;
+	}
 	return TCP_OK;
 }
 
@@ -86,6 +513,21 @@ int32_t IDFSServer::server_header(const char* header_buffer, int32_t header_len,
 }
 
 int32_t IDFSServer::server_process(const char* request_buffer, int32_t request_len, char* reply_buffer, int32_t reply_size, const void* handle)
+{
+	replyVector reply;
+	int32_t ret=server_process_vector(request_buffer, request_len, reply_buffer, reply_size, reply, handle);
+
+	// 读取图片的数据只能以分段响应发送
+	if(reply.length>0) {
+		server_reply_done(reply, handle);
+		return TCP_ERR_OPERATE_TYPE;
+	}
+
+	return ret;
+}
+
+int32_t IDFSServer::server_process_vector(const char* request_buffer, int32_t request_len, char* reply_buffer, int32_t reply_size, \
+		replyVector& reply, const void* handle)
 {
 	Q_CHECK_PTR(request_buffer);
 	Q_CHECK_PTR(reply_buffer);
@@ -138,12 +580,17 @@ int32_t IDFSServer::server_process(const char* request_buffer, int32_t request_l
 		char* ptr_reply_end=ptr_reply_temp+reply_size;
 
 		replyParam* reply_param=reinterpret_cast<replyParam*>(ptr_reply_temp);
+		reply_param->request_id=request_param->request_id;
+		memset(reply_param->reserved, 0, sizeof(reply_param->reserved));
 		reply_param->status=0;
 		reply_param->command_type=request_param->command_type;
 
 		ptr_reply_temp+=sizeof(replyParam)+sizeof(int32_t);
 
-		ret=server_main(operate_type, ptr_data, data_len, ptr_reply_temp, (ptrdiff_t)(ptr_reply_end-ptr_reply_temp), handle);
+		if(operate_type==IDFS_OP_READ)
+			ret=read_image(ptr_data, data_len, ptr_reply_temp, (ptrdiff_t)(ptr_reply_end-ptr_reply_temp), reply);
+		else
+			ret=server_main(operate_type, ptr_data, data_len, ptr_reply_temp, (ptrdiff_t)(ptr_reply_end-ptr_reply_temp), handle);
 		if(ret<0) {
 			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
 					"process error, ret = (%d)!", \
@@ -157,7 +604,8 @@ int32_t IDFSServer::server_process(const char* request_buffer, int32_t request_l
 			ptr_reply_temp+=ret;
 		}
 
-		*(int32_t*)(reply_buffer+sizeof(replyParam))=ret;
+		// 长度包含分段响应中随后发送的图片数据
+		*(int32_t*)(reply_buffer+sizeof(replyParam))=ret+reply.length;
 		reply_len=(ptrdiff_t)(ptr_reply_temp-reply_buffer);
 	} else {
 		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
@@ -182,117 +630,54 @@ int32_t IDFSServer::server_main(uint16_t type, const char* ptr_data, int32_t dat
 
 	QMD5 qmd5;
 	uint64_t iid=0;
+	uint32_t crc=0;
 
 	std::string imgid("");
-	std::string local_path("");
-	std::string file_path("");
+	std::string location("");
 	std::string img_size("");
 	std::string img_md5("");
-
-	int32_t width=0;
-	int32_t height=0;
+	std::string img_crc("");
 
 	if(type>=0 && type<5)
 	{
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-		if(ptr_temp+ret>=ptr_end)
-			return -51;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<doc>\n");
-		if(ptr_temp+ret>=ptr_end)
-			return -52;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<base>\n");
-		if(ptr_temp+ret>=ptr_end)
-			return -53;
-		ptr_temp+=ret;
-
 		iid=qmd5.MD5Bits64((unsigned char*)ptr_data, data_len);
 		imgid=q_to_string(iid);
 
 		img_md5=md5((char*)ptr_data, data_len);
 
+		crc=crc32c(0, ptr_data, data_len);
+		img_crc=q_format("%08x", crc);
+
 		mongo_mutex_.lock();
-		if(mongo_client_->exists("imgid", imgid.c_str()))
+		if(image_exists(imgid))
 		{
-			if(mongo_client_->select("imgid", imgid.c_str(), "imgpath", file_path, "imgsize", img_size)==MONGO_ERR) {
+			if(!mongo_client_->select("imgid", imgid.c_str(), location_column(), location, "imgsize", img_size)) {
 				mongo_mutex_.unlock();
 				return -54;
 			}
-		} else {
-			file_path=q_format("%s/%03d/%lx.%s", img_dir_, static_cast<int32_t>(iid%1000), iid, get_image_type_name(type));
-
-			local_path=q_format("%s/%s", img_path_, file_path.c_str());
-
-			ret=save_image(local_path.c_str(), ptr_data, data_len);
-			if(ret<0) {
-				mongo_mutex_.unlock();
-				return -55;
-			}
-
-			ret=getImageSize(local_path.c_str(), &width, &height);
-			if(ret<0) {
-				mongo_mutex_.unlock();
-				return -56;
-			}
-
-			img_size=q_format("%d*%d", width, height);
-
-			if(mongo_client_->insert("imgid", imgid.c_str(), "imgpath", file_path.c_str(), "imgsize", img_size.c_str())==MONGO_ERR) {
+			if(add_reference(imgid)<0) {
 				mongo_mutex_.unlock();
-				return -57;
+				return -65;
 			}
+			mongo_mutex_.unlock();
+		} else {
+			// 落盘不持有mongo_mutex_, 慢盘不阻塞其他磁盘上的写入, 并发的相同图片由commit_image合并
+			mongo_mutex_.unlock();
+			ret=store_image(iid, type, ptr_data, data_len, crc, reinterpret_cast<QIoUring*>(const_cast<void*>(handle)), \
+					location, img_size);
+			if(ret<0)
+				return ret;
+
+			ret=commit_image(imgid, location, img_size, img_crc);
+			if(ret<0)
+				return ret;
 		}
 
-		mongo_mutex_.unlock();
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgid><![CDATA[%lu]]></imgid>\n", iid);
-		if(ptr_temp+ret>=ptr_end)
-			return -58;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgmd5><![CDATA[%s]]></imgmd5>\n", img_md5.c_str());
-		if(ptr_temp+ret>=ptr_end)
-			return -59;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgpath><![CDATA[%s]]></imgpath>\n", file_path.c_str());
-		if(ptr_temp+ret>=ptr_end)
-			return -60;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgsize><![CDATA[%s]]></imgsize>\n", img_size.c_str());
-		if(ptr_temp+ret>=ptr_end)
-			return -61;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</base>\n");
-		if(ptr_temp+ret>=ptr_end)
-			return -62;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</doc>");
-		if(ptr_temp+ret>=ptr_end)
-			return -63;
+		ret=format_result(ptr_temp, ptr_end-ptr_temp, iid, img_md5, location, img_size);
+		if(ret<0)
+			return ret;
 		ptr_temp+=ret;
 	} else if(type==64) {
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-		if(ptr_temp+ret>=ptr_end)
-			return -51;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<doc>\n");
-		if(ptr_temp+ret>=ptr_end)
-			return -52;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<base>\n");
-		if(ptr_temp+ret>=ptr_end)
-			return -53;
-		ptr_temp+=ret;
-
 		std::string request_xml(ptr_data, data_len);
 		std::string referer=q_substr(std::string(ptr_data, data_len), "<referer><![CDATA[", "]]></referer>");
 		std::string user_agent=q_substr(std::string(ptr_data, data_len), "<user_agent><![CDATA[", "]]></user_agent>");
@@ -321,73 +706,66 @@ int32_t IDFSServer::server_main(uint16_t type, const char* ptr_data, int32_t dat
 
 		img_md5=md5((char*)ptr_img, ret);
 
+		crc=crc32c(0, ptr_img, ret);
+		img_crc=q_format("%08x", crc);
+
 		mongo_mutex_.lock();
-		if(mongo_client_->exists("imgid", imgid.c_str()))
+		if(image_exists(imgid))
 		{
-			if(mongo_client_->select("imgid", imgid.c_str(), "imgpath", file_path, "imgsize", img_size)==MONGO_ERR) {
+			if(!mongo_client_->select("imgid", imgid.c_str(), location_column(), location, "imgsize", img_size)) {
 				q_delete_array<char>(ptr_img);
 				mongo_mutex_.unlock();
 				return -54;
 			}
+			if(add_reference(imgid)<0) {
+				q_delete_array<char>(ptr_img);
+				mongo_mutex_.unlock();
+				return -65;
+			}
+			mongo_mutex_.unlock();
 		} else {
-			file_path=q_format("%s/%03d/%lx.%s", img_dir_, static_cast<int32_t>(iid%1000), iid, get_image_type_name(type));
-
-			local_path=q_format("%s/%s", img_path_, file_path.c_str());
-
-			ret=save_image(local_path.c_str(), ptr_img, ret);
+			mongo_mutex_.unlock();
+			ret=store_image(iid, type, ptr_img, ret, crc, reinterpret_cast<QIoUring*>(const_cast<void*>(handle)), \
+					location, img_size);
 			if(ret<0) {
 				q_delete_array<char>(ptr_img);
-				mongo_mutex_.unlock();
-				return -55;
+				return ret;
 			}
 
-			ret=getImageSize(local_path.c_str(), &width, &height);
+			ret=commit_image(imgid, location, img_size, img_crc);
 			if(ret<0) {
 				q_delete_array<char>(ptr_img);
-				mongo_mutex_.unlock();
-				return -56;
-			}
-
-			img_size=q_format("%d*%d", width, height);
-
-			if(mongo_client_->insert("imgid", imgid.c_str(), "imgpath", file_path.c_str(), "imgsize", img_size.c_str())==MONGO_ERR) {
-				q_delete_array<char>(ptr_img);
-				mongo_mutex_.unlock();
-				return -57;
+				return ret;
 			}
 		}
 
 		q_delete_array<char>(ptr_img);
-		mongo_mutex_.unlock();
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgid><![CDATA[%lu]]></imgid>\n", iid);
-		if(ptr_temp+ret>=ptr_end)
-			return -58;
-		ptr_temp+=ret;
-
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgmd5><![CDATA[%s]]></imgmd5>\n", img_md5.c_str());
-		if(ptr_temp+ret>=ptr_end)
-			return -59;
-		ptr_temp+=ret;
 
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgpath><![CDATA[%s]]></imgpath>\n", file_path.c_str());
-		if(ptr_temp+ret>=ptr_end)
-			return -60;
+		ret=format_result(ptr_temp, ptr_end-ptr_temp, iid, img_md5, location, img_size);
+		if(ret<0)
+			return ret;
 		ptr_temp+=ret;
+	} else if(type==IDFS_OP_DELETE) {
+		// 请求体为上传时返回的十进制图片编号
+		std::string id_str(ptr_data, data_len);
+		char* id_end=NULL;
 
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgsize><![CDATA[%s]]></imgsize>\n", img_size.c_str());
-		if(ptr_temp+ret>=ptr_end)
-			return -61;
-		ptr_temp+=ret;
+		iid=strtoull(id_str.c_str(), &id_end, 10);
+		if(id_str.empty()||*id_end!='\0') {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"delete imgid error, imgid = (%s)!", \
+					id_str.c_str());
+			return -64;
+		}
 
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</base>\n");
-		if(ptr_temp+ret>=ptr_end)
-			return -62;
-		ptr_temp+=ret;
+		int32_t refs=0;
+		ret=delete_image(iid, refs);
+		if(ret<0)
+			return ret;
 
-		ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</doc>");
-		if(ptr_temp+ret>=ptr_end)
-			return -63;
+		ret=format_delete_result(ptr_temp, ptr_end-ptr_temp, iid, refs);
+		if(ret<0)
+			return ret;
 		ptr_temp+=ret;
 	} else {
 		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
@@ -399,29 +777,155 @@ int32_t IDFSServer::server_main(uint16_t type, const char* ptr_data, int32_t dat
 	return (ptrdiff_t)(ptr_temp-ptr_out);
 }
 
+void IDFSServer::server_reply_done(replyVector& reply, const void* handle)
+{
+	// 命中缓存时以内存段发送并持有缓存图片, 否则context为卷引用, 卷文件描述符归卷所有
+	if(reply.context!=NULL) {
+		if(reply.segment_num>0) {
+			hot_cache_->release(reinterpret_cast<cacheItem*>(reply.context));
+		} else {
+			volume_store_->release(reinterpret_cast<QVolume*>(reply.context));
+			reply.file_fd=-1;
+		}
+		reply.context=NULL;
+	}
+
+	QTcpServer::server_reply_done(reply, handle);
+}
+
 int32_t IDFSServer::server_free(const void* handle)
 {
+	QIoUring* ring=reinterpret_cast<QIoUring*>(const_cast<void*>(handle));
+	q_delete<QIoUring>(ring);
 	return TCP_OK;
 }
 
 int32_t IDFSServer::release()
 {
+	// 迁移线程使用元数据与卷, 最先停止; 中途停止时已复制未改写位置的图片仍在原处
+	if(tier_thread_started_) {
+		tier_stop_=1;
+		q_thread_join(tier_tid_);
+		tier_thread_started_=false;
+	}
+	q_delete<QAccessTracker>(access_tracker_);
+
 	q_free(img_path_);
 	q_free(mongo_uri_);
 	q_free(mongo_img_collection_);
 	q_delete<QMongoClient>(mongo_client_);
+
+	if(disk_thread_started_) {
+		disk_stop_=1;
+		q_thread_join(disk_tid_);
+		disk_thread_started_=false;
+	}
+
+	// 压缩中途停止时放弃新卷, 原卷不受影响; 压缩经磁盘写入线程写删除标记, 须先于写入线程停止
+	if(compact_thread_started_) {
+		compact_stop_=1;
+		q_thread_join(compact_tid_);
+		compact_thread_started_=false;
+	}
+
+	// 停止检查点线程后再写一次检查点, 下次启动无需扫描
+	if(index_thread_started_) {
+		index_stop_=1;
+		q_thread_join(index_tid_);
+		index_thread_started_=false;
+	}
+
+	// 排队中的写入完成后停止磁盘写入线程, 之后卷中不再有新needle
+	q_delete_array<QDiskQueue>(disk_queues_);
+	if(needle_index_!=NULL && volume_store_!=NULL && save_index()<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"needle index (%s) checkpoint error!", \
+				index_path_.c_str());
+	}
+	q_delete<QVolumeStore>(volume_store_);
+	q_delete<QNeedleIndex>(needle_index_);
+	q_delete<QImageCache>(hot_cache_);
 	QNetworkAccessManager::global_cleanup();
 	return TCP_OK;
 }
 
-int32_t IDFSServer::save_image(const char* path, const char* data, int32_t len)
+int32_t IDFSServer::save_image(const char* path, const char* temp_path, const char* data, int32_t len, uint32_t crc, \
+		QIoUring* ring)
 {
-	if(path==NULL||data==NULL||len<=0)
+	if(path==NULL||temp_path==NULL||data==NULL||len<=0)
 		return -1;
 
-	if(access(path, F_OK)!=0)
+	// 已有文件可能是崩溃前未写完的残留, 校验一致才沿用, 否则重新写入覆盖
+	int32_t exist_fd=::open(path, O_RDONLY);
+	if(exist_fd>=0) {
+		uint32_t exist_crc=0;
+		bool same=file_checksum(exist_fd, len, exist_crc) && exist_crc==crc;
+		::close(exist_fd);
+		if(same)
+			return 1;
+
+		q_add_and_fetch(&checksum_errors_);
+		logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"image file (%s) does not match its crc32c, rewriting!", \
+				path);
+	}
+
+	if(ring)
 	{
-		FILE* fp = fopen(path, "w");
+		int32_t fd=::open(temp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if(fd<0)
+			return -2;
+
+		// 写入与关闭链接成一组, 一次io_uring_enter提交并等待两者完成;
+		// user_data按调用编号, 低位区分写入与关闭, 其他调用遗留的完成事件不会被误认
+		uint64_t tag=(uint64_t)q_add_and_fetch(&uring_seq_)<<1;
+		uint64_t user_data=0;
+		int32_t res=0;
+		int32_t write_res=-ECANCELED;
+		int32_t close_res=-ECANCELED;
+		int32_t queued=0;
+		int32_t done=0;
+
+		if(ring->write(fd, data, len, 0, tag, true)==0) {
+			++queued;
+			if(ring->close(fd, tag|1)==0)
+				++queued;
+		}
+
+		// 准备失败时撤回尚未交给内核的提交项, 已交给内核的仍须等到完成事件, 之后才能关闭fd并释放数据
+		if(queued<2)
+			queued-=q_min((int32_t)ring->withdraw(), queued);
+
+		while(done<queued)
+		{
+			if(!ring->next_completion(user_data, res)) {
+				if(ring->submit(queued-done)<0 && errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) {
+					// 提交失败时内核未取走的提交项撤回, 已取走的继续等待
+					queued-=q_min((int32_t)ring->withdraw(), queued-done);
+					if(done<queued)
+						q_sleep(1);
+				}
+				continue;
+			}
+
+			if((user_data&~(uint64_t)1)!=tag)
+				continue;
+
+			if(user_data&1)
+				close_res=res;
+			else
+				write_res=res;
+			++done;
+		}
+
+		// 写入不完整时链接中断, 关闭被取消; 关闭未提交时同样需自行关闭
+		if(close_res==-ECANCELED)
+			::close(fd);
+
+		if(write_res!=len)
+			return -3;
+	} else {
+		FILE* fp = fopen(temp_path, "w");
 		if(fp==NULL)
 			return -2;
 
@@ -431,31 +935,2100 @@ int32_t IDFSServer::save_image(const char* path, const char* data, int32_t len)
 			return -3;
 		}
 
-		fclose(fp);
+		if(fclose(fp)!=0) {
+			fp=NULL;
+			return -3;
+		}
 		fp=NULL;
+	}
+
+	if(::rename(temp_path, path)<0)
+		return -4;
+
+	return 0;
+}
+
+bool IDFSServer::file_checksum(int32_t fd, int32_t len, uint32_t& crc)
+{
+	struct stat st;
+	char buf[1<<16];
+	int32_t done=0;
+	ssize_t ret=0;
+
+	if(fstat(fd, &st)<0||st.st_size!=len)
+		return false;
+
+	crc=0;
+	while(done<len)
+	{
+		ret=pread(fd, buf, len-done<(int32_t)sizeof(buf)?len-done:(int32_t)sizeof(buf), done);
+		if(ret<0 && errno==EINTR)
+			continue;
+		if(ret<=0)
+			return false;
+		crc=crc32c(crc, buf, ret);
+		done+=ret;
+	}
+
+	return true;
+}
+
+int32_t IDFSServer::store_image(uint64_t iid, int32_t type, const char* data, int32_t len, uint32_t crc, QIoUring* ring, \
+		std::string& location, std::string& img_size)
+{
+	int32_t width=0;
+	int32_t height=0;
+
+	if(storage_mode_==IDFS_STORAGE_VOLUME) {
+		// 先从内存解码取尺寸, 无法解码的数据不写入卷
+		if(getImageSize(data, len, &width, &height)<0)
+			return -56;
+
+		if(append_volume(iid, data, len, -1, location)<0)
+			return -55;
 	} else {
-		return 1;
+		diskWrite write(this, iid);
+		write.data=data;
+		write.len=len;
+		write.crc=crc;
+		write.name=q_format("%s/%03d/%lx.%s", img_dir_, static_cast<int32_t>(iid%1000), iid, get_image_type_name(type));
+		write.ring=ring;
+
+		if(write_image(write)<0)
+			return -55;
+
+		location=disk_location(write.disk, write.name);
+		if(getImageSize(local_path(location).c_str(), &width, &height)<0)
+			return -56;
 	}
 
+	img_size=q_format("%d*%d", width, height);
 	return 0;
 }
 
-const char* IDFSServer::get_image_type_name(int32_t type)
+int32_t IDFSServer::append_volume(uint64_t iid, const char* data, int32_t len, int32_t in_fd, std::string& location)
 {
-	switch(type)
+	volumeLocation vol_location;
+	int32_t ret=0;
+
+	if((uint32_t)len>NEEDLE_LOC_MAX_SIZE) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"image too large for volume storage, imgid = (%lu), len = (%d)!", \
+				iid, \
+				len);
+		return -1;
+	}
+
+	// 元数据写入失败时needle已在卷中, 重试时沿用, 不重复追加
+	if(!needle_index_->find(iid, vol_location))
 	{
-	case 0:
-		return "jpg";
-	case 1:
-		return "png";
-	case 2:
-		return "bmp";
-	case 3:
-		return "gif";
-	case 4:
-		return "tif";
-	default:
-		return "jpg";
+		// 追加后在磁盘写入锁内登记索引, 检查点取得的写入位置之前的needle都已在索引中
+		diskWrite write(this, iid);
+		write.data=data;
+		write.len=len;
+		write.in_fd=in_fd;
+
+		ret=write_image(write);
+		if(ret<0)
+			return -1;
+
+		vol_location=write.location;
+	}
+
+	location=QVolumeStore::format_location(vol_location);
+	return 0;
+}
+
+int32_t IDFSServer::write_image(diskWrite& write)
+{
+	std::vector<uint32_t> disks;
+	int32_t ret=0;
+
+	// 新图片写入前先记一次访问, 迁移线程不会把刚写入的图片当作冷图片
+	if(access_tracker_!=NULL)
+		access_tracker_->touch(write.iid);
+
+	place_disks(write.iid, disks);
+	if(disks.empty()) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"all disks are read-only, imgid = (%lu)!", \
+				write.iid);
+		return -1;
+	}
+
+	for(size_t i=0; i<disks.size(); ++i)
+	{
+		diskJob job(IDFSServer::disk_write, &write);
+		write.disk=disks[i];
+
+		// 队列已满说明该盘写入过慢, 不排队等待, 直接改写下一块磁盘
+		if(disk_queues_[write.disk].submit(job)<0)
+			continue;
+
+		if(job.ret>=0)
+			return 0;
+
+		ret=job.ret;
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"image write error, disk = (%s), imgid = (%lu), len = (%d), ret = (%d)!", \
+				img_paths_[write.disk].c_str(), \
+				write.iid, \
+				write.len, \
+				ret);
+	}
+
+	if(ret==0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"all disk queues are full, imgid = (%lu)!", \
+				write.iid);
+		return -1;
+	}
+
+	return -2;
+}
+
+int32_t IDFSServer::disk_write(void* arg)
+{
+	diskWrite* write=reinterpret_cast<diskWrite*>(arg);
+	IDFSServer* server=write->server;
+	std::string path("");
+	std::string temp_path("");
+	int32_t ret=0;
+
+	if(server->storage_mode_==IDFS_STORAGE_VOLUME) {
+		// 删除标记追加前已移出索引, 不再回调
+		if(write->in_fd<0) {
+			return server->volume_store_->append(write->disk, write->iid, write->data, write->len, write->location, write->flags, \
+					(write->flags&NEEDLE_FLAG_DELETED)?NULL:IDFSServer::index_visitor, server);
+		}
+
+		// 上一块磁盘写入失败时已读过部分数据, 从头读取
+		if(lseek(write->in_fd, 0, SEEK_SET)<0)
+			return -1;
+		return server->volume_store_->append_file(write->disk, write->iid, write->in_fd, write->len, write->location, \
+				IDFSServer::index_visitor, server);
+	}
+
+	// 临时文件与图片同盘, 写完后改名, 失败时删除
+	path=q_format("%s/%s", server->img_paths_[write->disk].c_str(), write->name.c_str());
+	temp_path=q_format("%s/%s/%s/%d.%u", server->img_paths_[write->disk].c_str(), server->img_dir_, IDFS_IMG_TMP_DIR, \
+			getpid(), q_add_and_fetch(&server->stream_seq_));
+	ret=server->save_image(path.c_str(), temp_path.c_str(), write->data, write->len, write->crc, write->ring);
+	if(ret<0)
+		::unlink(temp_path.c_str());
+
+	return ret;
+}
+
+void IDFSServer::place_disks(uint64_t iid, std::vector<uint32_t>& disks, bool by_space, int32_t tier)
+{
+	std::vector<std::pair<uint64_t, uint32_t> > scores;
+	std::vector<uint32_t> tier_disks;
+	uint32_t disk_num=0;
+	uint32_t disk=0;
+	uint64_t free_bytes=0;
+	uint64_t latency=0;
+	uint64_t score=0;
+	uint64_t fill=0;
+
+	disks.clear();
+
+	// 只在指定存储层的磁盘中选择, 热层磁盘全部只读时新图片写入冷层
+	bool writable=false;
+	for(uint32_t i=0; i<img_paths_.size(); ++i)
+	{
+		if(disk_tiers_[i]!=tier)
+			continue;
+		tier_disks.push_back(i);
+		writable=writable||!disk_queues_[i].readonly();
+	}
+	if(!writable && tier==IDFS_TIER_HOT) {
+		tier_disks.clear();
+		for(uint32_t i=0; i<img_paths_.size(); ++i)
+		{
+			if(disk_tiers_[i]==IDFS_TIER_COLD)
+				tier_disks.push_back(i);
+		}
+	}
+	disk_num=tier_disks.size();
+
+	// hash: 图片编号决定首选磁盘, 同一图片总是先写同一块盘
+	if(disk_placement_==IDFS_PLACEMENT_HASH && !by_space) {
+		for(uint32_t i=0; i<disk_num; ++i)
+		{
+			disk=tier_disks[(iid+i)%disk_num];
+			if(!disk_queues_[disk].readonly())
+				disks.push_back(disk);
+		}
+		return;
+	}
+
+	for(uint32_t i=0; i<disk_num; ++i)
+	{
+		disk=tier_disks[(iid+i)%disk_num];
+		if(disk_queues_[disk].readonly())
+			continue;
+
+		// space: 剩余空间多的磁盘优先;
+		// adaptive: 预计耗时为排队数乘最近平均写入耗时, 再按已用比例加权, 越满的磁盘越少写入
+		if(disk_placement_==IDFS_PLACEMENT_ADAPTIVE && !by_space) {
+			free_bytes=disk_queues_[disk].free_bytes();
+			fill=free_bytes>0?disk_queues_[disk].total_bytes()/free_bytes:100;
+			fill=q_min(q_max(fill, (uint64_t)1), (uint64_t)100);
+			latency=q_max(disk_queues_[disk].mean_latency(), (uint64_t)1);
+			score=(uint64_t)(disk_queues_[disk].depth()+1)*latency*fill;
+		} else {
+			score=~disk_queues_[disk].free_bytes();
+		}
+
+		// 得分相同时以图片编号轮换, 状态相近的磁盘均匀分担写入
+		scores.push_back(std::make_pair(score, i));
+	}
+	std::stable_sort(scores.begin(), scores.end());
+
+	// adaptive: 首选磁盘按预计耗时的倒数加权抽取, 图片编号即随机数; 只选最快的磁盘时
+	// 其余磁盘没有新的写入, 耗时统计无法更新, 加权抽取让每块磁盘都按比例得到写入
+	if(disk_placement_==IDFS_PLACEMENT_ADAPTIVE && !by_space && scores.size()>1) {
+		uint64_t total=0;
+		uint64_t pick=0;
+		size_t first=0;
+
+		for(size_t i=0; i<scores.size(); ++i)
+			total+=IDFS_DISK_WEIGHT_SCALE/scores[i].first+1;
+
+		pick=(iid>>16)%total;
+		for(first=0; first<scores.size()-1; ++first)
+		{
+			score=IDFS_DISK_WEIGHT_SCALE/scores[first].first+1;
+			if(pick<score)
+				break;
+			pick-=score;
+		}
+		std::rotate(scores.begin(), scores.begin()+first, scores.begin()+first+1);
+	}
+
+	for(size_t i=0; i<scores.size(); ++i)
+		disks.push_back(tier_disks[(iid+scores[i].second)%disk_num]);
+}
+
+void IDFSServer::check_disks()
+{
+	uint64_t free_bytes=0;
+	uint64_t total_bytes=0;
+	uint64_t p99=0;
+	int64_t now=time(NULL);
+	bool full=false;
+	bool slow=false;
+
+	for(size_t i=0; i<img_paths_.size(); ++i)
+	{
+		QDiskQueue& queue=disk_queues_[i];
+
+		if(queue.refresh()<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"statvfs disk (%s) error, errno = (%d)!", \
+					img_paths_[i].c_str(), \
+					errno);
+			continue;
+		}
+
+		free_bytes=queue.free_bytes();
+		total_bytes=queue.total_bytes();
+		p99=queue.latency(99);
+
+		full=disk_readonly_free_>0 && free_bytes*100<total_bytes*disk_readonly_free_;
+		slow=disk_readonly_latency_>0 && queue.latency_samples()>=IDFS_DISK_MIN_SAMPLES \
+			&& p99>(uint64_t)disk_readonly_latency_*1000;
+
+		if(queue.readonly()) {
+			// 因写入过慢只读的磁盘过一段时间清空耗时统计后重新试写, 仍然过慢时会再次置为只读
+			if(full)
+				continue;
+			if(disk_slow_since_[i]>0 && now-disk_slow_since_[i]<disk_readonly_retry_)
+				continue;
+
+			queue.reset_latency();
+			disk_slow_since_[i]=0;
+			queue.set_readonly(false);
+			logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"disk (%s) writable again, free = (%lu/%lu)", \
+					img_paths_[i].c_str(), \
+					free_bytes, \
+					total_bytes);
+		} else if(full||slow) {
+			disk_slow_since_[i]=full?0:now;
+			queue.set_readonly(true);
+			logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"disk (%s) set read-only, %s, free = (%lu/%lu), p99 write latency = (%lu us)!", \
+					img_paths_[i].c_str(), \
+					full?"free space below threshold":"write latency above threshold", \
+					free_bytes, \
+					total_bytes, \
+					p99);
+		}
+	}
+}
+
+void* IDFSServer::disk_check_thread(void* argv)
+{
+	IDFSServer* server=reinterpret_cast<IDFSServer*>(argv);
+	int64_t elapsed=0;
+
+	while(!server->disk_stop_)
+	{
+		q_sleep(100);
+		elapsed+=100;
+		if(elapsed<1000)
+			continue;
+		elapsed=0;
+
+		server->check_disks();
+	}
+
+	return NULL;
+}
+
+std::string IDFSServer::disk_location(uint32_t disk, const std::string& name) const
+{
+	// 第一块磁盘上的位置与单盘时一致, 原有元数据无需改写
+	if(disk==0)
+		return name;
+	return q_format("%u:%s", disk, name.c_str());
+}
+
+std::string IDFSServer::local_path(const std::string& location) const
+{
+	std::string::size_type pos=location.find(':');
+	uint32_t disk=0;
+
+	if(pos!=std::string::npos) {
+		char* disk_end=NULL;
+		disk=strtoul(location.c_str(), &disk_end, 10);
+		if(disk_end!=location.c_str()+pos||disk>=img_paths_.size())
+			return std::string("");
+		return q_format("%s/%s", img_paths_[disk].c_str(), location.c_str()+pos+1);
+	}
+
+	return q_format("%s/%s", img_paths_[0].c_str(), location.c_str());
+}
+
+int32_t IDFSServer::sync_image(const std::string& location)
+{
+	volumeLocation vol_location;
+	QVolume* vol=NULL;
+	int32_t fd=-1;
+	int32_t ret=0;
+
+	if(group_commit_.mode()!=GROUP_COMMIT_NONE)
+	{
+		if(storage_mode_==IDFS_STORAGE_VOLUME) {
+			if(QVolumeStore::parse_location(location.c_str(), vol_location)<0)
+				return -55;
+			// 卷已被压缩移除时needle已随新卷落盘
+			vol=volume_store_->acquire(vol_location.vid);
+			if(vol!=NULL) {
+				ret=group_commit_.sync(vol->fd());
+				volume_store_->release(vol);
+			}
+		} else {
+			fd=::open(local_path(location).c_str(), O_RDONLY);
+			if(fd<0)
+				return -55;
+			ret=group_commit_.sync(fd);
+			::close(fd);
+		}
+
+		if(ret<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"sync image error, location = (%s), errno = (%d)!", \
+					location.c_str(), \
+					errno);
+			return -55;
+		}
+	}
+
+	return 0;
+}
+
+int32_t IDFSServer::commit_image(const std::string& imgid, const std::string& location, const std::string& img_size, \
+		const std::string& img_crc)
+{
+	volumeLocation index_location;
+	int32_t ret=0;
+
+	// 等待落盘时不持有mongo_mutex_, 并发的上传才能加入同一批次
+	ret=sync_image(location);
+	if(ret<0)
+		return ret;
+
+	mongo_mutex_.lock();
+	wait_delete(strtoull(imgid.c_str(), NULL, 10));
+	// 写入与落盘期间图片可能已被删除, 卷中needle不再被索引引用或文件已删除, 由客户端重新上传
+	if(storage_mode_==IDFS_STORAGE_VOLUME && !needle_index_->find(strtoull(imgid.c_str(), NULL, 10), index_location)) {
+		mongo_mutex_.unlock();
+		return -55;
+	}
+	if(storage_mode_==IDFS_STORAGE_FILE && access(local_path(location).c_str(), F_OK)<0) {
+		mongo_mutex_.unlock();
+		return -55;
+	}
+
+	// 落盘期间相同图片可能已由其他请求登记, 此时只增加引用
+	if(mongo_client_->exists("imgid", imgid.c_str())) {
+		if(add_reference(imgid)<0) {
+			mongo_mutex_.unlock();
+			return -65;
+		}
+	} else if(mongo_client_->insert("imgid", imgid.c_str(), location_column(), location.c_str(), "imgsize", img_size.c_str(), \
+				"imgcrc", img_crc.c_str())==MONGO_ERR) {
+		mongo_mutex_.unlock();
+		return -57;
+	}
+	mongo_mutex_.unlock();
+
+	return 0;
+}
+
+bool IDFSServer::image_exists(const std::string& imgid)
+{
+	volumeLocation location;
+
+	wait_delete(strtoull(imgid.c_str(), NULL, 10));
+	if(!mongo_client_->exists("imgid", imgid.c_str()))
+		return false;
+
+	if(storage_mode_!=IDFS_STORAGE_VOLUME||needle_index_->find(strtoull(imgid.c_str(), NULL, 10), location))
+		return true;
+
+	logger_->log(LEVEL_WARNING, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+			"image metadata without needle, removed, imgid = (%s)!", \
+			imgid.c_str());
+	mongo_client_->remove("imgid", imgid.c_str());
+
+	return false;
+}
+
+void IDFSServer::wait_delete(uint64_t iid)
+{
+	while(deleting_.count(iid)>0)
+	{
+		mongo_mutex_.unlock();
+		q_sleep(1);
+		mongo_mutex_.lock();
+	}
+}
+
+int32_t IDFSServer::add_reference(const std::string& imgid)
+{
+	int32_t dup=0;
+
+	if(mongo_client_->increment("imgid", imgid.c_str(), IDFS_DUP_COLUMN, 1, dup)==MONGO_ERR) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"add reference error, imgid = (%s)!", \
+				imgid.c_str());
+		return -1;
 	}
+
+	// 重复上传也算一次访问
+	if(access_tracker_!=NULL)
+		access_tracker_->touch(strtoull(imgid.c_str(), NULL, 10));
+
+	return dup+1;
 }
 
+int32_t IDFSServer::delete_image(uint64_t iid, int32_t& refs)
+{
+	std::string imgid=q_to_string(iid);
+	std::string location("");
+	volumeLocation vol_location;
+	volumeLocation killed_location;
+	needleTombstone tombstone;
+	bool killed=false;
+	int32_t dup=0;
+	int32_t ret=0;
+
+	mongo_mutex_.lock();
+	wait_delete(iid);
+	if(!mongo_client_->exists("imgid", imgid.c_str())) {
+		mongo_mutex_.unlock();
+		return -64;
+	}
+
+	// 去重的每次上传各持有一个引用, 未减到0时只改计数
+	if(mongo_client_->increment("imgid", imgid.c_str(), IDFS_DUP_COLUMN, -1, dup)==MONGO_ERR) {
+		mongo_mutex_.unlock();
+		return -65;
+	}
+
+	if(dup>=0) {
+		mongo_mutex_.unlock();
+		refs=dup+1;
+		return 0;
+	}
+
+	if(!mongo_client_->select("imgid", imgid.c_str(), location_column(), location)) {
+		mongo_mutex_.unlock();
+		return -66;
+	}
+
+	// 卷模式下先写删除标记并落盘, 再移出索引与元数据, 否则两步之间崩溃时重启回放会让needle复活;
+	// 写入与落盘时不持有mongo_mutex_, 同一图片的上传与删除在wait_delete等待;
+	// 期间压缩或迁移可能移走needle, 重新加锁后索引位置变化时为新位置再写一次标记
+	deleting_.insert(iid);
+	while(storage_mode_==IDFS_STORAGE_VOLUME && needle_index_->find(iid, vol_location) \
+			&& !(killed && vol_location.vid==killed_location.vid && vol_location.offset==killed_location.offset))
+	{
+		mongo_mutex_.unlock();
+
+		tombstone.vid=vol_location.vid;
+		tombstone.generation=volume_store_->generation(vol_location.vid);
+		tombstone.offset=vol_location.offset;
+
+		diskWrite write(this, iid);
+		write.data=(const char*)&tombstone;
+		write.len=sizeof(tombstone);
+		write.flags=NEEDLE_FLAG_DELETED;
+
+		ret=write_image(write);
+		if(ret==0)
+			ret=sync_image(QVolumeStore::format_location(write.location));
+
+		mongo_mutex_.lock();
+		if(ret<0) {
+			// 恢复引用, 图片保持可读, 由客户端重试删除
+			mongo_client_->increment("imgid", imgid.c_str(), IDFS_DUP_COLUMN, 1, dup);
+			deleting_.erase(iid);
+			mongo_mutex_.unlock();
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"tombstone append error, imgid = (%lu), ret = (%d)!", \
+					iid, \
+					ret);
+			return -67;
+		}
+
+		killed=true;
+		killed_location=vol_location;
+	}
+	deleting_.erase(iid);
+
+	if(killed)
+		needle_index_->remove(iid);
+
+	if(mongo_client_->remove("imgid", imgid.c_str())==MONGO_ERR) {
+		mongo_mutex_.unlock();
+		return -66;
+	}
+
+	if(storage_mode_==IDFS_STORAGE_FILE)
+		::unlink(local_path(location).c_str());
+
+	if(hot_cache_!=NULL)
+		hot_cache_->erase(iid);
+	mongo_mutex_.unlock();
+
+	refs=0;
+	return 0;
+}
+
+int32_t IDFSServer::read_image(const char* ptr_data, int32_t data_len, char* ptr_out, int32_t out_size, replyVector& reply)
+{
+	std::string id_str(ptr_data, data_len);
+	std::string location("");
+	std::string img_crc("");
+	volumeLocation vol_location;
+	QVolume* vol=NULL;
+	cacheItem* item=NULL;
+	char* buf=NULL;
+	uint64_t data_offset=0;
+	uint64_t cache_epoch=0;
+	uint64_t iid=0;
+	int32_t length=0;
+	int32_t fd=-1;
+	int32_t ret=0;
+
+	// 请求体为"编号[:偏移[:长度]]", 长度缺省或为0时读到图片末尾
+	uint64_t range_offset=0;
+	uint64_t range_len=0;
+	std::string::size_type pos=id_str.find(':');
+	if(pos!=std::string::npos) {
+		std::string range_str=id_str.substr(pos+1);
+		char* range_end=NULL;
+
+		id_str.erase(pos);
+		range_offset=strtoull(range_str.c_str(), &range_end, 10);
+		if(*range_end==':')
+			range_len=strtoull(range_end+1, &range_end, 10);
+		if(range_str.empty()||range_str[0]<'0'||range_str[0]>'9'||*range_end!='\0') {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"read range error, range = (%s)!", \
+					range_str.c_str());
+			return -72;
+		}
+	}
+
+	// 32位md5串的前8字节即上传时计算的64位图片编号
+	if(id_str.length()==32 && strspn(id_str.c_str(), "0123456789abcdefABCDEF")==32) {
+		for(int32_t i=0; i<8; ++i)
+			iid|=(uint64_t)strtoul(id_str.substr(i<<1, 2).c_str(), NULL, 16)<<(i<<3);
+	} else {
+		char* id_end=NULL;
+		iid=strtoull(id_str.c_str(), &id_end, 10);
+		if(id_str.empty()||*id_end!='\0') {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"read imgid error, imgid = (%s)!", \
+					id_str.c_str());
+			return -69;
+		}
+	}
+
+	// 命中缓存时不再访问存储, 卷模式仍查一次索引以取得当前位置并确认图片未被删除;
+	// 删除与迁移改完元数据后才从缓存删除, 此前开始的读取带着旧删除计数, 读出的图片不会再放入缓存
+	if(hot_cache_!=NULL)
+		item=hot_cache_->get(iid, cache_epoch);
+
+	if(item!=NULL) {
+		if(storage_mode_==IDFS_STORAGE_VOLUME) {
+			if(!needle_index_->find(iid, vol_location)) {
+				hot_cache_->release(item);
+				return -69;
+			}
+			location=QVolumeStore::format_location(vol_location);
+		} else {
+			location=item->location;
+		}
+		length=item->len;
+	} else if(storage_mode_==IDFS_STORAGE_VOLUME) {
+		// 卷模式只查索引不访问mongo; 压缩可能在查找与获取之间移走needle, 此时按新位置重查
+		for(int32_t retry=0; retry<2 && vol==NULL; ++retry)
+		{
+			if(!needle_index_->find(iid, vol_location))
+				return -69;
+			vol=volume_store_->acquire(vol_location.vid);
+		}
+		if(vol==NULL)
+			return -70;
+
+		ret=vol->locate(vol_location.offset, iid, vol_location.size, data_offset);
+		if(ret<0) {
+			volume_store_->release(vol);
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"needle locate error, location = (%s), ret = (%d)!", \
+					QVolumeStore::format_location(vol_location).c_str(), \
+					ret);
+			return -70;
+		}
+
+		location=QVolumeStore::format_location(vol_location);
+		length=vol_location.size;
+	} else {
+		std::string imgid=q_to_string(iid);
+		struct stat st;
+
+		mongo_mutex_.lock();
+		if(!mongo_client_->exists("imgid", imgid.c_str()) \
+				||!mongo_client_->select("imgid", imgid.c_str(), location_column(), location, "imgcrc", img_crc)) {
+			mongo_mutex_.unlock();
+			return -69;
+		}
+		mongo_mutex_.unlock();
+
+		fd=::open(local_path(location).c_str(), O_RDONLY);
+		if(fd<0)
+			return -70;
+		if(fstat(fd, &st)<0||st.st_size>IDFS_IMG_MAX_SIZE) {
+			::close(fd);
+			return -70;
+		}
+
+		length=st.st_size;
+	}
+
+	// 记录访问, 迁移线程据此判断冷图片
+	if(access_tracker_!=NULL)
+		access_tracker_->touch(iid);
+
+	// 未命中时准入策略接受才读出整张图片放入缓存, 卷中needle读出时校验crc, 文件与元数据中的crc32c比对,
+	// 早于校验值的图片元数据中没有crc
+	if(item==NULL && hot_cache_!=NULL && hot_cache_->admit(iid, length)) {
+		buf=q_new_array<char>(length);
+		if(buf!=NULL) {
+			if(vol!=NULL)
+				ret=vol->read(vol_location.offset, iid, buf, length);
+			else if(pread(fd, buf, length, 0)!=length)
+				ret=-1;
+			else if(!img_crc.empty() && strtoul(img_crc.c_str(), NULL, 16)!=crc32c(0, buf, length))
+				ret=-4;
+
+			// 卷needle的-4与文件的-4均为数据与校验值不符
+			if(ret==-4)
+				q_add_and_fetch(&checksum_errors_);
+
+			if(ret<0) {
+				q_delete_array<char>(buf);
+				if(vol!=NULL)
+					volume_store_->release(vol);
+				else
+					::close(fd);
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"read image error, location = (%s), ret = (%d)!", \
+						location.c_str(), \
+						ret);
+				return -70;
+			}
+
+			item=hot_cache_->put(iid, buf, length, location, cache_epoch);
+			if(item!=NULL) {
+				if(vol!=NULL)
+					volume_store_->release(vol);
+				else
+					::close(fd);
+				vol=NULL;
+				fd=-1;
+			}
+		}
+	}
+
+	if(range_offset>(uint64_t)length) {
+		if(item!=NULL)
+			hot_cache_->release(item);
+		else if(vol!=NULL)
+			volume_store_->release(vol);
+		else
+			::close(fd);
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"read range error, imgid = (%lu), offset = (%lu), imglength = (%d)!", \
+				iid, \
+				range_offset, \
+				length);
+		return -72;
+	}
+	if(range_len==0||range_len>length-range_offset)
+		range_len=length-range_offset;
+
+	// 只发送请求的区间, 缓存图片与卷引用由server_reply_done释放, 文件由其关闭
+	if(item!=NULL) {
+		reply.add(item->data+range_offset, range_len);
+		reply.context=item;
+	} else if(vol!=NULL) {
+		reply.set_file(vol->fd(), data_offset+range_offset, range_len);
+		reply.context=vol;
+	} else {
+		reply.set_file(fd, range_offset, range_len);
+	}
+
+	return format_read_result(ptr_out, out_size, iid, location, length, range_offset, range_len);
+}
+
+int32_t IDFSServer::server_stats(char* buf, int32_t size)
+{
+	uint64_t direct_bytes=0;
+	uint64_t buffered_bytes=0;
+	cacheStat cache_stat;
+
+	if(volume_store_!=NULL)
+		volume_store_->io_bytes(direct_bytes, buffered_bytes);
+
+	if(hot_cache_!=NULL)
+		hot_cache_->stats(cache_stat);
+	uint64_t lookups=cache_stat.hits+cache_stat.misses;
+
+	// 压缩进度为当前卷已扫描字节的百分比, 未在压缩时为0
+	uint64_t total=compact_total_bytes_;
+	uint32_t progress=total>0?(uint32_t)(compact_done_bytes_*100/total):0;
+
+	int32_t ret=snprintf(buf, size, "volume_direct_bytes:%lu\r\n" \
+			"volume_buffered_bytes:%lu\r\n" \
+			"sync_batches:%u\r\n" \
+			"sync_writes:%u\r\n" \
+			"compact_volume:%u\r\n" \
+			"compact_progress:%u\r\n" \
+			"compacted_volumes:%u\r\n" \
+			"compact_copied_bytes:%lu\r\n" \
+			"compact_reclaimed_bytes:%lu\r\n" \
+			"hot_cache_hits:%lu\r\n" \
+			"hot_cache_misses:%lu\r\n" \
+			"hot_cache_hit_ratio:%lu\r\n" \
+			"hot_cache_evictions:%lu\r\n" \
+			"hot_cache_rejections:%lu\r\n" \
+			"hot_cache_bytes:%lu\r\n" \
+			"hot_cache_items:%lu\r\n" \
+			"torn_volumes:%u\r\n" \
+			"checksum_errors:%lu\r\n" \
+			"tier_migrating:%d\r\n" \
+			"tier_migrated_images:%lu\r\n" \
+			"tier_migrated_bytes:%lu\r\n" \
+			"tier_migrate_errors:%lu\r\n", \
+			direct_bytes, \
+			buffered_bytes, \
+			group_commit_.batches(), \
+			group_commit_.writes(), \
+			compact_vid_, \
+			progress, \
+			compact_volumes_, \
+			compact_copied_bytes_, \
+			compact_reclaimed_bytes_, \
+			cache_stat.hits, \
+			cache_stat.misses, \
+			lookups>0?cache_stat.hits*100/lookups:0, \
+			cache_stat.evictions, \
+			cache_stat.rejections, \
+			cache_stat.bytes, \
+			cache_stat.items, \
+			torn_volumes_, \
+			checksum_errors_, \
+			tier_migrating_, \
+			tier_migrated_images_, \
+			tier_migrated_bytes_, \
+			tier_migrate_errors_);
+	if(ret<0||ret>=size)
+		return -1;
+
+	// 每块磁盘的存储层与写入队列: 排队中的写入、已完成的写入、队列已满改写其他磁盘的次数、最近写入耗时与剩余空间
+	int32_t len=ret;
+	for(size_t i=0; disk_queues_!=NULL && i<img_paths_.size(); ++i)
+	{
+		ret=snprintf(buf+len, size-len, "disk%lu_queue_depth:%d\r\n" \
+				"disk%lu_writes:%lu\r\n" \
+				"disk%lu_queue_full:%lu\r\n" \
+				"disk%lu_latency_p50_us:%lu\r\n" \
+				"disk%lu_latency_p99_us:%lu\r\n" \
+				"disk%lu_free_bytes:%lu\r\n" \
+				"disk%lu_total_bytes:%lu\r\n" \
+				"disk%lu_readonly:%d\r\n" \
+				"disk%lu_tier:%s\r\n", \
+				i, disk_queues_[i].depth(), \
+				i, disk_queues_[i].jobs(), \
+				i, disk_queues_[i].rejected(), \
+				i, disk_queues_[i].latency(50), \
+				i, disk_queues_[i].latency(99), \
+				i, disk_queues_[i].free_bytes(), \
+				i, disk_queues_[i].total_bytes(), \
+				i, disk_queues_[i].readonly()?1:0, \
+				i, disk_tiers_[i]==IDFS_TIER_COLD?"cold":"hot");
+		if(ret<0||ret>=size-len)
+			return -1;
+		len+=ret;
+	}
+
+	return len;
+}
+
+int32_t IDFSServer::server_disk_usage(uint64_t& used_bytes, uint64_t& total_bytes)
+{
+	std::set<uint64_t> fsids;
+	int32_t readonly_disks=0;
+
+	if(disk_queues_==NULL)
+		return -1;
+
+	used_bytes=0;
+	total_bytes=0;
+	for(size_t i=0; i<img_paths_.size(); ++i)
+	{
+		if(disk_queues_[i].readonly())
+			++readonly_disks;
+		if(!fsids.insert(disk_queues_[i].fsid()).second)
+			continue;
+		used_bytes+=disk_queues_[i].total_bytes()-disk_queues_[i].free_bytes();
+		total_bytes+=disk_queues_[i].total_bytes();
+	}
+
+	return readonly_disks;
+}
+
+int32_t IDFSServer::save_index()
+{
+	std::vector<volumeMark> marks;
+	int32_t ret=0;
+
+	// 检查点线程与压缩线程都会写检查点, 共用同一临时文件, 需串行
+	index_save_mutex_.lock();
+
+	// 追加与登记索引都在磁盘写入锁内完成, 取得的写入位置之前的needle都已在索引中;
+	// 压缩改写索引在新卷落盘之后, 检查点早于改写时仍指向原卷, 原卷在下一次检查点之后才删除
+	volume_store_->marks(marks);
+
+	// 写入位置之前的needle落盘后检查点才生效, 重启时只需校验检查点之后的needle
+	ret=volume_store_->sync(marks);
+	if(ret==0)
+		ret=needle_index_->save(index_path_.c_str(), marks);
+	index_save_mutex_.unlock();
+
+	return ret;
+}
+
+int32_t IDFSServer::compact_volume(uint32_t vid, const volumeLive& live)
+{
+	QVolume* src=NULL;
+	QVolume* dst=NULL;
+	needleHeader header;
+	needleMove move;
+	needleTombstone tombstone;
+	std::vector<needleMove> moves;
+	std::vector<std::pair<uint64_t, needleTombstone> > kills;
+	volumeLocation location;
+	QStopwatch sw;
+	char* buf=NULL;
+	uint32_t buf_size=0;
+	uint32_t dst_vid=0;
+	uint64_t offset=VOLUME_HEADER_SIZE;
+	uint64_t next=0;
+	uint64_t capacity=0;
+	uint64_t copied=0;
+	uint64_t reclaimed=0;
+	int64_t moved=0;
+	int64_t wait_ms=0;
+	int32_t ret=0;
+
+	src=volume_store_->acquire(vid);
+	if(src==NULL)
+		return -1;
+
+	compact_total_bytes_=src->used();
+	compact_done_bytes_=0;
+	compact_vid_=vid;
+
+	// 新卷按存活needle总量建立, 不做直写补齐; 没有存活needle时不建新卷
+	if(live.needle_num>0) {
+		capacity=VOLUME_HEADER_SIZE+live.bytes;
+		capacity=(capacity+VOLUME_DIRECT_ALIGN-1)&~(uint64_t)(VOLUME_DIRECT_ALIGN-1);
+		dst=volume_store_->create_volume(capacity, src->disk());
+		if(dst==NULL) {
+			volume_store_->release(src);
+			compact_vid_=0;
+			return -2;
+		}
+		dst_vid=dst->vid();
+	}
+
+	sw.start();
+	while((ret=src->read_header(offset, header, next))==0)
+	{
+		if(compact_stop_) {
+			ret=-3;
+			break;
+		}
+
+		// 只复制索引仍指向此处的needle, 其余为已删除或已重新写入的死needle
+		if(dst!=NULL && needle_index_->find(header.key, location) && location.vid==vid && location.offset==offset) {
+			if(header.size>buf_size) {
+				q_delete_array<char>(buf);
+				buf_size=header.size;
+				buf=q_new_array<char>(buf_size);
+				if(buf==NULL) {
+					ret=-4;
+					break;
+				}
+			}
+
+			// 读取时校验数据, 损坏的needle不复制, 中止压缩保留原卷
+			if(src->read(offset, header.key, buf, header.size)<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"compact read error, volume = (%u), offset = (%lu), imgid = (%lu)!", \
+						vid, \
+						offset, \
+						header.key);
+				ret=-5;
+				break;
+			}
+
+			move.key=header.key;
+			move.from=location;
+			move.to.vid=dst_vid;
+			move.to.size=header.size;
+			if(dst->append(header.key, buf, header.size, move.to.offset, header.flags)<0) {
+				ret=-6;
+				break;
+			}
+			moves.push_back(move);
+			copied+=QVolume::needle_size(header.size);
+		} else if(header.flags==NEEDLE_FLAG_DELETED && header.size==sizeof(needleTombstone)) {
+			if(src->read(offset, header.key, (char*)&tombstone, sizeof(tombstone))<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"compact read error, volume = (%u), offset = (%lu), imgid = (%lu)!", \
+						vid, \
+						offset, \
+						header.key);
+				ret=-5;
+				break;
+			}
+
+			// 所删needle在其他卷且该卷仍在时保留删除标记, 否则needle已随其卷被压缩掉
+			if(tombstone.vid!=vid && volume_store_->generation(tombstone.vid)==tombstone.generation) {
+				kills.push_back(std::make_pair(header.key, tombstone));
+			}
+		}
+
+		offset=next;
+		compact_done_bytes_=offset;
+
+		// 限速: 按已复制字节计算应耗时间, 超前时休眠
+		if(compact_rate_>0) {
+			sw.stop();
+			wait_ms=(int64_t)(copied*1000/((uint64_t)compact_rate_<<20))-sw.elapsed_ms();
+			if(wait_ms>0)
+				q_sleep(wait_ms);
+		}
+	}
+	q_delete_array<char>(buf);
+
+	if(ret==1)
+		ret=0;
+
+	// 新卷落盘后释放其页缓存, 压缩不挤占热点图片
+	if(ret==0 && dst!=NULL) {
+		if(fdatasync(dst->fd())<0)
+			ret=-7;
+		else
+			posix_fadvise(dst->fd(), 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	// 保留的删除标记重新写入当前卷, 随下面的检查点落盘后才删除原卷
+	for(size_t i=0; ret==0 && i<kills.size(); ++i)
+	{
+		if(compact_stop_) {
+			ret=-3;
+			break;
+		}
+
+		diskWrite write(this, kills[i].first);
+		write.data=(const char*)&kills[i].second;
+		write.len=sizeof(needleTombstone);
+		write.flags=NEEDLE_FLAG_DELETED;
+		if(write_image(write)<0)
+			ret=-10;
+	}
+
+	if(ret<0) {
+		if(dst!=NULL) {
+			volume_store_->remove(dst_vid);
+			volume_store_->release(dst);
+		}
+		volume_store_->release(src);
+		compact_vid_=0;
+		compact_total_bytes_=0;
+		return ret;
+	}
+
+	// 改写索引与取检查点位置互斥, 检查点中的新卷位置与索引一致
+	mongo_mutex_.lock();
+	moved=needle_index_->relocate(moves);
+	mongo_mutex_.unlock();
+
+	if(moved<0) {
+		if(dst!=NULL) {
+			volume_store_->remove(dst_vid);
+			volume_store_->release(dst);
+		}
+		volume_store_->release(src);
+		compact_vid_=0;
+		compact_total_bytes_=0;
+		return -8;
+	}
+
+	// 复制期间被删除或重新写入的图片未改写位置, 其新卷副本写删除标记并落盘;
+	// 检查点写入前崩溃时新卷在旧检查点中没有写入位置, 重启全量扫描新卷也不会复活这些图片
+	for(size_t i=0; (size_t)moved<moves.size() && i<moves.size(); ++i)
+	{
+		if(needle_index_->find(moves[i].key, location) && location.vid==moves[i].to.vid \
+				&& location.offset==moves[i].to.offset)
+			continue;
+
+		tombstone.vid=moves[i].to.vid;
+		tombstone.generation=volume_store_->generation(moves[i].to.vid);
+		tombstone.offset=moves[i].to.offset;
+
+		diskWrite write(this, moves[i].key);
+		write.data=(const char*)&tombstone;
+		write.len=sizeof(tombstone);
+		write.flags=NEEDLE_FLAG_DELETED;
+		if(write_image(write)<0||sync_image(QVolumeStore::format_location(write.location))<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"tombstone append error, imgid = (%lu)!", \
+					moves[i].key);
+		}
+	}
+
+	// 检查点写成功后才删除原卷, 否则重启时旧检查点仍指向原卷
+	ret=save_index();
+	if(ret<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"needle index (%s) checkpoint error after compacting volume (%u), ret = (%d)!", \
+				index_path_.c_str(), \
+				vid, \
+				ret);
+		volume_store_->release(dst);
+		volume_store_->release(src);
+		compact_vid_=0;
+		compact_total_bytes_=0;
+		return -9;
+	}
+
+	reclaimed=src->capacity()-(dst!=NULL?dst->capacity():0);
+	volume_store_->release(dst);
+	volume_store_->release(src);
+	volume_store_->remove(vid);
+
+	compact_volumes_++;
+	compact_copied_bytes_+=copied;
+	compact_reclaimed_bytes_+=reclaimed;
+	compact_vid_=0;
+	compact_total_bytes_=0;
+
+	logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+			"volume (%u) compacted into volume (%u), needles = (%ld), copied = (%lu), reclaimed = (%lu)", \
+			vid, \
+			dst_vid, \
+			moved, \
+			copied, \
+			reclaimed);
+
+	return 0;
+}
+
+void* IDFSServer::compact_thread(void* argv)
+{
+	IDFSServer* server=reinterpret_cast<IDFSServer*>(argv);
+	std::vector<volumeLive> lives;
+	std::vector<volumeStat> stats;
+	volumeLive empty;
+	const volumeLive* live=NULL;
+	int64_t elapsed=0;
+	uint64_t used=0;
+	uint64_t dead=0;
+	uint32_t ratio=0;
+	uint32_t best_ratio=0;
+	uint32_t best_vid=0;
+	int32_t ret=0;
+
+	while(!server->compact_stop_)
+	{
+		q_sleep(100);
+		elapsed+=100;
+		if(elapsed<(int64_t)server->compact_interval_*1000)
+			continue;
+		elapsed=0;
+
+		// 死needle比例=卷中未被索引引用的字节占已写字节的比例, 当前卷不参与压缩
+		server->needle_index_->live(lives);
+		server->volume_store_->stats(stats);
+
+		best_ratio=0;
+		best_vid=0;
+		for(size_t i=0; i<stats.size(); ++i)
+		{
+			if(stats[i].active||stats[i].used<=VOLUME_HEADER_SIZE)
+				continue;
+
+			live=stats[i].vid<lives.size()?&lives[stats[i].vid]:&empty;
+			used=stats[i].used-VOLUME_HEADER_SIZE;
+			dead=used>live->bytes?used-live->bytes:0;
+			ratio=(uint32_t)(dead*100/used);
+			if(ratio>=(uint32_t)server->compact_dead_ratio_ && ratio>best_ratio) {
+				best_ratio=ratio;
+				best_vid=stats[i].vid;
+			}
+		}
+
+		if(best_vid==0)
+			continue;
+
+		live=best_vid<lives.size()?&lives[best_vid]:&empty;
+		ret=server->compact_volume(best_vid, *live);
+		if(ret<0) {
+			server->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, server->log_screen_, \
+					"compact volume (%u) error, dead ratio = (%u), ret = (%d)!", \
+					best_vid, \
+					best_ratio, \
+					ret);
+		}
+
+		// 一次压缩完成后立即检查下一个卷
+		elapsed=(int64_t)server->compact_interval_*1000;
+	}
+
+	return NULL;
+}
+
+void IDFSServer::migrate_wait(QStopwatch& sw, uint64_t moved)
+{
+	int64_t wait_ms=0;
+
+	if(tier_migrate_rate_<=0)
+		return;
+
+	sw.stop();
+	wait_ms=(int64_t)(moved*1000/((uint64_t)tier_migrate_rate_<<20))-sw.elapsed_ms();
+	if(wait_ms>0)
+		q_sleep(wait_ms);
+}
+
+int32_t IDFSServer::migrate_volume(uint32_t vid, QStopwatch& sw, uint64_t& moved)
+{
+	QVolume* src=NULL;
+	needleHeader header;
+	needleMove move;
+	needleTombstone tombstone;
+	std::vector<needleMove> moves;
+	std::vector<uint32_t> disks;
+	std::vector<volumeMark> marks;
+	volumeLocation location;
+	char* buf=NULL;
+	uint32_t buf_size=0;
+	uint64_t offset=VOLUME_HEADER_SIZE;
+	uint64_t next=0;
+	uint64_t bytes=0;
+	int64_t relocated=0;
+	int32_t ret=0;
+
+	src=volume_store_->acquire(vid);
+	if(src==NULL)
+		return -1;
+
+	while((ret=src->read_header(offset, header, next))==0)
+	{
+		if(tier_stop_) {
+			ret=-2;
+			break;
+		}
+
+		// 只迁移索引仍指向此处的冷图片, 其余为死needle
+		if(needle_index_->find(header.key, location) && location.vid==vid && location.offset==offset \
+				&& access_tracker_->cold(header.key, tier_cold_days_, tier_cold_count_)) {
+			if(header.size>buf_size) {
+				q_delete_array<char>(buf);
+				buf_size=header.size;
+				buf=q_new_array<char>(buf_size);
+				if(buf==NULL) {
+					ret=-3;
+					break;
+				}
+			}
+
+			// 读取时校验数据, 损坏的needle不迁移
+			if(src->read(offset, header.key, buf, header.size)<0) {
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"migrate read error, volume = (%u), offset = (%lu), imgid = (%lu)!", \
+						vid, \
+						offset, \
+						header.key);
+				ret=-4;
+				break;
+			}
+
+			// 冷层磁盘按剩余空间依次尝试
+			place_disks(header.key, disks, true, IDFS_TIER_COLD);
+			move.key=header.key;
+			move.from=location;
+			ret=-5;
+			for(size_t i=0; i<disks.size() && ret<0; ++i)
+				ret=volume_store_->append(disks[i], header.key, buf, header.size, move.to, header.flags);
+			if(ret<0) {
+				ret=-5;
+				break;
+			}
+
+			moves.push_back(move);
+			moved+=QVolume::needle_size(header.size);
+			migrate_wait(sw, moved);
+		}
+
+		offset=next;
+	}
+	q_delete_array<char>(buf);
+	volume_store_->release(src);
+
+	if(ret==1)
+		ret=0;
+
+	if(moves.empty())
+		return ret;
+
+	// 冷层副本落盘后才改写索引, 改写与取检查点位置互斥
+	volume_store_->marks(marks);
+	if(volume_store_->sync(marks)==0) {
+		mongo_mutex_.lock();
+		relocated=needle_index_->relocate(moves);
+		mongo_mutex_.unlock();
+	} else {
+		ret=-6;
+	}
+
+	// 复制期间被删除或重新写入的图片, 其冷层副本写删除标记, 重启回放时不会复活
+	for(size_t i=0; i<moves.size(); ++i)
+	{
+		if(relocated>0 && needle_index_->find(moves[i].key, location) && location.vid==moves[i].to.vid \
+				&& location.offset==moves[i].to.offset) {
+			bytes+=moves[i].to.size;
+			continue;
+		}
+
+		tombstone.vid=moves[i].to.vid;
+		tombstone.generation=volume_store_->generation(moves[i].to.vid);
+		tombstone.offset=moves[i].to.offset;
+
+		diskWrite write(this, moves[i].key);
+		write.data=(const char*)&tombstone;
+		write.len=sizeof(tombstone);
+		write.flags=NEEDLE_FLAG_DELETED;
+		if(write_image(write)<0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"tombstone append error, imgid = (%lu)!", \
+					moves[i].key);
+		}
+	}
+
+	if(relocated<0)
+		return -7;
+
+	tier_migrated_images_+=relocated;
+	tier_migrated_bytes_+=bytes;
+	return ret<0?ret:(int32_t)relocated;
+}
+
+int32_t IDFSServer::migrate_files(uint32_t disk, QStopwatch& sw, uint64_t& moved)
+{
+	DIR* dir=NULL;
+	struct dirent* entry=NULL;
+	char* name_end=NULL;
+	uint64_t iid=0;
+	int32_t migrated=0;
+	int32_t ret=0;
+
+	for(int32_t i=0; i<IDFS_IMG_SUBDIR_NAMES && !tier_stop_; ++i)
+	{
+		std::string subdir=q_format("%s/%03d", img_dir_, i);
+
+		dir=opendir(q_format("%s/%s", img_paths_[disk].c_str(), subdir.c_str()).c_str());
+		if(dir==NULL)
+			continue;
+
+		while(!tier_stop_ && (entry=readdir(dir))!=NULL)
+		{
+			// 文件名为十六进制图片编号加扩展名
+			iid=strtoull(entry->d_name, &name_end, 16);
+			if(name_end==entry->d_name||*name_end!='.')
+				continue;
+
+			if(!access_tracker_->cold(iid, tier_cold_days_, tier_cold_count_))
+				continue;
+
+			ret=migrate_file(iid, disk, subdir+"/"+entry->d_name);
+			if(ret<0) {
+				tier_migrate_errors_++;
+				logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+						"migrate image error, file = (%s/%s/%s), ret = (%d)!", \
+						img_paths_[disk].c_str(), \
+						subdir.c_str(), \
+						entry->d_name, \
+						ret);
+			} else if(ret>0) {
+				migrated++;
+				moved+=ret;
+				migrate_wait(sw, moved);
+			}
+		}
+		closedir(dir);
+	}
+
+	return migrated;
+}
+
+int32_t IDFSServer::migrate_file(uint64_t iid, uint32_t disk, const std::string& name)
+{
+	std::string imgid=q_to_string(iid);
+	std::string old_path=q_format("%s/%s", img_paths_[disk].c_str(), name.c_str());
+	std::string old_location=disk_location(disk, name);
+	std::string location("");
+	std::string new_location("");
+	std::string img_crc("");
+	std::vector<uint32_t> disks;
+	struct stat st;
+	char* buf=NULL;
+	uint32_t crc=0;
+	int32_t len=0;
+	int32_t fd=-1;
+	int32_t ret=0;
+
+	mongo_mutex_.lock();
+	if(!mongo_client_->exists("imgid", imgid.c_str()) \
+			||!mongo_client_->select("imgid", imgid.c_str(), location_column(), location, "imgcrc", img_crc)) {
+		mongo_mutex_.unlock();
+		return 0;
+	}
+	mongo_mutex_.unlock();
+
+	// 元数据指向别处时不是当前副本; 指向冷层同名文件的是重启前已迁移但未及删除的原文件
+	if(location!=old_location) {
+		for(uint32_t i=0; i<img_paths_.size(); ++i)
+		{
+			if(disk_tiers_[i]==IDFS_TIER_COLD && location==disk_location(i, name))
+				::unlink(old_path.c_str());
+		}
+		return 0;
+	}
+
+	fd=::open(old_path.c_str(), O_RDONLY);
+	if(fd<0)
+		return -1;
+	if(fstat(fd, &st)<0||st.st_size<=0||st.st_size>IDFS_IMG_MAX_SIZE) {
+		::close(fd);
+		return -1;
+	}
+
+	len=st.st_size;
+	buf=q_new_array<char>(len);
+	if(buf==NULL||pread(fd, buf, len, 0)!=len) {
+		q_delete_array<char>(buf);
+		::close(fd);
+		return -2;
+	}
+	::close(fd);
+
+	// 与元数据中的crc32c不符的图片不迁移, 早于校验值的图片元数据中没有crc
+	crc=crc32c(0, buf, len);
+	if(!img_crc.empty() && strtoul(img_crc.c_str(), NULL, 16)!=crc) {
+		q_add_and_fetch(&checksum_errors_);
+		q_delete_array<char>(buf);
+		return -3;
+	}
+
+	// 冷层磁盘按剩余空间依次尝试, 复制落盘后改名随文件系统一并同步
+	place_disks(iid, disks, true, IDFS_TIER_COLD);
+	ret=-4;
+	for(size_t i=0; i<disks.size() && ret<0; ++i)
+	{
+		std::string path=q_format("%s/%s", img_paths_[disks[i]].c_str(), name.c_str());
+		std::string temp_path=q_format("%s/%s/%s/%d.%u", img_paths_[disks[i]].c_str(), img_dir_, IDFS_IMG_TMP_DIR, \
+				getpid(), q_add_and_fetch(&stream_seq_));
+
+		ret=save_image(path.c_str(), temp_path.c_str(), buf, len, crc);
+		if(ret<0) {
+			::unlink(temp_path.c_str());
+			continue;
+		}
+
+		// 落盘失败的副本删除后改写下一块冷层磁盘
+		fd=::open(path.c_str(), O_RDONLY);
+		if(fd<0||syncfs(fd)<0) {
+			if(fd>=0)
+				::close(fd);
+			::unlink(path.c_str());
+			ret=-5;
+			continue;
+		}
+		::close(fd);
+		new_location=disk_location(disks[i], name);
+	}
+	q_delete_array<char>(buf);
+
+	if(ret<0)
+		return ret;
+
+	// 复制期间图片可能已被删除或重新写入, 元数据仍指向原文件时才改写位置
+	mongo_mutex_.lock();
+	ret=1;
+	if(mongo_client_->exists("imgid", imgid.c_str()) \
+			&& mongo_client_->select("imgid", imgid.c_str(), location_column(), location) \
+			&& location==old_location) {
+		ret=mongo_client_->update("imgid", imgid.c_str(), location_column(), new_location.c_str())==MONGO_ERR?-6:0;
+		if(ret==0 && hot_cache_!=NULL)
+			hot_cache_->erase(iid);
+	}
+	mongo_mutex_.unlock();
+
+	if(ret!=0) {
+		if(location!=new_location)
+			::unlink(local_path(new_location).c_str());
+		return ret<0?ret:0;
+	}
+
+	// 已解析到原位置的读取可能尚未打开文件, 原文件留到下一轮删除
+	tier_unlinks_.push_back(old_path);
+	tier_migrated_images_++;
+	tier_migrated_bytes_+=len;
+	return len;
+}
+
+void* IDFSServer::tier_thread(void* argv)
+{
+	IDFSServer* server=reinterpret_cast<IDFSServer*>(argv);
+	std::vector<volumeStat> stats;
+	QStopwatch sw;
+	uint64_t moved=0;
+	uint64_t images=0;
+	uint64_t bytes=0;
+	int64_t elapsed=0;
+	int32_t ret=0;
+
+	while(!server->tier_stop_)
+	{
+		q_sleep(100);
+		elapsed+=100;
+		if(elapsed<(int64_t)server->tier_migrate_interval_*1000)
+			continue;
+		elapsed=0;
+
+		server->tier_migrating_=1;
+		server->access_tracker_->decay();
+
+		// 上一轮迁移留下的原文件, 解析到原位置的读取此时都已结束
+		for(size_t i=0; i<server->tier_unlinks_.size(); ++i)
+			::unlink(server->tier_unlinks_[i].c_str());
+		server->tier_unlinks_.clear();
+
+		moved=0;
+		images=server->tier_migrated_images_;
+		bytes=server->tier_migrated_bytes_;
+		sw.start();
+
+		if(server->storage_mode_==IDFS_STORAGE_VOLUME) {
+			server->volume_store_->stats(stats);
+			for(size_t i=0; i<stats.size() && !server->tier_stop_; ++i)
+			{
+				if(server->disk_tiers_[stats[i].disk]!=IDFS_TIER_HOT)
+					continue;
+
+				ret=server->migrate_volume(stats[i].vid, sw, moved);
+				if(ret<0 && !server->tier_stop_) {
+					server->tier_migrate_errors_++;
+					server->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, server->log_screen_, \
+							"migrate volume (%u) error, ret = (%d)!", \
+							stats[i].vid, \
+							ret);
+				}
+			}
+		} else {
+			for(uint32_t disk=0; disk<server->img_paths_.size() && !server->tier_stop_; ++disk)
+			{
+				if(server->disk_tiers_[disk]==IDFS_TIER_HOT)
+					server->migrate_files(disk, sw, moved);
+			}
+		}
+
+		server->tier_migrating_=0;
+
+		if(server->tier_migrated_images_>images) {
+			server->logger_->log(LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, server->log_screen_, \
+					"migrated (%lu) images to the cold tier, bytes = (%lu)", \
+					server->tier_migrated_images_-images, \
+					server->tier_migrated_bytes_-bytes);
+		}
+	}
+
+	return NULL;
+}
+
+void* IDFSServer::index_thread(void* argv)
+{
+	IDFSServer* server=reinterpret_cast<IDFSServer*>(argv);
+	int64_t elapsed=0;
+	int32_t ret=0;
+
+	while(!server->index_stop_)
+	{
+		q_sleep(100);
+		elapsed+=100;
+		if(elapsed<(int64_t)server->index_checkpoint_interval_*1000)
+			continue;
+		elapsed=0;
+
+		ret=server->save_index();
+		if(ret<0) {
+			server->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, server->log_screen_, \
+					"needle index (%s) checkpoint error, ret = (%d)!", \
+					server->index_path_.c_str(), \
+					ret);
+		}
+	}
+
+	return NULL;
+}
+
+void IDFSServer::index_visitor(void* arg, uint32_t vid, uint32_t generation, uint64_t offset, const needleHeader& header, \
+		const needleTombstone* tombstone)
+{
+	IDFSServer* server=reinterpret_cast<IDFSServer*>(arg);
+	volumeLocation location;
+	int32_t ret=0;
+
+	// 多块磁盘上的卷交错回放, 删除标记可能先于所删needle; 只移出它指向的needle,
+	// 尚未回放的记下, 回放到时跳过; 所在卷已被压缩移除的标记失效
+	if(header.flags&NEEDLE_FLAG_DELETED) {
+		if(tombstone==NULL) {
+			server->needle_index_->remove(header.key);
+		} else if(server->volume_store_->generation(tombstone->vid)==tombstone->generation) {
+			if(server->needle_index_->find(header.key, location) && location.vid==tombstone->vid \
+					&& location.offset==tombstone->offset)
+				server->needle_index_->remove(header.key);
+			else
+				server->replay_kills_.insert(std::make_pair(tombstone->vid, tombstone->offset));
+		}
+		return;
+	}
+
+	if(!server->replay_kills_.empty() && server->replay_kills_.count(std::make_pair(vid, offset))>0)
+		return;
+
+	location.vid=vid;
+	location.offset=offset;
+	location.size=header.size;
+	ret=server->needle_index_->insert(header.key, location);
+	if(ret<0) {
+		server->logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, server->log_screen_, \
+				"needle index insert error, location = (%s), ret = (%d)!", \
+				QVolumeStore::format_location(location).c_str(), \
+				ret);
+	}
+}
+
+const char* IDFSServer::get_image_type_name(int32_t type)
+{
+	switch(type)
+	{
+	case 0:
+		return "jpg";
+	case 1:
+		return "png";
+	case 2:
+		return "bmp";
+	case 3:
+		return "gif";
+	case 4:
+		return "tif";
+	default:
+		return "jpg";
+	}
+}
+
+int32_t IDFSServer::format_result(char* ptr_out, int32_t out_size, uint64_t iid, const std::string& img_md5, \
+		const std::string& location, const std::string& img_size)
+{
+	char* ptr_temp=ptr_out;
+	char* ptr_end=ptr_temp+out_size;
+	int32_t ret=0;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -51;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<doc>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -52;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<base>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -53;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgid><![CDATA[%lu]]></imgid>\n", iid);
+	if(ptr_temp+ret>=ptr_end)
+		return -58;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgmd5><![CDATA[%s]]></imgmd5>\n", img_md5.c_str());
+	if(ptr_temp+ret>=ptr_end)
+		return -59;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<%s><![CDATA[%s]]></%s>\n", location_column(), location.c_str(), location_column());
+	if(ptr_temp+ret>=ptr_end)
+		return -60;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgsize><![CDATA[%s]]></imgsize>\n", img_size.c_str());
+	if(ptr_temp+ret>=ptr_end)
+		return -61;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</base>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -62;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</doc>");
+	if(ptr_temp+ret>=ptr_end)
+		return -63;
+	ptr_temp+=ret;
+
+	return (ptrdiff_t)(ptr_temp-ptr_out);
+}
+
+int32_t IDFSServer::format_delete_result(char* ptr_out, int32_t out_size, uint64_t iid, int32_t refs)
+{
+	char* ptr_temp=ptr_out;
+	char* ptr_end=ptr_temp+out_size;
+	int32_t ret=0;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -51;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<doc>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -52;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<base>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -53;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgid><![CDATA[%lu]]></imgid>\n", iid);
+	if(ptr_temp+ret>=ptr_end)
+		return -58;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgref><![CDATA[%d]]></imgref>\n", refs);
+	if(ptr_temp+ret>=ptr_end)
+		return -68;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</base>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -62;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</doc>");
+	if(ptr_temp+ret>=ptr_end)
+		return -63;
+	ptr_temp+=ret;
+
+	return (ptrdiff_t)(ptr_temp-ptr_out);
+}
+
+int32_t IDFSServer::format_read_result(char* ptr_out, int32_t out_size, uint64_t iid, const std::string& location, int32_t length, \
+		uint64_t range_offset, uint64_t range_len)
+{
+	char* ptr_temp=ptr_out;
+	char* ptr_end=ptr_temp+out_size;
+	int32_t ret=0;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -51;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<doc>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -52;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<base>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -53;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imgid><![CDATA[%lu]]></imgid>\n", iid);
+	if(ptr_temp+ret>=ptr_end)
+		return -58;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<%s><![CDATA[%s]]></%s>\n", location_column(), location.c_str(), location_column());
+	if(ptr_temp+ret>=ptr_end)
+		return -60;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<imglength><![CDATA[%d]]></imglength>\n", length);
+	if(ptr_temp+ret>=ptr_end)
+		return -71;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<rangeoffset><![CDATA[%lu]]></rangeoffset>\n", range_offset);
+	if(ptr_temp+ret>=ptr_end)
+		return -73;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "<rangelength><![CDATA[%lu]]></rangelength>\n", range_len);
+	if(ptr_temp+ret>=ptr_end)
+		return -74;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</base>\n");
+	if(ptr_temp+ret>=ptr_end)
+		return -62;
+	ptr_temp+=ret;
+
+	ret=snprintf(ptr_temp, ptr_end-ptr_temp, "</doc>");
+	if(ptr_temp+ret>=ptr_end)
+		return -63;
+	ptr_temp+=ret;
+
+	return (ptrdiff_t)(ptr_temp-ptr_out);
+}
+
+int32_t IDFSServer::server_stream_begin(const char* request_buffer, int32_t buf_len, int32_t request_len, void*& stream, \
+		const void* handle)
+{
+	Q_CHECK_PTR(request_buffer);
+
+	const char* ptr_temp=request_buffer;
+	int32_t head_len=sizeof(requestParam)+sizeof(uint16_t)+sizeof(int32_t);
+	uint16_t operate_type=0;
+	int32_t data_len=0;
+	int32_t ret=0;
+
+	if(buf_len<head_len) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"Stream head too short, buf_len = (%d)!", \
+				buf_len);
+		return TCP_ERR_DATA_LENGTH;
+	}
+
+	requestParam* request_param=reinterpret_cast<requestParam*>((char*)request_buffer);
+	ptr_temp+=sizeof(requestParam);
+
+	if(request_param->protocol_type!=TCP_DEFAULT_PROTOCOL_TYPE) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"Protocol type error, protocol_type = (%d)!", \
+				request_param->protocol_type);
+		return TCP_ERR_PROTOCOL_TYPE;
+	}
+
+	if(request_param->source_type!=TCP_DEFAULT_COMMAND_TYPE) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"Source type error, source_type = (%d)!", \
+				request_param->source_type);
+		return TCP_ERR_SOURCE_TYPE;
+	}
+
+	if(request_param->command_type!=TCP_DEFAULT_OPERATE_TYPE) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"Command type error, command_type = (%d)!", \
+				request_param->command_type);
+		return TCP_ERR_COMMAND_TYPE;
+	}
+
+	operate_type=*(uint16_t*)ptr_temp;
+	ptr_temp+=sizeof(uint16_t);
+
+	data_len=*(int32_t*)ptr_temp;
+	ptr_temp+=sizeof(int32_t);
+
+	if(data_len<=0 || head_len+data_len!=request_len) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"Data length error, data_len = (%d)!", \
+				data_len);
+		return TCP_ERR_DATA_LENGTH;
+	}
+
+	// 只有图片上传可以流式处理, 其余操作的请求体不会很大
+	if(operate_type>=5) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"Operate type (%d) can not be streamed!", \
+				operate_type);
+		return TCP_ERR_OPERATE_TYPE;
+	}
+
+	imgStream* img_stream=q_new<imgStream>();
+	if(img_stream==NULL)
+		return TCP_ERR_HEAP_ALLOC;
+
+	// 图片编号在收完数据后才知道, 临时文件放在剩余空间最多的磁盘
+	std::vector<uint32_t> disks;
+	place_disks(0, disks, true);
+	if(disks.empty()) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"all disks are read-only!");
+		q_delete<imgStream>(img_stream);
+		return -55;
+	}
+
+	img_stream->operate_type=operate_type;
+	img_stream->data_len=data_len;
+	img_stream->disk=disks[0];
+	img_stream->temp_path=q_format("%s/%s/%s/%d.%u", img_paths_[img_stream->disk].c_str(), img_dir_, IDFS_IMG_TMP_DIR, \
+			getpid(), q_add_and_fetch(&stream_seq_));
+
+	img_stream->fd=::open(img_stream->temp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(img_stream->fd<0) {
+		logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+				"open temp file (%s) error, errno = (%d)!", \
+				img_stream->temp_path.c_str(), \
+				errno);
+		q_delete<imgStream>(img_stream);
+		return -55;
+	}
+
+	img_stream->hasher.MD5Begin();
+
+	ret=server_stream_data(img_stream, ptr_temp, buf_len-head_len);
+	if(ret<0) {
+		server_stream_abort(img_stream);
+		return ret;
+	}
+
+	stream=img_stream;
+	return TCP_OK;
+}
+
+int32_t IDFSServer::server_stream_data(void* stream, const char* ptr_data, int32_t data_len)
+{
+	imgStream* img_stream=reinterpret_cast<imgStream*>(stream);
+	Q_CHECK_PTR(img_stream);
+
+	const char* ptr_temp=ptr_data;
+	int32_t ret=0;
+
+	if(data_len>img_stream->data_len-img_stream->recv_len)
+		return TCP_ERR_DATA_LENGTH;
+
+	img_stream->hasher.MD5Append((const unsigned char*)ptr_data, data_len);
+	img_stream->crc=crc32c(img_stream->crc, ptr_data, data_len);
+
+	while(ptr_temp<ptr_data+data_len)
+	{
+		ret=(int32_t)::write(img_stream->fd, ptr_temp, ptr_data+data_len-ptr_temp);
+		if(ret<0 && errno==EINTR)
+			continue;
+		if(ret<=0) {
+			logger_->log(LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, log_screen_, \
+					"write temp file (%s) error, errno = (%d)!", \
+					img_stream->temp_path.c_str(), \
+					errno);
+			return -55;
+		}
+		ptr_temp+=ret;
+	}
+
+	img_stream->recv_len+=data_len;
+	return TCP_OK;
+}
+
+int32_t IDFSServer::server_stream_end(void* stream, char* reply_buffer, int32_t reply_size, const void* handle)
+{
+	imgStream* img_stream=reinterpret_cast<imgStream*>(stream);
+	Q_CHECK_PTR(img_stream);
+	Q_CHECK_PTR(reply_buffer);
+
+	unsigned char digest[16]={0};
+	char digest_hex[33]={0};
+	uint64_t iid=0;
+	int32_t ret=0;
+
+	std::string imgid("");
+	std::string location("");
+	std::string img_size("");
+	std::string img_md5("");
+	std::string img_crc("");
+
+	int32_t width=0;
+	int32_t height=0;
+
+	if(img_stream->recv_len!=img_stream->data_len) {
+		server_stream_abort(img_stream);
+		return TCP_ERR_DATA_LENGTH;
+	}
+
+	if(::close(img_stream->fd)<0) {
+		img_stream->fd=-1;
+		server_stream_abort(img_stream);
+		return -55;
+	}
+	img_stream->fd=-1;
+
+	// 同一份摘要得到64位图片编号与md5串, 与整块处理时的结果一致
+	img_stream->hasher.MD5End(digest);
+	iid=*(uint64_t*)digest;
+	imgid=q_to_string(iid);
+
+	for(int32_t i=0; i<16; ++i)
+		sprintf(digest_hex+i*2, "%02x", digest[i]);
+	img_md5=digest_hex;
+	img_crc=q_format("%08x", img_stream->crc);
+
+	mongo_mutex_.lock();
+	if(image_exists(imgid))
+	{
+		if(!mongo_client_->select("imgid", imgid.c_str(), location_column(), location, "imgsize", img_size)) {
+			mongo_mutex_.unlock();
+			server_stream_abort(img_stream);
+			return -54;
+		}
+		if(add_reference(imgid)<0) {
+			mongo_mutex_.unlock();
+			server_stream_abort(img_stream);
+			return -65;
+		}
+		mongo_mutex_.unlock();
+		::unlink(img_stream->temp_path.c_str());
+	} else {
+		mongo_mutex_.unlock();
+
+		ret=getImageSize(img_stream->temp_path.c_str(), &width, &height);
+		if(ret<0) {
+			server_stream_abort(img_stream);
+			return -56;
+		}
+
+		img_size=q_format("%d*%d", width, height);
+
+		if(storage_mode_==IDFS_STORAGE_VOLUME) {
+			// 卷模式下临时文件整体追加到卷中后删除
+			int32_t fd=::open(img_stream->temp_path.c_str(), O_RDONLY);
+			if(fd<0||append_volume(iid, NULL, img_stream->data_len, fd, location)<0) {
+				if(fd>=0)
+					::close(fd);
+				server_stream_abort(img_stream);
+				return -55;
+			}
+			::close(fd);
+			::unlink(img_stream->temp_path.c_str());
+		} else {
+			// 文件模式下图片留在临时文件所在的磁盘
+			location=disk_location(img_stream->disk, q_format("%s/%03d/%lx.%s", img_dir_, static_cast<int32_t>(iid%1000), iid, \
+					get_image_type_name(img_stream->operate_type)));
+
+			if(::rename(img_stream->temp_path.c_str(), local_path(location).c_str())<0) {
+				server_stream_abort(img_stream);
+				return -55;
+			}
+		}
+
+		ret=commit_image(imgid, location, img_size, img_crc);
+		if(ret<0) {
+			// 文件模式下图片已改名到位, 元数据未指向它时删除; 同一图片可能已由其他请求登记到同一路径
+			if(storage_mode_==IDFS_STORAGE_FILE) {
+				std::string current("");
+				mongo_mutex_.lock();
+				if(!mongo_client_->exists("imgid", imgid.c_str()) \
+						||!mongo_client_->select("imgid", imgid.c_str(), location_column(), current) \
+						||current!=location)
+					::unlink(local_path(location).c_str());
+				mongo_mutex_.unlock();
+			}
+			q_delete<imgStream>(img_stream);
+			return ret;
+		}
+	}
+
+	q_delete<imgStream>(img_stream);
+
+	replyParam* reply_param=reinterpret_cast<replyParam*>(reply_buffer);
+	memset(reply_param, 0, sizeof(replyParam));
+	reply_param->command_type=TCP_DEFAULT_OPERATE_TYPE;
+
+	ret=format_result(reply_buffer+sizeof(replyParam)+sizeof(int32_t), reply_size-sizeof(replyParam)-sizeof(int32_t), \
+			iid, img_md5, location, img_size);
+	if(ret<0)
+		return ret;
+
+	*(int32_t*)(reply_buffer+sizeof(replyParam))=ret;
+	return sizeof(replyParam)+sizeof(int32_t)+ret;
+}
+
+void IDFSServer::server_stream_abort(void* stream)
+{
+	imgStream* img_stream=reinterpret_cast<imgStream*>(stream);
+	if(img_stream==NULL)
+		return;
+
+	if(img_stream->fd>=0)
+		::close(img_stream->fd);
+	::unlink(img_stream->temp_path.c_str());
+
+	q_delete<imgStream>(img_stream);
+}
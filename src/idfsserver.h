@@ -20,15 +20,110 @@
 #include "MD5.h"
 
 #include "qmongoclient.h"
+#include "qaccesstracker.h"
+#include "qdiskqueue.h"
 #include "qglobal.h"
+#include "qgroupcommit.h"
+#include "qimagecache.h"
 #include "qnetworkaccessmanager.h"
 #include "qopencv.h"
+#include "qneedleindex.h"
 #include "qtcpsocket.h"
+#include "qvolume.h"
 
 #define IDFS_IMG_MAX_SIZE (3<<20)
+#define IDFS_IMG_TMP_DIR  ("tmp")
+#define IDFS_VOLUME_DIR   ("volume")
+#define IDFS_INDEX_FILE   ("needle.idx")
+#define IDFS_ACCESS_FILE  ("access.map")
+#define IDFS_URING_ENTRIES (8)
+
+/* operate types besides the image uploads 0-4 and the url fetch 64 */
+#define IDFS_OP_DELETE      (65)
+#define IDFS_OP_READ        (66)
+
+/* extra uploads of a deduplicated image, its reference count is imgdup+1 */
+#define IDFS_DUP_COLUMN     ("imgdup")
+
+/* storage mode */
+#define IDFS_STORAGE_FILE   (0)
+#define IDFS_STORAGE_VOLUME (1)
+
+/* disk placement of new images when img-path lists several disks */
+#define IDFS_PLACEMENT_HASH  (0)
+#define IDFS_PLACEMENT_SPACE (1)
+#define IDFS_PLACEMENT_ADAPTIVE (2)
+
+/* storage tier of a disk, new images go to the hot disks and cold images migrate to the cold disks */
+#define IDFS_TIER_HOT        (0)
+#define IDFS_TIER_COLD       (1)
+
+/* file mode names images by imgid%IDFS_IMG_SUBDIR_NAMES under img-dir */
+#define IDFS_IMG_SUBDIR_NAMES (1000)
+
+/* writes a disk must have seen before its latency can make it read-only */
+#define IDFS_DISK_MIN_SAMPLES (16)
+/* adaptive placement picks a disk with weight IDFS_DISK_WEIGHT_SCALE/expected write time */
+#define IDFS_DISK_WEIGHT_SCALE (1ULL<<32)
 
 Q_USING_NAMESPACE
 
+/* streamed upload, written to a temp file and renamed once the digest is known */
+struct imgStream {
+	uint16_t        operate_type;
+	int32_t         data_len;
+	int32_t         recv_len;
+	int32_t         fd;
+	/* disk of the temp file, the image file stays there in file mode */
+	uint32_t        disk;
+	std::string     temp_path;
+	QMD5            hasher;
+	/* crc32c of the data received so far */
+	uint32_t        crc;
+
+	imgStream() :
+		operate_type(0),
+		data_len(0),
+		recv_len(0),
+		fd(-1),
+		disk(0),
+		crc(0)
+	{}
+};
+
+class IDFSServer;
+
+/* image write handed to the thread of one disk, lives on the worker's stack */
+struct diskWrite {
+	IDFSServer*     server;
+	uint32_t        disk;
+	uint64_t        iid;
+	const char*     data;
+	int32_t         len;
+	/* file mode: crc32c of data, an existing file is kept only when it matches */
+	uint32_t        crc;
+	/* volume mode: data is read from in_fd when it is not -1 */
+	int32_t         in_fd;
+	uint16_t        flags;
+	/* file mode: image file name under img-path */
+	std::string     name;
+	QIoUring*       ring;
+	/* volume mode: returned needle location */
+	volumeLocation  location;
+
+	diskWrite(IDFSServer* in_server, uint64_t in_iid) :
+		server(in_server),
+		disk(0),
+		iid(in_iid),
+		data(NULL),
+		len(0),
+		crc(0),
+		in_fd(-1),
+		flags(NEEDLE_FLAG_NONE),
+		ring(NULL)
+	{}
+};
+
 class IDFSServer : public QTcpServer {
 	public:
 		// @函数名: 继承类资源初始化函数
@@ -44,6 +139,13 @@ class IDFSServer : public QTcpServer {
 		virtual int32_t server_process(const char* rquest_buffer, int32_t request_len, char* reply_buffer, int32_t reply_size, \
 				const void* handle=NULL);
 
+		// @函数名: 分段响应的消息体解析函数, 读取图片时图片数据以sendfile直接从文件发送
+		virtual int32_t server_process_vector(const char* request_buffer, int32_t request_len, char* reply_buffer, int32_t reply_size, \
+				replyVector& reply, const void* handle=NULL);
+
+		// @函数名: 分段响应发送完毕, 释放读取图片时持有的缓存图片、卷引用或文件
+		virtual void server_reply_done(replyVector& reply, const void* handle=NULL);
+
 		// @函数名: 业务逻辑处理函数
 		virtual int32_t server_main(uint16_t type, const char* ptr_data, int32_t data_len, char* ptr_out, int32_t out_size, \
 				const void* handle=NULL);
@@ -51,26 +153,262 @@ class IDFSServer : public QTcpServer {
 		// @函数名: 业务逻辑析构函数
 		virtual int32_t server_free(const void* handle=NULL);
 
+		// @函数名: 流式上传开始函数, 校验请求参数并创建临时文件
+		virtual int32_t server_stream_begin(const char* request_buffer, int32_t buf_len, int32_t request_len, void*& stream, \
+				const void* handle=NULL);
+
+		// @函数名: 流式上传数据块处理函数, 增量计算摘要并写入临时文件
+		virtual int32_t server_stream_data(void* stream, const char* ptr_data, int32_t data_len);
+
+		// @函数名: 流式上传结束函数, 按摘要将临时文件改名到位并生成响应
+		virtual int32_t server_stream_end(void* stream, char* reply_buffer, int32_t reply_size, const void* handle=NULL);
+
+		// @函数名: 流式上传中止函数, 删除临时文件
+		virtual void server_stream_abort(void* stream);
+
+		// @函数名: 卷写入、落盘与热点缓存统计, 附加在监控统计之后
+		virtual int32_t server_stats(char* buf, int32_t size);
+
+		// @函数名: 全部数据盘的用量, 同一文件系统只计一次
+		// @返回值: 只读磁盘数
+		virtual int32_t server_disk_usage(uint64_t& used_bytes, uint64_t& total_bytes);
+
 		// @函数名: 继承类资源释放函数
 		virtual int32_t release();
 
 	private:
-		// @函数名: 图片存储函数
-		int32_t save_image(const char* path, const char* data, int32_t len);
+		// @函数名: 图片存储函数, 先写入同盘临时文件再改名, 崩溃时不会留下写了一半的图片文件;
+		//          ring非空时写入与关闭经io_uring一次提交
+		// @参数01: 图片文件路径, 已存在且校验值一致时不再写入
+		// @参数02: 临时文件路径
+		// @参数03: 图片数据
+		// @参数04: 数据长度
+		// @参数05: 数据的crc32c
+		// @返回值: 成功返回0, 已存在返回1, 失败返回小于0的错误码
+		int32_t save_image(const char* path, const char* temp_path, const char* data, int32_t len, uint32_t crc, \
+				QIoUring* ring=NULL);
+
+		// @函数名: 文件的crc32c, 读取失败或长度不符返回false
+		static bool file_checksum(int32_t fd, int32_t len, uint32_t& crc);
+
+		// @函数名: 新图片落盘并获取尺寸, 返回图片路径(文件模式)或卷位置(卷模式)
+		int32_t store_image(uint64_t iid, int32_t type, const char* data, int32_t len, uint32_t crc, QIoUring* ring, \
+				std::string& location, std::string& img_size);
+
+		// @函数名: 卷模式下追加图片并登记索引, 索引中已有时直接返回已有位置
+		int32_t append_volume(uint64_t iid, const char* data, int32_t len, int32_t in_fd, std::string& location);
+
+		// @函数名: 按放置策略依次交给各磁盘的写入线程, 队列已满或写入失败时改写下一块磁盘
+		// @参数01: 写入任务, 成功时disk为实际写入的磁盘
+		// @返回值: 成功返回0, 全部磁盘失败返回小于0的错误码
+		int32_t write_image(diskWrite& write);
+
+		// @函数名: 磁盘写入线程执行的写入任务
+		static int32_t disk_write(void* arg);
+
+		// @函数名: 新图片的候选磁盘, 按放置策略排序, 不含只读磁盘
+		// @参数01: 图片编号
+		// @参数02: 返回磁盘序号, 全部磁盘只读时为空
+		// @参数03: 为true时不论放置策略都按剩余空间排序
+		// @参数04: 存储层, 热层磁盘全部只读时退回冷层磁盘
+		void place_disks(uint64_t iid, std::vector<uint32_t>& disks, bool by_space=false, int32_t tier=IDFS_TIER_HOT);
+
+		// @函数名: 刷新各磁盘剩余空间, 剩余空间不足或写入过慢的磁盘置为只读, 恢复后重新接受写入
+		void check_disks();
+
+		// @函数名: 磁盘检查线程, 每秒检查一次
+		static void* disk_check_thread(void* argv);
+
+		// @函数名: 文件模式下的图片位置, 第一块以外的磁盘以"磁盘序号:"开头
+		std::string disk_location(uint32_t disk, const std::string& name) const;
+
+		// @函数名: 文件模式下图片位置对应的文件路径, 磁盘序号无效时返回空串
+		std::string local_path(const std::string& location) const;
+
+		// @函数名: 等待图片所在文件落盘, 落盘方式由sync-mode决定
+		int32_t sync_image(const std::string& location);
+
+		// @函数名: 等待新图片落盘后写入元数据, 已登记时增加引用
+		int32_t commit_image(const std::string& imgid, const std::string& location, const std::string& img_size, \
+				const std::string& img_crc);
+
+		// @函数名: 图片元数据是否存在, 须持有mongo_mutex_; 卷模式下删除在写完删除标记后中断时,
+		//         元数据仍在而索引中已无needle, 此时删除残留元数据, 按新图片处理
+		bool image_exists(const std::string& imgid);
+
+		// @函数名: 等待同一图片正在进行的删除完成, 须持有mongo_mutex_, 等待期间释放
+		void wait_delete(uint64_t iid);
+
+		// @函数名: 去重命中时增加图片引用, 须持有mongo_mutex_
+		// @返回值: 成功返回增加后的引用数, 失败返回小于0的错误码
+		int32_t add_reference(const std::string& imgid);
+
+		// @函数名: 按图片编号删除, 减少一个引用, 引用减到0时先写删除标记并落盘, 再删除元数据
+		// @参数01: 图片编号
+		// @参数02: 返回剩余引用数
+		// @返回值: 成功返回0, 失败返回小于0的错误码
+		int32_t delete_image(uint64_t iid, int32_t& refs);
+
+		// @函数名: 按图片编号或md5读取图片, 元数据写入ptr_out, 图片数据以文件区间加入reply
+		// @参数01: 十进制图片编号或32位md5串, 可附加":偏移[:长度]"只读取其中一段
+		// @参数02: 请求体长度
+		// @参数03: 元数据缓冲区
+		// @参数04: 元数据缓冲区大小
+		// @参数05: 分段响应, context持有缓存图片(内存段)或卷引用(卷文件区间)
+		// @返回值: 成功返回元数据长度, 失败返回小于0的错误码
+		int32_t read_image(const char* ptr_data, int32_t data_len, char* ptr_out, int32_t out_size, replyVector& reply);
+
+		// @函数名: 写needle索引检查点
+		int32_t save_index();
+
+		// @函数名: 索引检查点线程
+		static void* index_thread(void* argv);
+
+		// @函数名: 压缩卷, 存活needle复制到新卷并改写索引, 所删needle仍在的删除标记写入当前卷, 写检查点后删除原卷
+		// @参数01: 卷编号
+		// @参数02: 索引中该卷的存活needle统计
+		// @返回值: 成功返回0, 失败返回小于0的错误码, 失败时原卷不受影响
+		int32_t compact_volume(uint32_t vid, const volumeLive& live);
+
+		// @函数名: 压缩线程, 定期选出死needle比例最高且超过阈值的卷压缩
+		static void* compact_thread(void* argv);
+
+		// @函数名: 卷模式下将热层卷中的冷图片追加到冷层磁盘并改写索引, 原needle留给压缩回收
+		// @参数01: 卷编号
+		// @参数02: 本轮开始计时的秒表, 用于限速
+		// @参数03: 本轮已迁移字节数
+		// @返回值: 成功返回迁移的图片数, 失败返回小于0的错误码, 失败前已迁移的图片仍生效
+		int32_t migrate_volume(uint32_t vid, QStopwatch& sw, uint64_t& moved);
+
+		// @函数名: 文件模式下迁移一块热层磁盘上的冷图片
+		// @返回值: 成功返回迁移的图片数, 失败返回小于0的错误码
+		int32_t migrate_files(uint32_t disk, QStopwatch& sw, uint64_t& moved);
+
+		// @函数名: 文件模式下将一张图片复制到冷层磁盘, 落盘后改写元数据中的位置, 原文件在下一轮删除
+		// @参数01: 图片编号
+		// @参数02: 所在磁盘
+		// @参数03: 相对磁盘目录的文件名
+		// @返回值: 迁移返回复制的字节数, 不需迁移返回0, 失败返回小于0的错误码
+		int32_t migrate_file(uint64_t iid, uint32_t disk, const std::string& name);
+
+		// @函数名: 迁移限速, 按本轮已迁移字节计算应耗时间, 超前时休眠
+		void migrate_wait(QStopwatch& sw, uint64_t moved);
+
+		// @函数名: 迁移线程, 定期将热层磁盘上的冷图片迁移到冷层磁盘
+		static void* tier_thread(void* argv);
+
+		// @函数名: 卷扫描与追加回调, 将检查点之后追加的needle补入索引, 删除标记移除其指向的needle
+		static void index_visitor(void* arg, uint32_t vid, uint32_t generation, uint64_t offset, const needleHeader& header, \
+				const needleTombstone* tombstone);
+
+		// @函数名: 元数据中图片位置的列名
+		inline const char* location_column() const
+		{return storage_mode_==IDFS_STORAGE_VOLUME?"imglocation":"imgpath";}
 
 		// @函数名: 获取图片类型名
 		const char* get_image_type_name(int32_t type);
 
+		// @函数名: 生成图片存储结果
+		int32_t format_result(char* ptr_out, int32_t out_size, uint64_t iid, const std::string& img_md5, \
+				const std::string& location, const std::string& img_size);
+
+		// @函数名: 生成图片删除结果
+		int32_t format_delete_result(char* ptr_out, int32_t out_size, uint64_t iid, int32_t refs);
+
+		// @函数名: 生成图片读取结果, 图片数据紧随其后
+		// @参数05: 图片总长度
+		// @参数06: 返回区间在图片中的偏移
+		// @参数07: 返回区间长度, 即随后的数据长度
+		int32_t format_read_result(char* ptr_out, int32_t out_size, uint64_t iid, const std::string& location, int32_t length, \
+				uint64_t range_offset, uint64_t range_len);
+
 	private:
-		/* img directory */
+		/* img directory, img-path lists one or more disks separated by commas */
 		char*           img_path_;
+		std::vector<std::string> img_paths_;
 		char*           img_dir_;
 		int32_t         img_subdir_num_;
+		uint32_t        stream_seq_;
+		/* io_uring calls, tags their completions */
+		uint32_t        uring_seq_;
+		/* disks, one write thread each */
+		int32_t         disk_placement_;
+		int32_t         disk_queue_depth_;
+		QDiskQueue*     disk_queues_;
+		/* read-only thresholds: free space percent, p99 write latency in ms, retry delay in seconds */
+		int32_t         disk_readonly_free_;
+		int32_t         disk_readonly_latency_;
+		int32_t         disk_readonly_retry_;
+		/* time in seconds each disk was made read-only for its latency, 0 otherwise */
+		std::vector<int64_t> disk_slow_since_;
+		volatile int32_t disk_stop_;
+		pthread_t       disk_tid_;
+		bool            disk_thread_started_;
+		/* volume storage */
+		int32_t         storage_mode_;
+		int32_t         volume_size_;
+		int32_t         volume_direct_io_;
+		QVolumeStore*   volume_store_;
+		/* needle index */
+		QNeedleIndex*   needle_index_;
+		std::string     index_path_;
+		int32_t         index_checkpoint_interval_;
+		volatile int32_t index_stop_;
+		pthread_t       index_tid_;
+		bool            index_thread_started_;
+		QMutexLock      index_save_mutex_;
+		/* needles killed by tombstones replayed before them, only used while opening the volumes */
+		std::set<std::pair<uint32_t, uint64_t> > replay_kills_;
+		/* compaction */
+		int32_t         compact_dead_ratio_;
+		int32_t         compact_interval_;
+		int32_t         compact_rate_;
+		volatile int32_t compact_stop_;
+		pthread_t       compact_tid_;
+		bool            compact_thread_started_;
+		uint32_t        compact_volumes_;
+		uint64_t        compact_copied_bytes_;
+		uint64_t        compact_reclaimed_bytes_;
+		/* volume being compacted and its progress */
+		volatile uint32_t compact_vid_;
+		volatile uint64_t compact_total_bytes_;
+		volatile uint64_t compact_done_bytes_;
 		/* mongo */
 		QMongoClient*   mongo_client_;
 		char*           mongo_uri_;
 		char*           mongo_img_collection_;
 		QMutexLock      mongo_mutex_;
+		/* images whose tombstone is being written outside mongo_mutex_, guarded by it */
+		std::set<uint64_t> deleting_;
+		/* durability */
+		QGroupCommit    group_commit_;
+		/* volumes cut back to their last complete needle when opened */
+		uint32_t        torn_volumes_;
+		/* stored images whose data did not match their crc32c */
+		uint64_t        checksum_errors_;
+		/* storage tier of each disk, img-tier lists them in the order of img-path */
+		std::vector<int32_t> disk_tiers_;
+		/* access table, NULL when migration is disabled */
+		QAccessTracker* access_tracker_;
+		int32_t         tier_cold_days_;
+		int32_t         tier_cold_count_;
+		int32_t         tier_migrate_interval_;
+		int32_t         tier_migrate_rate_;
+		int32_t         tier_track_size_;
+		volatile int32_t tier_stop_;
+		pthread_t       tier_tid_;
+		bool            tier_thread_started_;
+		volatile int32_t tier_migrating_;
+		uint64_t        tier_migrated_images_;
+		uint64_t        tier_migrated_bytes_;
+		uint64_t        tier_migrate_errors_;
+		/* file mode: files left on the hot disks, unlinked next pass once the reads that resolved them are done */
+		std::vector<std::string> tier_unlinks_;
+		/* hot image cache, NULL when disabled */
+		QImageCache*    hot_cache_;
+		int32_t         hot_cache_size_;
+		int32_t         hot_cache_shards_;
+		int32_t         hot_cache_item_size_;
 };
 
 #endif // __IDFSSERVER_H_